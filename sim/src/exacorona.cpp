@@ -1,7 +1,9 @@
 /*------------------------------------------------------------------------*/
 /* Author: Kalyan S. Perumalla                                            */
 /*------------------------------------------------------------------------*/
+#if MPI_AVAILABLE
 #include <mpi.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
@@ -451,6 +453,7 @@ class Location : public NormalSimProcess
                       const HealthTransition &pttsvacc );
     protected: virtual void init( void );
     protected: virtual void execute( SimEvent *event );
+    protected: virtual void reverse_execute( SimEvent *event );
     protected: virtual void wrapup( void );
 
     protected: Region *psim(){return (Region*)Simulator::sim();}
@@ -459,6 +462,17 @@ class Location : public NormalSimProcess
     protected: string locname;
     protected: long initialpop;
     protected: long nsent, nrecd, ninfected;
+
+    /*Committed state behind Region::quiescent()*/
+    public: bool isquiet( const SimTime &cut ) const
+                { return ninfectious == 0 && npending == 0 && inflight < cut; }
+    public: long getninfected( void ) const { return ninfected; }
+    public: long getninfectious( void ) const { return ninfectious; }
+    protected: long ninfectious; /*Infectious occupants*/
+    protected: long npending; /*ISTATECHANGE events scheduled, not committed*/
+    protected: SimTime inflight; /*Latest arrival of infectious persons sent*/
+    protected: int dinfectious, nscheduled; /*Of the event being executed*/
+
     protected: typedef map<PersonID, PersonContainer> OccupantMap;
     protected: OccupantMap occupants;
     protected: unsigned long tempid_counter;/*For unique temp IDs of occupants*/
@@ -472,12 +486,29 @@ class Location : public NormalSimProcess
 
     protected: double infectprob; void recompute_infectprob( void ); //XXX
 
-    protected: double randunif(void) { return RandUnif(PID().loc_id); }
+    /*Destructive updates to occupants are logged for rollback*/
+    protected: void save_occupant( const PersonID &tempid );
+    protected: class OccupantUndo : public UndoRecord
+        {
+            public: OccupantUndo( OccupantMap &m, const PersonID &id,
+                                  const PersonContainer &c ) :
+                        occ(m), tempid(id), container(c) {}
+            public: virtual void undo( void )
+                        { occ.erase( tempid );
+                          occ.insert( OccupantMap::value_type(tempid,container) ); }
+            private: OccupantMap &occ;
+            private: PersonID tempid;
+            private: PersonContainer container;
+        };
+
+    /*Random draws are counted per event, so that rollback can un-draw them*/
+    protected: int ndraws;
+    protected: double randunif(void) { ndraws++; return RandUnif(PID().loc_id); }
     protected: void revrandunif(void) { RandReverseUnif(PID().loc_id); }
     protected: double randunif( double high, double low = 0.0 )
                    { return low + (randunif()*(high-low)); }
     protected: double randexp( double mean )
-                   { return RandExponential(PID().loc_id, mean); }
+                   { ndraws++; return RandExponential(PID().loc_id, mean); }
 };
 
 //-----------------------------------------------------------------------------
@@ -494,10 +525,35 @@ class Region : public Simulator
     public: const SimTime &getlatu( void ) const { return latu; }
     public: const SimTime &getendtu( void ) const { return endtu; }
 
+    /*Inter-region mobility graph, if the scenario gives one*/
+    public: bool hasmobility( void ) const { return hasmob; }
+    public: const vector< pair<int,double> > &getmobout( void ) const
+                { return mobout; }
+    public: const vector<int> &getmobin( void ) const { return mobin; }
+    public: int drawmobdest( double u ) const;
+    public: const SimTime &getfedlatu( int fid ) const
+                { return fid < int(fedlatu.size()) ? fedlatu[fid] : latu; }
+
     protected: string regname;
     protected: long nlocations, npersons;
     protected: SimTime latu;/*Lookahead in timeunits*/
     protected: SimTime endtu;
+    protected: bool hasmob;
+    protected: vector< pair<int,double> > mobout;/*Dest fed, cumulative frac*/
+    protected: vector<int> mobin;/*Remote feds with links into this one*/
+    protected: vector<SimTime> fedlatu;/*Lookahead (min travel) to each fed*/
+    protected: void readmobility( const vector<json> &activeregions );
+
+    /*Epidemic died out: nobody infectious, nor anybody's state to change*/
+    protected: virtual bool quiescent( const SimTime &cut );
+    protected: vector<Location*> locations;
+
+    /*Epidemic curve, totalled across feds along with the LBTS reductions*/
+    protected: virtual bool counter_values( const SimTime &cut, long *vals );
+    protected: virtual void counter_totals( const SimTime &cut,
+                                            const long *totals );
+    protected: struct { int ninfected, ninfectious, maxinfectious;
+                        long lastninfected, lastninfectious; } curve;
 
     /*Time-unit conversions*/
     public: static double TU(const string &tunitstr, double tm);
@@ -547,10 +603,14 @@ struct ExaCoronaData
 class ExaCoronaEvent : public SimEvent
 {
     DEFINE_BASE_EVENT(ExaCorona, ExaCoronaEvent, SimEvent);
-    public: ExaCoronaEvent( const ExaCoronaEventType &et )
-            { edata.etype = et; edata.ninfected = 0; }
+    public: ExaCoronaEvent( const ExaCoronaEventType &et ) : nrngdraws(0)
+            { edata.etype = et; edata.ninfected = 0;
+              quiet.dinfectious = quiet.nscheduled = 0; }
     public: const ExaCoronaEventType &getetype(void)const{return edata.etype;}
     public: ExaCoronaData edata;
+    public: int nrngdraws; //#random draws made by execution (not transmitted)
+    public: struct { int dinfectious, nscheduled; SimTime inflight; } quiet;
+                //Execution's effect on quiescence; applied at commit (ditto)
 };
 
 //-----------------------------------------------------------------------------
@@ -688,11 +748,30 @@ Location::Location( long pnum,
                     const HealthTransition &_pnorm,
                     const HealthTransition &_pinf ) :
     locnum(pnum), locname(lname), nsent(0), nrecd(0), ninfected(0),
-    occupants(), tempid_counter(0)
+    ninfectious(0), npending(0), inflight(0), dinfectious(0), nscheduled(0),
+    occupants(), tempid_counter(0), infectprob(0), ndraws(0)
 {
     Region *reg = psim();
-    enable_undo( false, 10*reg->getlatu(), 0 );
-    add_dest( SimPID::ANY_PID, reg->getlatu() );
+    bool optimistic = !getenv("OPTIMISTIC") || strcmp(getenv("OPTIMISTIC"),"false");
+    enable_undo( optimistic, 10*reg->getlatu(), 0 );
+    if( reg->hasmobility() )
+    {
+        /*Only the federates on the mobility graph are linked to this one*/
+        add_dest( SimPID( SimPID::ANY_LOC_ID, reg->fed_id() ), reg->getlatu() );
+        for( auto &link : reg->getmobout() )
+        {
+            add_dest( SimPID( SimPID::ANY_LOC_ID, link.first ),
+                      reg->getfedlatu( link.first ) );
+        }
+        for( auto fid : reg->getmobin() )
+        {
+            add_src( SimPID( SimPID::ANY_LOC_ID, fid ) );
+        }
+    }
+    else
+    {
+        add_dest( SimPID::ANY_PID, reg->getlatu() );
+    }
 
     ptts_normal = _pnorm;
     ptts_vaccinated = _pinf;
@@ -734,6 +813,7 @@ void Location::init( void )
             newp.markinfectious( infstate );
             newp.setinfectts(infectts);
             ninf++;
+            inflight.increase_to( arrdt );
         }
 
         ArrivalEvent *ae = new ArrivalEvent( newp );
@@ -753,11 +833,15 @@ void Location::evolve_infection( Person &person, const SimTime &dts, int tempid)
 {
     bool isvaccinated = false; //XXX TBC
     const HealthTransition &trans = (isvaccinated ? ptts_vaccinated : ptts_normal);
+    save_occupant( tempid );
+
     int ist = person.getistate().get();
     double rng = randunif();
     const HealthTransition::Entry &entry = trans.nextstate( ist, rng );
 
+    dinfectious -= trans.isinfectious( person.getistate() );
     person.accistate().resetto( entry.j );
+    dinfectious += trans.isinfectious( person.getistate() );
 
     /*Schedule its next infection state change, if any*/
     double lo = entry.lo.dwelltime, hi = entry.hi.dwelltime;
@@ -771,6 +855,7 @@ void Location::evolve_infection( Person &person, const SimTime &dts, int tempid)
             InfectionStateChangeEvent *new_ie =
                 new InfectionStateChangeEvent( tempid );
             send( PID(), new_ie, infectdt );
+            nscheduled++;
         }
     }
 }
@@ -798,6 +883,7 @@ void Location::recompute_infectprob( void )
 
     double avgdt = ( (N <= 1) ? 0.0 : (overlapdt / (N-1)) );
     const double r = 0.3, s = 0.05, rho = 0.05;
+    save_field( infectprob );
     infectprob = 1 - exp( N * avgdt * log(1 - (r*s*rho)) );
     ENSURE( 0, 0.0 <= infectprob && infectprob <= 1.0, infectprob );
 
@@ -865,6 +951,8 @@ void Location::execute( SimEvent *event )
     ExaCoronaEvent *re = reinterpret_cast<ExaCoronaEvent *>(event);
 
     nrecd++;
+    ndraws = 0;
+    dinfectious = nscheduled = 0;
 
     EXADBG( 2, "Location " << PID() << " @ " << now() <<
                " execute " << *re << " eventtype=" << re->getetype() <<
@@ -891,6 +979,7 @@ void Location::execute( SimEvent *event )
             const Person &person = container.getperson();
             ENSURE( 0, occupants.find(tempid) == occupants.end(), "Duplicate?");
             occupants.insert( OccupantMap::value_type( tempid, container ) );
+            dinfectious += ptts_normal.isinfectious( person.getistate() );
 
             /*Schedule its departure*/
             DepartureEvent *de = new DepartureEvent( tempid );
@@ -920,7 +1009,7 @@ void Location::execute( SimEvent *event )
             if( 1 || randunif() < reg->getprob().locality ) //XXX
             {
                 destlid = 0; //XXX
-                destfid = 0;
+                destfid = reg->hasmobility() ? reg->drawmobdest(randunif()) : 0;
                 destloc = destlid;
                 arrdt = randexp( reg->getprob().meanlocaltraveldt );
             }
@@ -943,16 +1032,22 @@ void Location::execute( SimEvent *event )
                 destfid = 0;
                 arrdt = randexp( reg->getprob().meanremotetraveldt );
             }
-            arrdt += reg->getlatu();
+            arrdt += reg->getfedlatu( destfid );
             SimPID dest( destlid, destfid );
 
             /*Send it out*/
             ArrivalEvent *ae = new ArrivalEvent( person );
             send( dest, ae, arrdt );
+            if( ptts_normal.isinfectious( person.getistate() ) )
+            {
+                dinfectious--;
+                re->quiet.inflight = now() + arrdt;
+            }
 
             ANIMT("DE "<<person.getpersonid()<<" "<<locnum<<
                   " "<<destloc<<" "<<arrdt.ts);
 
+            save_occupant( de->data.tempid );
             occupants.erase( de->data.tempid );
 
             EXADBG(2, PID()<<" @ "<<now()<<" DEPARTURE of "<<
@@ -989,6 +1084,59 @@ void Location::execute( SimEvent *event )
         }
     }
     nsent++;
+    re->nrngdraws = ndraws;
+    re->quiet.dinfectious = dinfectious;
+    re->quiet.nscheduled = nscheduled;
+}
+
+//-----------------------------------------------------------------------------
+void Location::save_occupant( const PersonID &tempid )
+{
+    if( !undo_logging() ) return;
+    OccupantMap::const_iterator occ_it = occupants.find(tempid);
+    ENSURE( 0, occ_it != occupants.end(), "Must be an occupant" );
+    log_undo( new OccupantUndo( occupants, tempid, occ_it->second ) );
+}
+
+//-----------------------------------------------------------------------------
+void Location::reverse_execute( SimEvent *event )
+{
+    ExaCoronaEvent *re = reinterpret_cast<ExaCoronaEvent *>(event);
+
+    EXADBG( 2, "Location " << PID() << " @ " << now() <<
+               " reverse " << *re << " eventtype=" << re->getetype() <<
+               " nrngdraws= " << re->nrngdraws );
+
+    /*Infections and departures were undone from the log; undo the rest*/
+    switch( re->getetype() )
+    {
+        case ARRIVAL:
+        {
+            PersonID tempid = --tempid_counter;
+            ENSURE( 0, occupants.find(tempid) != occupants.end(),
+                    "Must be an occupant" );
+            occupants.erase( tempid );
+            break;
+        }
+        case DEPARTURE:
+        case ISTATECHANGE:
+        {
+            break;
+        }
+        default:
+        {
+            FAIL("Impossible");
+            break;
+        }
+    }
+
+    for( int i = 0; i < re->nrngdraws; i++ ) { revrandunif(); }
+    re->nrngdraws = 0;
+    re->edata.ninfected = 0;
+    re->quiet.dinfectious = re->quiet.nscheduled = 0;
+    re->quiet.inflight = 0;
+    nsent--;
+    nrecd--;
 }
 
 //-----------------------------------------------------------------------------
@@ -1005,6 +1153,9 @@ void Location::commit_event( SimEventBase *event, bool is_kernel)
                    " NINFECTED " << re->edata.ninfected <<
                    " TOTINFECTED " << ninfected );
         }
+        ninfectious += re->quiet.dinfectious;
+        npending += re->quiet.nscheduled - (re->getetype() == ISTATECHANGE);
+        inflight.increase_to( re->quiet.inflight );
     }
 
     NormalSimProcess::commit_event( event, is_kernel );
@@ -1024,7 +1175,8 @@ void Location::wrapup( void )
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 Region::Region( void ) :
-    regname(""), nlocations(2), npersons(10), endtu(360), nsent(0), nrecd(0)
+    regname(""), nlocations(2), npersons(10), endtu(360), hasmob(false),
+    nsent(0), nrecd(0)
 {
     latu = gconfig.lookahead;
 }
@@ -1069,6 +1221,9 @@ void Region::init( int ac, char *av[] )
         string myregfile = gconfig.prefdir(myregionjson["file"]);
         EXADBG(0,"json#myregfile="<<myregfile);
 
+        //Mobility among the active regions; needed before any locations
+        readmobility( activeregions );
+
         //My region
         {
             json regjs; ifstream reginfs(myregfile); reginfs >> regjs;
@@ -1087,6 +1242,7 @@ void Region::init( int ac, char *av[] )
                     Location *location = new Location(locid, locname, locfile,
                                                       pttsnorm, pttsvacc);
                     add( location );
+                    locations.push_back( location );
                     EXADBG( 0, "Added location " << locid << " ID= " <<
                             location->PID() << " " << locname << " " << locfile );
                 }
@@ -1135,12 +1291,136 @@ void Region::init( int ac, char *av[] )
     randinit(locations_per_fed);
     if(fed_id()==0)EXADBG( 0, "RNG streams initialized." );
 
+    curve.ninfected = add_counter( COUNTER_SUM );
+    curve.ninfectious = add_counter( COUNTER_SUM );
+    curve.maxinfectious = add_counter( COUNTER_MAX );
+    curve.lastninfected = curve.lastninfectious = -1;
+
     if( fed_id() == 0 )
     {
         ANIM( "-1 N "<<num_feds()<<" "<<getnlocations()<<" "<< getnpersons() );
     }
 }
 
+/*---------------------------------------------------------------------------*/
+/* Mobility file lists, per source region, the fraction of departures going  */
+/* to each destination region, by name:                                      */
+/*     {"links": {"Japan": {"Japan": 0.9, "United States": 0.1}, ...}}       */
+/* Regions are federates in their "active regions" order; regions beyond the */
+/* number of federates are ignored.  Any remainder of a region's fractions   */
+/* stays within that region.  Without the file, all federates are linked.    */
+/* An optional "min travel" section, in the same shape but with times (e.g.  */
+/* "9 hours"), gives the least travel time on a link; it becomes the         */
+/* lookahead to that region, never below the global one.                    */
+/*---------------------------------------------------------------------------*/
+void Region::readmobility( const vector<json> &activeregions )
+{
+    ifstream mobinfs( gconfig.mob.filename );
+    if( !mobinfs.is_open() )
+    {
+        EXADBG(0,"No mobility file "<<gconfig.mob.filename<<"; all-to-all");
+        return;
+    }
+
+    json mobjs; mobinfs >> mobjs;
+    map<string,int> regnums;
+    for( int r = 0; r < int(activeregions.size()) && r < num_feds(); r++ )
+    {
+        string rname = activeregions[r]["name"];
+        regnums[rname] = r;
+    }
+
+    int myregnum = fed_id();
+    fedlatu.assign( num_feds(), latu );
+    if( mobjs.count("min travel") )
+    {
+        json &mymin = mobjs["min travel"][regname];
+        for( auto &to : mymin.items() )
+        {
+            auto tit = regnums.find( to.key() );
+            if( tit == regnums.end() || tit->second == myregnum ) continue;
+            string mintravelstr = to.value();
+            SimTime mintravel( parsetime( mintravelstr ) );
+            if( mintravel > latu ) fedlatu[tit->second] = mintravel;
+        }
+    }
+
+    double cumfrac = 0;
+    for( auto &from : mobjs["links"].items() )
+    {
+        auto fit = regnums.find( from.key() );
+        if( fit == regnums.end() ) continue;
+        for( auto &to : from.value().items() )
+        {
+            auto tit = regnums.find( to.key() );
+            if( tit == regnums.end() ) continue;
+            double frac = to.value();
+            if( frac <= 0 ) continue;
+            if( fit->second == myregnum )
+            {
+                cumfrac += frac;
+                mobout.push_back( make_pair( tit->second, cumfrac ) );
+            }
+            else if( tit->second == myregnum )
+            {
+                mobin.push_back( fit->second );
+            }
+        }
+    }
+    ENSURE( 0, cumfrac <= 1.0+1e-9,
+            "Mobility fractions from "<<regname<<" add up to "<<cumfrac );
+
+    hasmob = true;
+    EXADBG(0,"Mobility links out= "<<mobout.size()<<" in= "<<mobin.size());
+}
+
+/*---------------------------------------------------------------------------*/
+int Region::drawmobdest( double u ) const
+{
+    for( auto &link : mobout )
+    {
+        if( u < link.second ) return link.first;
+    }
+    return fed_id();
+}
+
+/*---------------------------------------------------------------------------*/
+bool Region::quiescent( const SimTime &cut )
+{
+    for( auto loc : locations )
+    {
+        if( !loc->isquiet( cut ) ) return false;
+    }
+    return true;
+}
+
+/*---------------------------------------------------------------------------*/
+bool Region::counter_values( const SimTime &cut, long *vals )
+{
+    for( auto loc : locations )
+    {
+        vals[curve.ninfected] += loc->getninfected();
+        vals[curve.ninfectious] += loc->getninfectious();
+        vals[curve.maxinfectious] = max( vals[curve.maxinfectious],
+                                         loc->getninfectious() );
+    }
+    return true;
+}
+
+/*---------------------------------------------------------------------------*/
+void Region::counter_totals( const SimTime &cut, const long *totals )
+{
+    if( fed_id() != 0 ) return;
+    if( totals[curve.ninfected] == curve.lastninfected &&
+        totals[curve.ninfectious] == curve.lastninfectious ) return;
+    curve.lastninfected = totals[curve.ninfected];
+    curve.lastninfectious = totals[curve.ninfectious];
+    EXADBG( 0, cut.ts << " EPICURVE" <<
+               " TOTINFECTED " << totals[curve.ninfected] <<
+               " INFECTIOUS " << totals[curve.ninfectious] <<
+               " MAXPERLOC " << totals[curve.maxinfectious] );
+}
+
 /*---------------------------------------------------------------------------*/
 void Region::run( void )
 {
@@ -6,12 +6,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#if __linux__
+    #include <sys/prctl.h>
+#endif
 
 #include "mycompat.h"
 #include "fmshm.h"
 #include "fmgm.h"
 #include "fmtcp.h"
 #include "fmmpi.h"
+#include "fmring.h"
+#include "fmrma.h"
 #include "fm.h"
 
 /*---------------------------------------------------------------------------*/
@@ -21,8 +30,11 @@
 #define MAX(a,b) (((a)>(b)) ? (a) : (b))
 
 /*---------------------------------------------------------------------------*/
-#define FMMAXPIECES MAX( MAX(SHMMAXPIECES, GMMAXPIECES), TCPMAXPIECES )
-#define FMMAXPIECELEN MAX( MAX(SHMMAXPIECELEN, GMMAXPIECELEN), TCPMAXPIECELEN )
+#define FMMAXPIECES MAX( MAX( MAX( MAX(SHMMAXPIECES, GMMAXPIECES), \
+                                TCPMAXPIECES ), RINGMAXPIECES ), RMAMAXPIECES )
+#define FMMAXPIECELEN MAX( MAX( MAX( MAX(SHMMAXPIECELEN, GMMAXPIECELEN), \
+                                TCPMAXPIECELEN ), RINGMAXPIECELEN ), \
+                           RMAMAXPIECELEN )
 
 /*---------------------------------------------------------------------------*/
 #if TCP_AVAILABLE
@@ -47,6 +59,8 @@ typedef enum
     FM_XFACE_CLASS_MYR,   /*Myrinet*/
     FM_XFACE_CLASS_TCP,   /*TCP LAN or WAN*/
     FM_XFACE_CLASS_MPI,   /*MPI*/
+    FM_XFACE_CLASS_RNG,   /*Lock-free shared memory rings*/
+    FM_XFACE_CLASS_RMA,   /*One-sided MPI mailboxes*/
     FM_XFACE_CLASS_NUM,   /*Total number of interface classes*/
     FM_XFACE_CLASS_NUL,   /*Void; drop it on the floor*/
     FM_XFACE_CLASS_BAD,   /*Invalid class type*/
@@ -58,6 +72,8 @@ typedef enum
 #define LINK_COST_LAN 100
 #define LINK_COST_WAN 1000
 #define LINK_COST_MPI 20
+#define LINK_COST_RNG 5
+#define LINK_COST_RMA 15
 #define LINK_COST_INF 1e10
 
 /*---------------------------------------------------------------------------*/
@@ -68,6 +84,8 @@ typedef enum
     FM_SUBNET_LAN,  /*TCP local area*/
     FM_SUBNET_WAN,  /*TCP wide area*/
     FM_SUBNET_MPI,  /*MPI virtual cluster*/
+    FM_SUBNET_RNG,  /*Node-local shared memory rings*/
+    FM_SUBNET_RMA,  /*MPI one-sided mailboxes*/
     FM_SUBNET_NUM,  /*Number of subnet types*/
     FM_SUBNET_BAD,  /*Invalid subnet type*/
 } SubnetType;
@@ -78,9 +96,11 @@ typedef enum
 		                    ((ct)==FM_XFACE_CLASS_MYR ? "MYR" :        \
 		                    ((ct)==FM_XFACE_CLASS_TCP ? "TCP" :        \
 		                    ((ct)==FM_XFACE_CLASS_MPI ? "MPI" :        \
+		                    ((ct)==FM_XFACE_CLASS_RNG ? "RNG" :        \
+		                    ((ct)==FM_XFACE_CLASS_RMA ? "RMA" :        \
 		                    ((ct)==FM_XFACE_CLASS_NUL ? "NUL" :        \
 		                    ((ct)==FM_XFACE_CLASS_BAD ? "BAD" :        \
-				                                "???" ))))))
+				                                "???" ))))))))
 
 /*---------------------------------------------------------------------------*/
 #define SUBNET_STR_TO_TYPE(sn) \
@@ -89,7 +109,9 @@ typedef enum
 				    (!strcmp((sn),"LAN") ? FM_SUBNET_LAN :\
 				    (!strcmp((sn),"WAN") ? FM_SUBNET_WAN :\
 				    (!strcmp((sn),"MPI") ? FM_SUBNET_MPI :\
-				                           FM_SUBNET_BAD)))))
+				    (!strcmp((sn),"RNG") ? FM_SUBNET_RNG :\
+				    (!strcmp((sn),"RMA") ? FM_SUBNET_RMA :\
+				                           FM_SUBNET_BAD)))))))
 
 /*---------------------------------------------------------------------------*/
 #define SUBNET_TYPE_TO_XFACE_CLASS(sn) \
@@ -98,7 +120,9 @@ typedef enum
 				    ((sn)==FM_SUBNET_LAN ? FM_XFACE_CLASS_TCP :\
 				    ((sn)==FM_SUBNET_WAN ? FM_XFACE_CLASS_TCP :\
 				    ((sn)==FM_SUBNET_MPI ? FM_XFACE_CLASS_MPI :\
-				                         FM_XFACE_CLASS_NUL)))))
+				    ((sn)==FM_SUBNET_RNG ? FM_XFACE_CLASS_RNG :\
+				    ((sn)==FM_SUBNET_RMA ? FM_XFACE_CLASS_RMA :\
+				                         FM_XFACE_CLASS_NUL)))))))
 
 /*---------------------------------------------------------------------------*/
 #define SUBNET_LINK_COST(sn) \
@@ -107,7 +131,9 @@ typedef enum
 		                    ((sn)==FM_SUBNET_LAN ? LINK_COST_LAN :     \
 		                    ((sn)==FM_SUBNET_WAN ? LINK_COST_WAN :     \
 		                    ((sn)==FM_SUBNET_MPI ? LINK_COST_MPI :     \
-				                           LINK_COST_INF)))))
+		                    ((sn)==FM_SUBNET_RNG ? LINK_COST_RNG :     \
+		                    ((sn)==FM_SUBNET_RMA ? LINK_COST_RMA :     \
+				                           LINK_COST_INF)))))))
 
 /*---------------------------------------------------------------------------*/
 typedef struct
@@ -388,6 +414,111 @@ int xf_mpi_callback(int handler, FMMPI_stream *stream,
     return absorb_or_route( handler, stream, src_pe, src_id, dest_id );
 }
 
+/*---------------------------------------------------------------------------*/
+static long ring_key = 0; /*Names the node's ring segment; same on all peers*/
+void xf_rng_new(XFace *xf)
+{
+    xf->xf_instance = 0; /*Only one (static) instance supported by RINGFM*/
+}
+void xf_rng_delete(XFace *xf)
+{
+    /*Do nothing*/
+}
+void xf_rng_constructor(XFace *xf, int i, int N, FMNodeName nodenames[])
+{
+    RING_initialize( i, N, ring_key, (RINGCallback*)xf->xf_class->xf_callback );
+}
+void xf_rng_destructor(XFace *xf)
+{
+    RING_finalize();
+}
+void xf_rng_begin_message(XFace *xf, XFaceStream *pstream,
+    int recipient, int length, int handler, int src_id, int dest_id )
+{
+    *pstream = RING_begin_message(recipient, length, handler, src_id, dest_id);
+}
+void xf_rng_send_piece(XFace *xf, XFaceStream stream, void *buf, int len)
+{
+    RING_send_piece( stream, buf, len );
+}
+void xf_rng_end_message(XFace *xf, XFaceStream stream)
+{
+    RING_end_message( stream );
+}
+int xf_rng_extract(XFace *xf, int max_bytes)
+{
+    return RING_extract( max_bytes );
+}
+int xf_rng_num_pieces(XFace *xf, XFaceStream stream)
+{
+    return RING_numpieces( stream );
+}
+int xf_rng_piece_len(XFace *xf, XFaceStream stream, int piece_num)
+{
+    return RING_piecelen( stream, piece_num );
+}
+void xf_rng_recv_piece(XFace *xf, XFaceStream stream, void *buf, int maxlen)
+{
+    RING_receive( buf, stream, maxlen );
+}
+int xf_rng_callback(int handler, RING_stream *stream,
+    int src_pe, int src_id, int dest_id)
+{
+    return absorb_or_route( handler, stream, src_pe, src_id, dest_id );
+}
+
+/*---------------------------------------------------------------------------*/
+void xf_rma_new(XFace *xf)
+{
+    xf->xf_instance = 0; /*Only one (static) instance supported by RMAFM*/
+}
+void xf_rma_delete(XFace *xf)
+{
+    /*Do nothing*/
+}
+void xf_rma_constructor(XFace *xf, int i, int N, FMNodeName nodenames[])
+{
+    RMA_initialize( i, N, (RMACallback*)xf->xf_class->xf_callback );
+}
+void xf_rma_destructor(XFace *xf)
+{
+    RMA_finalize();
+}
+void xf_rma_begin_message(XFace *xf, XFaceStream *pstream,
+    int recipient, int length, int handler, int src_id, int dest_id )
+{
+    *pstream = RMA_begin_message(recipient, length, handler, src_id, dest_id);
+}
+void xf_rma_send_piece(XFace *xf, XFaceStream stream, void *buf, int len)
+{
+    RMA_send_piece( stream, buf, len );
+}
+void xf_rma_end_message(XFace *xf, XFaceStream stream)
+{
+    RMA_end_message( stream );
+}
+int xf_rma_extract(XFace *xf, int max_bytes)
+{
+    return RMA_extract( max_bytes );
+}
+int xf_rma_num_pieces(XFace *xf, XFaceStream stream)
+{
+    return RMA_numpieces( stream );
+}
+int xf_rma_piece_len(XFace *xf, XFaceStream stream, int piece_num)
+{
+    return RMA_piecelen( stream, piece_num );
+}
+void xf_rma_recv_piece(XFace *xf, XFaceStream stream, void *buf, int maxlen)
+{
+    RMA_receive( buf, stream, maxlen );
+}
+int xf_rma_callback(int handler, RMA_stream *stream,
+    int src_pe, int src_id, int dest_id)
+{
+    return absorb_or_route( handler, stream, src_pe, src_id, dest_id );
+}
+
 /*---------------------------------------------------------------------------*/
 static XFaceClass xf_classes[FM_XFACE_CLASS_NUM] =
 {
@@ -426,6 +557,24 @@ static XFaceClass xf_classes[FM_XFACE_CLASS_NUM] =
 	xf_mpi_extract,       xf_mpi_num_pieces,   xf_mpi_piece_len,
         xf_mpi_recv_piece,    xf_mpi_callback,
 	FMMPIMAXPIECELEN
+    },
+    {
+	FM_XFACE_CLASS_RNG,
+        xf_rng_new,           xf_rng_delete,
+	xf_rng_constructor,   xf_rng_destructor,
+	xf_rng_begin_message, xf_rng_send_piece,   xf_rng_end_message,
+	xf_rng_extract,       xf_rng_num_pieces,   xf_rng_piece_len,
+        xf_rng_recv_piece,    xf_rng_callback,
+	RINGMAXPIECELEN
+    },
+    {
+	FM_XFACE_CLASS_RMA,
+        xf_rma_new,           xf_rma_delete,
+	xf_rma_constructor,   xf_rma_destructor,
+	xf_rma_begin_message, xf_rma_send_piece,   xf_rma_end_message,
+	xf_rma_extract,       xf_rma_num_pieces,   xf_rma_piece_len,
+        xf_rma_recv_piece,    xf_rma_callback,
+	RMAMAXPIECELEN
     }
 };
 
@@ -477,9 +626,34 @@ typedef struct
     int tot_subnets; /*Total number of ALL subnets in the network*/
     NodeGroupMap grps[FM_SUBNET_NUM]; /*Grouping info for ALL subnets*/
     NodeGroup *subnets[FMMAXPE]; /*Pointers to group info indexed by subnet_id*/
+    SubnetType subnet_type[FMMAXPE]; /*Type of each subnet by subnet_id*/
     XFaceNextHopTable nhop_table;     /*Next hop info from this PE to others*/
 } Network;
 
+/*---------------------------------------------------------------------------*/
+/* A message extracted by a capturing thread, held for replay; see           */
+/* FM_capture_thread().                                                      */
+/*---------------------------------------------------------------------------*/
+typedef struct _FMCapturedMsg
+{
+    struct _FMCapturedMsg *next;
+    int handler;
+    int src_id;
+    int len;
+    double due;   /*Emulation only: when it arrived, then when it is delivered*/
+    char data[1]; /*Actually len bytes: all pieces back to back*/
+} FMCapturedMsg;
+
+/*---------------------------------------------------------------------------*/
+/* Virtual clocks of one emulated link, from some sender to this node.       */
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    double free_at;      /*When the link finishes its previous message*/
+    double last_due;     /*When the previous message is delivered*/
+    unsigned long long rng; /*Jitter generator; advanced once per message*/
+} FMEmuLink;
+
 /*---------------------------------------------------------------------------*/
 typedef struct
 {
@@ -503,6 +677,34 @@ typedef struct
 	    XFace *xf;         /*Currently active interface*/
         } in, out;             /*Incoming, Outgoing*/
     } curr;
+
+    struct
+    {
+        int on;                   /*Any of FM_EMU_* set?*/
+        double latency;           /*Seconds added to every message*/
+        double jitter;            /*Up to this many more seconds, per message*/
+        double bytes_per_sec;     /*Per-link bandwidth; 0 is unlimited*/
+        long seed;                /*Jitter seed; same seed, same delays*/
+        FMEmuLink *link;          /*[FM_numnodes], indexed by sender*/
+        FMCapturedMsg *head, *tail;/*Held messages, in order of due time*/
+        unsigned long nheld, nqueued, maxqueued;
+        double totdelay, maxdelay;
+    } emu;
+
+    struct
+    {
+        FMCapturedMsg * volatile head; /*Newest first; pushed with CAS*/
+        FMCapturedMsg *msg;            /*Being replayed now, if any*/
+        int pos;                       /*#bytes of msg received so far*/
+        unsigned long ncaptured;       /*Total so far*/
+    } capture;
+
+    struct
+    {
+        int gateway;             /*FM ID of this node's gateway*/
+        int nnodes;              /*#nodes, i.e., #gateways*/
+        unsigned long nforwarded;/*Messages this node passed on to others*/
+    } route;
 } MixFMData;
 
 /*---------------------------------------------------------------------------*/
@@ -542,6 +744,185 @@ static int use_mpi =
 		          0
 		      #endif
 		          ;
+static int use_ring = 0; /*FM_RING: node-local peers via shared memory rings*/
+static int use_rma = 0; /*FM_RMA: all peers via one-sided MPI mailboxes*/
+static int use_local = 0; /*FM_LOCAL: all peers forked off this launch*/
+static int use_gateway = 0; /*FM_GATEWAY: off-node msgs via node gateways*/
+static int local_numnodes = 0; /*FM_LOCAL value, if more than 1*/
+static pid_t local_pids[RINGMAXPE]; /*Node 0 only: pids of forked nodes*/
+static int local_reaped = 0; /*Node 0 only: forked nodes waited for?*/
+static __thread int capturing = 0; /*Does this thread queue incoming msgs?*/
+
+/*---------------------------------------------------------------------------*/
+/* Copies an incoming message off its interface.                            */
+/*---------------------------------------------------------------------------*/
+static FMCapturedMsg *copy_message( int handler, void *in_stream, int src_id )
+{
+    XFace *in_xf = mixfm->curr.in.xf;
+    int p = 0, np = 0, len = 0;
+    FMCapturedMsg *m = 0;
+
+    MYASSERT( in_xf, ("An interface must be currently active") );
+    np = in_xf->xf_class->xf_num_pieces( in_xf, in_stream );
+    MYASSERT( 0 <= np && np <= FMMAXPIECES, ("%d %d",np,FMMAXPIECES) );
+    for( p = 0; p < np; p++ )
+    {
+        len += in_xf->xf_class->xf_piece_len( in_xf, in_stream, p );
+    }
+
+    m = (FMCapturedMsg *)malloc( sizeof(FMCapturedMsg) + len );
+    MYASSERT( m, ("Can't capture %d bytes",len) );
+    m->handler = handler;
+    m->src_id = src_id;
+    m->len = 0;
+    for( p = 0; p < np; p++ )
+    {
+        int piecelen = in_xf->xf_class->xf_piece_len( in_xf, in_stream, p );
+        in_xf->xf_class->xf_recv_piece( in_xf, in_stream,
+                                        m->data+m->len, piecelen );
+        m->len += piecelen;
+    }
+
+    m->due = 0;
+    if( mixfm->emu.on ) { TIMER_TYPE t; TIMER_NOW(t); m->due = TIMER_SECONDS(t); }
+
+    return m;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Runs the handler of a copied message, and frees it.                      */
+/*---------------------------------------------------------------------------*/
+static void deliver_copied( FMCapturedMsg *m )
+{
+    FM_handler *hf = FM_handler_table[m->handler];
+    MYASSERT( hf, ("Handler function %d must exist",m->handler) );
+
+    mixfm->capture.msg = m;
+    mixfm->capture.pos = 0;
+    mixfm->curr.in.xf = 0; mixfm->curr.in.stream = (FM_stream)m;
+    hf( (FM_stream *)m, m->src_id );
+    mixfm->capture.msg = 0;
+    mixfm->curr.in.stream = 0;
+    free( m );
+}
+
+/*---------------------------------------------------------------------------*/
+/* Network emulation (FM_EMU_*).  Every message bound to this node is held  */
+/* until its emulated link would have delivered it.  Each link keeps a      */
+/* virtual clock of when it is next free: a message of b bytes arriving at  */
+/* t leaves at max(t,free), holds the link for b/bandwidth, and lands       */
+/* latency plus jitter after that, never ahead of the previous message on   */
+/* that link.  Jitter comes from a per-link generator seeded by the link,   */
+/* so the k-th message on a link always gets the same jitter.               */
+/*---------------------------------------------------------------------------*/
+static double emu_jitter( FMEmuLink *link )
+{
+    unsigned long long z = (link->rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z = z ^ (z >> 31);
+    return mixfm->emu.jitter * ((z >> 11) * (1.0/9007199254740992.0));
+}
+
+/*---------------------------------------------------------------------------*/
+static void emu_hold( FMCapturedMsg *m )
+{
+    FMEmuLink *link = &mixfm->emu.link[m->src_id];
+    double arrived = m->due, leave = 0;
+
+    leave = (link->free_at > arrived) ? link->free_at : arrived;
+    link->free_at = leave + (mixfm->emu.bytes_per_sec > 0 ?
+                             m->len / mixfm->emu.bytes_per_sec : 0);
+    m->due = link->free_at + mixfm->emu.latency + emu_jitter( link );
+    if( m->due < link->last_due ) m->due = link->last_due;
+    link->last_due = m->due;
+
+    mixfm->emu.nheld++;
+    mixfm->emu.totdelay += m->due - arrived;
+    if( m->due - arrived > mixfm->emu.maxdelay )
+        mixfm->emu.maxdelay = m->due - arrived;
+    if( ++mixfm->emu.nqueued > mixfm->emu.maxqueued )
+        mixfm->emu.maxqueued = mixfm->emu.nqueued;
+
+    /*Due times mostly grow, so this is nearly always an append*/
+    m->next = 0;
+    if( !mixfm->emu.head )
+    {
+        mixfm->emu.head = mixfm->emu.tail = m;
+    }
+    else if( m->due >= mixfm->emu.tail->due )
+    {
+        mixfm->emu.tail->next = m; mixfm->emu.tail = m;
+    }
+    else
+    {
+        FMCapturedMsg **pm = &mixfm->emu.head;
+        while( (*pm)->due <= m->due ) pm = &(*pm)->next;
+        m->next = *pm; *pm = m;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Delivers the held messages that are due; returns how many.              */
+/*---------------------------------------------------------------------------*/
+static int emu_release( void )
+{
+    int ndelivered = 0;
+    double now = 0;
+    TIMER_TYPE t;
+
+    if( !mixfm->emu.head ) return 0;
+
+    TIMER_NOW(t); now = TIMER_SECONDS(t);
+    while( mixfm->emu.head && mixfm->emu.head->due <= now )
+    {
+        FMCapturedMsg *m = mixfm->emu.head;
+        mixfm->emu.head = m->next;
+        if( !mixfm->emu.head ) mixfm->emu.tail = 0;
+        mixfm->emu.nqueued--;
+        deliver_copied( m );
+        ndelivered++;
+    }
+
+    return ndelivered;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Copies an incoming message off its interface, for replay by a thread     */
+/* that does not capture.                                                    */
+/*---------------------------------------------------------------------------*/
+static void capture_message( int handler, void *in_stream, int src_id )
+{
+    FMCapturedMsg *m = copy_message( handler, in_stream, src_id ), *head = 0;
+
+    do { head = mixfm->capture.head; m->next = head; }
+    while( !__sync_bool_compare_and_swap( &mixfm->capture.head, head, m ) );
+    mixfm->capture.ncaptured++;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Hands all captured messages, oldest first, to their handlers.             */
+/*---------------------------------------------------------------------------*/
+static int replay_captured( void )
+{
+    int nreplayed = 0;
+    FMCapturedMsg *m = 0, *fifo = 0;
+
+    if( !mixfm->capture.head ) return 0;
+
+    m = __sync_lock_test_and_set( &mixfm->capture.head, (FMCapturedMsg *)0 );
+    while( m ) { FMCapturedMsg *nm = m->next; m->next = fifo; fifo = m; m = nm; }
+
+    while( fifo )
+    {
+        m = fifo; fifo = m->next;
+        if( mixfm->emu.on ) emu_hold( m ); /*Delivered by emu_release()*/
+        else deliver_copied( m );
+        nreplayed++;
+    }
+
+    return nreplayed;
+}
 
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
@@ -554,7 +935,15 @@ int absorb_or_route( int handler, void *in_stream,
     MYASSERT( 0 <= dest_id && dest_id < FM_numnodes, ("%d",dest_id) );
 
     mixfm->curr.in.stream = in_stream;
-    if( dest_id == FM_nodeid )
+    if( dest_id == FM_nodeid && capturing )
+    {
+        capture_message( handler, in_stream, src_id );
+    }
+    else if( dest_id == FM_nodeid && mixfm->emu.on )
+    {
+        emu_hold( copy_message( handler, in_stream, src_id ) );
+    }
+    else if( dest_id == FM_nodeid )
     {
         /*Destined to self; call the local handler*/
 	FM_handler *hf = FM_handler_table[handler];
@@ -569,8 +958,9 @@ int absorb_or_route( int handler, void *in_stream,
 	mixfm->curr.out.xf = nhe->xf;
 
 #if !NODEBUG
-if(mixfm->dbg>=3){printf("Forwarding msg from %d via %d to %d\n",src_id,nh,dest_id);}
+if(mixfm->dbg>=3){printf("Forwarding msg from %d via %d to %d\n",src_id,nh,dest_id);fflush(stdout);}
 #endif
+	mixfm->route.nforwarded++;
 
 	/*Copy pieces from incoming interface to outgoing interface*/
 	{
@@ -673,6 +1063,42 @@ if(mixfm->dbg>=6){printf("MIXFM: Node[%d]=\"%s\"\n", i, fmn);fflush(stdout);}
 #endif
     }
 
+    estr = getenv("FM_RING"); /*TRUE or FALSE*/
+    use_ring = estr ? !strcmp(estr,"TRUE") : 0;
+
+    use_local = (local_numnodes > 1);
+    if( use_local ) use_ring = 1;
+
+    estr = getenv("FM_RMA"); /*TRUE or FALSE*/
+    use_rma = estr ? !strcmp(estr,"TRUE") : 0;
+
+    estr = getenv("FM_GATEWAY"); /*TRUE or FALSE*/
+    use_gateway = estr ? !strcmp(estr,"TRUE") : 0;
+
+    estr = getenv("FM_EMU_LATENCYUS"); /*Emulated one-way latency*/
+    mixfm->emu.latency = estr ? atof(estr)*1e-6 : 0;
+    estr = getenv("FM_EMU_JITTERUS"); /*Emulated extra latency, uniform*/
+    mixfm->emu.jitter = estr ? atof(estr)*1e-6 : 0;
+    estr = getenv("FM_EMU_MBPS"); /*Emulated link bandwidth, MB/sec*/
+    mixfm->emu.bytes_per_sec = estr ? atof(estr)*1e6 : 0;
+    estr = getenv("FM_EMU_SEED");
+    mixfm->emu.seed = estr ? atol(estr) : 1;
+    MYASSERT( mixfm->emu.latency >= 0 && mixfm->emu.jitter >= 0 &&
+              mixfm->emu.bytes_per_sec >= 0, ("FM_EMU_* must be >= 0") );
+    mixfm->emu.on = (mixfm->emu.latency > 0 || mixfm->emu.jitter > 0 ||
+                     mixfm->emu.bytes_per_sec > 0);
+    if( mixfm->emu.on )
+    {
+        mixfm->emu.link = (FMEmuLink *)calloc( FM_numnodes, sizeof(FMEmuLink) );
+        MYASSERT( mixfm->emu.link, ("FM_EMU links %lu",FM_numnodes) );
+        for( i = 0; i < FM_numnodes; i++ )
+        {
+            mixfm->emu.link[i].rng = (unsigned long long)mixfm->emu.seed *
+                                     0x100000001b3ULL ^
+                                     ((unsigned long long)i << 32 | FM_nodeid);
+        }
+    }
+
 #if !NODEBUG
 if(mixfm->dbg>=1){if(FM_nodeid==0){printf("FM_nodeid=%lu, FM_numnodes=%lu\n",FM_nodeid,FM_numnodes);fflush(stdout);}}
 #endif
@@ -698,6 +1124,76 @@ static void group_mpi_nodes( void )
     }
 }
 
+/*---------------------------------------------------------------------------*/
+static void group_rma_nodes( void )
+{
+    int i = 0;
+    NodeGroupMap *rmagrps = &mixfm->net.grps[FM_SUBNET_RMA];
+    NodeGroup *newgrp = &rmagrps->group[0];
+
+    MYASSERT( FM_nodeid == FMMPI_nodeid && FM_numnodes == FMMPI_numnodes,
+            ("FM IDs must equal MPI ranks to use RMA") );
+
+    rmagrps->ngroups = 1;
+    newgrp->numnodes = FM_numnodes;
+    for( i = 0; i < FM_numnodes; i++ )
+    {
+	newgrp->fmnodeid[i] = i;
+	strcpy( newgrp->canname[i], mixfm->FM_nodenames[i] );
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+static void group_ring_nodes( void )
+{
+    int i = 0, n = 0, *ids = (int *)malloc( RINGMAXPE*sizeof(int) );
+    NodeGroupMap *rnggrps = &mixfm->net.grps[FM_SUBNET_RNG];
+    NodeGroup *newgrp = &rnggrps->group[0];
+
+    MYASSERT( ids, ("!") );
+    MYASSERT( FM_nodeid == FMMPI_nodeid,
+            ("FM ID %lu must equal MPI rank %d",FM_nodeid,FMMPI_nodeid) );
+
+    /*Only this node's group is needed, since routing is always direct*/
+    n = FMMPI_node_peers( ids, RINGMAXPE, &ring_key );
+    rnggrps->ngroups = 0;
+    if( n > 1 )
+    {
+        rnggrps->ngroups = 1;
+        newgrp->numnodes = n;
+        for( i = 0; i < n; i++ )
+        {
+            newgrp->fmnodeid[i] = ids[i];
+            strcpy( newgrp->canname[i], mixfm->FM_nodenames[ids[i]] );
+        }
+    }
+    free( ids );
+
+#if !NODEBUG
+if(mixfm->dbg>=1){printf("%lu: %d node-local ring peers\n",FM_nodeid,n);fflush(stdout);}
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+static void group_local_nodes( void )
+{
+    int i = 0;
+    NodeGroupMap *rnggrps = &mixfm->net.grps[FM_SUBNET_RNG];
+    NodeGroup *newgrp = &rnggrps->group[0];
+
+    MYASSERT( FM_numnodes == local_numnodes,
+            ("FM_NUMNODES %lu must equal FM_LOCAL %d",FM_numnodes,
+             local_numnodes) );
+
+    rnggrps->ngroups = 1;
+    newgrp->numnodes = FM_numnodes;
+    for( i = 0; i < FM_numnodes; i++ )
+    {
+	newgrp->fmnodeid[i] = i;
+	strcpy( newgrp->canname[i], mixfm->FM_nodenames[i] );
+    }
+}
+
 /*---------------------------------------------------------------------------*/
 static void group_shm_nodes( void )
 {
@@ -940,8 +1436,12 @@ if(mixfm->dbg>=1){printf("Note: No links belonging to subnet %s on line %d are\n
 /*---------------------------------------------------------------------------*/
 static void group_nodes( void )
 {
+    if( use_local ) { group_local_nodes(); return; }
+
     #if MPI_AVAILABLE
     group_mpi_nodes();
+    if( use_ring ) group_ring_nodes();
+    if( use_rma ) group_rma_nodes();
     #else /*MPI_AVAILABLE*/
     group_shm_nodes();
     #endif /*MPI_AVAILABLE*/
@@ -1030,6 +1530,13 @@ if(mixfm->dbg>=3){if(i==0&&j==0){printf("%d: Omitting ADJMATRIX\n",FM_nodeid);ff
 	{
 	  int subnet_id = mixfm->net.tot_subnets++;
 	  mixfm->net.subnets[subnet_id] = grp;
+#if NOADJMATRIX
+	  /*All subnets other than rings and RMA are carried over MPI*/
+	  mixfm->net.subnet_type[subnet_id] =
+	      (s == FM_SUBNET_RNG || s == FM_SUBNET_RMA) ? s : FM_SUBNET_MPI;
+#else /*NOADJMATRIX*/
+	  mixfm->net.subnet_type[subnet_id] = s;
+#endif /*NOADJMATRIX*/
 #if !NODEBUG
 if(mixfm->dbg>=5){printf("Subnet type %d group %d ID %d\n",s,g,subnet_id);}
 #endif
@@ -1159,9 +1666,13 @@ static void instantiate_interfaces( void )
         XFaceClassTag cltag = FM_XFACE_CLASS_BAD;
 	int i = 0, j = 0, nincl = 0;
 #if NOADJMATRIX
-	for( i = 0; i < FM_numnodes; i++ ) incl[i] = 1;
-	nincl = FM_numnodes;
-	cltag = FM_XFACE_CLASS_MPI;
+	{
+	    NodeGroup *grp = mixfm->net.subnets[subnet_id];
+	    for( i = 0; i < FM_numnodes; i++ ) incl[i] = 0;
+	    for( j = 0; j < grp->numnodes; j++ ) incl[grp->fmnodeid[j]] = 1;
+	    nincl = grp->numnodes;
+	    cltag = SUBNET_TYPE_TO_XFACE_CLASS(mixfm->net.subnet_type[subnet_id]);
+	}
 #else /*NOADJMATRIX*/
 	for( i = 0; i < FM_numnodes; i++ ) incl[i] = 0;
 	for( i = 0; i < FM_numnodes; i++ )
@@ -1219,14 +1730,11 @@ static void instantiate_interfaces( void )
 		    xf->xf_map[i] = id;
 		    xf->xf_inv_map[id] = i;
 
-#if NOADJMATRIX
-                    m = i; /*Self*/
-#else /*NOADJMATRIX*/
-		    for( m = 0; m < sgrp->numnodes; m++ )
+		    m = (i < sgrp->numnodes && sgrp->fmnodeid[i] == i) ? i : 0;
+		    for( ; m < sgrp->numnodes; m++ )
 		    {
 		        if( sgrp->fmnodeid[m] == i ) break;
 		    }
-#endif /*NOADJMATRIX*/
 		    MYASSERT( m < sgrp->numnodes, ("%d %d",subnet_id,i) );
 		    strcpy( xf->xf_canname[id], sgrp->canname[m] );
 		}
@@ -1262,6 +1770,23 @@ static void make_nexthop_table( void )
 	aij->xf_cltag = FM_XFACE_CLASS_MPI;
 	aij->subnet_id = 0;
 	aij->next_hop = j;
+	aij->cost = LINK_COST_INF;
+	if( i != j )
+	{
+	    /*Directly reach j via the cheapest interface that includes it*/
+	    int x = 0;
+	    for( x = 0; x < mixfm->nxfaces; x++ )
+	    {
+	        XFace *xf = &mixfm->xfaces[x];
+		SubnetType st = mixfm->net.subnet_type[xf->xf_subnet_id];
+	        if( xf->xf_map[j] >= 0 && SUBNET_LINK_COST(st) < aij->cost )
+		{
+		    aij->xf_cltag = xf->xf_class->xf_cltag;
+		    aij->subnet_id = xf->xf_subnet_id;
+		    aij->cost = SUBNET_LINK_COST(st);
+		}
+	    }
+	}
 #else /*NOADJMATRIX*/
 	AdjEntry *aij = &adj->matrix[i][j];
 #endif /*NOADJMATRIX*/
@@ -1292,6 +1817,67 @@ static void make_nexthop_table( void )
     }
 }
 
+/*---------------------------------------------------------------------------*/
+/* Node-level routing (FM_GATEWAY).  The lowest FM ID on each node is its   */
+/* gateway.  A message to another node goes to this node's gateway, across */
+/* to the gateway of the destination's node, and from there to the         */
+/* destination; node-local hops take the cheapest interface, e.g., rings.   */
+/* So only gateways talk across nodes, each to one peer per remote node,    */
+/* and all traffic between two nodes shares one aggregated stream.          */
+/* FM_GATEWAY_GROUPSIZE=k instead treats every k consecutive IDs as a node. */
+/* Collective over all nodes, after the interfaces are up.                  */
+/*---------------------------------------------------------------------------*/
+static void route_via_gateways( void )
+{
+    int i = 0, j = 0, x = 0, k = 0, me = (int)FM_nodeid;
+    int *gw = (int *)malloc( FM_numnodes*sizeof(int) );
+    char *estr = getenv("FM_GATEWAY_GROUPSIZE");
+
+    MYASSERT( gw, ("!") );
+    k = estr ? atoi( estr ) : 0;
+    if( k > 0 ) { for( i = 0; i < FM_numnodes; i++ ) gw[i] = i - i%k; }
+    else { FM_node_leaders( gw ); }
+
+    mixfm->route.gateway = gw[me];
+    mixfm->route.nnodes = 0;
+    for( i = 0; i < FM_numnodes; i++ )
+    {
+        MYASSERT( 0 <= gw[i] && gw[i] <= i && gw[gw[i]] == gw[i],
+                ("Bad gateway %d of FM node %d",gw[i],i) );
+        if( gw[i] == i ) mixfm->route.nnodes++;
+    }
+
+    for( j = 0; j < FM_numnodes; j++ )
+    {
+        XFaceNextHopEntry *nhe = &mixfm->net.nhop_table.nhop_entry[j];
+        double cost = LINK_COST_INF;
+        int nh = j;
+
+        if( j == me ) continue;
+        if( gw[j] != gw[me] ) nh = (me == gw[me]) ? gw[j] : gw[me];
+
+        nhe->dest_id = j;
+        nhe->next_hop = nh;
+        nhe->xf = 0;
+        for( x = 0; x < mixfm->nxfaces; x++ )
+        {
+            XFace *xf = &mixfm->xfaces[x];
+            SubnetType st = mixfm->net.subnet_type[xf->xf_subnet_id];
+            if( xf->xf_map[nh] >= 0 && SUBNET_LINK_COST(st) < cost )
+            {
+                nhe->xf = xf;
+                cost = SUBNET_LINK_COST(st);
+            }
+        }
+        MYASSERT( nhe->xf, ("No interface to next hop %d of %d",nh,j) );
+    }
+    free( gw );
+
+#if !NODEBUG
+if(mixfm->dbg>=0){if(FM_nodeid==0){printf("FM gateway routing over %d nodes\n",mixfm->route.nnodes);fflush(stdout);}}
+#endif
+}
+
 /*---------------------------------------------------------------------------*/
 static void initialize_interfaces( void )
 {
@@ -1334,11 +1920,130 @@ static void finalize_interfaces( void )
     }
 }
 
+/*---------------------------------------------------------------------------*/
+/* FM_LOCAL=N runs N federates off a single launch, without MPI: node 0     */
+/* maps the rings, then forks nodes 1..N-1, which inherit the mapping.      */
+/* Node 0 reaps the others in FM_finalize(), kills them if it exits before */
+/* that (e.g., on a failed assertion), and stops everyone if one dies.      */
+/*---------------------------------------------------------------------------*/
+static void local_sigchld( int sig )
+{
+    int i = 0, j = 0;
+
+    for( i = 1; i < local_numnodes; i++ )
+    {
+        siginfo_t si;
+        si.si_pid = 0;
+        if( waitid( P_PID, local_pids[i], &si, WEXITED|WNOHANG|WNOWAIT ) == 0 &&
+            si.si_pid == local_pids[i] &&
+            !(si.si_code == CLD_EXITED && si.si_status == 0) )
+        {
+            static const char msg[] = "FM_LOCAL: Federate failed; aborting\n";
+            if( write( 2, msg, sizeof(msg)-1 ) < 0 ) {}
+            for( j = 1; j < local_numnodes; j++ ) kill( local_pids[j], SIGKILL );
+            _exit( 1 );
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+static void local_reap( void )
+{
+    int i = 0, status = 0, nfailed = 0;
+
+    if( local_reaped ) return;
+    signal( SIGCHLD, SIG_DFL );
+    for( i = 1; i < local_numnodes; i++ )
+    {
+        if( waitpid( local_pids[i], &status, 0 ) != local_pids[i] ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) nfailed++;
+    }
+    local_reaped = TRUE;
+    if( nfailed > 0 )
+    {
+        fprintf( stderr, "FM_LOCAL: %d federate(s) failed\n", nfailed );
+        fflush( 0 );
+        _exit( 1 );
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Node 0 exiting without FM_finalize(); the others may be waiting on it.   */
+/*---------------------------------------------------------------------------*/
+static void local_kill( void )
+{
+    int i = 0;
+
+    if( local_reaped ) return;
+    signal( SIGCHLD, SIG_DFL );
+    for( i = 1; i < local_numnodes; i++ ) kill( local_pids[i], SIGKILL );
+    for( i = 1; i < local_numnodes; i++ ) waitpid( local_pids[i], 0, 0 );
+    local_reaped = TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+static void local_spawn( void )
+{
+    int i = 0, id = 0, n = 0;
+    char *estr = getenv("FM_LOCAL"), *nstr = 0;
+
+    if( !estr || (n = atoi( estr )) <= 1 ) return;
+    MYASSERT( n <= FMMAXPE && n <= RINGMAXPE,
+            ("FM_LOCAL=%d must lie in [1..%d]",n,
+             (FMMAXPE < RINGMAXPE ? FMMAXPE : RINGMAXPE)) );
+
+    local_numnodes = n;
+    if( n > sysconf( _SC_NPROCESSORS_ONLN ) && !getenv("FMRING_IDLEUS") )
+    {
+        /*Oversubscribed; spinning would only delay the peer being waited on*/
+        putenv( "FMRING_IDLEUS=100" );
+        if( !getenv("FMRING_SPINS") ) putenv( "FMRING_SPINS=16" );
+    }
+    RING_preallocate( n );
+
+    fflush( 0 ); /*Else buffered output is repeated by every child*/
+    local_pids[0] = getpid();
+    for( i = 1; i < n; i++ )
+    {
+        pid_t pid = fork();
+        MYASSERT( pid >= 0, ("fork() of federate %d failed",i); perror("") );
+        if( pid == 0 )
+        {
+            #if __linux__
+                prctl( PR_SET_PDEATHSIG, SIGKILL ); /*Don't outlive node 0*/
+                if( getppid() != local_pids[0] ) _exit( 1 );
+            #endif
+            id = i;
+            break;
+        }
+        local_pids[i] = pid;
+    }
+
+    if( id == 0 )
+    {
+        signal( SIGCHLD, local_sigchld );
+        atexit( local_kill );
+    }
+
+    nstr = (char *)malloc( 100 );
+    sprintf( nstr, "NODEINFO=%d:%d@localhost:%d", n, n, id );
+    putenv( nstr );
+    FM_nodeid = id;
+    FM_numnodes = n;
+}
+
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
 void FM_pre_init( int *pac, char ***av ) /*Appl MUST call PreInit if using MPI*/
 {
+    #if MPI_AVAILABLE
+	MYASSERT( !getenv("FM_LOCAL"),
+	        ("FM_LOCAL needs a build without MPI (make MPI=0)") );
+    #else /*MPI_AVAILABLE*/
+	local_spawn();
+    #endif /*MPI_AVAILABLE*/
+
     #if MPI_AVAILABLE
 	FMMPI_pre_initialize( pac, av );
 	/*Create NODEINFO env var*/
@@ -1375,6 +2080,7 @@ if(mixfm->dbg>=2){printf("Sizeof(MixFMData)== %.2lf MB.\n",sizeof(MixFMData)/1e6
     instantiate_interfaces();
     make_nexthop_table();
     initialize_interfaces();
+    if( use_gateway ) route_via_gateways();
 
     _printlscfg = (_printlscfg && (FM_nodeid < _printlsdbgmaxfmid));
 
@@ -1392,6 +2098,14 @@ if(mixfm->dbg>=0){if(FM_numnodes<5){printf("%lu: Redirecting stdout to \"%s\"\n"
         LSCFGLD( "FM_NUMNODES", (long)FM_numnodes, "FM number of nodes" );
         LSCFGLD( "FM_NODEID", (long)FM_nodeid, "FM node ID" );
         LSCFGLD( "FM_MAXPE", (long)MAX_PE, "FM max #PE" );
+        LSCFGLD( "FM_RING", (long)use_ring, "FM node-local shared memory rings" );
+        LSCFGLD( "FM_RMA", (long)use_rma, "FM one-sided MPI mailboxes" );
+        LSCFGLD( "FM_LOCAL", (long)local_numnodes, "FM in-process federates" );
+        LSCFGLD( "FM_GATEWAY", (long)use_gateway, "FM node-level routing" );
+        LSCFGLF( "FM_EMU_LATENCYUS", mixfm->emu.latency*1e6, "FM emulated latency" );
+        LSCFGLF( "FM_EMU_JITTERUS", mixfm->emu.jitter*1e6, "FM emulated jitter" );
+        LSCFGLF( "FM_EMU_MBPS", mixfm->emu.bytes_per_sec/1e6, "FM emulated bandwidth" );
+        LSCFGLD( "FM_EMU_SEED", mixfm->emu.seed, "FM emulated jitter seed" );
 
 #if !NODEBUG
 if(mixfm->dbg>=0){if(retcode!=0){printf("%lu: Failed to redirect stdout to \"%s\"\n",FM_nodeid,stdout_fname);fflush(stdout);}}
@@ -1411,7 +2125,29 @@ if(mixfm->dbg>=2){printf("FM_initialize() done.\n");fflush(stdout);}
 /*---------------------------------------------------------------------------*/
 void FM_finalize( void )
 {
+#if !NODEBUG
+if(mixfm->dbg>=0){if(use_gateway&&FM_nodeid==mixfm->route.gateway&&FM_nodeid<_printlsdbgmaxfmid){printf("%lu: FM gateway forwarded %lu msgs\n",FM_nodeid,mixfm->route.nforwarded);fflush(stdout);}}
+#endif
+
+    if( mixfm->emu.on )
+    {
+#if !NODEBUG
+if(mixfm->dbg>=0){if(FM_nodeid==0){printf("%lu: FM emulation held %lu msgs, avg delay %.1lf us, max %.1lf us, max queued %lu\n",FM_nodeid,mixfm->emu.nheld,(mixfm->emu.nheld>0?mixfm->emu.totdelay*1e6/mixfm->emu.nheld:0),mixfm->emu.maxdelay*1e6,mixfm->emu.maxqueued);fflush(stdout);}}
+#endif
+        while( mixfm->emu.head )
+        {
+            FMCapturedMsg *m = mixfm->emu.head;
+            mixfm->emu.head = m->next;
+            free( m );
+        }
+        free( mixfm->emu.link );
+        mixfm->emu.link = 0;
+        mixfm->emu.on = 0;
+    }
+
     finalize_interfaces();
+
+    if( local_numnodes > 1 && FM_nodeid == 0 ) local_reap();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -1476,6 +2212,15 @@ void FM_receive( void *buffer, FM_stream *receivestream, unsigned int length )
     XFace *xf = mixfm->curr.in.xf;
     MYASSERT( receivestream == mixfm->curr.in.stream,
             ("%p %p",receivestream,mixfm->curr.in.stream) );
+    if( mixfm->capture.msg && receivestream == (FM_stream *)mixfm->capture.msg )
+    {
+        FMCapturedMsg *m = mixfm->capture.msg;
+        MYASSERT( mixfm->capture.pos + (int)length <= m->len,
+                  ("%d+%u > %d",mixfm->capture.pos,length,m->len) );
+        memcpy( buffer, m->data+mixfm->capture.pos, length );
+        mixfm->capture.pos += length;
+        return;
+    }
     MYASSERT( xf, ("An interface must be currently active") );
     xf->xf_class->xf_recv_piece( xf, receivestream, buffer, length );
 }
@@ -1488,6 +2233,10 @@ int FM_extract( unsigned int maxbytes )
 
     if( extracting++ > 0 ) return 0;
 
+    /*Messages captured earlier go first, to keep per-sender order*/
+    if( !capturing ) replay_captured();
+    if( !capturing ) emu_release();
+
     for( x = 0; nextracted < maxbytes && x < mixfm->nxfaces; x++ )
     {
 	XFace *xf = &mixfm->xfaces[x];
@@ -1506,6 +2255,99 @@ int FM_extract( unsigned int maxbytes )
     return nextracted;
 }
 
+/*---------------------------------------------------------------------------*/
+/* Marks a handler's messages as latency-critical (time management,         */
+/* retractions).  Interfaces that can, carry them on a separate channel     */
+/* that FM_extract_urgent() polls without touching bulk traffic.            */
+/*---------------------------------------------------------------------------*/
+void FM_set_urgent( ULONG handler )
+{
+    MYASSERT( handler < FM_MAX_HANDLERS, ("%lu",handler) );
+    if( use_mpi ) FMMPI_set_urgent( (int)handler );
+}
+
+/*---------------------------------------------------------------------------*/
+int FM_extract_urgent( void )
+{
+    int x = 0, nextracted = 0;
+
+    if( !use_mpi ) return 0;
+    if( extracting++ > 0 ) { extracting--; return 0; }
+
+    if( !capturing ) replay_captured();
+    if( !capturing ) emu_release();
+
+    for( x = 0; x < mixfm->nxfaces; x++ )
+    {
+	XFace *xf = &mixfm->xfaces[x];
+
+	if( xf->xf_class->xf_cltag != FM_XFACE_CLASS_MPI ) continue;
+
+	mixfm->curr.in.xf = xf; mixfm->curr.in.stream = 0;
+	mixfm->curr.out.xf = xf; mixfm->curr.out.stream = 0;
+
+	nextracted += FMMPI_extract_urgent();
+
+	mixfm->curr.in.xf = 0; mixfm->curr.in.stream = 0;
+	mixfm->curr.out.xf = xf; mixfm->curr.out.stream = 0;
+    }
+
+    extracting--;
+
+    return nextracted;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Lets a helper thread drain the interfaces without running any handlers:  */
+/* messages it extracts are queued, and run in order by the next FM_extract()*/
+/* of a thread that does not capture.  Callers must still make sure that no */
+/* two threads are inside FM at the same time.                              */
+/*---------------------------------------------------------------------------*/
+void FM_capture_thread( int on ) { capturing = on; }
+unsigned long FM_num_captured( void ) { return mixfm->capture.ncaptured; }
+
+/*---------------------------------------------------------------------------*/
+void FM_flush( void )
+{
+    if( use_ring ) RING_flush();
+    if( use_rma ) RMA_flush();
+    if( use_tcp ) TCP_flush();
+}
+
+/*---------------------------------------------------------------------------*/
+/* May threads other than the initializing one call into FM, one at a time? */
+/*---------------------------------------------------------------------------*/
+int FM_threads_serialized( void )
+{
+    return !use_mpi || FMMPI_threads_serialized();
+}
+
+/*---------------------------------------------------------------------------*/
+/* leaders[i] is the lowest FM ID placed on the same host as FM node i:     */
+/* detected via MPI if available, else from the NODEINFO hostnames.         */
+/* Collective over all nodes.                                               */
+/*---------------------------------------------------------------------------*/
+void FM_node_leaders( int *leaders )
+{
+    int i = 0, j = 0;
+
+    #if MPI_AVAILABLE
+    FM_flush(); /*Peers may be waiting on staged messages before joining*/
+    if( FM_nodeid == FMMPI_nodeid &&
+        FMMPI_node_leaders( leaders, (int)FM_numnodes ) ) return;
+    #endif /*MPI_AVAILABLE*/
+
+    for( i = 0; i < FM_numnodes; i++ )
+    {
+        for( j = 0; j < i; j++ )
+        {
+            if( !strcmp( mixfm->FM_nodenames[j], mixfm->FM_nodenames[i] ) )
+                break;
+        }
+        leaders[i] = j;
+    }
+}
+
 /*---------------------------------------------------------------------------*/
 /*                                                                           */
 /*---------------------------------------------------------------------------*/
@@ -1621,6 +2463,32 @@ void FML_PrintHandlerTable (void)
   fflush(stdout);
 }
 
+#if MPI_AVAILABLE
+/*---------------------------------------------------------------------------*/
+/* A gateway blocked in MPI_Barrier would strand the messages it relays for */
+/* nodes yet to reach the barrier, so keep forwarding until it completes.   */
+/* Messages for this node are captured, and run by the next FM_extract().   */
+/*---------------------------------------------------------------------------*/
+static void gateway_barrier( void )
+{
+    MPI_Request req;
+    int done = FALSE, was_capturing = capturing, retcode = 0;
+
+    FM_flush();
+    retcode = MPI_Ibarrier( MPI_COMM_WORLD, &req );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Ibarrier") );
+    capturing = TRUE;
+    while( !done )
+    {
+        FM_extract( ~0 );
+        FM_flush();
+        retcode = MPI_Test( &req, &done, MPI_STATUS_IGNORE );
+        MYASSERT( retcode == MPI_SUCCESS, ("MPI_Test barrier") );
+    }
+    capturing = was_capturing;
+}
+#endif /*MPI_AVAILABLE*/
+
 /*---------------------------------------------------------------------------*/
 /* Simple barrier; does not guarantee all messages flushed out of system     */
 /* Broadcast a msg, wait until a broadcast is recd from each other processor.*/
@@ -1631,7 +2499,8 @@ static void FML_BarrierInternal(int v)
   int i;
  
   #if MPI_AVAILABLE
-  if( 1 ) { MPI_Barrier( MPI_COMM_WORLD ); return; }
+  if( use_gateway ) { gateway_barrier(); return; }
+  if( 1 ) { FM_flush(); MPI_Barrier( MPI_COMM_WORLD ); return; }
   #endif
   if( use_rmb ) { rmb_barrier(); return; }
 
@@ -39,6 +39,13 @@ void FM_send_piece(FM_stream *, void *, ULONG);
 void FM_end_message(FM_stream *);
 void FM_receive(void *, FM_stream *, unsigned int);
 int FM_extract(unsigned int maxbytes);
+int FM_extract_urgent(void); /*Polls only the urgent channel, if any*/
+void FM_set_urgent(ULONG handler); /*Send handler's msgs on urgent channel*/
+void FM_flush(void); /*Push out batched sends before blocking outside FM*/
+void FM_capture_thread(int on); /*Caller's extracts queue msgs for replay*/
+void FM_node_leaders(int *leaders); /*Lowest FM ID on each node's host*/
+int FM_threads_serialized(void); /*May threads take turns calling FM?*/
+unsigned long FM_num_captured(void);
 ULONG FM_register_handler(ULONG , FM_handler *);
 void FM_set_parameter(int, int);
 int FM_debug_level(int);
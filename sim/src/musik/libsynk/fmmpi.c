@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "mycompat.h"
 #include "fmmpi.h"
@@ -24,6 +25,8 @@
     #define MPI_SUCCESS 0
     #define MPI_ERROR 1
     #define MPI_Init(a,b)      (void)0
+    #define MPI_Init_thread(a,b,c,d) (*(d)=(c))
+    #define MPI_THREAD_SERIALIZED 0
     #define MPI_Finalize()     (void)0
     #define MPI_Comm_rank(a,b) (void)0
     #define MPI_Comm_size(a,b) (void)0
@@ -36,8 +39,36 @@
     #define MPI_Iprobe(a,b,c,d,e) (MPI_ERROR)
     #define MPI_Probe(a,b,c,d,e) (MPI_ERROR)
     #define MPI_Barrier(a) (MPI_ERROR)
+    #define MPI_Buffer_detach(a,b) (MPI_ERROR)
+    #define MPI_Alloc_mem(a,b,c) (MPI_ERROR)
+    #define MPI_Free_mem(a) (MPI_ERROR)
+    #define MPI_Isend(a,b,c,d,e,f,g) (MPI_ERROR)
+    #define MPI_Irecv(a,b,c,d,e,f,g) (MPI_ERROR)
+    #define MPI_Recv_init(a,b,c,d,e,f,g) (MPI_ERROR)
+    #define MPI_Start(a) (MPI_ERROR)
+    #define MPI_Startall(a,b) (MPI_ERROR)
+    #define MPI_Test(a,b,c) (MPI_ERROR)
+    #define MPI_Testany(a,b,c,d,e) (MPI_ERROR)
+    #define MPI_Testsome(a,b,c,d,e) (MPI_ERROR)
+    #define MPI_Wait(a,b) (MPI_ERROR)
+    #define MPI_Waitall(a,b,c) (MPI_ERROR)
+    #define MPI_Cancel(a) (MPI_ERROR)
+    #define MPI_Request_free(a) (MPI_ERROR)
+    #define MPI_Bcast(a,b,c,d,e) (MPI_ERROR)
+    #define MPI_Allreduce(a,b,c,d,e,f) (MPI_ERROR)
+    #define MPI_Allgather(a,b,c,d,e,f,g) (MPI_ERROR)
+    #define MPI_Comm_dup(a,b) (MPI_ERROR)
+    #define MPI_Comm_free(a) (MPI_ERROR)
+    #define MPI_Comm_split_type(a,b,c,d,e) (MPI_ERROR)
     #define MPI_BYTE 0
     #define MPI_PACKED 0
+    #define MPI_INT 0
+    #define MPI_LONG 0
+    #define MPI_MIN 0
+    #define MPI_INFO_NULL 0
+    #define MPI_COMM_TYPE_SHARED 0
+    #define MPI_STATUS_IGNORE 0
+    #define MPI_STATUSES_IGNORE 0
     #define MPI_COMM_WORLD 0
     #define MPI_ANY_SOURCE 0
     #define MPI_BSEND_OVERHEAD 0
@@ -46,6 +77,8 @@
     #endif
     typedef struct { int MPI_SOURCE; int MPI_TAG; } MPI_Status;
     typedef void *MPI_Request;
+    typedef int MPI_Comm;
+    typedef long MPI_Aint;
     #define MPI_REQUEST_NULL 0
     #define MPI_UNDEFINED 0
 #endif
@@ -67,6 +100,8 @@ typedef struct
     int npieces; /*Including this header piece; hence always >=1*/
     int piecelen[FMMPIMAXPIECES]; /*Byte length of each piece*/
     int totbytes;/*#bytes in all pieces combined; hence always >= sizeof(hdr)*/
+    int seq;     /*Per src_pe->dest_pe sequence number (non-blocking engine)*/
+    int window;  /*Sender's current credit window (non-blocking engine)*/
 } FMMPIMsgHeaderPiece;
 
 /*---------------------------------------------------------------------------*/
@@ -97,6 +132,28 @@ static void flctl_ppsbuf_delete( Flctl_PPSBuf *fbuf );
 static void flctl_ppsbuf_prepend( Flctl_PPSBuf **head, Flctl_PPSBuf *fbuf );
 static void flctl_ppsbuf_delink( Flctl_PPSBuf **pfbuf );
 
+/*---------------------------------------------------------------------------*/
+struct FMMPINonBlockingStruct;
+typedef struct FMMPINonBlockingStruct FMMPINonBlocking;
+static void nb_init( void );
+static void nb_finalize( void );
+static void nb_begin_message( void );
+static void nb_send_piece( const void *buffer, int length );
+static void nb_end_message( void );
+static int nb_extract( unsigned int maxbytes );
+static char *nb_rbuf( void );
+
+/*---------------------------------------------------------------------------*/
+struct FMMPIUrgentStruct;
+typedef struct FMMPIUrgentStruct FMMPIUrgent;
+static void urg_init( void );
+static void urg_finalize( void );
+static BOOLEAN urg_begin_message( int handler );
+static BOOLEAN urg_send_piece( const void *buffer, int length );
+static BOOLEAN urg_end_message( void );
+static int urg_extract( void );
+static char *urg_rbuf( void );
+
 /*---------------------------------------------------------------------------*/
 typedef struct
 {
@@ -107,6 +164,8 @@ typedef struct
 
     int msg_tag;
 
+    int thread_level; /*As provided by MPI_Init_thread()*/
+
     FMMPISendMsg send_msg;
     FMMPIRecvMsg recv_msg;
 
@@ -144,6 +203,9 @@ typedef struct
     BOOLEAN flctl_icantsendto[FMMPIMAXPE];
     long flctl_nsentto[FMMPIMAXPE];
     long flctl_nrecdfrom[FMMPIMAXPE];
+
+    FMMPINonBlocking *nb; /*Non-null if using the Isend/persistent-recv engine*/
+    FMMPIUrgent *urg;     /*Non-null if urgent handlers get their own channel*/
 } FMMPIState;
 
 /*---------------------------------------------------------------------------*/
@@ -371,11 +433,14 @@ void FMMPI_pre_initialize(int *pac, char ***pav)
 {
     if( !mpi || !mpi->inited )
     {
-        int i = 0, rank = -1, size = 0;
+        int i = 0, rank = -1, size = 0, provided = 0;
         char *estr = getenv("FMMPI_DEBUG");
         char *pprstr = getenv("FMMPI_PREPOSTRECV"); /*TRUE or FALSE*/
         char *pprcstr = getenv("FMMPI_PREPOSTRECVCOUNT"); /*Integer >0*/
         char *testanystr = getenv("FMMPI_PREPOSTTESTANY"); /*TRUE or FALSE*/
+        char *nbstr = getenv("FMMPI_NONBLOCKING"); /*TRUE or FALSE*/
+        char *urgstr = getenv("FMMPI_URGENT"); /*TRUE or FALSE*/
+        BOOLEAN use_nb = FALSE;
         mpifmdbg = estr ? atoi(estr) : 1;
 
 #if !NODEBUG
@@ -386,7 +451,8 @@ if(mpifmdbg>=2){printf("FMMPI_DEBUG=%d\n",mpifmdbg);fflush(stdout);}
 if(mpifmdbg>=2){printf("FMMPI_pre_init() started.\n");fflush(stdout);}
 #endif
 
-        MPI_Init( pac, pav );
+        /*Callers may drive FM from more than one thread, one at a time*/
+        MPI_Init_thread( pac, pav, MPI_THREAD_SERIALIZED, &provided );
         MPI_Comm_rank( MPI_COMM_WORLD, &rank );
         MPI_Comm_size( MPI_COMM_WORLD, &size );
         MPI_Barrier( MPI_COMM_WORLD );
@@ -398,8 +464,10 @@ if(mpifmdbg>=2){printf("FMMPI_pre_init() started.\n");fflush(stdout);}
         mpi->nodeid = FMMPI_nodeid = rank;
         mpi->numnodes = FMMPI_numnodes = size;
         mpi->msg_tag = 123;
+        mpi->thread_level = provided;
 
         FMMPI_portals_init();
+        use_nb = !use_portals && (nbstr ? !strcmp(nbstr,"TRUE") : FALSE);
 
         #if STATICBUFS
         {
@@ -408,7 +476,7 @@ if(mpifmdbg>=2){printf("FMMPI_pre_init() started.\n");fflush(stdout);}
         }
         #else /*STATICBUFS*/
         {
-            int nmsgs = (use_portals ? 1 : MAXPENDINGMSGS);
+            int nmsgs = ((use_portals || use_nb) ? 1 : MAXPENDINGMSGS);
             int nbytes = nmsgs * (MAXBUFLEN + MPI_BSEND_OVERHEAD);
 
             mpi->attachbuf = (char*)malloc( nbytes );
@@ -419,7 +487,7 @@ if(mpifmdbg>=2){printf("FMMPI_pre_init() started.\n");fflush(stdout);}
         }
         #endif /*STATICBUFS*/
 
-        mpi->prerecv = use_portals ? FALSE :
+        mpi->prerecv = (use_portals || use_nb) ? FALSE :
                        (pprstr ? !strcmp(pprstr,"TRUE") : FALSE);
         mpi->prerecvbufcount = !mpi->prerecv ? 1 : (pprcstr?atoi(pprcstr):100);
         mpi->prerecvtestany = testanystr ? !strcmp(testanystr,"TRUE") : FALSE;
@@ -462,7 +530,20 @@ if(mpifmdbg>=2){printf("FMMPI_pre_init() started.\n");fflush(stdout);}
         mpi->flctl_k = getenv("FMMPI_FLCTLK") ?
 	                 atoi(getenv("FMMPI_FLCTLK")) : 0; /*CUSTOMIZE*/
 
-        MPI_Buffer_attach( mpi->attachbuf, mpi->attachbuflen );
+        if( use_nb )
+        {
+            mpi->flctl_k = 0; /*Superseded by per-peer credits*/
+            nb_init();
+        }
+        else
+        {
+            MPI_Buffer_attach( mpi->attachbuf, mpi->attachbuflen );
+        }
+
+        if( !use_portals && (urgstr ? !strcmp(urgstr,"TRUE") : TRUE) )
+        {
+            urg_init();
+        }
 
         MPI_Barrier( MPI_COMM_WORLD );
 
@@ -485,6 +566,12 @@ void FMMPI_post_initialize( void )
              "FMMPI if prerecv, #recv bufs to prepost initially" );
     LSCFGST( "FMMPI_PREPOSTTESTANY", (mpi->prerecvtestany?"TRUE":"FALSE"),
              "FMMPI if prerecv, use testany instead of testsome " );
+    LSCFGST( "FMMPI_NONBLOCKING", (mpi->nb?"TRUE":"FALSE"),
+             "FMMPI uses Isend from a buffer pool & persistent recvs" );
+    LSCFGLD( "FMMPI_THREADLEVEL", (long)mpi->thread_level,
+             "FMMPI MPI thread support level provided" );
+    LSCFGST( "FMMPI_URGENT", (mpi->urg?"TRUE":"FALSE"),
+             "FMMPI sends urgent (TM/retract) msgs on a separate channel" );
 #if 1 || !NODEBUG
 if(mpi->nodeid==0 && mpifmdbg>=0){printf("FMMPI %susing prepost recv %d\n",(mpi->prerecv?"":"not "),mpi->prerecvbufcount);fflush(stdout);}
 if(mpi->nodeid==0 && mpifmdbg>=0){printf("FMMPI using prepost test%s\n",(mpi->prerecvtestany?"any":"some"));fflush(stdout);}
@@ -547,6 +634,16 @@ if(mpifmdbg>=0){if(FMMPI_nodeid==0){printf("%d: MPI probetot %lu probereadytot %
         FMPTL_Finish( FMMPI_nodeid );
     }
 
+    if( mpi->nb )
+    {
+        nb_finalize();
+    }
+
+    if( mpi->urg )
+    {
+        urg_finalize();
+    }
+
     if( mpi->prerecv )
     {
         int i = 0;
@@ -606,6 +703,15 @@ if(mpifmdbg>=2){printf("%d: FMMPI_begin_message(to=%d, len=%d)\n",FMMPI_nodeid,r
     iov->iov_base = (char *)hdr;
     iov->iov_len = hdr->totbytes;
 
+    if( mpi->urg && urg_begin_message( handler ) )
+    {
+        /*Goes out on the urgent channel*/
+    }
+    else if( mpi->nb )
+    {
+        nb_begin_message();
+    }
+
     return (FMMPI_stream *)msg;
 }
 
@@ -629,6 +735,15 @@ if(0)/*XXX Don't need to check for SSIZE_MAX limit for purely MPI-only runs*/
     MYASSERT( hdr->totbytes+length <= mpi->packbuflen,
               ("%d + %d <= %d", hdr->totbytes, length, mpi->packbuflen) );
 
+    if( mpi->urg && urg_send_piece( buffer, length ) )
+    {
+        /*Copied into the urgent slot*/
+    }
+    else if( mpi->nb )
+    {
+        nb_send_piece( buffer, length );
+    }
+
     {
     int pn = hdr->npieces++;
     IOVEC *iov = &msg->pieces[pn];
@@ -733,7 +848,15 @@ if(mpifmdbg>=2){printf("%d: FMMPI_end_message()\n",FMMPI_nodeid);fflush(stdout);
     MYASSERT( hdr->totbytes <= mpi->packbuflen,
               ("%d %d", hdr->totbytes, mpi->packbuflen) );
 
-    if( mpi->flctl_icantsendto[hdr->dest_pe] )
+    if( mpi->urg && urg_end_message() )
+    {
+        /*Sent on the urgent channel*/
+    }
+    else if( mpi->nb )
+    {
+        nb_end_message();
+    }
+    else if( mpi->flctl_icantsendto[hdr->dest_pe] )
     {
         Flctl_PPSBuf *ppsbuf = 0;
 #if !NODEBUG
@@ -786,10 +909,20 @@ int FMMPI_receive( void *buffer, FMMPI_stream *receivestream,
                 ("%d, %d, %d", length, hdr->totbytes, msg->nbytes_recd) );
     }
 
-  if( use_portals )
+  if( mpi->urg && urg_rbuf() )
+  {
+    memcpy( buffer, urg_rbuf() + msg->position, length );
+    msg->position += length;
+  }
+  else if( use_portals )
   {
     FMPTL_RecvPiece( buffer, length );
   }
+  else if( mpi->nb )
+  {
+    memcpy( buffer, nb_rbuf() + msg->position, length );
+    msg->position += length;
+  }
   else
   {
     retcode = MPI_Unpack( mpi->prerecvbuf[mpi->prerecvbufidx],mpi->prerecvbufsz,
@@ -868,7 +1001,10 @@ if(mpifmdbg>=2){printf("%d: service_mesg(from_pe=%d) done fmcb\n", FMMPI_nodeid,
 
         nbytes = msg->nbytes_recd;
 
-        flctl_send_dummy( hdr->src_pe );
+        if( !(mpi->urg && urg_rbuf()) ) /*Urgent msgs bypass flow control*/
+        {
+            flctl_send_dummy( hdr->src_pe );
+        }
     }
 
 #if !NODEBUG
@@ -937,6 +1073,813 @@ if(mpifmdbg>=2){printf("%d: service_prerecv() done %d\n",FMMPI_nodeid,mpi->prere
     return nbytes;
 }
 
+/*---------------------------------------------------------------------------*/
+/* Non-blocking engine (FMMPI_NONBLOCKING=TRUE).                             */
+/* Pieces are copied once, straight into a send slot taken from a pool of    */
+/* MPI_Alloc_mem buffers, and the slot is handed to MPI_Isend; nothing is    */
+/* Bsend-attached, so there is no attach-size ceiling, and the pool grows on */
+/* demand instead.  Receives are persistent (MPI_Recv_init) and completed    */
+/* with MPI_Testsome; a per-pair sequence number restores FIFO order across  */
+/* the pre-posted buffers.  Flow control is credit based: a sender may have  */
+/* at most "window" unacknowledged messages to a peer, and queues the slot   */
+/* (without copying) when it runs out.  The receiver hands credits back once */
+/* half the advertised window is consumed.  Windows double for peers that    */
+/* stalled since the last grant and decay again when they stay calm.         */
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    char *buf;    /*MAXBUFLEN bytes; header followed by the pieces*/
+    int next;     /*Next slot in free list or in a peer's stalled queue*/
+    int dest_pe;
+    int len;
+} FMMPINBSlot;
+
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    int sseq, rseq;   /*Next sequence numbers to send to/deliver from peer*/
+    int window;       /*Max #uncredited messages to this peer*/
+    int used;         /*#messages sent to this peer but not yet credited*/
+    int stalled;      /*Queued a message for lack of credits since last grant*/
+    int calm;         /*#consecutive grants without a stall*/
+    int qhead, qtail; /*Slots waiting for credits, in order*/
+    int owed;         /*#messages consumed from this peer, not yet credited*/
+    int peerwin;      /*Window last advertised by this peer*/
+    int creditout;    /*Payload of the in-flight credit message*/
+    MPI_Request creditreq;
+    BOOLEAN onstall, onowe; /*Listed in stallpeers/owepeers?*/
+} FMMPINBPeer;
+
+/*---------------------------------------------------------------------------*/
+struct FMMPINonBlockingStruct
+{
+    int npool;             /*#send slots allocated so far*/
+    FMMPINBSlot *slots;
+    MPI_Request *sendreq;  /*sendreq[i] is active while slot i is in flight*/
+    int *doneidx;          /*Scratch for MPI_Testsome on sendreq*/
+    int freelist;          /*Head of free slot list; -1 if none*/
+    int cur;               /*Slot being filled by the current outgoing msg*/
+    int ninflight;
+    char **chunks; int nchunks; /*MPI_Alloc_mem'ed slot buffer chunks*/
+
+    int nrecv, ncrecv;     /*#persistent data, credit receives*/
+    char **recvbuf;        /*[nrecv]*/
+    int *creditin;         /*[ncrecv]*/
+    MPI_Request *recvreq;  /*[nrecv+ncrecv]; data first, then credits*/
+    MPI_Status *recvstat;
+    int *recvidx;
+    char *recvactive;      /*Is recvreq[i] started and not yet completed?*/
+    int *held, nheld;      /*Completed data receives awaiting their turn*/
+    char *rbuf;            /*Buffer of the message being serviced*/
+
+    FMMPINBPeer *peer;     /*[numnodes]*/
+    int *stallpeers, nstallpeers;
+    int *owepeers, nowepeers;
+    int initcredits, mincredits, maxcredits;
+
+    unsigned long nsent, nqueued, ngrants, ngrows, nshrinks, npoolgrows;
+};
+
+/*---------------------------------------------------------------------------*/
+static void nb_grow_pool( void )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    int i = 0, n = (nb->npool > 0 ? nb->npool : 128), retcode = 0;
+    char *chunk = 0;
+    {char *estr = getenv("FMMPI_NBPOOL"); if(nb->npool<=0 && estr) n=atoi(estr);}
+    MYASSERT( n > 0, ("FMMPI_NBPOOL %d must be > 0",n) );
+
+    retcode = MPI_Alloc_mem( (MPI_Aint)n*MAXBUFLEN, MPI_INFO_NULL, &chunk );
+    MYASSERT( retcode == MPI_SUCCESS && chunk,
+              ("MPI_Alloc_mem %d send slots",n) );
+    nb->chunks = (char **)realloc( nb->chunks, (nb->nchunks+1)*sizeof(char*) );
+    nb->chunks[nb->nchunks++] = chunk;
+
+    nb->slots = (FMMPINBSlot *)realloc( nb->slots,
+                                  (nb->npool+n)*sizeof(FMMPINBSlot) );
+    nb->sendreq = (MPI_Request *)realloc( nb->sendreq,
+                                  (nb->npool+n)*sizeof(MPI_Request) );
+    nb->doneidx = (int *)realloc( nb->doneidx, (nb->npool+n)*sizeof(int) );
+    MYASSERT( nb->slots && nb->sendreq && nb->doneidx, ("!") );
+
+    for( i = nb->npool+n-1; i >= nb->npool; --i )
+    {
+        FMMPINBSlot *slot = &nb->slots[i];
+        slot->buf = chunk + (size_t)(i-nb->npool)*MAXBUFLEN;
+        slot->next = nb->freelist;
+        slot->dest_pe = -1;
+        slot->len = 0;
+        nb->sendreq[i] = MPI_REQUEST_NULL;
+        nb->freelist = i;
+    }
+    nb->npool += n;
+    nb->npoolgrows++;
+
+#if !NODEBUG
+if(mpifmdbg>=2){printf("%d: FMMPI send pool grown to %d slots\n",FMMPI_nodeid,nb->npool);fflush(stdout);}
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+static void nb_reap_sends( void )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    int i = 0, ndone = 0, retcode = 0;
+
+    if( nb->ninflight <= 0 ) return;
+
+    retcode = MPI_Testsome( nb->npool, nb->sendreq, &ndone, nb->doneidx,
+                            MPI_STATUSES_IGNORE );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Testsome sends") );
+    for( i = 0; ndone != MPI_UNDEFINED && i < ndone; i++ )
+    {
+        int k = nb->doneidx[i];
+        nb->slots[k].next = nb->freelist;
+        nb->freelist = k;
+        nb->ninflight--;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+static void nb_isend( int k )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    FMMPINBSlot *slot = &nb->slots[k];
+    int retcode = MPI_Isend( slot->buf, slot->len, MPI_BYTE, slot->dest_pe,
+                             mpi->msg_tag, MPI_COMM_WORLD, &nb->sendreq[k] );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Isend must succeed!") );
+    nb->ninflight++;
+    nb->peer[slot->dest_pe].used++;
+    nb->nsent++;
+}
+
+/*---------------------------------------------------------------------------*/
+static void nb_service_stalled( void )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    int i = 0;
+
+    for( i = 0; i < nb->nstallpeers; )
+    {
+        int p = nb->stallpeers[i];
+        FMMPINBPeer *peer = &nb->peer[p];
+        while( peer->qhead >= 0 && peer->used < peer->window )
+        {
+            int k = peer->qhead;
+            peer->qhead = nb->slots[k].next;
+            if( peer->qhead < 0 ) peer->qtail = -1;
+            nb_isend( k );
+        }
+        if( peer->qhead < 0 )
+        {
+            peer->onstall = FALSE;
+            nb->stallpeers[i] = nb->stallpeers[--nb->nstallpeers];
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+static BOOLEAN nb_send_credit( int p )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    FMMPINBPeer *peer = &nb->peer[p];
+    int retcode = 0;
+
+    if( peer->creditreq != MPI_REQUEST_NULL )
+    {
+        int done = 0;
+        retcode = MPI_Test( &peer->creditreq, &done, MPI_STATUS_IGNORE );
+        MYASSERT( retcode == MPI_SUCCESS, ("MPI_Test credit") );
+        if( !done ) return FALSE;
+    }
+
+    peer->creditout = peer->owed;
+    peer->owed = 0;
+    retcode = MPI_Isend( &peer->creditout, 1, MPI_INT, p, mpi->flctl_msg_tag,
+                         MPI_COMM_WORLD, &peer->creditreq );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Isend credit") );
+#if !NODEBUG
+if(mpifmdbg>=3){printf("%d: FMMPI credit %d to %d\n",FMMPI_nodeid,peer->creditout,p);fflush(stdout);}
+#endif
+    return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+static void nb_service_owed( void )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    int i = 0;
+
+    for( i = 0; i < nb->nowepeers; )
+    {
+        int p = nb->owepeers[i];
+        if( nb->peer[p].owed <= 0 || nb_send_credit( p ) )
+        {
+            nb->peer[p].onowe = FALSE;
+            nb->owepeers[i] = nb->owepeers[--nb->nowepeers];
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+static void nb_consumed( int p, int peerwin )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    FMMPINBPeer *peer = &nb->peer[p];
+
+    peer->peerwin = peerwin;
+    if( ++peer->owed >= (peer->peerwin+1)/2 && !nb_send_credit( p ) &&
+        !peer->onowe )
+    {
+        peer->onowe = TRUE;
+        nb->owepeers[nb->nowepeers++] = p;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+static void nb_granted( int p, int ncredits )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    FMMPINBPeer *peer = &nb->peer[p];
+
+    MYASSERT( 0 < ncredits && ncredits <= peer->used,
+              ("%d: credit %d from %d with %d used",FMMPI_nodeid,ncredits,
+               p,peer->used) );
+    peer->used -= ncredits;
+    nb->ngrants++;
+
+    if( peer->stalled )
+    {
+        peer->calm = 0;
+        if( peer->window < nb->maxcredits )
+        {
+            peer->window *= 2;
+            if( peer->window > nb->maxcredits ) peer->window = nb->maxcredits;
+            nb->ngrows++;
+        }
+    }
+    else if( ++peer->calm >= 8 && peer->window > nb->mincredits )
+    {
+        peer->calm = 0;
+        peer->window /= 2;
+        if( peer->window < nb->mincredits ) peer->window = nb->mincredits;
+        nb->nshrinks++;
+    }
+    peer->stalled = FALSE;
+}
+
+/*---------------------------------------------------------------------------*/
+static void nb_init( void )
+{
+    FMMPINonBlocking *nb = 0;
+    int i = 0, n = 0, retcode = 0;
+    char *estr = 0;
+
+    nb = mpi->nb = (FMMPINonBlocking *)calloc( 1, sizeof(FMMPINonBlocking) );
+    MYASSERT( nb, ("!") );
+
+    nb->freelist = -1;
+    nb->cur = -1;
+    nb->initcredits = (estr=getenv("FMMPI_NBCREDITS")) ? atoi(estr) : 32;
+    nb->mincredits = (estr=getenv("FMMPI_NBMINCREDITS")) ? atoi(estr) : 8;
+    nb->maxcredits = (estr=getenv("FMMPI_NBMAXCREDITS")) ? atoi(estr) : 1024;
+    nb->nrecv = (estr=getenv("FMMPI_NBRECVS")) ? atoi(estr) : 64;
+    nb->ncrecv = 8;
+    MYASSERT( 1 <= nb->mincredits && nb->mincredits <= nb->initcredits &&
+              nb->initcredits <= nb->maxcredits,
+              ("FMMPI credits min %d init %d max %d",nb->mincredits,
+               nb->initcredits,nb->maxcredits) );
+    MYASSERT( nb->nrecv > 0, ("FMMPI_NBRECVS %d",nb->nrecv) );
+
+    nb_grow_pool();
+
+    nb->peer = (FMMPINBPeer *)calloc( mpi->numnodes, sizeof(FMMPINBPeer) );
+    nb->stallpeers = (int *)malloc( mpi->numnodes*sizeof(int) );
+    nb->owepeers = (int *)malloc( mpi->numnodes*sizeof(int) );
+    MYASSERT( nb->peer && nb->stallpeers && nb->owepeers, ("!") );
+    for( i = 0; i < mpi->numnodes; i++ )
+    {
+        FMMPINBPeer *peer = &nb->peer[i];
+        peer->window = nb->initcredits;
+        peer->peerwin = nb->initcredits;
+        peer->qhead = peer->qtail = -1;
+        peer->creditreq = MPI_REQUEST_NULL;
+    }
+
+    n = nb->nrecv + nb->ncrecv;
+    nb->recvbuf = (char **)malloc( nb->nrecv*sizeof(char*) );
+    nb->creditin = (int *)malloc( nb->ncrecv*sizeof(int) );
+    nb->recvreq = (MPI_Request *)malloc( n*sizeof(MPI_Request) );
+    nb->recvstat = (MPI_Status *)malloc( n*sizeof(MPI_Status) );
+    nb->recvidx = (int *)malloc( n*sizeof(int) );
+    nb->recvactive = (char *)malloc( n );
+    nb->held = (int *)malloc( nb->nrecv*sizeof(int) );
+    MYASSERT( nb->recvbuf && nb->creditin && nb->recvreq && nb->recvstat &&
+              nb->recvidx && nb->recvactive && nb->held, ("!") );
+    memset( nb->recvactive, TRUE, n );
+    for( i = 0; i < nb->nrecv; i++ )
+    {
+        nb->recvbuf[i] = (char *)malloc( MAXBUFLEN );
+        MYASSERT( nb->recvbuf[i], ("!") );
+        retcode = MPI_Recv_init( nb->recvbuf[i], MAXBUFLEN, MPI_BYTE,
+                                 MPI_ANY_SOURCE, mpi->msg_tag, MPI_COMM_WORLD,
+                                 &nb->recvreq[i] );
+        MYASSERT( retcode == MPI_SUCCESS, ("MPI_Recv_init %d",i) );
+    }
+    for( i = 0; i < nb->ncrecv; i++ )
+    {
+        retcode = MPI_Recv_init( &nb->creditin[i], 1, MPI_INT,
+                                 MPI_ANY_SOURCE, mpi->flctl_msg_tag,
+                                 MPI_COMM_WORLD, &nb->recvreq[nb->nrecv+i] );
+        MYASSERT( retcode == MPI_SUCCESS, ("MPI_Recv_init credit %d",i) );
+    }
+    retcode = MPI_Startall( n, nb->recvreq );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Startall") );
+}
+
+/*---------------------------------------------------------------------------*/
+static void nb_finalize( void )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    int i = 0, nqueued = 0;
+
+#if !NODEBUG
+if(mpifmdbg>=0){if(FMMPI_nodeid==0){printf("%d: FMMPI nonblocking sent %lu queued %lu grants %lu window grows %lu shrinks %lu pool %d slots\n",FMMPI_nodeid,nb->nsent,nb->nqueued,nb->ngrants,nb->ngrows,nb->nshrinks,nb->npool);fflush(stdout);}}
+#endif
+
+    for( i = 0; i < mpi->numnodes; i++ )
+    {
+        FMMPINBPeer *peer = &nb->peer[i];
+        int k = 0;
+        for( k = peer->qhead; k >= 0; k = nb->slots[k].next ) nqueued++;
+        if( peer->creditreq != MPI_REQUEST_NULL )
+            MPI_Wait( &peer->creditreq, MPI_STATUS_IGNORE ); /*Reads peer*/
+    }
+#if !NODEBUG
+if(mpifmdbg>=1){if(nqueued>0){printf("%d: FMMPI %d messages still awaiting credits\n",FMMPI_nodeid,nqueued);fflush(stdout);}}
+#endif
+
+    /*In-flight sends still read the chunks freed below*/
+    MPI_Waitall( nb->npool, nb->sendreq, MPI_STATUSES_IGNORE );
+
+    for( i = 0; i < nb->nrecv + nb->ncrecv; i++ )
+    {
+        if( nb->recvactive[i] )
+        {
+            MPI_Cancel( &nb->recvreq[i] );
+            MPI_Wait( &nb->recvreq[i], MPI_STATUS_IGNORE );
+        }
+        MPI_Request_free( &nb->recvreq[i] );
+    }
+
+    for( i = 0; i < nb->nrecv; i++ ) free( nb->recvbuf[i] );
+    for( i = 0; i < nb->nchunks; i++ ) MPI_Free_mem( nb->chunks[i] );
+    free( nb->recvbuf ); free( nb->creditin ); free( nb->recvreq );
+    free( nb->recvstat ); free( nb->recvidx ); free( nb->recvactive );
+    free( nb->held ); free( nb->chunks ); free( nb->slots );
+    free( nb->sendreq ); free( nb->doneidx ); free( nb->peer );
+    free( nb->stallpeers ); free( nb->owepeers );
+    free( nb );
+    mpi->nb = 0; /*Finalize may be invoked more than once*/
+}
+
+/*---------------------------------------------------------------------------*/
+static void nb_begin_message( void )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+
+    MYASSERT( nb->cur < 0, ("Only one outgoing FMMPI message at a time") );
+    if( nb->freelist < 0 ) nb_reap_sends();
+    if( nb->freelist < 0 ) nb_grow_pool();
+
+    nb->cur = nb->freelist;
+    nb->freelist = nb->slots[nb->cur].next;
+    nb->slots[nb->cur].next = -1;
+    nb->slots[nb->cur].len = sizeof(FMMPIMsgHeaderPiece);
+}
+
+/*---------------------------------------------------------------------------*/
+static void nb_send_piece( const void *buffer, int length )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    FMMPINBSlot *slot = &nb->slots[nb->cur];
+
+    MYASSERT( slot->len + length <= MAXBUFLEN,
+              ("%d + %d <= %d", slot->len, length, MAXBUFLEN) );
+    memcpy( slot->buf + slot->len, buffer, length );
+    slot->len += length;
+}
+
+/*---------------------------------------------------------------------------*/
+static void nb_end_message( void )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    FMMPIMsgHeaderPiece *hdr = &mpi->send_msg.hdr;
+    int k = nb->cur, p = hdr->dest_pe;
+    FMMPINBSlot *slot = &nb->slots[k];
+    FMMPINBPeer *peer = &nb->peer[p];
+
+    MYASSERT( slot->len == hdr->totbytes, ("%d %d",slot->len,hdr->totbytes) );
+    hdr->seq = peer->sseq++;
+    hdr->window = peer->window;
+    memcpy( slot->buf, hdr, sizeof(*hdr) );
+    slot->dest_pe = p;
+    nb->cur = -1;
+
+    if( peer->qhead < 0 && peer->used < peer->window )
+    {
+        nb_isend( k );
+    }
+    else
+    {
+        if( peer->qtail >= 0 ) nb->slots[peer->qtail].next = k;
+        else peer->qhead = k;
+        peer->qtail = k;
+        peer->stalled = TRUE;
+        nb->nqueued++;
+        if( !peer->onstall )
+        {
+            peer->onstall = TRUE;
+            nb->stallpeers[nb->nstallpeers++] = p;
+        }
+#if !NODEBUG
+if(mpifmdbg>=3){printf("%d: FMMPI queued msg to %d used %d window %d\n",FMMPI_nodeid,p,peer->used,peer->window);fflush(stdout);}
+#endif
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+static char *nb_rbuf( void )
+{
+    return mpi->nb->rbuf;
+}
+
+/*---------------------------------------------------------------------------*/
+static int nb_deliver_held( void )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    int nbytes = 0, progress = TRUE;
+
+    while( progress )
+    {
+        int h = 0;
+        progress = FALSE;
+        for( h = 0; h < nb->nheld; )
+        {
+            int k = nb->held[h], retcode = 0;
+            FMMPIMsgHeaderPiece *rhdr = (FMMPIMsgHeaderPiece *)nb->recvbuf[k];
+            int src = rhdr->src_pe, win = rhdr->window;
+            if( rhdr->seq != nb->peer[src].rseq )
+            {
+                h++;
+                continue;
+            }
+            nb->held[h] = nb->held[--nb->nheld];
+            nb->peer[src].rseq++;
+            nb->rbuf = nb->recvbuf[k];
+            nbytes += service_mesg( src );
+            nb->rbuf = 0;
+            retcode = MPI_Start( &nb->recvreq[k] );
+            MYASSERT( retcode == MPI_SUCCESS, ("MPI_Start %d",k) );
+            nb->recvactive[k] = TRUE;
+            nb_consumed( src, win );
+            progress = TRUE;
+        }
+    }
+
+    return nbytes;
+}
+
+/*---------------------------------------------------------------------------*/
+static int nb_extract( unsigned int maxbytes )
+{
+    FMMPINonBlocking *nb = mpi->nb;
+    int nbytes = 0;
+
+    while( nbytes < maxbytes )
+    {
+        int i = 0, ndone = 0, retcode = 0;
+
+        nb_reap_sends();
+
+        retcode = MPI_Testsome( nb->nrecv+nb->ncrecv, nb->recvreq, &ndone,
+                                nb->recvidx, nb->recvstat );
+        MYASSERT( retcode == MPI_SUCCESS, ("MPI_Testsome recvs") );
+        mpi->probetot++;
+        if( ndone == MPI_UNDEFINED ) ndone = 0;
+
+        for( i = 0; i < ndone; i++ )
+        {
+            int k = nb->recvidx[i];
+            nb->recvactive[k] = FALSE;
+            if( k < nb->nrecv )
+            {
+                nb->held[nb->nheld++] = k;
+            }
+            else
+            {
+                nb_granted( nb->recvstat[i].MPI_SOURCE,
+                            nb->creditin[k-nb->nrecv] );
+                retcode = MPI_Start( &nb->recvreq[k] );
+                MYASSERT( retcode == MPI_SUCCESS, ("MPI_Start credit") );
+                nb->recvactive[k] = TRUE;
+            }
+        }
+
+        if( ndone > 0 ) mpi->probereadytot++;
+        nbytes += nb_deliver_held();
+
+        if( nb->nstallpeers > 0 ) nb_service_stalled();
+        if( nb->nowepeers > 0 ) nb_service_owed();
+
+        if( ndone <= 0 ) break;
+    }
+
+    return nbytes;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Urgent channel (FMMPI_URGENT=TRUE, the default).                          */
+/* Messages of handlers marked with FMMPI_set_urgent() bypass the bulk      */
+/* engine: each is copied into a send slot of its own and Isent on a        */
+/* private duplicate of MPI_COMM_WORLD, where a few persistent receives are */
+/* always posted.  They therefore never wait for bulk credits or Bsend      */
+/* space at the sender, nor sit behind bulk messages in the receiver's      */
+/* matching queue.  A per-pair sequence number keeps urgent messages FIFO    */
+/* among themselves; there is no ordering with respect to bulk messages.    */
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    char *buf;        /*MAXBUFLEN bytes; header followed by the pieces*/
+    int len;
+    MPI_Request req;  /*Active while the slot is in flight*/
+} FMMPIUrgSlot;
+
+/*---------------------------------------------------------------------------*/
+struct FMMPIUrgentStruct
+{
+    MPI_Comm comm;         /*Private duplicate of MPI_COMM_WORLD*/
+    char handler[FMMPIMAXHANDLERS]; /*Are this handler's messages urgent?*/
+
+    int nslots;            /*#send slots allocated so far*/
+    FMMPIUrgSlot *slots;
+    int cur;               /*Slot being filled by the current urgent msg*/
+    int *sseq, *rseq;      /*[numnodes] next seq# to send to/deliver from*/
+
+    int nrecv;             /*#persistent receives*/
+    char **recvbuf;        /*[nrecv]*/
+    MPI_Request *recvreq;
+    int *recvidx;
+    int *held, nheld;      /*Completed receives awaiting their turn*/
+    char *rbuf;            /*Buffer of the message being serviced*/
+
+    unsigned long nsent, nrecd, npolls;
+};
+
+/*---------------------------------------------------------------------------*/
+static void urg_init( void )
+{
+    FMMPIUrgent *urg = 0;
+    int i = 0, retcode = 0;
+    char *estr = 0;
+
+    urg = mpi->urg = (FMMPIUrgent *)calloc( 1, sizeof(FMMPIUrgent) );
+    MYASSERT( urg, ("!") );
+
+    retcode = MPI_Comm_dup( MPI_COMM_WORLD, &urg->comm );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Comm_dup urgent") );
+
+    urg->cur = -1;
+    urg->nrecv = (estr=getenv("FMMPI_URGRECVS")) ? atoi(estr) : 16;
+    MYASSERT( urg->nrecv > 0, ("FMMPI_URGRECVS %d",urg->nrecv) );
+
+    urg->sseq = (int *)calloc( mpi->numnodes, sizeof(int) );
+    urg->rseq = (int *)calloc( mpi->numnodes, sizeof(int) );
+    urg->recvbuf = (char **)malloc( urg->nrecv*sizeof(char*) );
+    urg->recvreq = (MPI_Request *)malloc( urg->nrecv*sizeof(MPI_Request) );
+    urg->recvidx = (int *)malloc( urg->nrecv*sizeof(int) );
+    urg->held = (int *)malloc( urg->nrecv*sizeof(int) );
+    MYASSERT( urg->sseq && urg->rseq && urg->recvbuf && urg->recvreq &&
+              urg->recvidx && urg->held, ("!") );
+    for( i = 0; i < urg->nrecv; i++ )
+    {
+        urg->recvbuf[i] = (char *)malloc( MAXBUFLEN );
+        MYASSERT( urg->recvbuf[i], ("!") );
+        retcode = MPI_Recv_init( urg->recvbuf[i], MAXBUFLEN, MPI_BYTE,
+                                 MPI_ANY_SOURCE, mpi->msg_tag, urg->comm,
+                                 &urg->recvreq[i] );
+        MYASSERT( retcode == MPI_SUCCESS, ("MPI_Recv_init urgent %d",i) );
+    }
+    retcode = MPI_Startall( urg->nrecv, urg->recvreq );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Startall urgent") );
+}
+
+/*---------------------------------------------------------------------------*/
+static void urg_finalize( void )
+{
+    FMMPIUrgent *urg = mpi->urg;
+    int i = 0;
+
+#if !NODEBUG
+if(mpifmdbg>=0){if(FMMPI_nodeid==0){printf("%d: FMMPI urgent sent %lu recd %lu polls %lu slots %d\n",FMMPI_nodeid,urg->nsent,urg->nrecd,urg->npolls,urg->nslots);fflush(stdout);}}
+#endif
+
+    for( i = 0; i < urg->nslots; i++ )
+    {
+        if( urg->slots[i].req != MPI_REQUEST_NULL ) /*Still reads buf*/
+            MPI_Wait( &urg->slots[i].req, MPI_STATUS_IGNORE );
+        free( urg->slots[i].buf );
+    }
+
+    for( i = 0; i < urg->nrecv; i++ )
+    {
+        int done = 0;
+        MPI_Test( &urg->recvreq[i], &done, MPI_STATUS_IGNORE );
+        if( !done )
+        {
+            MPI_Cancel( &urg->recvreq[i] );
+            MPI_Wait( &urg->recvreq[i], MPI_STATUS_IGNORE );
+        }
+        MPI_Request_free( &urg->recvreq[i] );
+        free( urg->recvbuf[i] );
+    }
+
+    MPI_Comm_free( &urg->comm );
+    free( urg->slots ); free( urg->sseq ); free( urg->rseq );
+    free( urg->recvbuf ); free( urg->recvreq ); free( urg->recvidx );
+    free( urg->held );
+    free( urg );
+    mpi->urg = 0; /*Finalize may be invoked more than once*/
+}
+
+/*---------------------------------------------------------------------------*/
+static BOOLEAN urg_begin_message( int handler )
+{
+    FMMPIUrgent *urg = mpi->urg;
+    int k = 0, retcode = 0;
+
+    MYASSERT( 0 <= handler && handler < FMMPIMAXHANDLERS, ("%d",handler) );
+    if( !urg->handler[handler] ) return FALSE;
+    MYASSERT( urg->cur < 0, ("Only one outgoing FMMPI message at a time") );
+
+    for( k = 0; k < urg->nslots; k++ )
+    {
+        int done = TRUE;
+        if( urg->slots[k].req != MPI_REQUEST_NULL )
+        {
+            retcode = MPI_Test( &urg->slots[k].req, &done, MPI_STATUS_IGNORE );
+            MYASSERT( retcode == MPI_SUCCESS, ("MPI_Test urgent send") );
+        }
+        if( done ) break;
+    }
+
+    if( k >= urg->nslots )
+    {
+        int i = 0, n = (urg->nslots > 0 ? 2*urg->nslots : 4);
+        urg->slots = (FMMPIUrgSlot *)realloc( urg->slots,
+                                             n*sizeof(FMMPIUrgSlot) );
+        MYASSERT( urg->slots, ("%d urgent slots",n) );
+        for( i = urg->nslots; i < n; i++ )
+        {
+            urg->slots[i].buf = (char *)malloc( MAXBUFLEN );
+            MYASSERT( urg->slots[i].buf, ("!") );
+            urg->slots[i].len = 0;
+            urg->slots[i].req = MPI_REQUEST_NULL;
+        }
+        urg->nslots = n;
+    }
+
+    urg->cur = k;
+    urg->slots[k].len = sizeof(FMMPIMsgHeaderPiece);
+
+    return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+static BOOLEAN urg_send_piece( const void *buffer, int length )
+{
+    FMMPIUrgent *urg = mpi->urg;
+    FMMPIUrgSlot *slot = 0;
+
+    if( urg->cur < 0 ) return FALSE;
+
+    slot = &urg->slots[urg->cur];
+    MYASSERT( slot->len + length <= MAXBUFLEN,
+              ("%d + %d <= %d", slot->len, length, MAXBUFLEN) );
+    memcpy( slot->buf + slot->len, buffer, length );
+    slot->len += length;
+
+    return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+static BOOLEAN urg_end_message( void )
+{
+    FMMPIUrgent *urg = mpi->urg;
+    FMMPIMsgHeaderPiece *hdr = &mpi->send_msg.hdr;
+    FMMPIUrgSlot *slot = 0;
+    int retcode = 0;
+
+    if( urg->cur < 0 ) return FALSE;
+
+    slot = &urg->slots[urg->cur];
+    MYASSERT( slot->len == hdr->totbytes, ("%d %d",slot->len,hdr->totbytes) );
+    hdr->seq = urg->sseq[hdr->dest_pe]++;
+    hdr->window = 0;
+    memcpy( slot->buf, hdr, sizeof(*hdr) );
+    urg->cur = -1;
+
+    retcode = MPI_Isend( slot->buf, slot->len, MPI_BYTE, hdr->dest_pe,
+                         mpi->msg_tag, urg->comm, &slot->req );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Isend urgent must succeed!") );
+    urg->nsent++;
+
+#if !NODEBUG
+if(mpifmdbg>=3){printf("%d: FMMPI urgent msg %d to %d\n",FMMPI_nodeid,hdr->seq,hdr->dest_pe);fflush(stdout);}
+#endif
+
+    return TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+static char *urg_rbuf( void )
+{
+    return mpi->urg->rbuf;
+}
+
+/*---------------------------------------------------------------------------*/
+static int urg_extract( void )
+{
+    FMMPIUrgent *urg = mpi->urg;
+    int nbytes = 0, ndone = 0;
+
+    do
+    {
+        int i = 0, retcode = 0, progress = TRUE;
+
+        retcode = MPI_Testsome( urg->nrecv, urg->recvreq, &ndone,
+                                urg->recvidx, MPI_STATUSES_IGNORE );
+        MYASSERT( retcode == MPI_SUCCESS, ("MPI_Testsome urgent recvs") );
+        urg->npolls++;
+        if( ndone == MPI_UNDEFINED ) ndone = 0;
+
+        for( i = 0; i < ndone; i++ )
+        {
+            urg->held[urg->nheld++] = urg->recvidx[i];
+        }
+
+        while( progress )
+        {
+            int h = 0;
+            progress = FALSE;
+            for( h = 0; h < urg->nheld; )
+            {
+                int k = urg->held[h];
+                FMMPIMsgHeaderPiece *rhdr=(FMMPIMsgHeaderPiece *)urg->recvbuf[k];
+                int src = rhdr->src_pe;
+                if( rhdr->seq != urg->rseq[src] )
+                {
+                    h++;
+                    continue;
+                }
+                urg->held[h] = urg->held[--urg->nheld];
+                urg->rseq[src]++;
+                urg->rbuf = urg->recvbuf[k];
+                nbytes += service_mesg( src );
+                urg->rbuf = 0;
+                retcode = MPI_Start( &urg->recvreq[k] );
+                MYASSERT( retcode == MPI_SUCCESS, ("MPI_Start urgent %d",k) );
+                urg->nrecd++;
+                progress = TRUE;
+            }
+        }
+    } while( ndone > 0 );
+
+    return nbytes;
+}
+
+/*---------------------------------------------------------------------------*/
+void FMMPI_set_urgent( int handler )
+{
+    MYASSERT( 0 <= handler && handler < FMMPIMAXHANDLERS, ("%d",handler) );
+    if( mpi && mpi->urg ) mpi->urg->handler[handler] = TRUE;
+}
+
+/*---------------------------------------------------------------------------*/
+int FMMPI_extract_urgent( void )
+{
+    if( mpi->numnodes <= 1 || !mpi->urg ) return 0;
+    return urg_extract();
+}
+
 /*---------------------------------------------------------------------------*/
 static int poll_all_once( unsigned int maxbytes )
 {
@@ -1046,6 +1989,10 @@ if(mpifmdbg>=10){printf("%d: FMMPI_extract(%u)\n",FMMPI_nodeid,maxbytes);fflush(
 
 if( mpi->numnodes <= 1 ) return 0;
 
+    if( mpi->urg ) nbytes += urg_extract();
+
+    if( mpi->nb ) return nbytes + nb_extract( maxbytes );
+
     while( nbytes < maxbytes )
     {
       if( use_portals )
@@ -1104,3 +2051,65 @@ int FMMPI_debug_level( int level )
 }
 
 /*---------------------------------------------------------------------------*/
+/* Did MPI grant enough thread support for callers to take turns in FMMPI?  */
+/*---------------------------------------------------------------------------*/
+int FMMPI_threads_serialized( void )
+{
+    return !mpi || mpi->thread_level >= MPI_THREAD_SERIALIZED;
+}
+
+/*---------------------------------------------------------------------------*/
+/* For every rank, the lowest rank sharing its memory domain.  Collective   */
+/* over all ranks; returns FALSE if placement cannot be detected via MPI.   */
+/*---------------------------------------------------------------------------*/
+int FMMPI_node_leaders( int *leaders, int N )
+{
+#if MPI_AVAILABLE
+    MPI_Comm nodecomm;
+    int leader = FMMPI_nodeid;
+
+    if( !mpi || N != FMMPI_numnodes ) return FALSE;
+    MPI_Comm_split_type( MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0,
+                         MPI_INFO_NULL, &nodecomm );
+    MPI_Allreduce( &mpi->nodeid, &leader, 1, MPI_INT, MPI_MIN, nodecomm );
+    MPI_Comm_free( &nodecomm );
+    MPI_Allgather( &leader, 1, MPI_INT, leaders, 1, MPI_INT, MPI_COMM_WORLD );
+#if !NODEBUG
+if(mpifmdbg>=2){printf("%d: FMMPI node leader %d\n",FMMPI_nodeid,leader);fflush(stdout);}
+#endif
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/* Ranks sharing this rank's memory domain, in ascending order, and a key   */
+/* common to them (pid of the lowest one).  Collective over all ranks.      */
+/*---------------------------------------------------------------------------*/
+int FMMPI_node_peers( int *ids, int maxids, long *key )
+{
+    int n = 1;
+#if MPI_AVAILABLE
+    MPI_Comm nodecomm;
+    long pid = (long)getpid();
+
+    MPI_Comm_split_type( MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0,
+                         MPI_INFO_NULL, &nodecomm );
+    MPI_Comm_size( nodecomm, &n );
+    MYASSERT( n <= maxids, ("%d node-local ranks exceed %d",n,maxids) );
+    MPI_Allgather( &mpi->nodeid, 1, MPI_INT, ids, 1, MPI_INT, nodecomm );
+    MPI_Bcast( &pid, 1, MPI_LONG, 0, nodecomm );
+    MPI_Comm_free( &nodecomm );
+    *key = pid;
+#else
+    ids[0] = FMMPI_nodeid;
+    *key = 0;
+#endif
+#if !NODEBUG
+if(mpifmdbg>=2){printf("%d: FMMPI %d node peers key %ld\n",FMMPI_nodeid,n,*key);fflush(stdout);}
+#endif
+    return n;
+}
+
+/*---------------------------------------------------------------------------*/
@@ -10,6 +10,7 @@
 #define FMMPIMAXPIECES 16
 #define FMMPIMAXDATALEN 2048 /*XXX CUSTOMIZE*/
 #define FMMPIMAXPIECELEN FMMPIMAXDATALEN
+#define FMMPIMAXHANDLERS 64 /*CUSTOMIZE*/
 
 /*---------------------------------------------------------------------------*/
 typedef void FMMPI_stream;
@@ -29,7 +30,12 @@ int FMMPI_receive(void *, FMMPI_stream *, unsigned int);
 int FMMPI_numpieces(FMMPI_stream *);
 int FMMPI_piecelen(FMMPI_stream *, int);
 int FMMPI_extract(unsigned int maxbytes);
+void FMMPI_set_urgent(int handler);
+int FMMPI_extract_urgent(void);
 int FMMPI_debug_level(int);
+int FMMPI_node_peers(int *, int, long *);
+int FMMPI_node_leaders(int *, int);
+int FMMPI_threads_serialized(void);
 
 /*---------------------------------------------------------------------------*/
 extern int FMMPI_nodeid;
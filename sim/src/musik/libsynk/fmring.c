@@ -0,0 +1,769 @@
+/*---------------------------------------------------------------------------*/
+/* Lock-free ring-buffer shared-memory FM-like implementation (POSIX shm).   */
+/*                                                                           */
+/* One POSIX shared memory segment is mapped by all node-local processors.   */
+/* For every ordered pair (from,to) there is a single-producer/single-       */
+/* consumer ring of variable-length records.  The producer owns "tail" and   */
+/* the consumer owns "head"; both are monotonic byte counters kept on their  */
+/* own cache lines, so the only cross-core traffic is the data itself plus   */
+/* one index store per batch.  Records are appended privately and published */
+/* to the consumer in batches (every FMRING_BATCH records, a quarter ring,   */
+/* or at the next RING_extract).  A sender never blocks: if its ring to a    */
+/* peer is full, records queue in a private overflow list that is drained    */
+/* in order as the consumer frees space.  An idle consumer may optionally    */
+/* sleep on a futex doorbell (FMRING_IDLEUS) instead of spinning.            */
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if __linux__
+    #include <sys/syscall.h>
+    #include <linux/futex.h>
+#endif
+
+#include "mycompat.h"
+#include "fmring.h"
+
+/*---------------------------------------------------------------------------*/
+static int ringfmdbg = 0;
+
+/*---------------------------------------------------------------------------*/
+#define RINGLINE 64 /*Cache line size*/
+#define RINGMAGIC 0x52494e47
+#define RINGPAD (-1) /*Handler value of wrap-around filler records*/
+#define ALIGN8(_n) ((((_n)+7)/8)*8)
+
+#define LOAD_ACQ(_p) __atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define STORE_REL(_p,_v) __atomic_store_n((_p), (_v), __ATOMIC_RELEASE)
+
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    uint64_t v;
+    char pad[RINGLINE-sizeof(uint64_t)];
+} RINGPaddedIndex;
+
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    RINGPaddedIndex head; /*Bytes consumed; written only by the consumer*/
+    RINGPaddedIndex tail; /*Bytes published; written only by the producer*/
+} RINGIndices;
+
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    int v;        /*Bumped by producers that find the consumer asleep*/
+    int sleeping; /*Consumer is (about to be) waiting on v*/
+    char pad[RINGLINE-2*sizeof(int)];
+} RINGDoorbell;
+
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    int magic;     /*Set by node 0 once the segment is fully initialized*/
+    int njoined;   /*Number of processors that have mapped the segment*/
+    int numnodes;
+    int ringbytes;
+    char pad[RINGLINE-4*sizeof(int)];
+    /*Followed by RINGDoorbell[numnodes], RINGIndices[npairs], ring data*/
+} RINGSegmentHeader;
+
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    int reclen;   /*Total record bytes incl. this header; multiple of 8*/
+    int handler;  /*FM handler, or RINGPAD for wrap-around filler*/
+    int src_id;
+    int dest_id;
+    int npieces;
+    int piecelen[RINGMAXPIECES];
+} RINGRecord;
+
+#define RINGHDRLEN ALIGN8(sizeof(RINGRecord))
+#define RINGMAXRECLEN (RINGHDRLEN + RINGMAXDATALEN + 8*RINGMAXPIECES)
+
+/*---------------------------------------------------------------------------*/
+typedef struct _RINGOverflow
+{
+    struct _RINGOverflow *next;
+    int cap;
+    double rec[1]; /*RINGRecord followed by pieces; actual size is cap*/
+} RINGOverflow;
+
+/*---------------------------------------------------------------------------*/
+typedef struct _RINGMsg
+{
+    int peer;            /*Recipient (sending) or sender (receiving)*/
+    RINGRecord *rec;     /*Record being built or read*/
+    int cap;             /*Bytes available for rec while building*/
+    int used;            /*Bytes of rec filled so far while building*/
+    int pad;             /*Filler bytes to commit ahead of an in-ring rec*/
+    RINGOverflow *ov;    /*Overflow node holding rec, if not in ring*/
+    int nrecd;           /*#pieces received by user from current message*/
+    int rdoff;           /*Offset of next piece to be received*/
+} RINGMsg;
+
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    RINGIndices *ix;
+    char *data;
+    uint64_t ptail;      /*Private tail; ahead of ix->tail until published*/
+    uint64_t chead;      /*Cached copy of consumer's head*/
+    int unpub;           /*#records appended but not yet published*/
+    RINGOverflow *ovhead, *ovtail; /*Records waiting for ring space*/
+    unsigned long nsent, noverflow, npublish;
+} RINGSendState;
+
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    RINGIndices *ix;
+    char *data;
+    uint64_t head;       /*Private head; ahead of ix->head until stored*/
+    unsigned long nrecd;
+} RINGRecvState;
+
+/*---------------------------------------------------------------------------*/
+int RING_nodeid;
+int RING_numnodes;
+
+/*---------------------------------------------------------------------------*/
+static long ringkey = 0;
+static char ringname[100];
+static int ringbytes = 0;
+static int ringbatch = 16;
+static int ringspins = 4096;
+static int ringidleus = 0;
+static size_t ringsegsize = 0;
+static RINGSegmentHeader *fmring = 0;
+static RINGDoorbell *bells = 0;
+static int unlinked_ring = 0;
+static RINGCallback *fmcb = 0;
+static RINGSendState sends[RINGMAXPE];
+static RINGRecvState recvs[RINGMAXPE];
+static RINGMsg sendmsg, recvmsg;
+static int sending = 0;
+static unsigned long nidle = 0, nsleeps = 0;
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void config(void)
+{
+    char *estr = 0;
+    int kb = 256;
+
+    estr = getenv("FMRING_DEBUG");
+    ringfmdbg = estr ? atoi(estr) : 0;
+#if !NODEBUG
+if(ringfmdbg>=1){printf("FMRING_DEBUG=%d\n",ringfmdbg);fflush(stdout);}
+#endif
+
+    if( (estr = getenv("FMRING_KEY")) ) ringkey = atol( estr );
+    if( (estr = getenv("FMRING_KB")) ) kb = atoi( estr );
+    if( (estr = getenv("FMRING_BATCH")) ) ringbatch = atoi( estr );
+    if( (estr = getenv("FMRING_SPINS")) ) ringspins = atoi( estr );
+    if( (estr = getenv("FMRING_IDLEUS")) ) ringidleus = atoi( estr );
+    if( ringbatch < 1 ) ringbatch = 1;
+
+    /*Power of two, and room for several maximal records*/
+    for( ringbytes = RINGLINE;
+         ringbytes < kb*1024 || ringbytes < 4*RINGMAXRECLEN; )
+        ringbytes *= 2;
+
+    sprintf( ringname, "/synkring-%d-%ld", (int)getuid(), ringkey );
+}
+
+/*---------------------------------------------------------------------------*/
+static int pair_index( int from, int to )
+{
+    return from*(RING_numnodes-1) + (to < from ? to : to-1);
+}
+
+/*---------------------------------------------------------------------------*/
+static void map_rings( void )
+{
+    int i = 0, npairs = RING_numnodes*(RING_numnodes-1);
+    char *base = (char *)fmring;
+    RINGIndices *ix = 0;
+    char *data = 0;
+
+    bells = (RINGDoorbell *)(base + sizeof(RINGSegmentHeader));
+    ix = (RINGIndices *)(bells + RING_numnodes);
+    data = (char *)(ix + npairs);
+
+    for( i = 0; i < RING_numnodes; i++ )
+    {
+        if( i != RING_nodeid )
+        {
+            int sp = pair_index( RING_nodeid, i ), rp = pair_index( i, RING_nodeid );
+            RINGSendState *s = &sends[i];
+            RINGRecvState *r = &recvs[i];
+            memset( s, 0, sizeof(*s) );
+            s->ix = &ix[sp];
+            s->data = data + (size_t)sp*ringbytes;
+            memset( r, 0, sizeof(*r) );
+            r->ix = &ix[rp];
+            r->data = data + (size_t)rp*ringbytes;
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+static void doorbell_wake( int to )
+{
+    RINGDoorbell *bell = &bells[to];
+    __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    if( __atomic_load_n( &bell->sleeping, __ATOMIC_SEQ_CST ) )
+    {
+        __atomic_add_fetch( &bell->v, 1, __ATOMIC_SEQ_CST );
+#if __linux__
+        syscall( SYS_futex, &bell->v, FUTEX_WAKE, 1, 0, 0, 0 );
+#endif
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+static void publish( int to )
+{
+    RINGSendState *s = &sends[to];
+    if( s->unpub > 0 )
+    {
+        STORE_REL( &s->ix->tail.v, s->ptail );
+        s->unpub = 0;
+        s->npublish++;
+        if( ringidleus > 0 ) doorbell_wake( to );
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Find n contiguous free bytes at the private tail; 0 if the ring is full.  */
+/*---------------------------------------------------------------------------*/
+static char *ring_reserve( RINGSendState *s, int n, int *padlen )
+{
+    uint64_t pos = s->ptail & (ringbytes-1);
+    int pad = (pos + n > ringbytes) ? (int)(ringbytes - pos) : 0;
+
+    if( s->ptail + pad + n - s->chead > ringbytes )
+    {
+        s->chead = LOAD_ACQ( &s->ix->head.v );
+        if( s->ptail + pad + n - s->chead > ringbytes ) return 0;
+    }
+
+    *padlen = pad;
+    return s->data + (pad ? 0 : pos);
+}
+
+/*---------------------------------------------------------------------------*/
+static void ring_commit( int to, int n, int pad )
+{
+    RINGSendState *s = &sends[to];
+
+    if( pad > 0 )
+    {
+        RINGRecord *filler = (RINGRecord *)(s->data + (s->ptail&(ringbytes-1)));
+        filler->reclen = pad;
+        filler->handler = RINGPAD;
+    }
+    s->ptail += pad + n;
+    s->nsent++;
+
+    if( ++s->unpub >= ringbatch ||
+        s->ptail - s->ix->tail.v >= (uint64_t)ringbytes/4 )
+    {
+        publish( to );
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+static void flush_overflow( int to )
+{
+    RINGSendState *s = &sends[to];
+    while( s->ovhead )
+    {
+        RINGOverflow *ov = s->ovhead;
+        RINGRecord *rec = (RINGRecord *)ov->rec;
+        int pad = 0;
+        char *p = ring_reserve( s, rec->reclen, &pad );
+        if( !p ) break;
+        memcpy( p, rec, rec->reclen );
+        ring_commit( to, rec->reclen, pad );
+        s->ovhead = ov->next;
+        if( !s->ovhead ) s->ovtail = 0;
+        free( ov );
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+static RINGOverflow *new_overflow( int cap )
+{
+    RINGOverflow *ov = (RINGOverflow *)malloc( sizeof(RINGOverflow) + cap );
+    MYASSERT( ov, ("Can't allocate %d-byte ring overflow record",cap) );
+    ov->next = 0;
+    ov->cap = cap;
+    return ov;
+}
+
+/*---------------------------------------------------------------------------*/
+static int any_pending( void )
+{
+    int i = 0;
+    for( i = 0; i < RING_numnodes; i++ )
+    {
+        if( i != RING_nodeid &&
+            LOAD_ACQ( &recvs[i].ix->tail.v ) != recvs[i].head ) return 1;
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static void idle_wait( void )
+{
+    RINGDoorbell *bell = &bells[RING_nodeid];
+    int v = __atomic_load_n( &bell->v, __ATOMIC_SEQ_CST );
+
+    __atomic_store_n( &bell->sleeping, 1, __ATOMIC_SEQ_CST );
+    if( !any_pending() )
+    {
+#if __linux__
+        struct timespec ts;
+        ts.tv_sec = ringidleus / 1000000;
+        ts.tv_nsec = (ringidleus % 1000000) * 1000L;
+        syscall( SYS_futex, &bell->v, FUTEX_WAIT, v, &ts, 0, 0 );
+#else
+        usleep( ringidleus );
+#endif
+        nsleeps++;
+    }
+    __atomic_store_n( &bell->sleeping, 0, __ATOMIC_SEQ_CST );
+}
+
+/*---------------------------------------------------------------------------*/
+static size_t segment_size( int numnodes )
+{
+    int npairs = numnodes*(numnodes-1);
+    return sizeof(RINGSegmentHeader) + numnodes*sizeof(RINGDoorbell) +
+           npairs*sizeof(RINGIndices) + (size_t)npairs*ringbytes;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Maps an anonymous segment for numnodes processors that are yet to be     */
+/* forked off this one; they inherit it and RING_initialize() just joins.   */
+/*---------------------------------------------------------------------------*/
+void RING_preallocate( int numnodes )
+{
+    void *shm = 0;
+
+    MYASSERT( 2 <= numnodes && numnodes <= RINGMAXPE,
+            ("#RING nodes %d must lie in [2..%d]", numnodes, RINGMAXPE) );
+    MYASSERT( !fmring, ("Ring segment already mapped") );
+
+    config();
+    ringsegsize = segment_size( numnodes );
+    shm = mmap( 0, ringsegsize, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_ANONYMOUS, -1, 0 );
+    MYASSERT( shm != MAP_FAILED, ("mmap(%lu)",(unsigned long)ringsegsize);
+              perror("") );
+
+    fmring = (RINGSegmentHeader *)shm;
+    fmring->numnodes = numnodes;
+    fmring->ringbytes = ringbytes;
+    fmring->magic = RINGMAGIC;
+    unlinked_ring = 1; /*Nothing named to unlink*/
+
+#if !NODEBUG
+if(ringfmdbg>=0){printf("FMRING %d in-process nodes, %d KB per ring, %.2lf MB total, batch %d, idle %d us after %d polls\n",numnodes,ringbytes/1024,ringsegsize/(1024.0*1024),ringbatch,ringidleus,ringspins);fflush(stdout);}
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void RING_initialize( int nodeid, int numnodes, long key, RINGCallback *cb )
+{
+    MYASSERT( 1 <= numnodes && numnodes <= RINGMAXPE,
+            ("#RING nodes %d must lie in [1..%d]", numnodes, RINGMAXPE) );
+    MYASSERT( 0 <= nodeid && nodeid < numnodes,
+            ("RING node ID must lie in [0..%d]", numnodes-1) );
+
+    RING_nodeid = nodeid;
+    RING_numnodes = numnodes;
+
+    MYASSERT( cb, ("Message callback required") );
+    fmcb = cb;
+
+    ringkey = key;
+    config();
+
+    if( RING_numnodes > 1 && fmring )
+    {
+        /*Segment was mapped by RING_preallocate() before the fork*/
+        MYASSERT( fmring->numnodes == RING_numnodes,
+                ("Preallocated %d ring nodes, not %d",fmring->numnodes,
+                 RING_numnodes) );
+        ringbytes = fmring->ringbytes;
+        map_rings();
+        __atomic_add_fetch( &fmring->njoined, 1, __ATOMIC_SEQ_CST );
+        while( LOAD_ACQ( &fmring->njoined ) < RING_numnodes ) usleep( 100 );
+    }
+    else if( RING_numnodes > 1 )
+    {
+        int fd = -1;
+        void *shm = 0;
+
+        ringsegsize = segment_size( RING_numnodes );
+
+#if !NODEBUG
+if(ringfmdbg>=0){if(RING_nodeid==0){printf("FMRING %d nodes, \"%s\", %d KB per ring, %.2lf MB total, batch %d, idle %d us after %d polls\n",RING_numnodes,ringname,ringbytes/1024,ringsegsize/(1024.0*1024),ringbatch,ringidleus,ringspins);fflush(stdout);}}
+#endif
+
+        if( RING_nodeid == 0 )
+        {
+            shm_unlink( ringname ); /*Delete any old zombie segment*/
+            fd = shm_open( ringname, O_CREAT|O_EXCL|O_RDWR, 0600 );
+            MYASSERT( fd >= 0, ("shm_open(\"%s\")",ringname); perror("") );
+            if( ftruncate( fd, ringsegsize ) != 0 )
+            {
+                MYASSERT( 0, ("ftruncate(\"%s\",%lu)",ringname,
+                              (unsigned long)ringsegsize); perror("") );
+            }
+        }
+        else
+        {
+            for(;;)
+            {
+                struct stat st;
+                fd = shm_open( ringname, O_RDWR, 0600 );
+                if( fd >= 0 && fstat( fd, &st ) == 0 &&
+                    (size_t)st.st_size >= ringsegsize ) break;
+                if( fd >= 0 ) close( fd );
+#if !NODEBUG
+if(ringfmdbg>=2){printf("RING node %d: Retrying shm_open...\n",RING_nodeid);fflush(stdout);}
+#endif
+                usleep( 1000 );
+            }
+        }
+
+        shm = mmap( 0, ringsegsize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0 );
+        MYASSERT( shm != MAP_FAILED, ("mmap(\"%s\")",ringname); perror("") );
+        close( fd );
+        fmring = (RINGSegmentHeader *)shm;
+
+        if( RING_nodeid == 0 )
+        {
+            fmring->numnodes = RING_numnodes;
+            fmring->ringbytes = ringbytes;
+            STORE_REL( &fmring->magic, RINGMAGIC );
+        }
+        while( LOAD_ACQ( &fmring->magic ) != RINGMAGIC ) usleep( 1000 );
+        MYASSERT( fmring->numnodes == RING_numnodes &&
+                  fmring->ringbytes == ringbytes,
+                ("Mismatched ring segment %d/%d %d/%d",fmring->numnodes,
+                 RING_numnodes,fmring->ringbytes,ringbytes) );
+
+        map_rings();
+
+        __atomic_add_fetch( &fmring->njoined, 1, __ATOMIC_SEQ_CST );
+        while( LOAD_ACQ( &fmring->njoined ) < RING_numnodes ) usleep( 100 );
+
+        if( RING_nodeid == 0 )
+        {
+            shm_unlink( ringname ); unlinked_ring = 1;
+        }
+    }
+
+#if !NODEBUG
+if(ringfmdbg>=1){printf("RING_initialize() done.\n");fflush(stdout);}
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+void RING_finalize( void )
+{
+    int i = 0;
+    unsigned long nsent = 0, noverflow = 0, npublish = 0, nrecd = 0;
+
+    if( !fmring ) return;
+
+    RING_flush();
+    for( i = 0; i < RING_numnodes; i++ )
+    {
+        if( i != RING_nodeid )
+        {
+            nsent += sends[i].nsent; noverflow += sends[i].noverflow;
+            npublish += sends[i].npublish; nrecd += recvs[i].nrecd;
+        }
+    }
+
+#if !NODEBUG
+if(ringfmdbg>=0){if(RING_nodeid==0){printf("%d: FMRING sent %lu overflowed %lu published %lu received %lu sleeps %lu\n",RING_nodeid,nsent,noverflow,npublish,nrecd,nsleeps);fflush(stdout);}}
+#endif
+
+    if( RING_nodeid == 0 && !unlinked_ring )
+    {
+        shm_unlink( ringname ); unlinked_ring = 1;
+    }
+
+    munmap( (void *)fmring, ringsegsize );
+    fmring = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+RING_stream *RING_begin_message( int recipient, int length, int handler,
+    int src_id, int dest_id )
+{
+    RINGMsg *msg = &sendmsg;
+    RINGSendState *s = 0;
+    int est = 0;
+
+    MYASSERT( 0 <= recipient && recipient < RING_numnodes &&
+              recipient != RING_nodeid, ("%d", recipient) );
+    MYASSERT( !sending, ("Only one outgoing RING message at a time") );
+
+    s = &sends[recipient];
+    if( s->ovhead ) flush_overflow( recipient );
+
+    est = RINGHDRLEN + ALIGN8(length) + 8*RINGMAXPIECES;
+    if( length < 0 || est > RINGMAXRECLEN ) est = RINGMAXRECLEN;
+
+    msg->peer = recipient;
+    msg->ov = 0;
+    msg->pad = 0;
+    msg->rec = s->ovhead ? 0 :
+               (RINGRecord *)ring_reserve( s, est, &msg->pad );
+    if( !msg->rec )
+    {
+        msg->ov = new_overflow( est );
+        msg->rec = (RINGRecord *)msg->ov->rec;
+    }
+    msg->cap = est;
+    msg->used = RINGHDRLEN;
+
+    msg->rec->handler = handler;
+    msg->rec->src_id = src_id;
+    msg->rec->dest_id = dest_id;
+    msg->rec->npieces = 0;
+    sending = 1;
+
+#if !NODEBUG
+if(ringfmdbg>=3){printf("RING_begin_message(to=%d,len=%d) %s\n",recipient,length,(msg->ov?"overflow":"ring"));fflush(stdout);}
+#endif
+
+    return (RING_stream *)msg;
+}
+
+/*---------------------------------------------------------------------------*/
+void RING_send_piece( RING_stream *sendstream, void *buffer, int length )
+{
+    RINGMsg *msg = (RINGMsg *)sendstream;
+    int need = ALIGN8(length);
+
+    MYASSERT( msg == &sendmsg && sending, ("!") );
+    MYASSERT( msg->rec->npieces < RINGMAXPIECES,
+            ("RING msg pieces can't exceed compiled %d pieces",RINGMAXPIECES));
+    MYASSERT( 0 <= length && length <= RINGMAXPIECELEN,
+            ("RING piece size %d can't exceed compiled %d",
+            length, RINGMAXPIECELEN) );
+
+    if( msg->used + need > msg->cap )
+    {
+        /*Length hint was short; move the record to a private buffer*/
+        int cap = msg->used + need;
+        if( cap < 2*msg->cap ) cap = 2*msg->cap;
+        if( cap > RINGMAXRECLEN ) cap = RINGMAXRECLEN;
+        MYASSERT( msg->used + need <= cap, ("%d %d",msg->used+need,cap) );
+        if( msg->ov )
+        {
+            msg->ov = (RINGOverflow *)realloc( msg->ov,
+                                               sizeof(RINGOverflow) + cap );
+            MYASSERT( msg->ov, ("Can't grow ring overflow record to %d",cap) );
+            msg->ov->cap = cap;
+        }
+        else
+        {
+            msg->ov = new_overflow( cap );
+            memcpy( msg->ov->rec, msg->rec, msg->used );
+        }
+        msg->rec = (RINGRecord *)msg->ov->rec;
+        msg->cap = cap;
+        msg->pad = 0;
+    }
+
+    memcpy( (char *)msg->rec + msg->used, buffer, length );
+    msg->rec->piecelen[msg->rec->npieces++] = length;
+    msg->used += need;
+}
+
+/*---------------------------------------------------------------------------*/
+void RING_end_message( RING_stream *sendstream )
+{
+    RINGMsg *msg = (RINGMsg *)sendstream;
+    RINGSendState *s = 0;
+
+    MYASSERT( msg == &sendmsg && sending, ("!") );
+
+    s = &sends[msg->peer];
+    msg->rec->reclen = msg->used;
+
+    if( !msg->ov )
+    {
+        ring_commit( msg->peer, msg->used, msg->pad );
+    }
+    else
+    {
+        msg->ov->next = 0;
+        if( s->ovtail ) s->ovtail->next = msg->ov; else s->ovhead = msg->ov;
+        s->ovtail = msg->ov;
+        s->noverflow++;
+        flush_overflow( msg->peer );
+    }
+
+    msg->rec = 0; msg->ov = 0;
+    sending = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+void RING_receive( void *buffer, RING_stream *receivestream,
+    unsigned int length )
+{
+    RINGMsg *msg = (RINGMsg *)receivestream;
+    RINGRecord *rec = msg->rec;
+    int next_piece = msg->nrecd++;
+
+    MYASSERT( msg == &recvmsg && rec, ("!") );
+    MYASSERT( next_piece < rec->npieces, ("Only %d pieces exist",rec->npieces));
+    MYASSERT( length <= rec->piecelen[next_piece],
+            ("Only %d < %u bytes in piece", rec->piecelen[next_piece], length) );
+
+    memcpy( buffer, (char *)rec + msg->rdoff, length );
+    msg->rdoff += ALIGN8(rec->piecelen[next_piece]);
+}
+
+/*---------------------------------------------------------------------------*/
+int RING_extract( unsigned int maxbytes )
+{
+    int nbytes = 0;
+    static int pe = 0;
+    int i = 0;
+
+    if( RING_numnodes <= 1 ) return 0;
+
+    RING_flush();
+
+    while( nbytes < maxbytes )
+    {
+        int nready = 0;
+        for( i = 0; i < RING_numnodes-1; i++ )
+        {
+            if( pe == RING_nodeid ) pe++;
+            pe %= RING_numnodes;
+            if( pe != RING_nodeid )
+            {
+                RINGRecvState *r = &recvs[pe];
+                uint64_t tail = LOAD_ACQ( &r->ix->tail.v );
+                uint64_t head0 = r->head;
+                while( r->head < tail && nbytes < maxbytes )
+                {
+                    RINGRecord *rec =
+                        (RINGRecord *)(r->data + (r->head&(ringbytes-1)));
+                    MYASSERT( rec->reclen > 0 && rec->reclen <= ringbytes,
+                            ("%d",rec->reclen) );
+                    if( rec->handler != RINGPAD )
+                    {
+#if !NODEBUG
+if(ringfmdbg>=3){printf("Detected incoming RING msg src_pe=%d,src_id=%d,dest_id=%d!\n",pe,rec->src_id,rec->dest_id);fflush(stdout);}
+#endif
+                        recvmsg.peer = pe;
+                        recvmsg.rec = rec;
+                        recvmsg.nrecd = 0;
+                        recvmsg.rdoff = RINGHDRLEN;
+                        fmcb( rec->handler, (RING_stream *)&recvmsg, pe,
+                              rec->src_id, rec->dest_id );
+                        recvmsg.rec = 0;
+                        nbytes += rec->reclen;
+                        nready++;
+                        r->nrecd++;
+                    }
+                    r->head += rec->reclen;
+                    if( r->head - head0 >= (uint64_t)ringbytes/4 )
+                    {
+                        STORE_REL( &r->ix->head.v, r->head ); head0 = r->head;
+                    }
+                }
+                if( r->head != head0 ) STORE_REL( &r->ix->head.v, r->head );
+            }
+            pe++; pe %= RING_numnodes;
+        }
+        if( nready <= 0 ) break;
+    }
+
+    if( nbytes > 0 )
+    {
+        nidle = 0;
+    }
+    else if( ringidleus > 0 && ++nidle >= ringspins )
+    {
+        idle_wait();
+        nidle = 0;
+    }
+
+    return nbytes;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Everything appended so far becomes visible to the consumers.  Must be     */
+/* called before blocking outside of FM, e.g., in an MPI collective.         */
+/*---------------------------------------------------------------------------*/
+void RING_flush( void )
+{
+    int i = 0;
+
+    if( !fmring ) return;
+
+    for( i = 0; i < RING_numnodes; i++ )
+    {
+        if( i != RING_nodeid )
+        {
+            if( sends[i].ovhead ) flush_overflow( i );
+            publish( i );
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+int RING_numpieces( RING_stream *ring_stream )
+{
+    RINGMsg *msg = (RINGMsg *)ring_stream;
+    MYASSERT( msg == &recvmsg && msg->rec, ("!") );
+    return msg->rec->npieces;
+}
+
+/*---------------------------------------------------------------------------*/
+int RING_piecelen( RING_stream *ring_stream, int i )
+{
+    RINGMsg *msg = (RINGMsg *)ring_stream;
+    MYASSERT( msg == &recvmsg && msg->rec, ("!") );
+    MYASSERT( 0 <= i && i < msg->rec->npieces,
+            ("Only %d pieces", msg->rec->npieces) );
+    return msg->rec->piecelen[i];
+}
+
+/*---------------------------------------------------------------------------*/
+int RING_debug_level( int level )
+{
+    int old = ringfmdbg;
+    ringfmdbg = level;
+    return old;
+}
+
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,41 @@
+/*---------------------------------------------------------------------------*/
+/* Lock-free ring-buffer shared-memory FM-like interface (POSIX shm).        */
+/* Each ordered pair of node-local processors owns a single-producer,        */
+/* single-consumer ring of variable-length records; no slot handshakes.      */
+/*---------------------------------------------------------------------------*/
+#ifndef __RING_FM_H
+#define __RING_FM_H
+
+/*---------------------------------------------------------------------------*/
+#define RINGMAXPE 256 /*CUSTOMIZE*/
+#define RINGMAXPIECES 16
+#define RINGMAXPIECELEN 2048 /*CUSTOMIZE*/
+#define RINGMAXDATALEN (RINGMAXPIECES*RINGMAXPIECELEN)
+
+/*---------------------------------------------------------------------------*/
+struct _RINGMsg;
+typedef struct _RINGMsg RING_stream;
+
+/*---------------------------------------------------------------------------*/
+typedef int RINGCallback(int, RING_stream *, int, int, int);
+
+/*---------------------------------------------------------------------------*/
+void RING_preallocate(int);
+void RING_initialize(int, int, long, RINGCallback *);
+void RING_finalize(void);
+RING_stream *RING_begin_message(int, int, int, int, int);
+void RING_send_piece(RING_stream *, void *, int);
+void RING_end_message(RING_stream *);
+void RING_receive(void *, RING_stream *, unsigned int);
+int RING_numpieces(RING_stream *);
+int RING_piecelen(RING_stream *, int);
+int RING_extract(unsigned int maxbytes);
+void RING_flush(void);
+int RING_debug_level(int);
+
+/*---------------------------------------------------------------------------*/
+extern int RING_nodeid;
+extern int RING_numnodes;
+
+/*---------------------------------------------------------------------------*/
+#endif /* __RING_FM_H */
@@ -0,0 +1,518 @@
+/*---------------------------------------------------------------------------*/
+/* One-sided MPI RMA FM-like implementation.                                 */
+/*                                                                           */
+/* Each processor allocates one window (MPI_Win_allocate) laid out as        */
+/*     tail[N]  bytes deposited so far by each sender into its ring here     */
+/*     head[N]  bytes consumed so far by each receiver from my ring there    */
+/*     ring[N]  one mailbox ring per sender                                  */
+/* Senders stage records privately and deposit whole batches into the       */
+/* receiver's ring with MPI_Put, then advance the receiver's tail[] with an  */
+/* atomic MPI_Accumulate(MPI_REPLACE).  Receivers poll their own memory and  */
+/* hand back their head the same way, so no receive is ever matched.         */
+/* Batches are deposited every FMRMA_BATCH records, FMRMA_BATCHKB bytes, or  */
+/* at the next RMA_extract/RMA_flush.  A sender never blocks on a full ring; */
+/* the staged records simply wait for the receiver to free space.            */
+/*---------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mycompat.h"
+#include "fmrma.h"
+
+#if MPI_AVAILABLE
+    #include <mpi.h>
+#endif
+
+/*---------------------------------------------------------------------------*/
+static int rmafmdbg = 0;
+
+/*---------------------------------------------------------------------------*/
+int RMA_nodeid;
+int RMA_numnodes;
+
+#if MPI_AVAILABLE
+/*---------------------------------------------------------------------------*/
+#define RMALINE 64
+#define RMAPAD (-1) /*Handler value of wrap-around filler records*/
+#define ALIGN8(_n) ((((_n)+7)/8)*8)
+#define LOAD_ACQ(_p) __atomic_load_n((_p), __ATOMIC_ACQUIRE)
+
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    int reclen;   /*Total record bytes incl. this header; multiple of 8*/
+    int handler;  /*FM handler, or RMAPAD for wrap-around filler*/
+    int src_id;
+    int dest_id;
+    int npieces;
+    int piecelen[RMAMAXPIECES];
+} RMARecord;
+
+#define RMAHDRLEN ALIGN8(sizeof(RMARecord))
+#define RMAMAXRECLEN (RMAHDRLEN + RMAMAXDATALEN + 8*RMAMAXPIECES)
+
+/*---------------------------------------------------------------------------*/
+typedef struct _RMAMsg
+{
+    int peer;            /*Recipient (sending) or sender (receiving)*/
+    RMARecord *rec;      /*Record being built or read*/
+    int nrecd;           /*#pieces received by user from current message*/
+    int rdoff;           /*Offset of next piece to be received*/
+} RMAMsg;
+
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    char *stage;         /*Records not yet deposited, in order*/
+    int nstage, capstage;/*Bytes staged, bytes allocated*/
+    int nstaged;         /*#records staged since last deposit*/
+    uint64_t ptail;      /*Bytes deposited into peer's ring for me*/
+    uint64_t chead;      /*Cached copy of peer's head (from my head[peer])*/
+    uint64_t tailout;    /*Origin buffer of the tail update*/
+    int filler[2];       /*Origin buffer of a wrap-around filler*/
+    unsigned long nsent, ndeposits, nfull;
+} RMASendState;
+
+/*---------------------------------------------------------------------------*/
+typedef struct
+{
+    uint64_t head;       /*Bytes consumed from the sender's ring here*/
+    uint64_t headout;    /*Origin buffer of the head update*/
+    uint64_t headsent;   /*Most recent head handed back to the sender*/
+    unsigned long nrecd;
+} RMARecvState;
+
+/*---------------------------------------------------------------------------*/
+static MPI_Win win;
+static char *winbase = 0;
+static uint64_t *tails = 0, *heads = 0;
+static char *rings = 0;
+static MPI_Aint ringsoff = 0;
+static int ringbytes = 0;
+static int rmabatch = 16;
+static int rmabatchbytes = 8*1024;
+static RMACallback *fmcb = 0;
+static RMASendState *sends = 0;
+static RMARecvState *recvs = 0;
+static RMAMsg sendmsg, recvmsg;
+static int sending = 0;
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+static void config(void)
+{
+    char *estr = 0;
+    int kb = 64;
+
+    estr = getenv("FMRMA_DEBUG");
+    rmafmdbg = estr ? atoi(estr) : 0;
+#if !NODEBUG
+if(rmafmdbg>=1){printf("FMRMA_DEBUG=%d\n",rmafmdbg);fflush(stdout);}
+#endif
+
+    if( (estr = getenv("FMRMA_KB")) ) kb = atoi( estr );
+    if( (estr = getenv("FMRMA_BATCH")) ) rmabatch = atoi( estr );
+    if( (estr = getenv("FMRMA_BATCHKB")) ) rmabatchbytes = atoi( estr )*1024;
+    if( rmabatch < 1 ) rmabatch = 1;
+
+    /*Power of two, and room for a maximal record on either side of a wrap*/
+    for( ringbytes = RMALINE;
+         ringbytes < kb*1024 || ringbytes < 2*RMAMAXRECLEN; )
+        ringbytes *= 2;
+    if( rmabatchbytes > ringbytes/2 ) rmabatchbytes = ringbytes/2;
+}
+
+/*---------------------------------------------------------------------------*/
+static MPI_Aint tail_disp( int sender ) { return sender*sizeof(uint64_t); }
+static MPI_Aint head_disp( int recvr )
+    { return (RMA_numnodes+recvr)*sizeof(uint64_t); }
+static MPI_Aint ring_disp( int sender )
+    { return ringsoff + (MPI_Aint)sender*ringbytes; }
+
+/*---------------------------------------------------------------------------*/
+/* Deposit as many staged records as the peer's ring can take, in order.     */
+/*---------------------------------------------------------------------------*/
+static void deposit( int to )
+{
+    RMASendState *s = &sends[to];
+    int off = 0, retcode = 0;
+
+    while( off < s->nstage )
+    {
+        int pos = (int)(s->ptail & (ringbytes-1)), contig = ringbytes - pos;
+        int nfree = ringbytes - (int)(s->ptail - s->chead), n = 0, lim = 0;
+
+        if( nfree < ((RMARecord *)(s->stage+off))->reclen )
+        {
+            MPI_Win_sync( win );
+            s->chead = LOAD_ACQ( &heads[to] );
+            nfree = ringbytes - (int)(s->ptail - s->chead);
+        }
+
+        lim = nfree < contig ? nfree : contig;
+        while( off+n < s->nstage &&
+               n + ((RMARecord *)(s->stage+off+n))->reclen <= lim )
+        {
+            n += ((RMARecord *)(s->stage+off+n))->reclen;
+        }
+
+        if( n > 0 )
+        {
+            retcode = MPI_Put( s->stage+off, n, MPI_BYTE, to,
+                               ring_disp(RMA_nodeid)+pos, n, MPI_BYTE, win );
+            MYASSERT( retcode == MPI_SUCCESS, ("MPI_Put %d bytes",n) );
+            s->ptail += n;
+            off += n;
+        }
+        else if( contig < nfree )
+        {
+            /*Next record straddles the end; fill up and wrap around*/
+            s->filler[0] = contig;
+            s->filler[1] = RMAPAD;
+            retcode = MPI_Put( s->filler, 2, MPI_INT, to,
+                               ring_disp(RMA_nodeid)+pos, 2, MPI_INT, win );
+            MYASSERT( retcode == MPI_SUCCESS, ("MPI_Put filler") );
+            s->ptail += contig;
+        }
+        else
+        {
+            s->nfull++;
+            break; /*Ring is full; retry once the receiver hands back space*/
+        }
+    }
+
+    if( off > 0 )
+    {
+        /*Data must land before the receiver can see the new tail*/
+        MPI_Win_flush( to, win );
+        s->tailout = s->ptail;
+        retcode = MPI_Accumulate( &s->tailout, 1, MPI_UINT64_T, to,
+                                  tail_disp(RMA_nodeid), 1, MPI_UINT64_T,
+                                  MPI_REPLACE, win );
+        MYASSERT( retcode == MPI_SUCCESS, ("MPI_Accumulate tail") );
+        MPI_Win_flush( to, win );
+
+        memmove( s->stage, s->stage+off, s->nstage-off );
+        s->nstage -= off;
+        s->nstaged = 0;
+        s->ndeposits++;
+
+#if !NODEBUG
+if(rmafmdbg>=3){printf("%d: RMA deposited %d bytes to %d tail %lu\n",RMA_nodeid,off,to,(unsigned long)s->ptail);fflush(stdout);}
+#endif
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+static void hand_back_head( int from )
+{
+    RMARecvState *r = &recvs[from];
+    int retcode = 0;
+
+    r->headout = r->head;
+    retcode = MPI_Accumulate( &r->headout, 1, MPI_UINT64_T, from,
+                              head_disp(RMA_nodeid), 1, MPI_UINT64_T,
+                              MPI_REPLACE, win );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Accumulate head") );
+    MPI_Win_flush_local( from, win );
+    r->headsent = r->head;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                                                           */
+/*---------------------------------------------------------------------------*/
+void RMA_initialize( int nodeid, int numnodes, RMACallback *cb )
+{
+    int mpisize = 0, retcode = 0;
+    MPI_Aint winsize = 0;
+
+    MYASSERT( 1 <= numnodes && numnodes <= RMAMAXPE,
+            ("#RMA nodes %d must lie in [1..%d]", numnodes, RMAMAXPE) );
+    MYASSERT( 0 <= nodeid && nodeid < numnodes,
+            ("RMA node ID must lie in [0..%d]", numnodes-1) );
+    MPI_Comm_size( MPI_COMM_WORLD, &mpisize );
+    MYASSERT( numnodes == mpisize,
+            ("RMA spans all %d MPI ranks, not %d", mpisize, numnodes) );
+
+    RMA_nodeid = nodeid;
+    RMA_numnodes = numnodes;
+
+    MYASSERT( cb, ("Message callback required") );
+    fmcb = cb;
+
+    config();
+
+    ringsoff = ALIGN8( 2*RMA_numnodes*sizeof(uint64_t) );
+    ringsoff = ((ringsoff + RMALINE-1)/RMALINE)*RMALINE;
+    winsize = ringsoff + (MPI_Aint)RMA_numnodes*ringbytes;
+
+#if !NODEBUG
+if(rmafmdbg>=0){if(RMA_nodeid==0){printf("FMRMA %d nodes, %d KB per ring, %.2lf MB window, batch %d records %d KB\n",RMA_numnodes,ringbytes/1024,winsize/(1024.0*1024),rmabatch,rmabatchbytes/1024);fflush(stdout);}}
+#endif
+
+    retcode = MPI_Win_allocate( winsize, 1, MPI_INFO_NULL, MPI_COMM_WORLD,
+                                &winbase, &win );
+    MYASSERT( retcode == MPI_SUCCESS && winbase,
+            ("MPI_Win_allocate %ld bytes",(long)winsize) );
+    memset( winbase, 0, ringsoff );
+    tails = (uint64_t *)winbase;
+    heads = tails + RMA_numnodes;
+    rings = winbase + ringsoff;
+
+    sends = (RMASendState *)calloc( RMA_numnodes, sizeof(RMASendState) );
+    recvs = (RMARecvState *)calloc( RMA_numnodes, sizeof(RMARecvState) );
+    MYASSERT( sends && recvs, ("!") );
+
+    /*Zeroed indices must be in place before anyone deposits*/
+    MPI_Barrier( MPI_COMM_WORLD );
+    MPI_Win_lock_all( MPI_MODE_NOCHECK, win );
+
+#if !NODEBUG
+if(rmafmdbg>=1){printf("RMA_initialize() done.\n");fflush(stdout);}
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+void RMA_finalize( void )
+{
+    int i = 0;
+    unsigned long nsent = 0, ndeposits = 0, nfull = 0, nrecd = 0;
+
+    if( !sends ) return;
+
+    RMA_flush();
+    for( i = 0; i < RMA_numnodes; i++ )
+    {
+        nsent += sends[i].nsent; ndeposits += sends[i].ndeposits;
+        nfull += sends[i].nfull; nrecd += recvs[i].nrecd;
+    }
+
+#if !NODEBUG
+if(rmafmdbg>=0){if(RMA_nodeid==0){printf("%d: FMRMA sent %lu deposits %lu ring-full %lu received %lu\n",RMA_nodeid,nsent,ndeposits,nfull,nrecd);fflush(stdout);}}
+#endif
+
+    MPI_Win_unlock_all( win );
+    MPI_Win_free( &win );
+    for( i = 0; i < RMA_numnodes; i++ ) free( sends[i].stage );
+    free( sends ); sends = 0;
+    free( recvs ); recvs = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+RMA_stream *RMA_begin_message( int recipient, int length, int handler,
+    int src_id, int dest_id )
+{
+    RMAMsg *msg = &sendmsg;
+    RMASendState *s = 0;
+    RMARecord *rec = 0;
+
+    MYASSERT( 0 <= recipient && recipient < RMA_numnodes &&
+              recipient != RMA_nodeid, ("%d", recipient) );
+    MYASSERT( !sending, ("Only one outgoing RMA message at a time") );
+
+    s = &sends[recipient];
+    if( s->nstage + RMAMAXRECLEN > s->capstage )
+    {
+        s->capstage = s->nstage + RMAMAXRECLEN;
+        if( s->capstage < 2*rmabatchbytes ) s->capstage = 2*rmabatchbytes;
+        s->stage = (char *)realloc( s->stage, s->capstage );
+        MYASSERT( s->stage, ("Can't grow RMA stage to %d",s->capstage) );
+    }
+
+    rec = (RMARecord *)(s->stage + s->nstage);
+    rec->reclen = RMAHDRLEN;
+    rec->handler = handler;
+    rec->src_id = src_id;
+    rec->dest_id = dest_id;
+    rec->npieces = 0;
+
+    msg->peer = recipient;
+    msg->rec = rec;
+    sending = 1;
+
+#if !NODEBUG
+if(rmafmdbg>=3){printf("RMA_begin_message(to=%d,len=%d)\n",recipient,length);fflush(stdout);}
+#endif
+
+    return (RMA_stream *)msg;
+}
+
+/*---------------------------------------------------------------------------*/
+void RMA_send_piece( RMA_stream *sendstream, void *buffer, int length )
+{
+    RMAMsg *msg = (RMAMsg *)sendstream;
+    RMARecord *rec = msg->rec;
+
+    MYASSERT( msg == &sendmsg && sending, ("!") );
+    MYASSERT( rec->npieces < RMAMAXPIECES,
+            ("RMA msg pieces can't exceed compiled %d pieces",RMAMAXPIECES));
+    MYASSERT( 0 <= length && length <= RMAMAXPIECELEN,
+            ("RMA piece size %d can't exceed compiled %d",
+            length, RMAMAXPIECELEN) );
+
+    memcpy( (char *)rec + rec->reclen, buffer, length );
+    rec->piecelen[rec->npieces++] = length;
+    rec->reclen += ALIGN8(length);
+}
+
+/*---------------------------------------------------------------------------*/
+void RMA_end_message( RMA_stream *sendstream )
+{
+    RMAMsg *msg = (RMAMsg *)sendstream;
+    RMASendState *s = 0;
+
+    MYASSERT( msg == &sendmsg && sending, ("!") );
+
+    s = &sends[msg->peer];
+    s->nstage += msg->rec->reclen;
+    s->nsent++;
+    if( ++s->nstaged >= rmabatch || s->nstage >= rmabatchbytes )
+    {
+        deposit( msg->peer );
+    }
+
+    msg->rec = 0;
+    sending = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+void RMA_receive( void *buffer, RMA_stream *receivestream,
+    unsigned int length )
+{
+    RMAMsg *msg = (RMAMsg *)receivestream;
+    RMARecord *rec = msg->rec;
+    int next_piece = msg->nrecd++;
+
+    MYASSERT( msg == &recvmsg && rec, ("!") );
+    MYASSERT( next_piece < rec->npieces, ("Only %d pieces exist",rec->npieces));
+    MYASSERT( length <= rec->piecelen[next_piece],
+            ("Only %d < %u bytes in piece", rec->piecelen[next_piece], length) );
+
+    memcpy( buffer, (char *)rec + msg->rdoff, length );
+    msg->rdoff += ALIGN8(rec->piecelen[next_piece]);
+}
+
+/*---------------------------------------------------------------------------*/
+int RMA_extract( unsigned int maxbytes )
+{
+    int nbytes = 0;
+    static int pe = 0;
+    int i = 0;
+
+    if( RMA_numnodes <= 1 ) return 0;
+
+    RMA_flush();
+
+    while( nbytes < maxbytes )
+    {
+        int nready = 0;
+        MPI_Win_sync( win );
+        for( i = 0; i < RMA_numnodes-1; i++ )
+        {
+            if( pe == RMA_nodeid ) pe++;
+            pe %= RMA_numnodes;
+            if( pe != RMA_nodeid )
+            {
+                RMARecvState *r = &recvs[pe];
+                char *data = rings + (size_t)pe*ringbytes;
+                uint64_t tail = LOAD_ACQ( &tails[pe] );
+                while( r->head < tail && nbytes < maxbytes )
+                {
+                    RMARecord *rec =
+                        (RMARecord *)(data + (r->head&(ringbytes-1)));
+                    MYASSERT( rec->reclen > 0 && rec->reclen <= ringbytes,
+                            ("%d",rec->reclen) );
+                    if( rec->handler != RMAPAD )
+                    {
+#if !NODEBUG
+if(rmafmdbg>=3){printf("Detected incoming RMA msg src_pe=%d,src_id=%d,dest_id=%d!\n",pe,rec->src_id,rec->dest_id);fflush(stdout);}
+#endif
+                        recvmsg.peer = pe;
+                        recvmsg.rec = rec;
+                        recvmsg.nrecd = 0;
+                        recvmsg.rdoff = RMAHDRLEN;
+                        fmcb( rec->handler, (RMA_stream *)&recvmsg, pe,
+                              rec->src_id, rec->dest_id );
+                        recvmsg.rec = 0;
+                        nbytes += rec->reclen;
+                        nready++;
+                        r->nrecd++;
+                    }
+                    r->head += rec->reclen;
+                    if( r->head - r->headsent >= (uint64_t)ringbytes/4 )
+                    {
+                        hand_back_head( pe );
+                    }
+                }
+                if( r->head != r->headsent ) hand_back_head( pe );
+            }
+            pe++; pe %= RMA_numnodes;
+        }
+        if( nready <= 0 ) break;
+    }
+
+    return nbytes;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Everything staged so far is deposited, space permitting.  Must be called  */
+/* before blocking outside of FM, e.g., in an MPI collective.                */
+/*---------------------------------------------------------------------------*/
+void RMA_flush( void )
+{
+    int i = 0;
+
+    if( !sends ) return;
+
+    for( i = 0; i < RMA_numnodes; i++ )
+    {
+        if( sends[i].nstage > 0 ) deposit( i );
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+int RMA_numpieces( RMA_stream *rma_stream )
+{
+    RMAMsg *msg = (RMAMsg *)rma_stream;
+    MYASSERT( msg == &recvmsg && msg->rec, ("!") );
+    return msg->rec->npieces;
+}
+
+/*---------------------------------------------------------------------------*/
+int RMA_piecelen( RMA_stream *rma_stream, int i )
+{
+    RMAMsg *msg = (RMAMsg *)rma_stream;
+    MYASSERT( msg == &recvmsg && msg->rec, ("!") );
+    MYASSERT( 0 <= i && i < msg->rec->npieces,
+            ("Only %d pieces", msg->rec->npieces) );
+    return msg->rec->piecelen[i];
+}
+
+#else /*MPI_AVAILABLE*/
+/*---------------------------------------------------------------------------*/
+void RMA_initialize( int nodeid, int numnodes, RMACallback *cb )
+    { MYASSERT( 0, ("RMA needs MPI") ); }
+void RMA_finalize( void ) {}
+RMA_stream *RMA_begin_message( int recipient, int length, int handler,
+    int src_id, int dest_id ) { return 0; }
+void RMA_send_piece( RMA_stream *s, void *buffer, int length ) {}
+void RMA_end_message( RMA_stream *s ) {}
+void RMA_receive( void *buffer, RMA_stream *s, unsigned int length ) {}
+int RMA_extract( unsigned int maxbytes ) { return 0; }
+void RMA_flush( void ) {}
+int RMA_numpieces( RMA_stream *s ) { return 0; }
+int RMA_piecelen( RMA_stream *s, int i ) { return 0; }
+#endif /*MPI_AVAILABLE*/
+
+/*---------------------------------------------------------------------------*/
+int RMA_debug_level( int level )
+{
+    int old = rmafmdbg;
+    rmafmdbg = level;
+    return old;
+}
+
+/*---------------------------------------------------------------------------*/
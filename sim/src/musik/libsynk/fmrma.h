@@ -0,0 +1,41 @@
+/*---------------------------------------------------------------------------*/
+/* One-sided MPI RMA FM-like interface.                                      */
+/* Every processor exposes one MPI window holding, for each sender, a ring   */
+/* of variable-length records that the sender fills with MPI_Put; the only   */
+/* receiver-side work is reading its own memory.                             */
+/*---------------------------------------------------------------------------*/
+#ifndef __RMA_FM_H
+#define __RMA_FM_H
+
+/*---------------------------------------------------------------------------*/
+#define RMAMAXPE 4096 /*CUSTOMIZE*/
+#define RMAMAXPIECES 16
+#define RMAMAXPIECELEN 2048 /*CUSTOMIZE*/
+#define RMAMAXDATALEN (RMAMAXPIECES*RMAMAXPIECELEN)
+
+/*---------------------------------------------------------------------------*/
+struct _RMAMsg;
+typedef struct _RMAMsg RMA_stream;
+
+/*---------------------------------------------------------------------------*/
+typedef int RMACallback(int, RMA_stream *, int, int, int);
+
+/*---------------------------------------------------------------------------*/
+void RMA_initialize(int, int, RMACallback *);
+void RMA_finalize(void);
+RMA_stream *RMA_begin_message(int, int, int, int, int);
+void RMA_send_piece(RMA_stream *, void *, int);
+void RMA_end_message(RMA_stream *);
+void RMA_receive(void *, RMA_stream *, unsigned int);
+int RMA_numpieces(RMA_stream *);
+int RMA_piecelen(RMA_stream *, int);
+int RMA_extract(unsigned int maxbytes);
+void RMA_flush(void);
+int RMA_debug_level(int);
+
+/*---------------------------------------------------------------------------*/
+extern int RMA_nodeid;
+extern int RMA_numnodes;
+
+/*---------------------------------------------------------------------------*/
+#endif /* __RMA_FM_H */
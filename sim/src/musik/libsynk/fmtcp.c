@@ -60,6 +60,8 @@
     #define FMFD_ISSET(a,b) 0
     #define FMFD_ZERO(a) ((void)0)
     typedef int FMFDSet;
+    #define SOCKET_NONBLOCK(s,on) ((void)0)
+    #define SOCKET_WOULDBLOCK() 0
 
 #elif PLATFORM_WIN
     #include <winsock.h>
@@ -107,8 +109,18 @@
     #define FMFD_ISSET(a,b) FD_ISSET(a,b)
     #define FMFD_ZERO(a) FD_ZERO(a)
     typedef fd_set FMFDSet;
+    #define SOCKET_NONBLOCK(s,on) \
+        do{ u_long _nb = (on); ioctlsocket( s, FIONBIO, &_nb ); }while(0)
+    #define SOCKET_WOULDBLOCK() (WSAGetLastError()==WSAEWOULDBLOCK)
 #else
+    #undef ntohl /*mycompat.h stubs these out; the socket headers declare them*/
+    #undef htonl
+    #undef ntohs
+    #undef htons
     #include <limits.h>
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <poll.h>
     #include <sys/param.h>
     #include <sys/types.h>
     #include <sys/uio.h>
@@ -135,6 +147,22 @@
     #define FMFD_ISSET(a,b) FD_ISSET(a,b)
     #define FMFD_ZERO(a) FD_ZERO(a)
     typedef fd_set FMFDSet;
+    #define SOCKET_NONBLOCK(s,on) \
+        fcntl( s, F_SETFL, (on) ? (fcntl(s,F_GETFL,0) |  O_NONBLOCK) \
+                                : (fcntl(s,F_GETFL,0) & ~O_NONBLOCK) )
+    #define SOCKET_WOULDBLOCK() (errno==EAGAIN || errno==EWOULDBLOCK)
+    #define TCP_NBCONNECT 1 /*Connect to all lower peers concurrently*/
+    #ifdef __linux__
+        #include <sys/epoll.h>
+        #define TCP_EPOLL 1
+    #endif
+#endif
+
+#ifndef TCP_NBCONNECT
+    #define TCP_NBCONNECT 0
+#endif
+#ifndef TCP_EPOLL
+    #define TCP_EPOLL 0
 #endif
 
 #include "fmtcp.h"
@@ -168,8 +196,25 @@ typedef struct
     TCPMsgHeaderPiece hdr;
     int npieces_recd;
     int nbytes_recd;
+    char *data; /*Whole message, header first, in the sender's input buffer*/
 } TCPRecvMsg;
 
+/*---------------------------------------------------------------------------*/
+/* Outgoing bytes wait in a per-peer queue of chunks, written out with one   */
+/* writev() per flush; incoming bytes are read in bulk into a per-peer       */
+/* buffer, from which whole messages are handed up in place.                 */
+/*---------------------------------------------------------------------------*/
+#define TCPCHUNKLEN 65536 /*CUSTOMIZE*/
+#define TCPMAXIOV 64
+#define TCPINBUFLEN (4*TCPCHUNKLEN) /*CUSTOMIZE*/
+
+typedef struct _TCPOutChunk
+{
+    struct _TCPOutChunk *next;
+    int head, tail; /*Unsent bytes are data[head..tail)*/
+    char data[TCPCHUNKLEN];
+} TCPOutChunk;
+
 /*---------------------------------------------------------------------------*/
 typedef struct
 {
@@ -177,6 +222,10 @@ typedef struct
     char hostname[MAXHOSTNAMELEN+1];
     struct sockaddr_in addr;
     int port;
+    TCPOutChunk *first, *last; /*Queue of bytes not yet written*/
+    long nqueued;
+    char *ibuf; /*Bytes read but not yet handled are ibuf[ihead..itail)*/
+    int ihead, itail, icap;
 } TCPPeer;
 
 /*---------------------------------------------------------------------------*/
@@ -187,6 +236,15 @@ typedef struct
     TCPPeer peer[TCPMAXPE];
     TCPSendMsg send_msg;
     TCPRecvMsg recv_msg;
+    TCPOutChunk *freechunks;
+    long nqueued; /*Total over all peers*/
+    int batchbytes; /*Flush a peer once this many bytes are queued for it*/
+    int nodelay, cork, use_epoll;
+    int epfd;
+    struct
+    {
+        unsigned long nsent, nwritev, nrecd, nreads, npolls;
+    } stats;
 } TCPState;
 
 /*---------------------------------------------------------------------------*/
@@ -244,6 +302,19 @@ static void config( char *hostnames[] )
     tcpfmdbg = estr ? atoi(estr) : 1;
 #if !NODEBUG
 if(tcpfmdbg>=1){printf("FMTCP_DEBUG=%d\n",tcpfmdbg);fflush(stdout);}
+#endif
+
+    estr = getenv("FMTCP_BATCHBYTES"); /*0 writes every message right away*/
+    tcp->batchbytes = estr ? atoi(estr) : TCPCHUNKLEN/2;
+    estr = getenv("FMTCP_NODELAY"); /*TRUE or FALSE*/
+    tcp->nodelay = estr ? !strcmp(estr,"TRUE") : 1;
+    estr = getenv("FMTCP_CORK"); /*TRUE or FALSE*/
+    tcp->cork = estr ? !strcmp(estr,"TRUE") : 0;
+    estr = getenv("FMTCP_EPOLL"); /*TRUE or FALSE*/
+    tcp->use_epoll = TCP_EPOLL && (estr ? !strcmp(estr,"TRUE") : 1);
+    tcp->epfd = -1;
+#if !NODEBUG
+if(tcpfmdbg>=1){printf("FMTCP batch %d bytes nodelay %d cork %d epoll %d\n",tcp->batchbytes,tcp->nodelay,tcp->cork,tcp->use_epoll);fflush(stdout);}
 #endif
 
     for( i = 0; i < tcp->numnodes; i++ )
@@ -309,10 +380,143 @@ static int writen( SOCKET fd, char *buf, int n )
     return (n - nleft);
 }
 
+/*---------------------------------------------------------------------------*/
+static void set_cork( SOCKET fd, int on )
+{
+#ifdef TCP_CORK
+    setsockopt( fd, IPPROTO_TCP, TCP_CORK, (const char *)&on, sizeof(on) );
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+static void resolve_peer( TCPPeer *peer, int i )
+{
+    struct sockaddr_in *psin = &peer->addr;
+    struct hostent *hent = gethostbyname(peer->hostname);
+    MYASSERT( hent, ("hent[%d]%s",i,peer->hostname); perror("hostent") );
+    memset(psin, 0, sizeof(*psin));
+    memcpy(&psin->sin_addr, hent->h_addr, hent->h_length);
+    psin->sin_family = AF_INET; psin->sin_port = htons((u_short)peer->port);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Connects to peers lo..hi-1, whose ports must be known.  With non-blocking */
+/* connect, all attempts are in flight at once, and refused ones (peer not   */
+/* listening yet) are retried every 100ms; connected sockets stay blocking  */
+/* for the handshake.                                                        */
+/*---------------------------------------------------------------------------*/
+static void connect_peers( int lo, int hi )
+{
+    int i = 0, atry = 0, maxtries = 1000, npending = hi-lo;
+
+    for( i = lo; i < hi; i++ )
+    {
+	MYASSERT( tcp->peer[i].port >= 0, ("Port[%d] = %d",i,tcp->peer[i].port) );
+        resolve_peer( &tcp->peer[i], i );
+    }
+
+#if TCP_NBCONNECT
+    for( atry = 0; npending > 0 && atry < 10*maxtries; atry++ )
+    {
+        struct pollfd pfd[TCPMAXPE];
+        int pe[TCPMAXPE], np = 0, k = 0;
+
+        for( i = lo; i < hi; i++ )
+        {
+            TCPPeer *peer = &tcp->peer[i];
+            SOCKET sock = NO_SOCKET;
+            if( peer->sockfd != NO_SOCKET ) continue;
+            sock = socket(AF_INET, SOCK_STREAM, 0);
+	    MYASSERT( sock!=NO_SOCKET, ("socket[%d]%s",i,peer->hostname);perror("socket"));
+            SOCKET_NONBLOCK( sock, 1 );
+            if( connect(sock,(struct sockaddr *)&peer->addr,sizeof(peer->addr))==0 )
+            {
+                SOCKET_NONBLOCK( sock, 0 );
+                peer->sockfd = sock; npending--;
+            }
+            else if( errno == EINPROGRESS )
+            {
+                pfd[np].fd = sock; pfd[np].events = POLLOUT; pfd[np].revents = 0;
+                pe[np++] = i;
+            }
+            else
+            {
+                SOCKET_CLOSE(sock);
+            }
+        }
+
+        if( np > 0 ) poll( pfd, np, 5000/*ms*/ );
+        for( k = 0; k < np; k++ )
+        {
+            int err = -1; socklen_t elen = sizeof(err);
+            if( (pfd[k].revents & (POLLOUT|POLLERR|POLLHUP)) &&
+                getsockopt( pfd[k].fd, SOL_SOCKET, SO_ERROR, &err, &elen ) == 0 &&
+                err == 0 )
+            {
+                SOCKET_NONBLOCK( pfd[k].fd, 0 );
+                tcp->peer[pe[k]].sockfd = pfd[k].fd; npending--;
+#if !NODEBUG
+if(tcpfmdbg>=2){printf( "Node %d connected to node %d - %s:%d\n", tcp->nodeid, pe[k], tcp->peer[pe[k]].hostname, tcp->peer[pe[k]].port);fflush(stdout);}
+#endif
+            }
+            else
+            {
+                SOCKET_CLOSE( pfd[k].fd );
+            }
+        }
+
+        if( npending > 0 )
+        {
+#if !NODEBUG
+if(tcpfmdbg>=2){printf("Try %d: %d connections pending\n",atry,npending);fflush(stdout);}
+#endif
+            usleep( 100000 );
+        }
+    }
+#else /*TCP_NBCONNECT*/
+    for( i = lo; i < hi; i++ )
+    {
+	SOCKET sock;
+	TCPPeer *peer = &tcp->peer[i];
+	int connected = 0;
+	const char *hname = peer->hostname;
+
+        for( atry = 0; atry < maxtries; atry++ )
+        {
+            struct sockaddr_in *psin = &peer->addr;
+            sock = socket(AF_INET, SOCK_STREAM, 0);
+	    MYASSERT( sock!=NO_SOCKET, ("socket[%d]%s",i,hname);perror("socket"));
+            connected=(connect(sock,(struct sockaddr *)psin,sizeof(*psin))==0);
+
+	    if( connected ) break;
+
+            perror("Retrying. connect()"); fflush(stderr);
+	    SOCKET_CLOSE(sock); sock = NO_SOCKET;
+	    sleep(1);
+#if !NODEBUG
+if(tcpfmdbg>=2){printf("Try %d\n",atry);fflush(stdout);}
+#endif
+        }
+
+        MYASSERT( connected, ("Connection to %s:%d",hname,peer->port) );
+
+#if !NODEBUG
+if(tcpfmdbg>=2){printf( "Node %d connected to node %d - %s:%d\n", tcp->nodeid, i, hname, peer->port);fflush(stdout);}
+#endif
+
+	peer->sockfd = sock;
+	npending--;
+    }
+#endif /*TCP_NBCONNECT*/
+
+    MYASSERT( npending == 0, ("%d connections to nodes %d..%d failed",
+                              npending, lo, hi-1) );
+}
+
 /*---------------------------------------------------------------------------*/
 static void make_connections( void )
 {
-    int i, j;
+    int i, j, lo, hi;
     TCPPeer *self = &tcp->peer[tcp->nodeid];
     int master_portnum = -1;
 
@@ -370,7 +574,7 @@ if(tcpfmdbg>=2){printf("FMTCP %d : 1st port to try bind= %d\n",tcp->nodeid,port_
 #if !NODEBUG
 if(tcpfmdbg>=1){printf("Node %d %s bound to port %d\n", tcp->nodeid, self->hostname, port);fflush(stdout);}
 #endif
-        listened = listen(sock, 10);
+        listened = listen(sock, TCPMAXPE);
 	MYASSERT( listened >= 0, ("listen %d",listened); perror("listen") );
 
 	self->port = port;
@@ -433,48 +637,16 @@ if(tcpfmdbg>=2){printf("Done.\nMaster port# is %d\n", master_portnum);}
         tcp->peer[0].port = master_portnum;
     }
 
-    for( i = 0; i < tcp->nodeid; i++ )
+    for( lo = 0; lo < tcp->nodeid; lo = hi )
     {
-	SOCKET sock;
-	TCPPeer *peer = &tcp->peer[i];
-	int atry = 0, maxtries = 1000;
-	int port = peer->port, connected = 0;
-	const char *hname = peer->hostname;
-
-	MYASSERT( port >= 0, ("Port[%d] = %d",i,port) );
+        hi = (lo == 0 ? 1 : tcp->nodeid); /*Others' ports come from node 0*/
+        connect_peers( lo, hi );
 
-        for( atry = 0; atry < maxtries; atry++ )
+        for( i = lo; i < hi; i++ )
         {
-            struct sockaddr_in *psin = &peer->addr;
-            struct hostent *hent = gethostbyname(hname);
-            MYASSERT( hent, ("hent[%d]%s",i,hname); perror("hostent") );
-            memset(psin, 0, sizeof(*psin));
-            memcpy(&psin->sin_addr, hent->h_addr, hent->h_length);
-            psin->sin_family = AF_INET; psin->sin_port = htons((u_short)port);
-            sock = socket(AF_INET, SOCK_STREAM, 0);
-	    MYASSERT( sock!=NO_SOCKET, ("socket[%d]%s",i,hname);perror("socket"));
-            connected=(connect(sock,(struct sockaddr *)psin,sizeof(*psin))==0);
-
-	    if( connected ) break;
-
-            perror("Retrying. connect()"); fflush(stderr);
-	    SOCKET_CLOSE(sock); sock = NO_SOCKET;
-	    sleep(1);
-#if !NODEBUG
-if(tcpfmdbg>=2){printf("Try %d\n",atry);fflush(stdout);}
-#endif
-        }
-
-        MYASSERT( connected, ("Connection to %s:%d",hname,port) );
-
-#if !NODEBUG
-if(tcpfmdbg>=2){printf( "Node %d connected to node %d - %s:%d\n", tcp->nodeid, i, hname, port);fflush(stdout);}
-#endif
-
-	peer->sockfd = sock;
-
+	TCPPeer *peer = &tcp->peer[i];
 	{
-            int nw = writen( sock, (char *)&tcp->nodeid, sizeof(tcp->nodeid) );
+            int nw = writen( peer->sockfd, (char *)&tcp->nodeid, sizeof(tcp->nodeid) );
 	    MYASSERT( nw == sizeof(tcp->nodeid), ("!") );
 	}
 
@@ -493,6 +665,7 @@ if(tcpfmdbg>=2){printf( "Node %d connected to node %d - %s:%d\n", tcp->nodeid, i
 		else tcp->peer[j].port = port;
 	    }
 	}
+        }
     }
 
     for( i = tcp->nodeid+1; i < tcp->numnodes; i++ )
@@ -634,9 +807,31 @@ if(tcpfmdbg>=4){printf("Node %d: Using SO_SNDBUF %d bytes\n",tcp->nodeid,newssz)
 	                         (const char *)&lr, sizeof(lr) );
 	    MYASSERT( retval >= 0, ("!"); perror("setsockopt") );
 
+	    f = tcp->nodelay;
 	    retval = setsockopt( fd, IPPROTO_TCP, TCP_NODELAY,
 	                         (const char *)&f, sizeof(f) );
 	    MYASSERT( retval >= 0, ("!"); perror("setsockopt") );
+	    set_cork( fd, tcp->cork );
+
+	    SOCKET_NONBLOCK( fd, 1 );
+	    peer->icap = TCPINBUFLEN;
+	    peer->ibuf = (char *)malloc( peer->icap );
+	    MYASSERT( peer->ibuf, ("TCP input buffer %d bytes",peer->icap) );
+	    peer->ihead = peer->itail = 0;
+	    peer->first = peer->last = 0;
+	    peer->nqueued = 0;
+#if TCP_EPOLL
+	    if( tcp->use_epoll )
+	    {
+	        struct epoll_event ev;
+	        memset( &ev, 0, sizeof(ev) );
+	        ev.events = EPOLLIN; ev.data.u32 = i;
+	        if( tcp->epfd < 0 ) tcp->epfd = epoll_create1( 0 );
+	        MYASSERT( tcp->epfd >= 0, ("!"); perror("epoll_create1") );
+	        retval = epoll_ctl( tcp->epfd, EPOLL_CTL_ADD, fd, &ev );
+	        MYASSERT( retval >= 0, ("!"); perror("epoll_ctl") );
+	    }
+#endif /*TCP_EPOLL*/
 	}
     }
 }
@@ -683,15 +878,39 @@ if(tcpfmdbg>=1){printf("TCP_initialize() done.\n");fflush(stdout);}
 void TCP_finalize( void )
 {
     int i = 0;
+    TCP_flush();
+#if !NODEBUG
+if(tcpfmdbg>=1 && tcp->numnodes>1){printf("TCP %d: sent %lu msgs in %lu writev, recd %lu msgs in %lu reads, %lu polls\n",tcp->nodeid,tcp->stats.nsent,tcp->stats.nwritev,tcp->stats.nrecd,tcp->stats.nreads,tcp->stats.npolls);fflush(stdout);}
+#endif
     for( i = 0; i < tcp->numnodes; i++ )
     {
-        SOCKET *pfd = &tcp->peer[i].sockfd;
+        TCPPeer *peer = &tcp->peer[i];
+        SOCKET *pfd = &peer->sockfd;
 	if( *pfd != NO_SOCKET )
 	{
 	    SOCKET_CLOSE( *pfd );
 	}
 	*pfd = NO_SOCKET;
+	while( peer->first )
+	{
+	    TCPOutChunk *c = peer->first;
+	    peer->first = c->next;
+	    free( c );
+	}
+	peer->last = 0;
+	if( peer->ibuf ) free( peer->ibuf );
+	peer->ibuf = 0;
     }
+    while( tcp->freechunks )
+    {
+        TCPOutChunk *c = tcp->freechunks;
+        tcp->freechunks = c->next;
+        free( c );
+    }
+#if TCP_EPOLL
+    if( tcp->epfd >= 0 ) close( tcp->epfd );
+    tcp->epfd = -1;
+#endif /*TCP_EPOLL*/
     SOCKET_CLEANUP();
 }
 
@@ -748,21 +967,114 @@ void TCP_send_piece( TCP_stream *sendstream, void *buffer, int length )
     }
 }
 
+/*---------------------------------------------------------------------------*/
+static void enqueue( TCPPeer *peer, const char *buf, int n )
+{
+    while( n > 0 )
+    {
+        TCPOutChunk *c = peer->last;
+        int m = 0;
+        if( !c || c->tail >= TCPCHUNKLEN )
+        {
+            c = tcp->freechunks;
+            if( c ) tcp->freechunks = c->next;
+            else c = (TCPOutChunk *)malloc( sizeof(TCPOutChunk) );
+            MYASSERT( c, ("TCP output chunk") );
+            c->next = 0; c->head = c->tail = 0;
+            if( peer->last ) peer->last->next = c; else peer->first = c;
+            peer->last = c;
+        }
+        m = TCPCHUNKLEN - c->tail;
+        if( m > n ) m = n;
+        memcpy( c->data + c->tail, buf, m );
+        c->tail += m; buf += m; n -= m;
+        peer->nqueued += m; tcp->nqueued += m;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/* Writes as much of the peer's queue as the socket takes without blocking. */
+/*---------------------------------------------------------------------------*/
+static long flush_peer( TCPPeer *peer )
+{
+    long ntotal = 0;
+
+    while( peer->first && peer->sockfd != NO_SOCKET )
+    {
+        struct iovec iov[TCPMAXIOV];
+        TCPOutChunk *c = peer->first;
+        int niov = 0;
+        long nw = 0;
+
+        for( ; c && niov < TCPMAXIOV; c = c->next )
+        {
+            iov[niov].iov_base = c->data + c->head;
+            iov[niov].iov_len = c->tail - c->head;
+            niov++;
+        }
+
+        nw = SOCKET_WRITEV( peer->sockfd, iov, niov );
+        tcp->stats.nwritev++;
+        if( nw < 0 )
+        {
+            MYASSERT( SOCKET_WOULDBLOCK(), ("writev to %s failed",
+                      peer->hostname); perror("writev") );
+            break;
+        }
+
+        ntotal += nw;
+        peer->nqueued -= nw; tcp->nqueued -= nw;
+        while( nw > 0 )
+        {
+            c = peer->first;
+            if( nw < c->tail - c->head ) { c->head += nw; break; }
+            nw -= c->tail - c->head;
+            peer->first = c->next;
+            if( !peer->first ) peer->last = 0;
+            c->next = tcp->freechunks; tcp->freechunks = c;
+        }
+        if( peer->first ) break; /*Socket buffer full; retry on next flush*/
+    }
+
+    return ntotal;
+}
+
+/*---------------------------------------------------------------------------*/
+void TCP_flush( void )
+{
+    int i = 0;
+
+    if( tcp->nqueued <= 0 ) return;
+
+    for( i = 0; i < tcp->numnodes; i++ )
+    {
+        TCPPeer *peer = &tcp->peer[i];
+        if( peer->first && flush_peer( peer ) > 0 && tcp->cork )
+        {
+            set_cork( peer->sockfd, 0 ); /*Push out the partial segment*/
+            set_cork( peer->sockfd, 1 );
+        }
+    }
+}
+
 /*---------------------------------------------------------------------------*/
 void TCP_end_message( TCP_stream *sendstream )
 {
     TCPSendMsg *msg = &tcp->send_msg;
     TCPMsgHeaderPiece *hdr = &msg->hdr;
-    int to = hdr->dest_pe, nwritten = 0;
-    SOCKET sockfd = tcp->peer[to].sockfd;
+    int to = hdr->dest_pe, pn = 0;
+    TCPPeer *peer = &tcp->peer[to];
 
     MYASSERT( sendstream == (TCP_stream *)msg, ("!") );
 
-    if( sockfd != NO_SOCKET )
+    if( peer->sockfd != NO_SOCKET )
     {
-        nwritten = SOCKET_WRITEV( sockfd, msg->pieces, hdr->npieces );
-        MYASSERT( nwritten == hdr->totbytes,
-                ("nwritten %d must equal totbytes %d",nwritten,hdr->totbytes) );
+        for( pn = 0; pn < hdr->npieces; pn++ )
+        {
+            enqueue( peer, msg->pieces[pn].iov_base, msg->pieces[pn].iov_len );
+        }
+        tcp->stats.nsent++;
+        if( peer->nqueued >= tcp->batchbytes ) flush_peer( peer );
     }
 }
 
@@ -771,151 +1083,171 @@ int TCP_receive( void *buffer, TCP_stream *receivestream, unsigned int length )
 {
     TCPRecvMsg *msg = &tcp->recv_msg;
     TCPMsgHeaderPiece *hdr = &msg->hdr;
-    SOCKET *pfd = &tcp->peer[hdr->src_pe].sockfd;
-    int nread = 0, pn = 0;
+    int pn = 0;
 
     MYASSERT( receivestream == msg, ("!") );
 
     pn = msg->npieces_recd++;
 
-    if( pn > 0 )
-    {
-        MYASSERT( pn < hdr->npieces,
-	        ("Only #%d pieces", hdr->npieces) );
-        MYASSERT( length == hdr->piecelen[pn],
-	        ("request len %d != sent len %d", length, hdr->piecelen[pn]));
-        MYASSERT( length <= hdr->totbytes - msg->nbytes_recd,
-                ("%d, %d, %d", length, hdr->totbytes, msg->nbytes_recd) );
-    }
-
-    if( *pfd != NO_SOCKET )
-    {
-        nread = readn( *pfd, buffer, length );
-    }
-
-    if( nread <= 0 )
-    {
-        SOCKET_CLOSE( *pfd );
-	*pfd = NO_SOCKET;
-    }
+    MYASSERT( 0 < pn && pn < hdr->npieces,
+	    ("Only #%d pieces", hdr->npieces) );
+    MYASSERT( length == hdr->piecelen[pn],
+	    ("request len %d != sent len %d", length, hdr->piecelen[pn]));
+    MYASSERT( length <= hdr->totbytes - msg->nbytes_recd,
+            ("%d, %d, %d", length, hdr->totbytes, msg->nbytes_recd) );
 
+    memcpy( buffer, msg->data + msg->nbytes_recd, length );
     msg->nbytes_recd += length;
 
-    return nread;
+    return length;
 }
 
 /*---------------------------------------------------------------------------*/
-static int recv_one_msg( int pe )
+static void close_peer( TCPPeer *peer )
 {
-    int i = 0, nbytes = 0, nrecd = 0;
-    SOCKET fd = tcp->peer[pe].sockfd;
-    TCPRecvMsg *msg = &tcp->recv_msg;
-    TCPMsgHeaderPiece temphdr, *hdr = &msg->hdr;
-
-    MYASSERT( fd != NO_SOCKET, ("Ensure valid fd[%d]=%d", pe, fd) );
-
-    msg->nbytes_recd = 0; msg->npieces_recd = 0;
+#if TCP_EPOLL
+    if( tcp->epfd >= 0 ) epoll_ctl( tcp->epfd, EPOLL_CTL_DEL, peer->sockfd, 0 );
+#endif /*TCP_EPOLL*/
+    SOCKET_CLOSE( peer->sockfd );
+    peer->sockfd = NO_SOCKET;
+}
 
-    hdr->src_id = -1; hdr->dest_id = -1;
-    hdr->src_pe = pe; hdr->dest_pe = tcp->nodeid;
-    hdr->handler = 0; hdr->npieces = 0; hdr->totbytes = 0;
+/*---------------------------------------------------------------------------*/
+/* One read() of whatever the peer has sent, into its input buffer.          */
+/*---------------------------------------------------------------------------*/
+static int fill_peer( TCPPeer *peer )
+{
+    int nread = 0;
 
-    nrecd = TCP_receive( &temphdr, msg, sizeof(temphdr) );
+    if( peer->ihead == peer->itail )
+    {
+        peer->ihead = peer->itail = 0;
+    }
+    else if( peer->ihead > 0 && peer->icap - peer->itail < TCPCHUNKLEN )
+    {
+        memmove( peer->ibuf, peer->ibuf + peer->ihead,
+                 peer->itail - peer->ihead );
+        peer->itail -= peer->ihead; peer->ihead = 0;
+    }
+    if( peer->itail >= peer->icap ) /*Only part of a huge message so far*/
+    {
+        peer->icap *= 2;
+        peer->ibuf = (char *)realloc( peer->ibuf, peer->icap );
+        MYASSERT( peer->ibuf, ("TCP input buffer %d bytes",peer->icap) );
+    }
 
-    if( nrecd <= 0 )
+    nread = SOCKET_READ( peer->sockfd, peer->ibuf + peer->itail,
+                         peer->icap - peer->itail );
+    tcp->stats.nreads++;
+    if( nread > 0 )
     {
-	/*Do nothing*/
+        peer->itail += nread;
+    }
+    else if( nread == 0 || !SOCKET_WOULDBLOCK() )
+    {
+        close_peer( peer );
+        nread = 0;
     }
     else
     {
-    MYASSERT( temphdr.src_pe == hdr->src_pe,
-            ("src pes must agree: %d != %d", temphdr.src_pe, hdr->src_pe) );
-    MYASSERT( temphdr.dest_pe == hdr->dest_pe,
-            ("dest pes must agree: %d != %d", temphdr.dest_pe, hdr->dest_pe) );
-    MYASSERT( temphdr.totbytes >= sizeof(*hdr),
-            ("msg size: %d >= %lu", temphdr.totbytes, sizeof(*hdr)) );
-    MYASSERT( temphdr.piecelen[0] == sizeof(*hdr),
-            ("piecelen[0] %d != hdr sz %lu",temphdr.piecelen[0],sizeof(*hdr)));
+        nread = 0;
+    }
 
-    *hdr = temphdr;
+    return nread;
+}
 
-    fmcb( hdr->handler, msg, hdr->src_pe, hdr->src_id, hdr->dest_id );
+/*---------------------------------------------------------------------------*/
+/* Hands up the complete messages buffered from pe, up to maxbytes' worth.   */
+/*---------------------------------------------------------------------------*/
+static int recv_buffered( int pe, unsigned int maxbytes )
+{
+    int nbytes = 0;
+    TCPPeer *peer = &tcp->peer[pe];
+    TCPRecvMsg *msg = &tcp->recv_msg;
+    TCPMsgHeaderPiece *hdr = &msg->hdr;
 
-    nrecd = 0;
-    for( i = msg->npieces_recd; i < hdr->npieces; i++ )
+    while( nbytes < maxbytes &&
+           peer->itail - peer->ihead >= (int)sizeof(*hdr) )
     {
-	char buf[TCPMAXPIECELEN];
-	int len = hdr->piecelen[i];
-	MYASSERT( len <= sizeof(buf), ("%d %lu",len,sizeof(buf)) );
-        nrecd = TCP_receive( buf, msg, len );
-	if( nrecd <= 0 ) break;
-    }
-
-    MYASSERT( nrecd <= 0 || msg->nbytes_recd == hdr->totbytes,
-            ("%d, %d", msg->nbytes_recd, hdr->totbytes) );
-
-    nbytes = msg->nbytes_recd;
+        memcpy( hdr, peer->ibuf + peer->ihead, sizeof(*hdr) );
+
+        MYASSERT( hdr->src_pe == pe,
+                ("src pes must agree: %d != %d", hdr->src_pe, pe) );
+        MYASSERT( hdr->dest_pe == tcp->nodeid,
+                ("dest pes must agree: %d != %d", hdr->dest_pe, tcp->nodeid) );
+        MYASSERT( hdr->totbytes >= sizeof(*hdr),
+                ("msg size: %d >= %lu", hdr->totbytes, sizeof(*hdr)) );
+        MYASSERT( hdr->piecelen[0] == sizeof(*hdr),
+                ("piecelen[0] %d != hdr sz %lu",hdr->piecelen[0],sizeof(*hdr)));
+
+        if( peer->itail - peer->ihead < hdr->totbytes ) break; /*Partial*/
+
+        msg->data = peer->ibuf + peer->ihead;
+        msg->npieces_recd = 1;
+        msg->nbytes_recd = sizeof(*hdr);
+        peer->ihead += hdr->totbytes; /*Handler may not receive every piece*/
+        nbytes += hdr->totbytes;
+        tcp->stats.nrecd++;
+
+        fmcb( hdr->handler, msg, hdr->src_pe, hdr->src_id, hdr->dest_id );
     }
 
     return nbytes;
 }
 
 /*---------------------------------------------------------------------------*/
-static int poll_all_once( unsigned int maxbytes )
+/* Lists the peers with data to read, without blocking.                      */
+/*---------------------------------------------------------------------------*/
+static int poll_ready( int ready[] )
 {
-    struct timeval tv;
-    int i = 0, maxfd = 0, nready = 0, nbytes = 0;
-    FMFDSet rfds;
+    int i = 0, nready = 0;
 
-    FMFD_ZERO( &rfds );
-    for( i = 0; i < tcp->numnodes; i++ )
+    tcp->stats.npolls++;
+#if TCP_EPOLL
+    if( tcp->use_epoll )
     {
-        if( i != tcp->nodeid )
-	{
-	    SOCKET fd = tcp->peer[i].sockfd;
-	    if( fd != NO_SOCKET )
-	    {
-	        FMFD_SET( fd, &rfds );
-		if( SOCK_CMP(fd, maxfd) > 0 ) maxfd = fd;
-	    }
-	}
+        struct epoll_event evs[TCPMAXPE];
+        int n = epoll_wait( tcp->epfd, evs, TCPMAXPE, 0 );
+        for( i = 0; i < n; i++ ) ready[nready++] = (int)evs[i].data.u32;
+        return nready;
     }
+#endif /*TCP_EPOLL*/
+    {
+        struct timeval tv;
+        int maxfd = 0, n = 0;
+        FMFDSet rfds;
 
-    tv.tv_sec = tv.tv_usec = 0;
-    nready = select( maxfd+1, &rfds, 0, 0, &tv );
+        FMFD_ZERO( &rfds );
+        for( i = 0; i < tcp->numnodes; i++ )
+        {
+            SOCKET fd = tcp->peer[i].sockfd;
+            if( i != tcp->nodeid && fd != NO_SOCKET )
+            {
+                FMFD_SET( fd, &rfds );
+                if( SOCK_CMP(fd, maxfd) > 0 ) maxfd = fd;
+            }
+        }
 
-    if( nready < 0 )
-    {
-        if(0){MYASSERT( 0, ("select() failed"); perror("") );}
-    }
-    else if( nready == 0 )
-    {
-    }
-    else
-    {
-        for( i = 0; i < tcp->numnodes-1 && nbytes < maxbytes; i++ )
+        tv.tv_sec = tv.tv_usec = 0;
+        n = select( maxfd+1, &rfds, 0, 0, &tv );
+        for( i = 0; n > 0 && i < tcp->numnodes; i++ )
         {
-            static int pe = 0;
-            if( pe == tcp->nodeid ) pe++;
-	    pe %= tcp->numnodes;
-	    {
-	        SOCKET fd = tcp->peer[pe].sockfd;
-	        if( fd != NO_SOCKET && FMFD_ISSET( fd, &rfds ) )
-		{
-		    nbytes += recv_one_msg( pe );
-		}
-	    }
-	    pe++; pe %= tcp->numnodes;
+            SOCKET fd = tcp->peer[i].sockfd;
+            if( i != tcp->nodeid && fd != NO_SOCKET && FMFD_ISSET( fd, &rfds ) )
+            {
+                ready[nready++] = i;
+            }
         }
     }
 
-    return nbytes;
+    return nready;
 }
 
 /*---------------------------------------------------------------------------*/
 int TCP_extract( unsigned int maxbytes )
 {
-    int nbytes = 0;
+    static int rr = 0; /*Round-robin start among peers, for fairness*/
+    int nbytes = 0, i = 0;
     static int removed_portfile = 0;
     if( TCP_nodeid == 0 && !removed_portfile )
     {
@@ -929,13 +1261,33 @@ int TCP_extract( unsigned int maxbytes )
 
     if( tcp->numnodes <= 1 ) return 0;
 
+    TCP_flush();
+
+    /*Messages left over from an earlier call, when maxbytes ran out*/
+    for( i = 0; i < tcp->numnodes && nbytes < maxbytes; i++ )
+    {
+        int pe = (rr + i) % tcp->numnodes;
+        nbytes += recv_buffered( pe, maxbytes-nbytes );
+    }
+
     while( nbytes < maxbytes )
     {
-	int m = poll_all_once( maxbytes-nbytes );
-	if( m <= 0 ) break;
+        int ready[TCPMAXPE], nready = poll_ready( ready ), m = 0;
+        if( nready <= 0 ) break;
+        for( i = 0; i < nready; i++ )
+        {
+            int pe = ready[(rr + i) % nready];
+            TCPPeer *peer = &tcp->peer[pe];
+            if( peer->sockfd == NO_SOCKET || fill_peer( peer ) <= 0 ) continue;
+            m += recv_buffered( pe, nbytes+m < maxbytes ? maxbytes-nbytes-m : 0 );
+        }
+        rr++;
+        if( m <= 0 ) break;
         nbytes += m;
     }
 
+    TCP_flush(); /*Replies sent by the handlers*/
+
     return nbytes;
 }
 
@@ -27,6 +27,7 @@ int TCP_receive(void *, TCP_stream *, unsigned int);
 int TCP_numpieces(TCP_stream *);
 int TCP_piecelen(TCP_stream *, int);
 int TCP_extract(unsigned int maxbytes);
+void TCP_flush(void);
 int TCP_debug_level(int);
 
 /*---------------------------------------------------------------------------*/
@@ -17,6 +17,8 @@
 
 /*----------------------------------------------------------------------------*/
 static int dbg = 0;
+static int *rm_gids = 0; /*Groups given via rm_set_groups(), if any*/
+static int rm_ngids = 0;
 
 /*----------------------------------------------------------------------------*/
 typedef struct
@@ -241,7 +243,7 @@ RMUserHandle rm_register
     st->dbg = getenv("RM_DEBUG") ? atoi(getenv("RM_DEBUG")) : 0;
     dbg = st->dbg;
     st->old_schedule = RM_SCHEDULE_UNDEFINED;
-    st->new_schedule = RM_SCHEDULE_GROUPED_BFLY;
+    st->new_schedule = RM_SCHEDULE_AUTO;
     st->do_jumpstarting = FALSE;
 
     if( getenv("RM_DOJUMPSTART") && !strcmp(getenv("RM_DOJUMPSTART"),"true") )
@@ -262,24 +264,56 @@ if(0){if(myid==0){static int x=0;if(x++==0){printf("RM: \"do_jumpstarting\"=%s\n
     else if(!strcmp(sch,"BFLY")) st->new_schedule = RM_SCHEDULE_BUTTERFLY;
     else if(!strcmp(sch,"GBFLY")) st->new_schedule = RM_SCHEDULE_GROUPED_BFLY;
     else if(!strcmp(sch,"PBFLY")) st->new_schedule = RM_SCHEDULE_PHASE_BFLY;
+    else if(!strcmp(sch,"TREE")) st->new_schedule = RM_SCHEDULE_TREE;
+    else if(!strcmp(sch,"GTREE")) st->new_schedule = RM_SCHEDULE_GROUPED_TREE;
+    else if(!strcmp(sch,"AUTO")) st->new_schedule = RM_SCHEDULE_AUTO;
     else                         {printf("Bad reduction schedule\n");exit(1);}
     }
 
-    #define STRING_RM_SCHEDULE(_st) (_st==RM_SCHEDULE_ALL_TO_ALL ? "A2A":\
-				     _st==RM_SCHEDULE_STAR       ? "STAR":\
-				     _st==RM_SCHEDULE_BUTTERFLY  ? "BUTTERFLY":\
-				     _st==RM_SCHEDULE_GROUPED_BFLY ? "GBFLY":\
-				     _st==RM_SCHEDULE_PHASE_BFLY ? "PBFLY":\
-				     "UNDEFINED")
-    LSCFGST( "RM_SCHEDULE", STRING_RM_SCHEDULE(st->new_schedule), "RM schedule" );
+    LSCFGST( "RM_SCHEDULE", rm_schedule_name(st->new_schedule), "RM schedule" );
 
 #if !NODEBUG
-if(st->dbg>=1){static int x=0;if(x++==0){printf("\n%d: ** RM using schedule of type %s.\n\n", myid, STRING_RM_SCHEDULE(st->new_schedule));fflush(stdout);}}
+if(st->dbg>=1){static int x=0;if(x++==0){printf("\n%d: ** RM using schedule of type %s.\n\n", myid, rm_schedule_name(st->new_schedule));fflush(stdout);}}
 #endif
 
     return (RMUserHandle)usr;
 }
 
+/*----------------------------------------------------------------------------*/
+RMScheduleType rm_get_schedule( RMUserHandle uh )
+{
+    return ((RMUser *)uh)->state.new_schedule;
+}
+
+/*----------------------------------------------------------------------------*/
+const char *rm_schedule_name( RMScheduleType sched )
+{
+    return sched==RM_SCHEDULE_ALL_TO_ALL ? "A2A":
+           sched==RM_SCHEDULE_STAR       ? "STAR":
+           sched==RM_SCHEDULE_BUTTERFLY  ? "BUTTERFLY":
+           sched==RM_SCHEDULE_GROUPED_BFLY ? "GBFLY":
+           sched==RM_SCHEDULE_PHASE_BFLY ? "PBFLY":
+           sched==RM_SCHEDULE_TREE       ? "TREE":
+           sched==RM_SCHEDULE_GROUPED_TREE ? "GTREE":
+           sched==RM_SCHEDULE_AUTO       ? "AUTO":
+           "UNDEFINED";
+}
+
+/*----------------------------------------------------------------------------*/
+void rm_set_groups( const int gids[], int N )
+{
+    int j = 0;
+    for( j = 0; j < N; j++ )
+    {
+        assert( 0 <= gids[j] && gids[j] < N && gids[gids[j]] == gids[j] );
+    }
+    free( rm_gids );
+    rm_gids = (int *)malloc( N*sizeof(int) );
+    assert( rm_gids );
+    memcpy( rm_gids, gids, N*sizeof(int) );
+    rm_ngids = N;
+}
+
 /*----------------------------------------------------------------------------*/
 /*  Init/Re-init user.                                                        */
 /*----------------------------------------------------------------------------*/
@@ -685,6 +719,67 @@ static void compute_butterfly_schedule
     *ssize = ss;
 }
 
+/*----------------------------------------------------------------------------*/
+/* Returns the communication schedule based on binomial tree pattern: values  */
+/* are reduced up the tree to processor 0, whose result is broadcast down it. */
+/*----------------------------------------------------------------------------*/
+static void compute_tree_schedule
+(
+    int i,
+    int N,
+    int mx,
+    int *ssize,
+    int ids[],
+    int rs[],
+    int js[],
+    int ro[]
+)
+{
+    int ss = 0;      /* Size of the schedule returned */
+    int k = 0;       /* Lowest set bit of i, if any; bounds i's subtree */
+    int parent = -1; /* i minus its lowest set bit */
+
+    assert( 0 <= i && i < N );
+    #define CHK() do{if(ss>=mx){printf("Add more actions!\n");exit(1);return;}}while(0)
+
+    /* First receive local value from self */
+    {CHK(); ids[ss]=i; rs[ss]=TRUE; js[ss]=FALSE; ro[ss]=TRUE; ss++; }
+
+    for( k = 1; k < N; k <<= 1 )
+    {
+        if( i & k ) { parent = i - k; break; }
+
+        if( i + k < N )
+        {
+            {CHK(); ids[ss]=i + k; rs[ss]=TRUE; js[ss]=TRUE;
+	     ro[ss]=TRUE; ss++;}  /*recv from child*/
+        }
+    }
+
+    if( parent >= 0 )
+    {
+        {CHK(); ids[ss]=parent; rs[ss]=FALSE; js[ss]=FALSE;
+	 ro[ss]=FALSE; ss++;} /*send to parent*/
+
+        {CHK(); ids[ss]=parent; rs[ss]=TRUE; js[ss]=FALSE;
+	 ro[ss]=FALSE; ss++;} /*recv result from parent*/
+    }
+
+    /*Send result to children, larger subtrees first*/
+    for( k >>= 1; k >= 1; k >>= 1 )
+    {
+        if( i + k < N )
+        {
+            {CHK(); ids[ss]=i + k; rs[ss]=FALSE; js[ss]=FALSE;
+	     ro[ss]=FALSE; ss++;}  /*send*/
+        }
+    }
+
+    #undef CHK
+
+    *ssize = ss;
+}
+
 /*----------------------------------------------------------------------------*/
 /* Returns a newly allocated duplicate of given string.                       */
 /*----------------------------------------------------------------------------*/
@@ -735,10 +830,13 @@ static void get_gids( const char *orig_estr, int gids[], int N )
 }
 
 /*----------------------------------------------------------------------------*/
-/* Returns the communication schedule based on a "grouped" butterfly pattern. */
+/* Returns the communication schedule based on a "grouped" pattern: members   */
+/* reduce into their group leader, leaders reduce among themselves with the   */
+/* given pattern, and leaders then send the result back to their members.     */
 /*----------------------------------------------------------------------------*/
-static void compute_grouped_bfly_schedule
+static void compute_grouped_schedule
 (
+    RMScheduleType hpattern,
     int i,
     int N,
     int mx,
@@ -768,16 +866,18 @@ static void compute_grouped_bfly_schedule
         estr = getenv("RM_NODEGROUPS");
     }
 
-    #if 0
-    if(!estr) {compute_butterfly_schedule(i,N,mx,ssize,ids,rs,js,ro,rt); return;}
-
+    if( estr )
+    {
 #if !NODEBUG
-if(dbg>=1){printf("Using grouping info: \"%s\"\n",estr);fflush(stdout);}
+if(dbg>=1){static int x = 0; if(x++==0){printf("Using grouping info: \"%s\"\n",estr);fflush(stdout);}}
 #endif
         get_gids( estr, gids, N );
-
-    #else
-    if(!estr)
+    }
+    else if( rm_gids && rm_ngids == N && !getenv("RM_GROUPSIZE") )
+    {
+        memcpy( gids, rm_gids, N*sizeof(int) );
+    }
+    else
     {
         int gsz=12; /*XXX CUSTOMIZE*/
         static int checkedgstr = 0;
@@ -797,7 +897,6 @@ if(dbg>=1){printf("Using grouping info: \"%s\"\n",estr);fflush(stdout);}
 if(dbg>=1){static int x = 0; if(x++==0){printf("%d: Using grouped bfly w/ grpsz %d\n",i,gsz);fflush(stdout);}}
         {static int x = 0; if(x++==0){LSCFGLD( "RM_GROUPSIZE", (long)gsz, "RM grouped butterfly group size" );}}
     }
-    #endif
 
     assert( 0 < N && N <= MAXN );
     assert( 0 <= i && i < N );
@@ -832,7 +931,7 @@ if(dbg>=1){static int x = 0; if(x++==0){printf("%d: Using grouped bfly w/ grpsz
 	    }
         }
 
-        /* Reduce with other group heads using butterfly schedule */
+        /* Reduce with other group heads using the given schedule */
 	{
 	#define MAXHACTIONS 1000
         int nheads = 0, heads[MAXN], myheadid = -1, hssize = 0;
@@ -849,7 +948,7 @@ if(dbg>=1){static int x = 0; if(x++==0){printf("%d: Using grouped bfly w/ grpsz
 	}
 	assert( 0 < nheads && nheads <= N );
 	assert( 0 <= myheadid && myheadid < nheads );
-        compute_schedule( RM_SCHEDULE_BUTTERFLY, myheadid, nheads,
+        compute_schedule( hpattern, myheadid, nheads,
 	                  MAXHACTIONS, &hssize, hids, hrs, hjs, hro, NULL );
 	#undef MAXHACTIONS
 	for( j = 0; j < hssize; j++ )
@@ -1107,7 +1206,14 @@ int compute_schedule
    case RM_SCHEDULE_BUTTERFLY:
      {compute_butterfly_schedule(i, N, mx, ssize, ids, rs, js, ro); break;}
    case RM_SCHEDULE_GROUPED_BFLY:
-     {compute_grouped_bfly_schedule(i, N, mx, ssize, ids, rs, js, ro);break;}
+   case RM_SCHEDULE_AUTO: /*Not resolved by the user*/
+     {compute_grouped_schedule(RM_SCHEDULE_BUTTERFLY,
+                               i, N, mx, ssize, ids, rs, js, ro); break;}
+   case RM_SCHEDULE_TREE:
+     {compute_tree_schedule(i, N, mx, ssize, ids, rs, js, ro); break;}
+   case RM_SCHEDULE_GROUPED_TREE:
+     {compute_grouped_schedule(RM_SCHEDULE_TREE,
+                               i, N, mx, ssize, ids, rs, js, ro); break;}
    case RM_SCHEDULE_PHASE_BFLY:
      {compute_phase_bfly_schedule(i, N, mx, ssize, ids, rs, js, ro); break;}
    default:
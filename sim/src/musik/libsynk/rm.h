@@ -77,7 +77,10 @@ typedef enum
     RM_SCHEDULE_ALL_TO_ALL,
     RM_SCHEDULE_BUTTERFLY,
     RM_SCHEDULE_GROUPED_BFLY,
-    RM_SCHEDULE_PHASE_BFLY /*Added by Alfred Park <park@cc.gatech.edu> 09Dec02*/
+    RM_SCHEDULE_PHASE_BFLY,/*Added by Alfred Park <park@cc.gatech.edu> 09Dec02*/
+    RM_SCHEDULE_TREE,        /*Binomial tree reduce to 0, then broadcast*/
+    RM_SCHEDULE_GROUPED_TREE,/*Grouped, with a tree among group leaders*/
+    RM_SCHEDULE_AUTO         /*User measures candidates & picks; else GBFLY*/
 } RMScheduleType;
 
 /*----------------------------------------------------------------------------*/
@@ -123,6 +126,19 @@ RMUserHandle rm_register
     RVALUE_CLASS *rv_class /* Class describing the type of reduced values */
 );
 
+/*----------------------------------------------------------------------------*/
+/*  Schedule configured for this user (RM_SCHEDULE), possibly RM_SCHEDULE_AUTO*/
+/*----------------------------------------------------------------------------*/
+RMScheduleType rm_get_schedule( RMUserHandle usr );
+const char *rm_schedule_name( RMScheduleType sched );
+
+/*----------------------------------------------------------------------------*/
+/*  Groups processors for the grouped schedules, e.g., by node: gids[j] is    */
+/*  the leader of j's group, with gids[gids[j]]==gids[j].  RM_NODEGROUPS or   */
+/*  RM_GROUPSIZE in the environment take precedence over these groups.        */
+/*----------------------------------------------------------------------------*/
+void rm_set_groups( const int gids[], int N );
+
 /*----------------------------------------------------------------------------*/
 /*  RM user invokes this after registering for the first time, or to reuse    */
 /*  this handle after a reduction is completed.                               */
@@ -332,7 +332,7 @@ if(dbg>0){printf("myid=%d N=%d\n", myid, N);fflush(stdout);}
     {
 	Transaction *act = &action[i];
         act->usr = rm_register( N, myid, MAXN, &rv_class );
-        rm_init( act->usr, RM_SCHEDULE_GROUPED_BFLY );
+        rm_init( act->usr, rm_get_schedule( act->usr ) ); /*RM_SCHEDULE*/
         act->trans_num = i;
         act->nmsgs = 0;
     }
@@ -393,8 +393,10 @@ if(dbg>3){static int nx=0;if(++nx%100000==0){printf("%d: nx=%d\n",myid,nx);fflus
 #if !NODEBUG
 if(dbg>1){printf("%d: TRANSACTION %ld  MIN= ",myid, trans); rv_print(stdout,&min_val);printf("\n"); fflush(stdout);}
 #endif
+		MYASSERT( fabs( min_val.val - 5.0*N*(N+1) ) < 1e-6,
+		          ("%d: sum %f != %f", myid, min_val.val, 5.0*N*(N+1)) );
 		{
-		    rm_init(act->usr, RM_SCHEDULE_GROUPED_BFLY);
+		    rm_init(act->usr, rm_get_schedule( act->usr ));
 		    act->trans_num += 2;
 		    act->nmsgs = 0;
 		}
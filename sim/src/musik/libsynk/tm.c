@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
 
 #include "mycompat.h"
 #include "fm.h"
@@ -26,6 +27,15 @@ typedef struct
     TM_TimeQual rep_qual;    /*What min qual this PE supplied most recently?*/
 
     TM_LBTSStartedProc sproc;/*Callback for getting this PE's snap shot value*/
+    TM_QuietProc qproc;      /*Callback for this PE's quiescence vote, if any*/
+    int quiescent;           /*Has a reduction found every PE quiet?*/
+
+    int nctrs;               /*Number of application counters registered*/
+    TM_CounterOp ctrops[TM_MAXCOUNTERS];/*Reduction op of each counter*/
+    TM_CountersProc cproc;   /*Callback for this PE's counter values, if any*/
+    long ctrtot[TM_MAXCOUNTERS];/*Most recent exact global totals*/
+    TM_Time ctrcut;          /*Cut as of which ctrtot holds*/
+    long nctrtot;            /*#times exact totals were found so far*/
 
     TM_LBTSDoneProc *dproc;  /*List of callbacks waiting for new LBTS value*/
     int max_dproc;           /*Limit on #callbacks that can wait for new LBTS*/
@@ -36,6 +46,7 @@ typedef struct
 typedef struct
 {
     long nlbts;             /*Total number of LBTS computations so far*/
+    long nstalls;           /*#skipped modules started due to a stall*/
     TIMER_TYPE start;       /*When did TM_Init() end?*/
 } TMStatistics;
 
@@ -47,6 +58,11 @@ typedef struct _TMModuleStateStruct
     int inited;             /*Has this module been initialized?*/
     int finied;             /*Has this module been finalied?*/
     long nwins;             /*#times this module advanced time before others*/
+    long period;            /*Start locally every period-th LBTS only; 0=all*/
+    long nstarts;           /*#LBTS computations requested of this module*/
+    long nskips;            /*#requests not passed on due to period*/
+    int skipped;            /*Was the pending LBTS request not passed on?*/
+    long startepoch;        /*LBTS epoch this module last started on*/
     struct _TMModuleStateStruct* next; /*Next in linked list of modules*/
 } TMModuleState;
 
@@ -68,6 +84,8 @@ typedef struct
     TMLBTSInfo lbts;        /*How LBTS values must be acquired/stored/reported*/
     TMModuleList modlist;   /*List of TM sub-modules*/
     TMStatistics stats;     /*Self-explanatory*/
+    long stall_ticks;       /*Ticks after which skipped modules are started*/
+    long waited_ticks;      /*Ticks so far spent waiting on the pending LBTS*/
 } TMState;
 
 /*----------------------------------------------------------------------------*/
@@ -102,6 +120,11 @@ void TM_AddModule( TMModule *mod )
         lmod->inited = FALSE;
         lmod->finied = FALSE;
         lmod->nwins = 0;
+        lmod->period = 0;
+        lmod->nstarts = 0;
+        lmod->nskips = 0;
+        lmod->skipped = FALSE;
+        lmod->startepoch = -1;
         lmod->next = 0;
         if( i > 0 ) (lmod-1)->next = lmod;
     }
@@ -163,6 +186,7 @@ if(st->debug>1){fprintf(tmfp,"** WIN **\n");}
         }
         lbts->n_dproc = 0;
         lbts->epoch_id++;
+        st->waited_ticks = 0;
     }
 #if !NODEBUG
 if(st->debug>3){TM_PrintState();}
@@ -175,6 +199,14 @@ static long TM_LBTSStarted( long epoch_id, TM_Time *min_ts,
 {
     long sproc_flag = TM_ACCEPT;
 
+    /*The active module is now computing the pending LBTS, if it was not*/
+    if( modlist->activemod >= 0 )
+    {
+        TMModuleState *amod = &modlist->mods[modlist->activemod];
+        amod->skipped = FALSE;
+        amod->startepoch = lbts->epoch_id;
+    }
+
     if( lbts->n_dproc > 0 )
     {
         *min_ts = lbts->rep_ts;
@@ -190,6 +222,16 @@ static long TM_LBTSStarted( long epoch_id, TM_Time *min_ts,
 
         lbts->rep_ts = *min_ts;
         lbts->rep_qual = *qual;
+
+        /*Other modules have not been asked; TM_Tick() brings them in on stall*/
+        if( sproc_flag != TM_DEFER && lbts->n_dproc > 0 )
+        {
+            TMModuleState *mod = modlist->mods;
+            for( ; mod; mod = mod->next )
+            {
+                if( mod->index != modlist->activemod ) mod->skipped = TRUE;
+            }
+        }
     }
 
 #if !NODEBUG
@@ -251,6 +293,12 @@ if(st->debug>1){fprintf(tmfp,"TM_DEBUG=%d\n",st->debug);}
     lbts->qual           = TM_TIME_QUAL_INCL;
     lbts->epoch_id       = 0;
     lbts->sproc          = 0;
+    lbts->qproc          = 0;
+    lbts->quiescent      = FALSE;
+    lbts->nctrs          = 0;
+    lbts->cproc          = 0;
+    lbts->ctrcut         = TM_ZERO;
+    lbts->nctrtot        = 0;
     lbts->max_dproc      = 1000;
     lbts->n_dproc        = 0;
     lbts->dproc          = (TM_LBTSDoneProc *)malloc(
@@ -261,7 +309,11 @@ if(st->debug>1){fprintf(tmfp,"TM_DEBUG=%d\n",st->debug);}
     modlist->activemod   = -1;
     modlist->mods        = 0;
 
+    st->stall_ticks      = 0;
+    st->waited_ticks     = 0;
+
     stats->nlbts         = 0;
+    stats->nstalls       = 0;
 
     TM_TopoInit();
 
@@ -272,10 +324,27 @@ if(st->debug>1){fprintf(tmfp,"TM_DEBUG=%d\n",st->debug);}
     if(FALSE || getenv("TM_DONULL"))/*Add TM-Null only on explicit request?*/
      if(!getenv("TM_NONULL")){void TMMNull_AddModule(void);TMMNull_AddModule();}
 
+    if(getenv("TM_DOHOR"))/*Event-horizon module only on explicit request*/
+     {void TMMHor_AddModule(void); TMMHor_AddModule();}
+
+    /*With null messages present, the global reduction can run less often*/
+    if(!getenv("TM_NORED") && modlist->nmods > 1)
+    {
+     char *pstr = getenv("TM_REDPERIOD"), *sstr = getenv("TM_REDSTALL");
+     modlist->mods[0].period = pstr ? atol(pstr) : 0;
+     st->stall_ticks = sstr ? atol(sstr) : 1000;
+     LSCFGLD( "TM_REDPERIOD", modlist->mods[0].period,
+              "Hybrid TM starts RED every this many LBTS (0=always)" );
+     LSCFGLD( "TM_REDSTALL", st->stall_ticks,
+              "Hybrid TM starts RED anyway after LBTS waits this many ticks" );
+    }
+
      LSCFGST( "TM_NORED", (getenv("TM_NORED")?"TRUE":"FALSE"),
               "TM should not use RED?" );
      LSCFGST( "TM_NONULL", (getenv("TM_NONULL")?"TRUE":"FALSE"),
               "TM should not use NULL?" );
+     LSCFGST( "TM_DOHOR", (getenv("TM_DOHOR")?"TRUE":"FALSE"),
+              "TM should use event-horizon cycles?" );
     }
 
     FML_Barrier();
@@ -334,6 +403,103 @@ void TM_Recent_Qual( TM_TimeQual *pq )
     if( pq ) *pq = lbts->qual;
 }
 
+/*----------------------------------------------------------------------------*/
+void TM_SetQuietProc( TM_QuietProc quiet_proc )
+{
+    lbts->qproc = quiet_proc;
+}
+
+/*----------------------------------------------------------------------------*/
+int TM_Quiescent( void )
+{
+    return lbts->quiescent;
+}
+
+/*----------------------------------------------------------------------------*/
+int TM_QuietVote( TM_Time cut )
+{
+    return lbts->qproc ? lbts->qproc( cut ) : FALSE;
+}
+
+/*----------------------------------------------------------------------------*/
+void TM_SetQuiescent( void )
+{
+#if !NODEBUG
+if(st->debug>0 && !lbts->quiescent){fprintf(tmfp,"TM_SetQuiescent() epoch=%ld\n",lbts->epoch_id);fflush(tmfp);}
+#endif
+    lbts->quiescent = TRUE;
+}
+
+/*----------------------------------------------------------------------------*/
+int TM_AddCounter( TM_CounterOp op )
+{
+    MYASSERT( lbts->nctrs < TM_MAXCOUNTERS, ("Max %d counters",TM_MAXCOUNTERS) );
+    lbts->ctrops[lbts->nctrs] = op;
+    return lbts->nctrs++;
+}
+
+/*----------------------------------------------------------------------------*/
+void TM_SetCountersProc( TM_CountersProc counters_proc )
+{
+    lbts->cproc = counters_proc;
+}
+
+/*----------------------------------------------------------------------------*/
+long TM_Recent_Counters( long *vals, TM_Time *pcut )
+{
+    if( vals ) memcpy( vals, lbts->ctrtot, lbts->nctrs*sizeof(long) );
+    if( pcut ) *pcut = lbts->ctrcut;
+    return lbts->nctrtot;
+}
+
+/*----------------------------------------------------------------------------*/
+int TM_NumCounters( const TM_CounterOp **ops )
+{
+    if( ops ) *ops = lbts->ctrops;
+    return lbts->nctrs;
+}
+
+/*----------------------------------------------------------------------------*/
+void TM_CounterInit( long *vals )
+{
+    int i = 0;
+    for( i = 0; i < lbts->nctrs; i++ )
+    {
+        vals[i] = lbts->ctrops[i] == TM_COUNTER_MIN ? LONG_MAX :
+                  lbts->ctrops[i] == TM_COUNTER_MAX ? LONG_MIN : 0;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+void TM_CounterReduce( long *a, const long *b )
+{
+    int i = 0;
+    for( i = 0; i < lbts->nctrs; i++ )
+    {
+        switch( lbts->ctrops[i] )
+        {
+            case TM_COUNTER_MIN: if( b[i] < a[i] ) a[i] = b[i]; break;
+            case TM_COUNTER_MAX: if( b[i] > a[i] ) a[i] = b[i]; break;
+            default: a[i] += b[i]; break;
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+int TM_CounterValues( TM_Time cut, long *vals )
+{
+    TM_CounterInit( vals );
+    return lbts->nctrs <= 0 || (lbts->cproc && lbts->cproc( cut, vals ));
+}
+
+/*----------------------------------------------------------------------------*/
+void TM_SetCounterTotals( TM_Time cut, const long *vals )
+{
+    memcpy( lbts->ctrtot, vals, lbts->nctrs*sizeof(long) );
+    lbts->ctrcut = cut;
+    lbts->nctrtot++;
+}
+
 /*----------------------------------------------------------------------------*/
 long TM_StartLBTS( TM_Time min_ts, TM_TimeQual qual,
                    TM_LBTSDoneProc done_proc, long *ptrans )
@@ -347,13 +513,34 @@ if(st->debug>0){fprintf(tmfp,"TM_StartLBTS(min_ts=%s,qual=%s,dproc=%p,trans=%ld)
     lbts->rep_ts = min_ts;
     lbts->rep_qual = qual;
 
+    /*Once stopping, a late module may already have won with the final LBTS*/
+    /*after every callback was served; don't start collectives others left*/
+    if( TM_TopoGetNoForwarding() && (TM_GT(lbts->LBTS, min_ts) ||
+        (TM_EQ(lbts->LBTS, min_ts) && lbts->qual >= qual)) )
+    {
+        *ptrans = lbts->epoch_id;
+        done_proc( lbts->LBTS, lbts->qual, lbts->epoch_id );
+        return TM_SUCCESS;
+    }
+
     TM_AddDoneProc( done_proc );
     *ptrans = lbts->epoch_id;
 
     while( mod )
     {
         if(!mod->inited)TM_InitMod( mod );
-        mod->cl.startlbts(mod->cl.closure, min_ts, qual, &TM_LBTSDone, NULL);
+        if( mod->period > 1 && (mod->nstarts++ % mod->period) != 0 )
+        {
+            /*Others advance time meanwhile; see TM_Tick() for stalls*/
+            mod->skipped = TRUE;
+            mod->nskips++;
+        }
+        else
+        {
+            mod->skipped = FALSE;
+            mod->startepoch = lbts->epoch_id;
+            mod->cl.startlbts(mod->cl.closure, min_ts, qual, &TM_LBTSDone,NULL);
+        }
         mod = mod->next;
     }
 
@@ -411,7 +598,9 @@ if(st->debug>1){fprintf(tmfp,"TM_In(ts=%f,tag=%ld)\n",TM_TS(ts),(*((long*)&tag))
     {
         int tagsz = 0;
         if(!mod->inited)TM_InitMod( mod );
+        modlist->activemod = mod->index; /*In() may start an LBTS remotely*/
         mod->cl.in(mod->cl.closure, ts, ((char*)&tag)+nbytes, &tagsz);
+        modlist->activemod = -1;
         nbytes += tagsz;
         mod = mod->next;
     }
@@ -427,6 +616,9 @@ void TM_PrintStats( void )
         if(!mod->inited)TM_InitMod( mod );
         mod->cl.printstats(mod->cl.closure);
         fprintf(tmfp,"%d: NWINS= %ld TOT= %ld\n", st->myid,mod->nwins,lbts->epoch_id);
+        if( mod->period > 1 )
+        fprintf(tmfp,"%d: PERIOD= %ld SKIPS= %ld STALLS= %ld\n", st->myid,
+                mod->period, mod->nskips, stats->nstalls);
         mod = mod->next;
     }
 }
@@ -467,6 +659,33 @@ void TM_Tick( void )
 
     MYASSERT( modlist->nmods > 0, ("At least one TM module required") );
 
+    /*Pending LBTS not delivered for a while; bring in the skipped modules*/
+    if( lbts->n_dproc > 0 && st->stall_ticks > 0 &&
+        ++st->waited_ticks >= st->stall_ticks )
+    {
+        TMModuleState *smod = modlist->mods;
+        st->waited_ticks = 0;
+        while( smod )
+        {
+            if( smod->skipped && smod->startepoch == lbts->epoch_id )
+            {
+                smod->skipped = FALSE; /*Already computing this LBTS*/
+            }
+            else if( smod->skipped )
+            {
+#if !NODEBUG
+if(st->debug>1){fprintf(tmfp,"TM_Tick() stalled; starting module %d\n",smod->index);}
+#endif
+                smod->skipped = FALSE;
+                smod->startepoch = lbts->epoch_id;
+                stats->nstalls++;
+                smod->cl.startlbts(smod->cl.closure, lbts->rep_ts,
+                                   lbts->rep_qual, &TM_LBTSDone, NULL);
+            }
+            smod = smod->next;
+        }
+    }
+
     while( mod )
     {
         modlist->activemod = mod->index;
@@ -485,6 +704,7 @@ void TM_Tick( void )
 typedef struct
 {
     int all2all;        /*Is it an all-to-all topology?*/
+    int noforwarding;   /*Incoming events can no longer cause outgoing ones?*/
 
     /*Minimum among lookaheads to all receivers*/
     TM_Time min_external_la;
@@ -702,8 +922,12 @@ int TM_TopoGetReceiver( int i )
     { return topo->all2all ? (i < st->myid ? i : i+1) : topo->recvr[i].pe; }
 /*----------------------------------------------------------------------------*/
 void TM_TopoSetMinExternalLA( TM_Time t )
-    { topo->min_external_la = TM_Min(topo->min_external_la, t);
-fprintf(tmfp,"TM_TopoSetMinExternalLA() min_external_la = %lf\n",TM_TS(topo->min_external_la));}
+{
+    topo->min_external_la = TM_Min(topo->min_external_la, t);
+#if !NODEBUG
+if(st->debug>1){fprintf(tmfp,"TM_TopoSetMinExternalLA() min_external_la = %lf\n",TM_TS(topo->min_external_la));}
+#endif
+}
 /*----------------------------------------------------------------------------*/
 TM_Time TM_TopoGetMinExternalLA( void )
     { return topo->min_external_la; }
@@ -746,12 +970,28 @@ void TM_TopoSetInternalLA( int spe, int rpe, TM_Time la )
 #endif /*INTERNALLA*/
 }
 
+/*----------------------------------------------------------------------------*/
+void TM_TopoSetNoForwarding( void )
+{
+    topo->noforwarding = TRUE;
+}
+
+/*----------------------------------------------------------------------------*/
+int TM_TopoGetNoForwarding( void )
+{
+    return topo->noforwarding;
+}
+
 /*----------------------------------------------------------------------------*/
 int TM_TopoGetInternalLA( int spe, int rpe, TM_Time *la )
 {
     int returned = 0;
     
-    if( topo->all2all )
+    if( topo->noforwarding && spe != st->myid )
+    {
+        returned = 0;
+    }
+    else if( topo->all2all )
     {
         *la = TM_ZERO;
         returned = 1;
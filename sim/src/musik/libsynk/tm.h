@@ -135,6 +135,19 @@ typedef void (*TM_LBTSDoneProc)(TM_Time, TM_TimeQual, long);
 typedef long (*TM_LBTSStartedProc)(long, TM_Time *, TM_TimeQual *,
                                    TM_LBTSDoneProc *);
 
+/*----------------------------------------------------------------------------*/
+/* Function giving this PE's quiescence vote, given a cut common to all PEs:  */
+/* non-zero if nothing more of interest can happen here at or beyond the cut  */
+typedef int (*TM_QuietProc)(TM_Time);
+
+/*----------------------------------------------------------------------------*/
+/* Application counters reduced along with LBTS; see TM_AddCounter()          */
+#define TM_MAXCOUNTERS 8 /*CUSTOMIZE*/
+typedef enum { TM_COUNTER_SUM, TM_COUNTER_MIN, TM_COUNTER_MAX } TM_CounterOp;
+/* Function filling in this PE's counter values as of a cut common to all PEs;*/
+/* returns zero if they are not (yet) exactly as of the cut                   */
+typedef int (*TM_CountersProc)(TM_Time, long *);
+
 /*----------------------------------------------------------------------------*/
 /* Type of tag added to messages */
 typedef struct { long tags[4/*CUSTOMIZE*/]; } TM_TagType;
@@ -151,6 +164,11 @@ void TM_SetLBTSStartProc(TM_LBTSStartedProc);
 long TM_CurrentEpoch(void);
 void TM_Recent_LBTS(TM_Time *);
 void TM_Recent_Qual(TM_TimeQual *);
+void TM_SetQuietProc(TM_QuietProc);/*Votes ride on the global reductions*/
+int TM_Quiescent(void);/*Did all PEs vote quiet in a completed reduction?*/
+int TM_AddCounter(TM_CounterOp);/*Same order on all PEs; returns its index*/
+void TM_SetCountersProc(TM_CountersProc);
+long TM_Recent_Counters(long *, TM_Time *);/*Latest exact totals, their cut*/
 long TM_StartLBTS(TM_Time, TM_TimeQual, TM_LBTSDoneProc, long *);
 void TM_PutTag(TM_TagType *);
 void TM_Out(TM_Time, long );
@@ -191,6 +209,13 @@ TM_Time TM_TopoGetReceiverLAByPE(int rpe);/*Get the receiver pe's lookahead*/
 /*----------------------------------------------------------------------------*/
 void TM_TopoSetInternalLA( int spe, int rpe, TM_Time la );
 int TM_TopoGetInternalLA( int spe, int rpe, TM_Time *la );
+/*----------------------------------------------------------------------------*/
+/* Declares that this PE will never again send a TSO message as a result of   */
+/* one it receives (e.g., once it stops executing events), so that no (spe->  */
+/* rpe) pair other than spe==thisPE constrains its guarantees any more.       */
+/*----------------------------------------------------------------------------*/
+void TM_TopoSetNoForwarding( void );
+int TM_TopoGetNoForwarding( void );/*Has TM_TopoSetNoForwarding() been called?*/
 
 /*----------------------------------------------------------------------------*/
 /* TM module functions                                                        */
@@ -229,6 +254,13 @@ typedef struct _TMModuleStruct
 } TMModule;
 /*----------------------------------------------------------------------------*/
 void TM_AddModule( TMModule *mod );
+int TM_QuietVote( TM_Time cut );/*This PE's vote; for modules that reduce*/
+void TM_SetQuiescent( void );/*Module found all PEs quiet*/
+int TM_NumCounters( const TM_CounterOp **ops );/*Registered counters*/
+int TM_CounterValues( TM_Time cut, long *vals );/*This PE's; TRUE if exact*/
+void TM_CounterInit( long *vals );/*Identity of each counter's op*/
+void TM_CounterReduce( long *a, const long *b );/*a = a op b*/
+void TM_SetCounterTotals( TM_Time cut, const long *vals );/*All PEs' exact*/
 
 /*----------------------------------------------------------------------------*/
 #endif /*__TM_KIT_H*/
@@ -0,0 +1,428 @@
+/*----------------------------------------------------------------------------*/
+/* An event-horizon TM ala Breathing Time Buckets.                            */
+/*                                                                            */
+/* Every cycle is one global reduction of each PE's guarantee together with   */
+/* the event horizon: the least timestamp among the TSO messages it sent that */
+/* are not yet known to have been received.  Unlike TMRed, a cycle never has  */
+/* to be retried while messages are in transit; their timestamps simply bound */
+/* the new LBTS.  Messages are colored with the sender's cycle number, so a   */
+/* cycle whose sent/received counts of older colors match globally retires    */
+/* all the horizon that was accumulated before it.                            */
+/*----------------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#include "mycompat.h"
+#include "fm.h"
+#include "tm.h"
+
+/*----------------------------------------------------------------------------*/
+extern FILE *tmfp;
+
+#if MPI_AVAILABLE
+#include <mpi.h>
+
+/*----------------------------------------------------------------------------*/
+typedef struct
+{
+    double ts, tie;     /*Least of guarantee and horizon*/
+    long qual;          /*Timestamp qualification*/
+    long nsent, nrecd;  /*Messages of colors older than this cycle*/
+} HorValue;
+
+/*----------------------------------------------------------------------------*/
+typedef struct
+{
+    long ID;                /*#cycles (snapshots) taken; color of new sends*/
+    int active;             /*Is a cycle's reduction in flight?*/
+    TM_Time LBTS;           /*Most recently known value*/
+    TM_TimeQual qual;       /*Qualification of recent LBTS; see TM_TimeQual*/
+    TM_LBTSStartedProc sproc;/*Callback to get this PE's current guarantee*/
+    TM_LBTSDoneProc *dproc; /*List of callbacks waiting for new LBTS value*/
+    int max_dproc;          /*Limit on #callbacks that can wait for new LBTS*/
+    int n_dproc;            /*Actual #callbacks waiting for new LBTS*/
+} CycleInfo;
+
+/*----------------------------------------------------------------------------*/
+typedef struct
+{
+    long nsent;             /*Sent so far (all colors <= ID)*/
+    long nrecd;             /*Received so far with colors <= ID*/
+    long nrecd_ahead;       /*Received so far with color ID+1*/
+    TM_Time pending;        /*Horizon of sends up to the last snapshot*/
+    TM_Time current;        /*Horizon of sends since the last snapshot*/
+} Horizon;
+
+/*----------------------------------------------------------------------------*/
+typedef struct
+{
+    TIMER_TYPE start;       /*When did TMMHor_Init() end?*/
+    long nclosed;           /*#cycles that retired all older horizon*/
+    long nremote;           /*#cycles joined on seeing a newer color*/
+    unsigned long ntests;   /*#times an in-flight reduction was tested*/
+} Statistics;
+
+/*----------------------------------------------------------------------------*/
+typedef struct
+{
+    int debug;              /*Debugging level*/
+    int myid;               /*My processor ID*/
+    int N;                  /*Total number of processors*/
+    CycleInfo cyc;          /*How LBTS values must be acquired/stored/reported*/
+    Horizon hor;            /*Event horizon and colored message counts*/
+    Statistics stats;       /*Self-explanatory*/
+    MPI_Datatype type;      /*Matches HorValue*/
+    MPI_Op op;              /*Reduces HorValue*/
+    MPI_Request req;        /*In-flight reduction, if any*/
+    MPI_Comm comm;          /*Private, so other modules' collectives can't mix*/
+    HorValue in, out;
+} TMState;
+
+/*----------------------------------------------------------------------------*/
+static TMState tm_state, *st;
+static CycleInfo *cyc;
+static Horizon *hor;
+static Statistics *stats;
+
+/*----------------------------------------------------------------------------*/
+static void TMMHor_ReduceOp( void *invec, void *inoutvec, int *len,
+                             MPI_Datatype *dtype )
+{
+    HorValue *in = (HorValue *)invec, *inout = (HorValue *)inoutvec;
+    int i = 0;
+    for( i = 0; i < *len; i++ )
+    {
+        if( in[i].ts < inout[i].ts ||
+            (in[i].ts == inout[i].ts && in[i].tie < inout[i].tie) ||
+            (in[i].ts == inout[i].ts && in[i].tie == inout[i].tie &&
+             in[i].qual < inout[i].qual) )
+        {
+            inout[i].ts = in[i].ts;
+            inout[i].tie = in[i].tie;
+            inout[i].qual = in[i].qual;
+        }
+        inout[i].nsent += in[i].nsent;
+        inout[i].nrecd += in[i].nrecd;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static void TMMHor_Init(TMM_Closure closure, TMM_LBTSStartedProc sproc)
+{
+    char *dbgstr = getenv("TMHOR_DEBUG");     /* Integer [0,inf] */
+    int blens[2] = { 2, 3 };
+    MPI_Aint disps[2] = { offsetof(HorValue,ts), offsetof(HorValue,qual) };
+    MPI_Datatype types[2] = { MPI_DOUBLE, MPI_LONG }, t = MPI_DATATYPE_NULL;
+
+    MYASSERT( closure == &tm_state, ("Closures should match") );
+
+    st = &tm_state;
+    cyc = &st->cyc;
+    hor = &st->hor;
+    stats = &st->stats;
+
+    st->debug            = dbgstr?atoi(dbgstr):0;
+    st->myid             = (int) FM_nodeid;
+    st->N                = (int) FM_numnodes;
+
+    LSCFGLD( "TMHOR_DEBUG", (long)st->debug, "TMHOR debug intensity" );
+
+    cyc->ID              = 0;
+    cyc->active          = FALSE;
+    cyc->LBTS            = TM_ZERO;
+    cyc->qual            = TM_TIME_QUAL_INCL;
+    cyc->sproc           = sproc;
+    cyc->max_dproc       = 1000;
+    cyc->n_dproc         = 0;
+    cyc->dproc           = (TM_LBTSDoneProc *)malloc(
+                           sizeof(TM_LBTSDoneProc)*cyc->max_dproc);
+
+    hor->nsent           = 0;
+    hor->nrecd           = 0;
+    hor->nrecd_ahead     = 0;
+    hor->pending         = TM_IDENT;
+    hor->current         = TM_IDENT;
+
+    stats->nclosed       = 0;
+    stats->nremote       = 0;
+    stats->ntests        = 0;
+
+    MPI_Type_create_struct( 2, blens, disps, types, &t );
+    MPI_Type_create_resized( t, 0, sizeof(HorValue), &st->type );
+    MPI_Type_free( &t );
+    MPI_Type_commit( &st->type );
+    MPI_Op_create( TMMHor_ReduceOp, TRUE, &st->op );
+    st->req = MPI_REQUEST_NULL;
+    MPI_Comm_dup( MPI_COMM_WORLD, &st->comm );
+
+    FML_Barrier();
+
+#if !NODEBUG
+if(st->debug>=1){fprintf(tmfp,"%d: TMHor initialized.\n",st->myid);fflush(tmfp);}
+#endif
+    TIMER_NOW(stats->start);
+}
+
+/*----------------------------------------------------------------------------*/
+static void TMMHor_Fini(TMM_Closure closure)
+{
+    if( st->req != MPI_REQUEST_NULL )
+    {
+        MPI_Wait( &st->req, MPI_STATUS_IGNORE );
+    }
+    MPI_Op_free( &st->op );
+    MPI_Type_free( &st->type );
+    MPI_Comm_free( &st->comm );
+}
+
+/*----------------------------------------------------------------------------*/
+static long TMMHor_CurrentEpoch( TMM_Closure closure ) { return cyc->ID; }
+/*----------------------------------------------------------------------------*/
+static void TMMHor_Recent_LBTS( TMM_Closure closure, TM_Time *pts )
+    { if( pts ) *pts = cyc->LBTS; }
+
+/*----------------------------------------------------------------------------*/
+/* Takes this PE's snapshot for the next cycle and posts its reduction.       */
+/*----------------------------------------------------------------------------*/
+static void TMMHor_StartCycle( TM_Time min_ts, TM_TimeQual qual )
+{
+    int retcode = 0;
+
+    MYASSERT( !cyc->active, ("One cycle at a time") );
+    MYASSERT( cyc->n_dproc <= 0, ("%d",cyc->n_dproc) );
+
+    /*Sends so far all have colors older than the new cycle*/
+    hor->pending = TM_Min( hor->pending, hor->current );
+    hor->current = TM_IDENT;
+
+    st->in.ts = TM_TS(min_ts);
+    st->in.tie = min_ts.tie;
+    st->in.qual = qual;
+    if( TM_LT(hor->pending, min_ts) ||
+        (TM_EQ(hor->pending, min_ts) && TM_TIME_QUAL_INCL < qual) )
+    {
+        st->in.ts = TM_TS(hor->pending);
+        st->in.tie = hor->pending.tie;
+        st->in.qual = TM_TIME_QUAL_INCL;
+    }
+    st->in.nsent = hor->nsent;
+    st->in.nrecd = hor->nrecd;
+
+    /*Messages of the new cycle's color seen early now count as older ones*/
+    ++cyc->ID;
+    hor->nrecd += hor->nrecd_ahead;
+    hor->nrecd_ahead = 0;
+    cyc->active = TRUE;
+
+#if !NODEBUG
+if(st->debug>1){fprintf(tmfp,"TMMHor_StartCycle(%ld, min_ts=%f, horizon=%f, nsent=%ld, nrecd=%ld)\n",cyc->ID,TM_TS(min_ts),TM_TS(hor->pending),st->in.nsent,st->in.nrecd);fflush(tmfp);}
+#endif
+
+    FM_flush(); /*Peers may be waiting on staged messages before joining*/
+    retcode = MPI_Iallreduce( &st->in, &st->out, 1, st->type, st->op,
+                              st->comm, &st->req );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Iallreduce") );
+}
+
+/*----------------------------------------------------------------------------*/
+static void TMMHor_AddDoneProc( TM_LBTSDoneProc done_proc )
+{
+    if( done_proc )
+    {
+        MYASSERT( cyc->n_dproc < cyc->max_dproc, ("!") );
+        cyc->dproc[cyc->n_dproc++] = done_proc;
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static long TMMHor_StartLBTS( TMM_Closure closure,
+                TM_Time min_ts, TM_TimeQual qual,
+                TM_LBTSDoneProc done_proc, long *ptrans )
+{
+#if !NODEBUG
+if(st->debug>1){fprintf(tmfp,"TMMHor_StartLBTS(%lf,%s).\n",TM_TS(min_ts),TM_TIME_QUAL_STR(qual));fflush(tmfp);}
+#endif
+
+    if( !cyc->active ) TMMHor_StartCycle( min_ts, qual );
+    TMMHor_AddDoneProc( done_proc );
+    if( ptrans ) *ptrans = cyc->ID;
+
+    return TM_SUCCESS;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Joins the cycle that a peer has evidently begun.                           */
+/*----------------------------------------------------------------------------*/
+static void TMMHor_RemoteStart( void )
+{
+    TM_Time min_ts = TM_ZERO;
+    TM_TimeQual qual = TM_TIME_QUAL_INCL;
+    TM_LBTSDoneProc dproc = 0;
+    long sproc_flag;
+
+#if !NODEBUG
+if(st->debug>1){fprintf(tmfp,"** Starting remotely initiated cycle %ld\n",cyc->ID+1);fflush(tmfp);}
+#endif
+
+    MYASSERT( cyc->sproc, ("!") );
+    sproc_flag = cyc->sproc( cyc->ID, &min_ts, &qual, &dproc );
+    if( sproc_flag == TM_DEFER ) { min_ts = cyc->LBTS; qual = cyc->qual; }
+    TMMHor_StartCycle( min_ts, qual );
+    TMMHor_AddDoneProc( dproc );
+    stats->nremote++;
+}
+
+/*----------------------------------------------------------------------------*/
+static void TMMHor_PutTag( TMM_Closure closure, char *ptag, int *nbytes )
+{
+    *((long *)ptag) = cyc->ID;
+    *nbytes = sizeof(cyc->ID);
+}
+
+/*----------------------------------------------------------------------------*/
+static void TMMHor_Out( TMM_Closure closure, TM_Time ts, long nevents )
+{
+    hor->nsent += nevents;
+    hor->current = TM_Min( hor->current, ts );
+}
+
+/*----------------------------------------------------------------------------*/
+static void TMMHor_In(TMM_Closure closure,TM_Time ts,char *ptag,int *nbytes)
+{
+    long color = *((long *)ptag);
+    *nbytes = sizeof(color);
+
+    MYASSERT( color <= cyc->ID+1, ("Color %ld in cycle %ld",color,cyc->ID) );
+
+    if( color <= cyc->ID )
+    {
+        ++hor->nrecd;
+    }
+    else
+    {
+        /*Sender already took the next snapshot; so must this PE, soon*/
+        ++hor->nrecd_ahead;
+        if( !cyc->active ) TMMHor_RemoteStart();
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+static void TMMHor_Tick( TMM_Closure closure )
+{
+    int done = FALSE, retcode = 0, c = 0;
+    TM_Time new_lbts;
+    TM_TimeQual new_qual;
+
+    if( !cyc->active ) return;
+
+    stats->ntests++;
+    retcode = MPI_Test( &st->req, &done, MPI_STATUS_IGNORE );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Test Iallreduce") );
+    if( !done ) return;
+
+    cyc->active = FALSE;
+    new_lbts.ts = st->out.ts;
+    new_lbts.tie = st->out.tie;
+    new_qual = (TM_TimeQual)st->out.qual;
+
+    if( st->out.nsent == st->out.nrecd )
+    {
+        /*Every message of an older color has been received by its snapshot*/
+        hor->pending = TM_IDENT;
+        stats->nclosed++;
+    }
+
+#if !NODEBUG
+if(st->debug>0){fprintf(tmfp,"TMMHor: cycle %ld done LBTS=%f (%s) nsent=%ld nrecd=%ld\n",cyc->ID,TM_TS(new_lbts),TM_TIME_QUAL_STR(new_qual),st->out.nsent,st->out.nrecd);fflush(tmfp);}
+#endif
+
+    MYASSERT( TM_LE(cyc->LBTS, new_lbts),
+              ("LBTS %lf must not decrease to %lf",
+               TM_TS(cyc->LBTS),TM_TS(new_lbts)) );
+    cyc->LBTS = new_lbts;
+    cyc->qual = new_qual;
+
+    for( c = 0; c < cyc->n_dproc; c++ )
+    {
+        cyc->dproc[c]( cyc->LBTS, cyc->qual, cyc->ID );
+    }
+    cyc->n_dproc = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+static void TMMHor_NotifyNewLBTS(TMM_Closure closure, TM_Time ts,TM_TimeQual q)
+{
+    /*Other modules' values cannot retire any of the horizon*/
+}
+
+/*----------------------------------------------------------------------------*/
+static void TMMHor_PrintStats( TMM_Closure closure )
+{
+    TIMER_TYPE stop;
+    double secs;
+
+    TIMER_NOW(stop);
+    secs = TIMER_DIFF(stop, stats->start);
+
+    fprintf(tmfp,"%d: TMMHOR-Stastics\n",st->myid);
+    fprintf(tmfp,"%d: ---------------------------\n",st->myid);
+    fprintf(tmfp,"%d: NCycles=             %ld\n",st->myid, cyc->ID);
+    fprintf(tmfp,"%d: Closed-cycles=       %ld\n",st->myid, stats->nclosed);
+    fprintf(tmfp,"%d: Remote-joins=        %ld\n",st->myid, stats->nremote);
+    fprintf(tmfp,"%d: Tests=               %lu\n",st->myid, stats->ntests);
+    fprintf(tmfp,"%d: Time-per-cycle=      %16.8f microsecs\n",st->myid,
+            (cyc->ID>0 ? secs/cyc->ID*1e6 : 0.0));
+    fprintf(tmfp,"%d: ---------------------------\n",st->myid);
+}
+
+/*----------------------------------------------------------------------------*/
+static void TMMHor_PrintState( TMM_Closure closure )
+{
+    int i = 0;
+
+    fprintf(tmfp,"------------  TMMHOR STATE START ------------\n");
+    fprintf(tmfp,"myid=%d, N=%d\n", st->myid, st->N);
+    fprintf(tmfp,"Cycle={ID=%ld active=%d LBTS=%f (%s) n_dproc=%d, dproc=[",
+            cyc->ID, cyc->active, TM_TS(cyc->LBTS),
+            TM_TIME_QUAL_STR(cyc->qual), cyc->n_dproc);
+    for(i=0; i<cyc->n_dproc; i++) fprintf(tmfp,"%s%p", (i>0?",":"!"),cyc->dproc[i]);
+    fprintf(tmfp,"]}\n");
+    fprintf(tmfp,"Horizon={nsent=%ld nrecd=%ld nrecd_ahead=%ld pending=%f "
+            "current=%f}\n", hor->nsent, hor->nrecd, hor->nrecd_ahead,
+            TM_TS(hor->pending), TM_TS(hor->current));
+    fprintf(tmfp,"------------  TMMHOR STATE END ------------\n");
+}
+
+/*----------------------------------------------------------------------------*/
+void TMMHor_AddModule( void )
+{
+    TMModule mod = {
+        &tm_state,
+        TMMHor_Init,
+        TMMHor_Fini,
+        TMMHor_CurrentEpoch,
+        TMMHor_Recent_LBTS,
+        TMMHor_StartLBTS,
+        TMMHor_PutTag,
+        TMMHor_Out,
+        TMMHor_In,
+        TMMHor_PrintStats,
+        TMMHor_PrintState,
+        TMMHor_Tick,
+        TMMHor_NotifyNewLBTS
+    };
+
+    TM_AddModule( &mod );
+}
+
+#else /*MPI_AVAILABLE*/
+/*----------------------------------------------------------------------------*/
+void TMMHor_AddModule( void )
+{
+    MYASSERT( FALSE, ("TMHor needs MPI (MPI_Iallreduce)") );
+}
+#endif /*MPI_AVAILABLE*/
+
+/*----------------------------------------------------------------------------*/
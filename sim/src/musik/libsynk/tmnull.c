@@ -63,6 +63,7 @@ typedef struct
     int updated;      /*Has the status changed in some way?*/
     int inprogress;   /*Is a null-mesg activity already in progress?*/
     TM_Time transient_ts; /*Timestamps of events received while inprogress*/
+    TM_Time own_ts;   /*This PE's guarantee as given, before minLA removal*/
 } Computation;
 
 /*----------------------------------------------------------------------------*/
@@ -178,6 +179,7 @@ static void TMMNull_SendNullMesg( int to_pe, TM_Time ts, TM_TimeQual qual)
 static void TMMNull_Init(TMM_Closure closure, TMM_LBTSStartedProc sproc)
 {
     char *dbgstr = getenv("TMNULL_DEBUG");     /* Integer [0,inf] */
+    char *pbstr = getenv("TMNULL_PIGGYBACK");  /* String TRUE or FALSE */
 
     MYASSERT( closure == &tm_state, ("Closures should match") );
 
@@ -206,17 +208,23 @@ static void TMMNull_Init(TMM_Closure closure, TMM_LBTSStartedProc sproc)
     comp->updated        = TRUE;
     comp->inprogress     = FALSE;
     comp->transient_ts   = TM_IDENT;
+    comp->own_ts         = TM_ZERO;
 
     stats->nulls.nsent   = 0;
     stats->nulls.nrecd   = 0;
     stats->events.nsent  = 0;
     stats->events.nrecd  = 0;
 
-    opt->piggyback_lbts.on      = TRUE;
+    /*Piggybacked LBTS values bound all senders only in all-to-all reduction*/
+    /*settings, and advance LBTS without notifying waiters; off by default*/
+    opt->piggyback_lbts.on      = pbstr && !strcmp(pbstr, "TRUE");
     opt->aggressive_sends.on    = FALSE;
     opt->aggressive_sends.count = 0;
     opt->aggressive_sends.freq  = FM_numnodes; /*One round trip around all PEs*/
 
+    LSCFGST( "TMNULL_PIGGYBACK", (opt->piggyback_lbts.on?"TRUE":"FALSE"),
+             "TMNULL piggyback LBTS on events?" );
+
     TMMNull_ConfigTopology();
 
     FML_RegisterHandler( &st->fmh, TMMNull_RecvNullMesg );
@@ -267,8 +275,7 @@ static void TMMNull_In(TMM_Closure closure,TM_Time ts,char *ptag,int *nbytes)
 
     if( comp->inprogress )
     {
-        TM_Time min_ext_la = TM_TopoGetMinExternalLA();
-        ts = TM_Sub( ts, min_ext_la ); /*Caller adds min LA to ts*/
+        /*Kept as is: the event's own ts bounds this PE's LBTS directly*/
         comp->transient_ts = TM_Min( comp->transient_ts, ts );
         comp->updated = TRUE;
     }
@@ -316,6 +323,7 @@ static void TMMNull_AddDoneProc( TM_LBTSDoneProc dproc )
 static void TMMNull_DoNullSends( void )
 {
     int i = 0, j = 0;
+    TM_Time min_ext_la = TM_TopoGetMinExternalLA();
 
     if( !comp->updated )
     {
@@ -358,9 +366,10 @@ if(st->debug>1){printf("TMMNull_DoNullSends() to %d lbts[%d(spe%d)]=%lf.\n",rpe,
             lbts_j = temp_min_ts;
         }
 
-        if( comp->inprogress && TM_LE(comp->transient_ts,lbts_j) )
+        if( comp->inprogress &&
+            TM_LE(TM_Sub(comp->transient_ts, min_ext_la),lbts_j) )
         {
-            lbts_j = comp->transient_ts;
+            lbts_j = TM_Sub(comp->transient_ts, min_ext_la);
             qual_j = TM_TIME_QUAL_INCL;
         }
 
@@ -432,6 +441,7 @@ static void TMMNull_RegisterLocalLBTS( TM_Time min_ts, TM_TimeQual qual,
 
     TMMNull_AddDoneProc( done_proc );
 
+    comp->own_ts = min_ts;
     min_ts = TM_Sub(min_ts, min_ext_la);/*Caller already adds min-lookahead*/
 
     TMMNull_UpdateSender( mype, min_ts, qual );
@@ -461,21 +471,18 @@ static void TMMNull_EvaluateProgress( void )
     int i = 0;
     TM_Time new_min_ts = TM_IDENT;
     TM_TimeQual new_min_qual = TM_TIME_QUAL_INCL;
-    TM_Time min_ext_la = TM_TopoGetMinExternalLA();
 
     for( i = 0; i < st->in.n; i++ ) /*Find min lbts among all incoming*/
     {
         ConnectionInfo *conn = &st->in.conn[i];
         TM_Time this_lbts = conn->lbts;
 
-        if(conn->pe == st->myid && st->N > 1) /*Self, multi-processor*/
-        {
-            continue; /*Skip self*/
-        }
-
-        if( st->N <= 1 )/*Special case for uni-processor*/
+        if( conn->pe == st->myid ) /*Self: own guarantee bounds LBTS too*/
         {
-            this_lbts = TM_Add(this_lbts, min_ext_la); /*Can progress by minLA*/
+            /*Keeps LBTS within the caller's own contribution, as a*/
+            /*reduction would; use it as given, since subtracting and*/
+            /*re-adding minLA need not round-trip in floating point*/
+            this_lbts = comp->own_ts;
         }
 
         if( TM_GT(new_min_ts, this_lbts)  ||
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
 
 #include "mycompat.h"
 #include "fm.h"
@@ -21,6 +22,9 @@ struct RVALUE_TYPE_STRUCT
     TM_Time val;        /*Timestamp being reduced*/
     TM_TimeQual qual;   /*Timestamp qualification: see TM_TimeQual definition*/
     long nsent, nrecd;  /*Number of timestamped messages sent/received*/
+    long nbusy;         /*Number of PEs not voting quiet; see TM_QuietVote()*/
+    long nstale;        /*Number of PEs whose counters missed the cut*/
+    long ctrs[TM_MAXCOUNTERS];/*Application counters; see TM_AddCounter()*/
      #if !PLATFORM_WIN
        #if 0 /*XXX Turned off 19Jan11 - will we ever use Windows again?*/
          long padding; /*Compatibility with size generated by Windows compiler*/
@@ -29,9 +33,13 @@ struct RVALUE_TYPE_STRUCT
 };
 /*----------------------------------------------------------------------------*/
 static void hton_RVALUE_TYPE( RVALUE_TYPE *v )
-    { (v)->nsent = htonl((v)->nsent); (v)->nrecd = htonl((v)->nrecd); }
+    { int i; (v)->nsent = htonl((v)->nsent); (v)->nrecd = htonl((v)->nrecd);
+      (v)->nbusy = htonl((v)->nbusy); (v)->nstale = htonl((v)->nstale);
+      for(i=0;i<TM_MAXCOUNTERS;i++) (v)->ctrs[i] = htonl((v)->ctrs[i]); }
 static void ntoh_RVALUE_TYPE( RVALUE_TYPE *v )
-    { (v)->nsent = ntohl((v)->nsent); (v)->nrecd = ntohl((v)->nrecd); }
+    { int i; (v)->nsent = ntohl((v)->nsent); (v)->nrecd = ntohl((v)->nrecd);
+      (v)->nbusy = ntohl((v)->nbusy); (v)->nstale = ntohl((v)->nstale);
+      for(i=0;i<TM_MAXCOUNTERS;i++) (v)->ctrs[i] = ntohl((v)->ctrs[i]); }
 /*----------------------------------------------------------------------------*/
 static RVALUE_TYPE *rv_new( void )
     { return malloc( sizeof( RVALUE_TYPE ) ); }
@@ -39,7 +47,9 @@ static void rv_delete( RVALUE_TYPE *v )
     { free( v ); }
 static void rv_init(RVALUE_TYPE *a)
     { if(a){ (a)->val = TM_IDENT; (a)->qual = TM_TIME_QUAL_INCL;
-             (a)->nsent = (a)->nrecd = 0; } }
+             (a)->nsent = (a)->nrecd = (a)->nbusy = (a)->nstale = 0;
+             memset( (a)->ctrs, 0, sizeof((a)->ctrs) );
+             TM_CounterInit( (a)->ctrs ); } }
 static void rv_assign( RVALUE_TYPE *a, RVALUE_TYPE *b )
     { if((a)&&(b)) *(a) = *(b); }
 static void rv_reduce( RVALUE_TYPE *a, RVALUE_TYPE *b)
@@ -47,16 +57,20 @@ static void rv_reduce( RVALUE_TYPE *a, RVALUE_TYPE *b)
         { if(TM_LT((b)->val, (a)->val) ||
              (TM_EQ((b)->val, (a)->val) && ((b)->qual < (a)->qual)) )
                  { (a)->val = (b)->val; (a)->qual = (b)->qual; }
-          (a)->nsent += (b)->nsent; (a)->nrecd += (b)->nrecd; } }
-static void rv_set( RVALUE_TYPE *a, TM_Time v, TM_TimeQual qual, int ns, int nr)
-    { if(a) { (a)->val = v; (a)->qual = qual;
-              (a)->nsent = ns; (a)->nrecd = nr; } }
+          (a)->nsent += (b)->nsent; (a)->nrecd += (b)->nrecd;
+          (a)->nbusy += (b)->nbusy; (a)->nstale += (b)->nstale;
+          TM_CounterReduce( (a)->ctrs, (b)->ctrs ); } }
+static void rv_set( RVALUE_TYPE *a, TM_Time v, TM_TimeQual qual, int ns, int nr,
+                    int nb )
+    { if(a) { rv_init( a ); (a)->val = v; (a)->qual = qual;
+              (a)->nsent = ns; (a)->nrecd = nr; (a)->nbusy = nb; } }
 static void rv_print( FILE *fp, RVALUE_TYPE *a )
     { if(!a) return;
       fprintf((fp), "<");
       if(TM_GE((a)->val,TM_IDENT)) fprintf((fp), "Infinity");
       else fprintf((fp),"%f (%s)", TM_TS((a)->val),TM_TIME_QUAL_STR((a)->qual));
-      fprintf( (fp), ", %ld, %ld>", (a)->nsent, (a)->nrecd );
+      fprintf( (fp), ", %ld, %ld, %ld, %ld>", (a)->nsent, (a)->nrecd, (a)->nbusy,
+               (a)->nstale );
     }
 /*----------------------------------------------------------------------------*/
 static RVALUE_CLASS rv_class =
@@ -122,6 +136,116 @@ typedef struct TMMesgStruct
 static int use_mpiallreduce = USE_MPIALLREDUCE;
 #undef USE_MPIALLREDUCE
 
+/*----------------------------------------------------------------------------*/
+/* Non-blocking variant: one MPI_Iallreduce per trial over the full           */
+/* (min ts, qual, counts, counters) tuple with a user-defined op, posted      */
+/* when the trial starts and tested on every tick.                            */
+/*----------------------------------------------------------------------------*/
+static int use_mpiiallreduce = FALSE;
+#if MPI_AVAILABLE
+typedef struct
+{
+    double ts, tie;
+    long qual, nsent, nrecd, nbusy, nstale;
+    long ctrs[TM_MAXCOUNTERS];
+} IRedValue;
+static struct
+{
+    MPI_Datatype type;     /*Matches IRedValue*/
+    MPI_Op op;             /*Reduces IRedValue like rv_reduce()*/
+    MPI_Request req;       /*In-flight reduction, if any*/
+    MPI_Comm comm;         /*Private, so other modules' collectives can't mix*/
+    IRedValue in, out;
+    int myid, debug;
+    unsigned long nposted, ntests;
+} ired;
+/*----------------------------------------------------------------------------*/
+static void ired_to_rv( const IRedValue *a, RVALUE_TYPE *v )
+{
+    v->val.ts = a->ts; v->val.tie = a->tie; v->qual = (TM_TimeQual)a->qual;
+    v->nsent = a->nsent; v->nrecd = a->nrecd; v->nbusy = a->nbusy;
+    v->nstale = a->nstale; memcpy( v->ctrs, a->ctrs, sizeof(v->ctrs) );
+}
+static void rv_to_ired( const RVALUE_TYPE *v, IRedValue *a )
+{
+    a->ts = v->val.ts; a->tie = v->val.tie; a->qual = v->qual;
+    a->nsent = v->nsent; a->nrecd = v->nrecd; a->nbusy = v->nbusy;
+    a->nstale = v->nstale; memcpy( a->ctrs, v->ctrs, sizeof(a->ctrs) );
+}
+/*----------------------------------------------------------------------------*/
+static void ired_reduce( void *invec, void *inoutvec, int *len,
+                         MPI_Datatype *dtype )
+{
+    IRedValue *in = (IRedValue *)invec, *inout = (IRedValue *)inoutvec;
+    int i = 0;
+    for( i = 0; i < *len; i++ )
+    {
+        RVALUE_TYPE a, b;
+        ired_to_rv( &inout[i], &a );
+        ired_to_rv( &in[i], &b );
+        rv_reduce( &a, &b );
+        rv_to_ired( &a, &inout[i] );
+    }
+}
+/*----------------------------------------------------------------------------*/
+static void ired_init( int myid, int debug )
+{
+    int blens[2] = { 2, 5+TM_MAXCOUNTERS };
+    MPI_Aint disps[2] = { offsetof(IRedValue,ts), offsetof(IRedValue,qual) };
+    MPI_Datatype types[2] = { MPI_DOUBLE, MPI_LONG }, t = MPI_DATATYPE_NULL;
+
+    MPI_Type_create_struct( 2, blens, disps, types, &t );
+    MPI_Type_create_resized( t, 0, sizeof(IRedValue), &ired.type );
+    MPI_Type_free( &t );
+    MPI_Type_commit( &ired.type );
+    MPI_Op_create( ired_reduce, TRUE, &ired.op );
+    ired.req = MPI_REQUEST_NULL;
+    MPI_Comm_dup( MPI_COMM_WORLD, &ired.comm );
+    ired.myid = myid;
+    ired.debug = debug;
+}
+/*----------------------------------------------------------------------------*/
+static void ired_finish( void )
+{
+#if !NODEBUG
+if(ired.debug>=0){if(ired.myid==0){fprintf(tmfp,"%d: TMRed Iallreduce posted %lu tests %lu\n",ired.myid,ired.nposted,ired.ntests);fflush(tmfp);}}
+#endif
+    if( ired.req != MPI_REQUEST_NULL )
+    {
+        MPI_Wait( &ired.req, MPI_STATUS_IGNORE );
+    }
+    MPI_Op_free( &ired.op );
+    MPI_Type_free( &ired.type );
+    MPI_Comm_free( &ired.comm );
+}
+/*----------------------------------------------------------------------------*/
+static void ired_start( const RVALUE_TYPE *v )
+{
+    int retcode = 0;
+    MYASSERT( ired.req == MPI_REQUEST_NULL, ("One reduction at a time") );
+    rv_to_ired( v, &ired.in );
+    retcode = MPI_Iallreduce( &ired.in, &ired.out, 1, ired.type, ired.op,
+                              ired.comm, &ired.req );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Iallreduce") );
+    ired.nposted++;
+}
+/*----------------------------------------------------------------------------*/
+static int ired_test( RVALUE_TYPE *result )
+{
+    int done = FALSE, retcode = 0;
+    ired.ntests++;
+    retcode = MPI_Test( &ired.req, &done, MPI_STATUS_IGNORE );
+    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Test Iallreduce") );
+    if( done ) ired_to_rv( &ired.out, result );
+    return done;
+}
+#else /*MPI_AVAILABLE*/
+    #define ired_init(_1) (void)0
+    #define ired_finish() (void)0
+    #define ired_start(_1) (void)0
+    #define ired_test(_1) (FALSE)
+#endif /*MPI_AVAILABLE*/
+
 /*----------------------------------------------------------------------------*/
 #if PORTALS_AVAILABLE
     #include "tmport.c"
@@ -137,6 +261,17 @@ static int use_mpiallreduce = USE_MPIALLREDUCE;
 static int use_portals = USE_PORTALS;
 #undef USE_PORTALS
 
+/*----------------------------------------------------------------------------*/
+#if MPI_AVAILABLE
+    #include "tmrma.c"
+#else /*MPI_AVAILABLE*/
+    #define TMRMA_Init( _1, _2, _3 ) (void)0
+    #define TMRMA_Finish() (void)0
+    #define TMRMA_Resume( _1, _2 ) (FALSE)
+    #define TMRMA_StartPending() (FALSE)
+#endif /*MPI_AVAILABLE*/
+static int use_rma = FALSE;
+
 /*----------------------------------------------------------------------------*/
 typedef struct
 {
@@ -155,8 +290,10 @@ typedef struct
     long ID;           /*Active (or most recently completed) snapshot number*/
     long trial;        /*Trial number within active snapshot computation*/
     RMUserHandle rh;   /*Handle for the reduction service*/
+    RMScheduleType schedule;/*Reduction schedule; picked at init if AUTO*/
     RVALUE_TYPE value; /*Reduction value reported in currently active trial*/
     RVALUE_TYPE transients; /*Transient msgs of this snapshot accumulated here*/
+    TM_Time cut;       /*Result of the last snapshot; quiescence votes refer to it*/
     struct
     {
       int do_timeout;  /*Should timeouts be turned on or off?*/
@@ -250,6 +387,7 @@ static void send_start_msg( RMUserHandle usr, void *closure,
                             int from_pe, int to_pe, int to_slot );
 static void send_value_msg( RMUserHandle usr, void *closure,
                             int from_pe, int to_pe, RVALUE_TYPE *v,int to_slot);
+static RMScheduleType select_schedule( RMScheduleType sched, int nrounds );
 static void continue_active_reduction( void );
 static int deliver_buffered_msgs( void );
 static void move_to_next_sshot_trial( void );
@@ -264,11 +402,15 @@ static void TMMRed_Init(TMM_Closure closure, TMM_LBTSStartedProc sproc)
     char *delaystr= getenv("TMRED_MSGDELAY"); /* Double  [0.0,inf] secs */
     char *useudpstr= getenv("TMRED_USEUDP");  /* String TRUE or FALSE */
     char *usempiallredstr= getenv("TMRED_USEMPIBC");  /* String TRUE or FALSE */
+    char *usempiiallredstr= getenv("TMRED_USEMPIIBC");  /* String TRUE or FALSE */
     char *useportalsstr= getenv("TMRED_USEPORTALS");  /* String TRUE or FALSE */
+    char *usermastr= getenv("TMRED_USERMA");  /* String TRUE or FALSE */
     char *warnntrialsstr= getenv("TMRED_WARNNTRIALS");  /* Integer [1,inf] */
     char *abortntrialsstr= getenv("TMRED_ABORTNTRIALS");  /* Integer [1,inf] */
     char *lbtseverynstr= getenv("TMRED_PRINTLBTSEVERYN");  /* Integer [1,inf] */
     char *lbtsprintmaxpestr=getenv("TMRED_PRINTLBTSLASTPE"); /*Integer [1,P]*/
+    char *schedroundsstr= getenv("TMRED_SCHEDROUNDS");  /* Integer [1,inf] */
+    int schedrounds = schedroundsstr ? atoi(schedroundsstr) : 20;
 
     MYASSERT( closure == &tm_state, ("Closures should match") );
 
@@ -292,7 +434,9 @@ static void TMMRed_Init(TMM_Closure closure, TMM_LBTSStartedProc sproc)
     sshot->active        = FALSE;
     sshot->ID            = -1;
     sshot->trial         = -1;
+    sshot->cut           = TM_ZERO;
     sshot->rh            = rm_register( st->N, st->myid, MAX_PE, &rv_class );
+    sshot->schedule      = rm_get_schedule( sshot->rh );
 
     sshot->timeout.do_timeout= TRUE;
     sshot->timeout.counter   = 0;
@@ -340,6 +484,7 @@ if(st->myid==0 && st->debug>=0){fprintf(tmfp,"%d: TMRed ntrials warn %ld abort %
     rv_init( &sshot->transients );
 
     FML_RegisterHandler( &comm->fmh, recv_msg );
+    FM_set_urgent( comm->fmh ); /*Reduction msgs must not queue behind events*/
 
     sshot->timeout.period = 2*(st->N-1)*comm->msg_delay;/*Worst case per trial*/
 
@@ -363,6 +508,25 @@ if(st->debug>=0){fprintf(tmfp,"%d: TMRed MPI_Allreduce available but not used\n"
 #endif
     }
 
+    use_mpiiallreduce = usempiiallredstr&&!strcmp(usempiiallredstr,"TRUE");
+    if( use_mpiiallreduce )
+    {
+        #if !MPI_AVAILABLE
+            MYASSERT( !use_mpiiallreduce,
+                      ("%d: TMRed MPI_Iallreduce not available\n",st->myid) );
+            use_mpiiallreduce = FALSE;
+        #else /*MPI_AVAILABLE*/
+            MYASSERT( !use_mpiallreduce,
+                      ("%d: TMRED_USEMPIIBC and TMRED_USEMPIBC are exclusive",
+                       st->myid) );
+            ired_init( st->myid, st->debug );
+            sshot->timeout.do_timeout = FALSE; /*A collective loses no msgs*/
+#if !NODEBUG
+if(st->debug>=0){fprintf(tmfp,"%d: TMRed Using MPI_Iallreduce\n",st->myid);fflush(tmfp);}
+#endif
+        #endif /*MPI_AVAILABLE*/
+    }
+
     FML_Barrier();
 
     use_portals = useportalsstr&&!strcmp(useportalsstr,"TRUE");
@@ -397,6 +561,28 @@ if(st->debug>=0){fprintf(tmfp,"%d: TMRed Portals not available\n",st->myid);fflu
 #endif
     }
 
+    use_rma = usermastr&&!strcmp(usermastr,"TRUE");
+    if( use_rma )
+    {
+        #if !MPI_AVAILABLE
+          MYASSERT( !use_rma, ("%d: TMRed MPI RMA not available\n",st->myid) );
+          use_rma = FALSE;
+        #else /*MPI_AVAILABLE*/
+          MYASSERT( !use_mpiallreduce && !use_mpiiallreduce,
+                    ("%d: TMRED_USERMA, TMRED_USEMPIBC and TMRED_USEMPIIBC"
+                     " are exclusive", st->myid) );
+#if !NODEBUG
+if(st->debug>=0){fprintf(tmfp,"%d: TMRed Using one-sided MPI RMA\n",st->myid);fflush(tmfp);}
+#endif
+          TMRMA_Init( st->myid, st->N, st->debug );
+        #endif /*MPI_AVAILABLE*/
+    }
+
+    if( !use_mpiallreduce && !use_mpiiallreduce && !use_rma )
+    {
+        sshot->schedule = select_schedule( sshot->schedule, schedrounds );
+    }
+
     TIMER_NOW(stats->start);
 
     if(getenv("TMRED_UDPALWAYS")){FM_SetTransport(FM_TRANSPORT_UNRELIABLE);comm->use_udp=1;fprintf(tmfp,"--TMRED_UDPALWAYS---\n");fflush(tmfp);}
@@ -413,12 +599,20 @@ if(st->debug>=1){fprintf(tmfp,"%d: TMRed initialized.\n",st->myid);fflush(tmfp);
              "TMRED debug intensity" );
     LSCFGST( "TMRED_USEMPIBC", (use_mpiallreduce?"TRUE":"FALSE"),
              "TMRED use MPI_Allreduce?" );
+    LSCFGST( "TMRED_USEMPIIBC", (use_mpiiallreduce?"TRUE":"FALSE"),
+             "TMRED use MPI_Iallreduce?" );
     LSCFGST( "TMRED_USEPORTALS", (use_portals?"TRUE":"FALSE"),
              "TMRED use portals?" );
+    LSCFGST( "TMRED_USERMA", (use_rma?"TRUE":"FALSE"),
+             "TMRED use one-sided MPI RMA?" );
     LSCFGLD( "TMRED_WARNNTRIALS", (long)stats->trial.warnntrials,
              "TMRED warn #trials" );
     LSCFGLD( "TMRED_ABORTNTRIALS", (long)stats->trial.abortntrials,
              "TMRED abort #trials" );
+    LSCFGLD( "TMRED_SCHEDROUNDS", (long)schedrounds,
+             "TMRED rounds timed per candidate schedule" );
+    LSCFGST( "TMRED_SCHEDULE", rm_schedule_name(sshot->schedule),
+             "TMRED reduction schedule in use" );
 }
 
 /*----------------------------------------------------------------------------*/
@@ -428,6 +622,8 @@ static void TMMRed_Fini(TMM_Closure closure)
 if(st->debug>=1){fprintf(tmfp,"%d: TMRed finalizing.\n",st->myid);fflush(tmfp);}
 #endif
     if( use_portals ) { TMPTL_Finish( st->myid ); }
+    if( use_rma ) { TMRMA_Finish(); }
+    if( use_mpiiallreduce ) { ired_finish(); use_mpiiallreduce = FALSE; }
 #if !NODEBUG
 if(st->debug>=1){fprintf(tmfp,"%d: TMRed finalized.\n",st->myid);fflush(tmfp);}
 #endif
@@ -486,7 +682,10 @@ if(st->debug>2){fprintf(tmfp,"TMMRed_StartLBTSSnapShot(min_ts=%f,sshot-epoch=%ld
             sshot->ID = epoch->ID;
             sshot->trial = trial_num-1;
             rv_init( &sshot->value );
-            rv_set(&sshot->transients, min_ts,qual, epoch->nsent, epoch->nrecd);
+            rv_set(&sshot->transients, min_ts,qual, epoch->nsent, epoch->nrecd,
+                   !TM_QuietVote( sshot->cut ));
+            sshot->transients.nstale =
+                   !TM_CounterValues( sshot->cut, sshot->transients.ctrs );
             move_to_next_sshot_trial();
         }
 
@@ -614,7 +813,7 @@ if(st->debug>1){fprintf(tmfp,"IncomingOldMsg(ts=%f,epoch=%ld)\n",TM_TS(ts),epoch
     else if( sshot->active && epoch_id == sshot->ID )
     {
         RVALUE_TYPE transient_msg;
-        rv_set( &transient_msg, ts, TM_TIME_QUAL_INCL, 0, 1 );
+        rv_set( &transient_msg, ts, TM_TIME_QUAL_INCL, 0, 1, 0 );
         rv_reduce( &sshot->transients, &transient_msg );
 #if !NODEBUG
 if(st->debug>2){fprintf(tmfp,"IncomingTransientMsg(ts=%f,epoch=%ld)\n",TM_TS(ts),epoch_id);}
@@ -754,10 +953,16 @@ static void TMMRed_Tick( TMM_Closure closure )
 {
     int ndelivered = 0;
     if( use_portals ) { TMPTL_RecvMesgs( st->myid, tmptl_recv_callback ); }
+    if( use_rma && !sshot->active && TMRMA_StartPending() )
+    {
+        remote_start_lbts( epoch->ID, 0 );
+    }
     do
     {
         continue_active_reduction();
-if( lbts->n_dproc <= 0 ) ndelivered = 0; else/*XXX*/
+        /*An idle PE joins a peer's snapshot upon its start msg, which*/
+        /*may arrive ahead of any event of the new epoch (FM_set_urgent)*/
+if( lbts->n_dproc <= 0 && sshot->active ) ndelivered = 0; else/*XXX*/
         ndelivered = deliver_buffered_msgs();
     }while(ndelivered > 0);
 }
@@ -795,12 +1000,15 @@ static void move_to_next_sshot_trial( void )
 
     update_trial_stats();
 
-    rm_init( sshot->rh, RM_SCHEDULE_GROUPED_BFLY );
+    rm_init( sshot->rh, sshot->schedule );
     rm_receive_value( sshot->rh, st->myid, &sshot->value );
+
+    if( use_mpiiallreduce ) ired_start( &sshot->value );
 }
 
 /*----------------------------------------------------------------------------*/
-static void terminate_active_sshot( TM_Time new_lbts, TM_TimeQual new_qual )
+static void terminate_active_sshot( TM_Time new_lbts, TM_TimeQual new_qual,
+                                    const RVALUE_TYPE *tot )
 {
     MYASSERT( sshot->active, ("!") );
     MYASSERT( TM_LE( lbts->LBTS, new_lbts ),
@@ -842,6 +1050,11 @@ static void terminate_active_sshot( TM_Time new_lbts, TM_TimeQual new_qual )
         }
     }
 
+    /*Every PE's vote and counters are in the value of a completed snapshot*/
+    if( tot && tot->nbusy == 0 ) TM_SetQuiescent();
+    if( tot && tot->nstale == 0 ) TM_SetCounterTotals( sshot->cut, tot->ctrs );
+    sshot->cut = new_lbts;
+
     /*Report to waiting callbacks*/
     {
         int c;
@@ -866,16 +1079,36 @@ static void continue_active_reduction( void )
 
         if( use_mpiallreduce )
         {
-            int inx = sshot->value.nrecd - sshot->value.nsent, outx = 0;
-            int retcode =
-              MPI_Allreduce( &inx, &outx, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD );
+            int inx[3], outx[3] = { 0, 0, 0 };
+            int retcode = 0;
+            inx[0] = sshot->value.nrecd - sshot->value.nsent;
+            inx[1] = sshot->value.nbusy;
+            inx[2] = sshot->value.nstale;
+            FM_flush();
+            retcode =
+              MPI_Allreduce( inx, outx, 3, MPI_INT, MPI_SUM, MPI_COMM_WORLD );
             MYASSERT( retcode == MPI_SUCCESS, ("MPI_Allreduce") );
+            rv_init( &dval );
             dval.val.ts = 0;
             dval.val.tie = 0;
-            dval.nsent = outx;
+            dval.nsent = outx[0];
             dval.nrecd = 0;
-            if( outx == 0 )
+            dval.nbusy = outx[1];
+            dval.nstale = outx[2];
+            if( outx[0] == 0 )
             {
+                const TM_CounterOp *ops = 0;
+                int i = 0, n = TM_NumCounters( &ops );
+                for( i = 0; i < n; i++ )
+                {
+                    retcode = MPI_Allreduce( &sshot->value.ctrs[i],
+                        &dval.ctrs[i], 1, MPI_LONG,
+                        (ops[i] == TM_COUNTER_MIN ? MPI_MIN :
+                         ops[i] == TM_COUNTER_MAX ? MPI_MAX : MPI_SUM),
+                        MPI_COMM_WORLD );
+                    MYASSERT( retcode == MPI_SUCCESS, ("MPI_Allreduce3") );
+                }
+
                 int retcode2 =
                   MPI_Allreduce( &sshot->value.val.ts, &dval.val.ts, 1,
                                  MPI_DOUBLE, MPI_MIN, MPI_COMM_WORLD );
@@ -884,6 +1117,14 @@ static void continue_active_reduction( void )
             }
             done = TRUE;
         }
+        else if( use_mpiiallreduce )
+        {
+            done = ired_test( &dval );
+        }
+        else if( use_rma )
+        {
+            done = TMRMA_Resume( &sshot->value, &dval );
+        }
         else
         {
             done=rm_resume(sshot->rh, &dval, send_start_msg, send_value_msg, 0);
@@ -920,7 +1161,7 @@ if(st->debug>2){printstate();}
 
             if( done && (dval.nsent == dval.nrecd) ) /*Current snapshot done!*/
             {
-                terminate_active_sshot( dval.val, dval.qual );
+                terminate_active_sshot( dval.val, dval.qual, &dval );
             }
             else /*Snapshot incomplete or timedout; start next trial*/
             {
@@ -981,7 +1222,7 @@ if(st->debug>1){fprintf(tmfp,"!!------------ Skipping currently active snapshot!
 #endif
 
                     if( sshot->timeout.do_timeout )
-                    terminate_active_sshot( msg->old_lbts, msg->old_qual );
+                    terminate_active_sshot( msg->old_lbts, msg->old_qual, NULL );
 
                     /*Future message; retain in queue*/
                     consume = FALSE;
@@ -1114,6 +1355,151 @@ static void send_value_msg( RMUserHandle usr, void *closure,
     send_msg( &msg, to_slot );
 }
 
+/*----------------------------------------------------------------------------*/
+/* Startup selection of the reduction schedule.  PEs are grouped by node for */
+/* the grouped schedules, so that members reduce into a leader on their own  */
+/* node (over shared memory, if FM_RING) and only leaders talk across nodes. */
+/* With RM_SCHEDULE=AUTO (the default), a few rounds of every candidate are  */
+/* timed with real reduction messages, and all PEs agree on the candidate   */
+/* whose slowest PE was fastest.                                             */
+/*----------------------------------------------------------------------------*/
+static struct
+{
+    unsigned int fmh;   /*FM handle ID for timed reduction msgs*/
+    RMUserHandle rh;    /*Handle for the timed reductions*/
+    long round;         /*Current round; msgs of other rounds are dropped*/
+} bench;
+
+/*----------------------------------------------------------------------------*/
+static int bench_recv_msg( FM_stream *strm, unsigned senderID )
+{
+    TMMesg msg;
+
+    FM_receive( &msg, strm, sizeof(msg) );
+    ntoh_TMMesg( &msg );
+
+    if( msg.ssn != bench.round ) {} /*Late jumpstart*/
+    else if( msg.type == RM_START_MSG ) rm_receive_start(bench.rh,msg.from_pe);
+    else rm_receive_value( bench.rh, msg.from_pe, &msg.val );
+
+    return FM_CONTINUE;
+}
+
+/*----------------------------------------------------------------------------*/
+static void bench_send_msg( TMMesg *msg )
+{
+    FM_stream *strm = 0;
+
+    msg->ssn = bench.round; msg->trial = 0;
+    msg->old_lbts = TM_ZERO;
+    msg->old_qual = TM_TIME_QUAL_INCL;
+
+    strm = FM_begin_message( msg->to_pe, sizeof(TMMesg), bench.fmh );
+    hton_TMMesg( msg );
+    FM_send_piece( strm, msg, sizeof(*msg) );
+    FM_end_message( strm );
+}
+
+/*----------------------------------------------------------------------------*/
+static void bench_send_start( RMUserHandle usr, void *closure,
+    int from_pe, int to_pe, int to_slot )
+{
+    TMMesg msg;
+    msg.type = RM_START_MSG; msg.from_pe = from_pe; msg.to_pe = to_pe;
+    rv_init( &msg.val );
+    bench_send_msg( &msg );
+}
+
+/*----------------------------------------------------------------------------*/
+static void bench_send_value( RMUserHandle usr, void *closure,
+    int from_pe, int to_pe, RVALUE_TYPE *v, int to_slot )
+{
+    TMMesg msg;
+    msg.type = RM_VALUE_MSG; msg.from_pe = from_pe; msg.to_pe = to_pe;
+    rv_assign( &msg.val, v );
+    bench_send_msg( &msg );
+}
+
+/*----------------------------------------------------------------------------*/
+/* Reduces v in place with the given schedule; returns this PE's seconds.    */
+/*----------------------------------------------------------------------------*/
+static double bench_reduce( RMScheduleType sched, RVALUE_TYPE *v )
+{
+    RVALUE_TYPE result;
+    TIMER_TYPE t0, t1;
+
+    bench.round++;
+    rm_init( bench.rh, sched );
+    rm_receive_value( bench.rh, st->myid, v );
+    FML_Barrier(); /*Everyone expects this round's msgs before any is sent*/
+
+    TIMER_NOW( t0 );
+    while( !rm_resume( bench.rh, &result, bench_send_start, bench_send_value,
+                       0 ) )
+    {
+        FM_extract( ~0 );
+    }
+    TIMER_NOW( t1 );
+
+    rv_assign( v, &result );
+    return TIMER_DIFF( t1, t0 );
+}
+
+/*----------------------------------------------------------------------------*/
+static RMScheduleType select_schedule( RMScheduleType sched, int nrounds )
+{
+    #define NCANDS 4
+    static const RMScheduleType cands[NCANDS] =
+        { RM_SCHEDULE_BUTTERFLY, RM_SCHEDULE_TREE,
+          RM_SCHEDULE_GROUPED_BFLY, RM_SCHEDULE_GROUPED_TREE };
+    double secs[NCANDS];
+    int i = 0, c = 0, best = 0, nnodes = 0;
+    int *leaders = (int *)malloc( st->N*sizeof(int) );
+    RVALUE_TYPE v;
+
+    MYASSERT( leaders, ("%d leaders",st->N) );
+    FM_node_leaders( leaders );
+    rm_set_groups( leaders, st->N );
+    for( i = 0; i < st->N; i++ ) if( leaders[i] == i ) nnodes++;
+    free( leaders );
+
+if(st->myid==0 && st->debug>=0){fprintf(tmfp,"%d: TMRed %d PEs on %d nodes\n",st->myid,st->N,nnodes);fflush(tmfp);}
+
+    if( sched != RM_SCHEDULE_AUTO ) return sched;
+    if( st->N <= 1 || nrounds <= 0 ) return RM_SCHEDULE_GROUPED_BFLY;
+
+    bench.rh = rm_register( st->N, st->myid, MAX_PE, &rv_class );
+    bench.round = 0;
+    FML_RegisterHandler( &bench.fmh, bench_recv_msg );
+    FM_set_urgent( bench.fmh );
+
+    for( c = 0; c < NCANDS; c++ )
+    {
+        secs[c] = 0;
+        for( i = 0; i < nrounds; i++ )
+        {
+            rv_init( &v );
+            secs[c] += bench_reduce( cands[c], &v );
+        }
+    }
+
+    /*Agree on the slowest PE's time of each, as min of negated times*/
+    for( c = 0; c < NCANDS; c++ )
+    {
+        rv_init( &v );
+        v.val = TM_ZERO;
+        TM_TS( v.val ) = -secs[c];
+        bench_reduce( RM_SCHEDULE_BUTTERFLY, &v );
+        secs[c] = -TM_TS( v.val );
+        if( secs[c] < secs[best] ) best = c;
+    }
+
+if(st->myid==0 && st->debug>=0){fprintf(tmfp,"%d: TMRed schedule usecs/round:",st->myid);for(c=0;c<NCANDS;c++)fprintf(tmfp," %s %.1f",rm_schedule_name(cands[c]),secs[c]*1e6/nrounds);fprintf(tmfp," -> %s\n",rm_schedule_name(cands[best]));fflush(tmfp);}
+
+    return cands[best];
+    #undef NCANDS
+}
+
 /*----------------------------------------------------------------------------*/
 static TMMesg *allocate_free_msgs( int nmsgs )
 {
@@ -0,0 +1,251 @@
+/*----------------------------------------------------------------------------*/
+/* One-sided MPI RMA support for reductions used inside TM.                   */
+/*                                                                            */
+/* Every trial of every snapshot is one global "round".  In round k, each PE  */
+/* puts its (min ts, qual, counters) into its own slot at PE 0, atomically    */
+/* adds its sent/received/busy counts into PE 0's sums with MPI_Accumulate,   */
+/* then bumps PE 0's arrival count.  PE 0 watches its own memory; once all N */
+/* arrived, it reduces, resets that parity's counters, and puts the result   */
+/* into every PE's window followed by the round number.  PEs that have not   */
+/* joined a round yet are nudged by PE 0 writing the round number into their */
+/* "start" word.  Nobody blocks in a collective, and no receive is matched.  */
+/*----------------------------------------------------------------------------*/
+#include <stddef.h>
+#include <mpi.h>
+
+/*----------------------------------------------------------------------------*/
+#define TMRMA_LOAD(_p) __atomic_load_n((_p), __ATOMIC_ACQUIRE)
+
+/*----------------------------------------------------------------------------*/
+typedef struct
+{
+    double ts, tie;     /*Timestamp being reduced*/
+    long qual;          /*Timestamp qualification*/
+    long nstale;        /*Counters missed the cut?*/
+    long ctrs[TM_MAXCOUNTERS];/*Application counters, reduced at PE 0*/
+} TMRMAValue;
+
+/*----------------------------------------------------------------------------*/
+typedef struct
+{
+    TMRMAValue val;
+    long nsent, nrecd, nbusy, nstale;
+    long ctrs[TM_MAXCOUNTERS];
+} TMRMAResult;
+
+/*----------------------------------------------------------------------------*/
+typedef struct
+{
+    long count[2];      /*PE 0 only: #arrivals in rounds of either parity*/
+    long sums[2][3];    /*PE 0 only: sum of nsent, nrecd, nbusy by parity*/
+    long start;         /*Latest round known by PE 0 to have begun*/
+    long resround;      /*Round whose result is in res*/
+    TMRMAResult res;    /*Result of round resround*/
+    /*PE 0 only: followed by TMRMAValue vals[2][N]*/
+} TMRMAWindow;
+
+/*----------------------------------------------------------------------------*/
+typedef struct
+{
+    int myid, N, debug;
+    MPI_Win win;
+    TMRMAWindow *w;
+    TMRMAValue *vals;   /*[2][N], meaningful at PE 0*/
+    long round;         /*#rounds this PE completed; next round to join*/
+    int joined;         /*Contributed to round "round" already?*/
+    long announced;     /*PE 0: latest round announced via start words*/
+    TMRMAValue myval;   /*Origin buffers; must stay put until flushed*/
+    long mysums[3], one, outround;
+    TMRMAResult outres;
+    unsigned long nrounds, npolls;
+} TMRMAState;
+
+/*----------------------------------------------------------------------------*/
+static TMRMAState tmrma;
+
+/*----------------------------------------------------------------------------*/
+#define TMRMA_DISP(_field) ((MPI_Aint)offsetof(TMRMAWindow,_field))
+#define TMRMA_VALDISP(_p,_i) \
+    ((MPI_Aint)(sizeof(TMRMAWindow) + ((_p)*tmrma.N+(_i))*sizeof(TMRMAValue)))
+
+/*----------------------------------------------------------------------------*/
+static void TMRMA_Init( int myid, int N, int debug )
+{
+    MPI_Aint winsize = sizeof(TMRMAWindow) + 2*N*sizeof(TMRMAValue);
+    int retcode = 0;
+
+    tmrma.myid = myid;
+    tmrma.N = N;
+    tmrma.debug = debug;
+    FM_flush(); /*Peers may be waiting on staged messages before joining*/
+    retcode = MPI_Win_allocate( winsize, 1, MPI_INFO_NULL, MPI_COMM_WORLD,
+                                &tmrma.w, &tmrma.win );
+    MYASSERT( retcode == MPI_SUCCESS && tmrma.w, ("TMRMA MPI_Win_allocate") );
+    memset( tmrma.w, 0, winsize );
+    tmrma.w->start = -1;
+    tmrma.w->resround = -1;
+    tmrma.vals = (TMRMAValue *)(tmrma.w + 1);
+    tmrma.round = 0;
+    tmrma.joined = FALSE;
+    tmrma.announced = -1;
+    tmrma.one = 1;
+
+    MPI_Barrier( MPI_COMM_WORLD );
+    MPI_Win_lock_all( MPI_MODE_NOCHECK, tmrma.win );
+}
+
+/*----------------------------------------------------------------------------*/
+static void TMRMA_Finish( void )
+{
+#if !NODEBUG
+if(tmrma.debug>=0){if(tmrma.myid==0){fprintf(tmfp,"%d: TMRed RMA rounds %lu polls %lu\n",tmrma.myid,tmrma.nrounds,tmrma.npolls);fflush(tmfp);}}
+#endif
+    MPI_Win_unlock_all( tmrma.win );
+    MPI_Win_free( &tmrma.win );
+}
+
+/*----------------------------------------------------------------------------*/
+static void TMRMA_Contribute( const RVALUE_TYPE *v )
+{
+    int p = (int)(tmrma.round % 2);
+
+    tmrma.myval.ts = v->val.ts;
+    tmrma.myval.tie = v->val.tie;
+    tmrma.myval.qual = v->qual;
+    tmrma.myval.nstale = v->nstale;
+    memcpy( tmrma.myval.ctrs, v->ctrs, sizeof(tmrma.myval.ctrs) );
+    tmrma.mysums[0] = v->nsent;
+    tmrma.mysums[1] = v->nrecd;
+    tmrma.mysums[2] = v->nbusy;
+
+    MPI_Put( &tmrma.myval, sizeof(TMRMAValue), MPI_BYTE, 0,
+             TMRMA_VALDISP(p,tmrma.myid), sizeof(TMRMAValue), MPI_BYTE,
+             tmrma.win );
+    MPI_Accumulate( tmrma.mysums, 3, MPI_LONG, 0, TMRMA_DISP(sums[p]),
+                    3, MPI_LONG, MPI_SUM, tmrma.win );
+    MPI_Win_flush( 0, tmrma.win ); /*Value & sums land before the arrival*/
+    MPI_Accumulate( &tmrma.one, 1, MPI_LONG, 0, TMRMA_DISP(count[p]),
+                    1, MPI_LONG, MPI_SUM, tmrma.win );
+    MPI_Win_flush( 0, tmrma.win );
+
+    tmrma.joined = TRUE;
+}
+
+/*----------------------------------------------------------------------------*/
+/* PE 0 only: finish the current round if everyone arrived, or announce it. */
+/*----------------------------------------------------------------------------*/
+static void TMRMA_Collect( void )
+{
+    int p = (int)(tmrma.round % 2), r = 0;
+    long count = 0;
+
+    MPI_Win_sync( tmrma.win );
+    count = TMRMA_LOAD( &tmrma.w->count[p] );
+
+    if( count >= tmrma.N )
+    {
+        RVALUE_TYPE tot, v;
+        TMRMAWindow *w = tmrma.w;
+
+        MYASSERT( count == tmrma.N, ("%ld arrivals",count) );
+        rv_init( &tot );
+        for( r = 0; r < tmrma.N; r++ )
+        {
+            TMRMAValue *val = &tmrma.vals[p*tmrma.N+r];
+            rv_init( &v );
+            v.val.ts = val->ts;
+            v.val.tie = val->tie;
+            v.qual = (TM_TimeQual)val->qual;
+            v.nstale = val->nstale;
+            memcpy( v.ctrs, val->ctrs, sizeof(v.ctrs) );
+            rv_reduce( &tot, &v );
+        }
+        tot.nsent = w->sums[p][0];
+        tot.nrecd = w->sums[p][1];
+        tot.nbusy = w->sums[p][2];
+
+        /*Nobody touches this parity again before seeing this round's result*/
+        w->count[p] = 0; w->sums[p][0] = w->sums[p][1] = w->sums[p][2] = 0;
+        MPI_Win_sync( tmrma.win );
+
+        tmrma.outres.val.ts = tot.val.ts;
+        tmrma.outres.val.tie = tot.val.tie;
+        tmrma.outres.val.qual = tot.qual;
+        tmrma.outres.nsent = tot.nsent;
+        tmrma.outres.nrecd = tot.nrecd;
+        tmrma.outres.nbusy = tot.nbusy;
+        tmrma.outres.nstale = tot.nstale;
+        memcpy( tmrma.outres.ctrs, tot.ctrs, sizeof(tmrma.outres.ctrs) );
+        tmrma.outround = tmrma.round;
+        for( r = 0; r < tmrma.N; r++ )
+        {
+            MPI_Put( &tmrma.outres, sizeof(TMRMAResult), MPI_BYTE, r,
+                     TMRMA_DISP(res), sizeof(TMRMAResult), MPI_BYTE,
+                     tmrma.win );
+        }
+        MPI_Win_flush_all( tmrma.win ); /*Results land before the round*/
+        for( r = 0; r < tmrma.N; r++ )
+        {
+            MPI_Accumulate( &tmrma.outround, 1, MPI_LONG, r,
+                            TMRMA_DISP(resround), 1, MPI_LONG, MPI_REPLACE,
+                            tmrma.win );
+        }
+        MPI_Win_flush_all( tmrma.win );
+        tmrma.nrounds++;
+    }
+    else if( count > 0 && tmrma.announced < tmrma.round )
+    {
+        tmrma.announced = tmrma.outround = tmrma.round;
+        for( r = 0; r < tmrma.N; r++ )
+        {
+            MPI_Accumulate( &tmrma.outround, 1, MPI_LONG, r,
+                            TMRMA_DISP(start), 1, MPI_LONG, MPI_REPLACE,
+                            tmrma.win );
+        }
+        MPI_Win_flush_all( tmrma.win );
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/* Joins the current round with value v if not done yet; returns TRUE and    */
+/* the reduced value in result once the round completes globally.           */
+/*----------------------------------------------------------------------------*/
+static int TMRMA_Resume( const RVALUE_TYPE *v, RVALUE_TYPE *result )
+{
+    int done = FALSE;
+
+    if( !tmrma.joined ) TMRMA_Contribute( v );
+    if( tmrma.myid == 0 ) TMRMA_Collect();
+
+    tmrma.npolls++;
+    MPI_Win_sync( tmrma.win );
+    if( TMRMA_LOAD( &tmrma.w->resround ) == tmrma.round )
+    {
+        TMRMAResult *res = &tmrma.w->res;
+        result->val.ts = res->val.ts;
+        result->val.tie = res->val.tie;
+        result->qual = (TM_TimeQual)res->val.qual;
+        result->nsent = res->nsent;
+        result->nrecd = res->nrecd;
+        result->nbusy = res->nbusy;
+        result->nstale = res->nstale;
+        memcpy( result->ctrs, res->ctrs, sizeof(result->ctrs) );
+        tmrma.round++;
+        tmrma.joined = FALSE;
+        done = TRUE;
+    }
+
+    return done;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Has some other PE begun a round that this (idle) PE has not joined yet?   */
+/*----------------------------------------------------------------------------*/
+static int TMRMA_StartPending( void )
+{
+    if( tmrma.myid == 0 ) TMRMA_Collect();
+    MPI_Win_sync( tmrma.win );
+    return TMRMA_LOAD( &tmrma.w->start ) >= tmrma.round;
+}
+
+/*----------------------------------------------------------------------------*/
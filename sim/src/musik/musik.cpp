@@ -23,6 +23,7 @@
 #include <string.h>
 #include <setjmp.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 
 #include "musik.h"
 
@@ -31,9 +32,10 @@
 #define WORDSIZE 8
 
 /*---------------------------------------------------------------------------*/
-FreeListMap SimEventBase::free_map;
 ostream *_musdbgstrm = &cout;
-int _simdbg = 1; ostream *_simdbgstrm = &cout, *_simdbgstrmdefault = &cout;
+int _simdbg = 1; ostream *_simdbgstrmdefault = &cout;
+__thread ostream *_simdbgstrm = &cout;
+__thread bool _simdbgdiverted = false;
 int _enslvl = 1;
 bool _printcfg = false;
 long _printdbgmaxfedid = 99999999;
@@ -52,7 +54,7 @@ const SimPID SimPID::INVALID_PID( SimPID::INVALID_LOC_ID,
                                   SimPID::INVALID_FED_ID );
 const SimPID SimPID::ANY_PID( SimPID::ANY_LOC_ID, SimPID::ANY_FED_ID );
 const SimReflectorID INVALID_RID = 0;
-unsigned long SimProcessBase::tie_counter = 0;
+SimTime SimProcessBase::sync_epsilon = 0;
 
 /*---------------------------------------------------------------------------*/
 extern "C" {
@@ -72,7 +74,41 @@ static struct {
     TM_TimeQual qual;
     unsigned int fed_fm_event_hid;
     unsigned int fed_fm_retract_hid;
+    long nsent, nrecd; /*Remote events and retractions*/
 } synk_lbts = { 0, 0, 0, {TM_ZERO.ts, TM_ZERO.tie}, TM_TIME_QUAL_INCL, 0 };
+/*---------------------------------------------------------------------------*/
+/* Federate-level communication topology, as declared through add_dest() and */
+/* add_src().  Handed to TM once at start; all-to-all unless every federate  */
+/* this one talks to was named explicitly.                                   */
+/*---------------------------------------------------------------------------*/
+static struct {
+    bool any_dest, any_src; /*Declared ANY_FED_ID?*/
+    vector<char> dest, src; /*Explicitly declared remote federates*/
+    SimTime min_la;         /*Least lookahead declared to a remote federate*/
+    SimTime any_la;         /*Least lookahead declared to ANY_FED_ID*/
+    vector<SimTime> la;     /*Least lookahead declared to each federate*/
+    SimTime max_proc_la;    /*Largest per-process min lookahead (in eets)*/
+    bool applied, all2all;  /*Handed to TM yet?  In all-to-all form?*/
+    bool perpair;           /*Receivers registered with their own lookahead?*/
+    bool learn;             /*Count the messages actually sent on each link?*/
+    vector<long> used;      /*#messages sent to each federate, if learning*/
+} synk_topo = { false, false, vector<char>(), vector<char>(),
+                SimTime::MAX_TIME, SimTime::MAX_TIME, vector<SimTime>(),
+                SimTime::ZERO_TIME, false, true, false, false, vector<long>() };
+static void Synk_TopoSent( int dest_pe );
+/*---------------------------------------------------------------------------*/
+/* With a communication progress thread running (MK_PROGRESS), every use of */
+/* FM and TM by the kernel is serialized with it; otherwise these are no-ops.*/
+/*---------------------------------------------------------------------------*/
+static void Synk_ProgressStart( long pollus );
+static void Synk_ProgressStop( void );
+static void Synk_FMLock( void );
+static void Synk_FMUnlock( void );
+struct Synk_FMGuard
+{
+    Synk_FMGuard( void ) { Synk_FMLock(); }
+    ~Synk_FMGuard( void ) { Synk_FMUnlock(); }
+};
 TIMER_TYPE start_time_with_init, start_time, stop_time;
 bool start_timer_started = false;
 /*---------------------------------------------------------------------------*/
@@ -107,6 +143,7 @@ static void Synk_InitiateLBTS( const SimTime &nts )
     ++synk_lbts.nactive;
     long trans = 0;
     TM_Time tm_ts; ts_musik2synk( tm_ts, nts );
+    Synk_FMGuard guard;
     TM_StartLBTS(tm_ts, TM_TIME_QUAL_INCL, Synk_LBTSDone, &trans);
 }
 /*---------------------------------------------------------------------------*/
@@ -123,6 +160,27 @@ static long Synk_LBTSStarted( long trans, TM_Time *plbts, TM_TimeQual *pqual,
     return TM_ACCEPT;
 }
 /*---------------------------------------------------------------------------*/
+static int Synk_QuietVote( TM_Time cut )
+{
+    SimTime mcut; ts_synk2musik( mcut, cut );
+    bool quiet = MicroKernel::muk()->local_quiet( mcut );
+    MUSDBG( 2, "QuietVote cut= "<<mcut<<" quiet= "<<quiet );
+    return quiet;
+}
+/*---------------------------------------------------------------------------*/
+static int Synk_CountersProc( TM_Time cut, long *vals )
+{
+    SimTime mcut; ts_synk2musik( mcut, cut );
+    bool exact = MicroKernel::muk()->local_counters( mcut, vals );
+    MUSDBG( 2, "CountersProc cut= "<<mcut<<" exact= "<<exact );
+    return exact;
+}
+/*---------------------------------------------------------------------------*/
+static bool Synk_Quiescent( void )
+{
+    return TM_Quiescent();
+}
+/*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 static bool Synk_FMSendEvent( const SimFedID &fed, SimEventBase *eb )
 {
@@ -158,6 +216,7 @@ static bool Synk_FMSendEvent( const SimFedID &fed, SimEventBase *eb )
     int totbytes = sizeof(hdr->totsz) + sizeof(Synk_Hdr) + sizeof(evtype) +
                    sizeof(nappevbytes) + nsendbytes;
 
+    Synk_FMGuard guard;
     FM_stream *stream = FM_begin_message(fed, totbytes,
                                          synk_lbts.fed_fm_event_hid);
     if( stream )
@@ -176,6 +235,8 @@ static bool Synk_FMSendEvent( const SimFedID &fed, SimEventBase *eb )
         long nsent = 1;
         TM_Time tm_ts; ts_musik2synk( tm_ts, eb->T() );
         TM_Out( tm_ts, nsent );
+        synk_lbts.nsent++;
+        Synk_TopoSent( fed );
 
         sent = true;
     }
@@ -250,6 +311,7 @@ static int Synk_FMEventHandler( FM_stream *stream, unsigned int src_pe )
     TM_Time tm_ts; ts_musik2synk( tm_ts, in_ts );
     ENSURE( 1, TM_GE(tm_ts, synk_lbts.ts), tm_ts<<" "<<synk_lbts.ts );
     TM_In(tm_ts, hdr->tag);
+    synk_lbts.nrecd++;
 
     return FM_CONTINUE;
 }
@@ -271,6 +333,7 @@ static void Synk_FMSendRetract( const SimFedID &fed,
 
     rmsg->eid = eid;
     rmsg->ts = ts;
+    Synk_FMGuard guard;
     TM_PutTag( &rmsg->tag );
 
     FM_stream *stream = FM_begin_message(fed, sizeof(FMRetractMsg),
@@ -280,6 +343,7 @@ static void Synk_FMSendRetract( const SimFedID &fed,
 
     TM_Time tm_ts; ts_musik2synk( tm_ts, ts );
     TM_Out( tm_ts, nsent );
+    synk_lbts.nsent++;
 }
 /*---------------------------------------------------------------------------*/
 static int Synk_FMRetractHandler( FM_stream *stream, unsigned int src_pe )
@@ -290,6 +354,7 @@ static int Synk_FMRetractHandler( FM_stream *stream, unsigned int src_pe )
     ENSURE( 1, TM_GE(rmsg->ts, synk_lbts.ts), rmsg->ts<<" "<<synk_lbts.ts );
     TM_Time tm_ts; ts_musik2synk( tm_ts, rmsg->ts );
     TM_In(tm_ts, rmsg->tag);
+    synk_lbts.nrecd++;
 
     MUSDBG( 2, "AddIncomingRetract "<<rmsg->ts );
     Simulator::sim()->incoming_remote_retract( rmsg->eid, rmsg->ts, src_pe );
@@ -300,7 +365,10 @@ static int Synk_FMRetractHandler( FM_stream *stream, unsigned int src_pe )
 /*---------------------------------------------------------------------------*/
 static void Synk_Tick( void )
 {
-    FM_extract(~0);
+    Synk_FMGuard guard;
+    FM_extract_urgent(); //LBTS latency first, ahead of the bulk of events
+    TM_Tick();
+    FM_extract(~0); //Also runs whatever the progress thread took in
     TM_Tick();
 }
 /*---------------------------------------------------------------------------*/
@@ -325,19 +393,177 @@ static void Synk_Init( const char *stdout_fname )
     FML_RegisterHandler( &synk_lbts.fed_fm_retract_hid, &Synk_FMRetractHandler);
 
     TM_Init(0); TM_SetLBTSStartProc(Synk_LBTSStarted);
+    TM_SetQuietProc(Synk_QuietVote);
+    TM_SetCountersProc(Synk_CountersProc);
 
     FML_Barrier();
     MUSDBG( 2, "Initialized" );
 }
 /*---------------------------------------------------------------------------*/
+void Synk_TopoAddDest( int dest_pe, const SimTime &la )
+{
+    int n = Synk_numnodes;
+    synk_topo.min_la.reduce_to( la );
+    if( dest_pe == SimPID::ANY_FED_ID )
+    {
+        synk_topo.any_dest = true;
+        synk_topo.any_la.reduce_to( la );
+    }
+    else
+    {
+        ENSURE( 0, 0 <= dest_pe && dest_pe < n, dest_pe << " " << n );
+        synk_topo.dest.resize( n, 0 );
+        synk_topo.dest[dest_pe] = 1;
+        synk_topo.la.resize( n, SimTime::MAX_TIME );
+        synk_topo.la[dest_pe].reduce_to( la );
+    }
+    ENSURE( 0, !synk_topo.applied || synk_topo.all2all ||
+               (dest_pe != SimPID::ANY_FED_ID && synk_topo.dest[dest_pe]),
+            "Link to federate " << dest_pe << " must be declared before start");
+}
+/*---------------------------------------------------------------------------*/
+/* Notes a process's least lookahead, which the kernel adds into eets.       */
+/*---------------------------------------------------------------------------*/
+static void Synk_TopoProcessLA( const SimTime &proc_min_la )
+{
+    if( synk_topo.max_proc_la < proc_min_la )
+        { synk_topo.max_proc_la = proc_min_la; }
+}
+/*---------------------------------------------------------------------------*/
+void Synk_TopoAddSrc( int src_pe )
+{
+    int n = Synk_numnodes;
+    if( src_pe == SimPID::ANY_FED_ID ) { synk_topo.any_src = true; }
+    else
+    {
+        ENSURE( 0, 0 <= src_pe && src_pe < n, src_pe << " " << n );
+        synk_topo.src.resize( n, 0 );
+        synk_topo.src[src_pe] = 1;
+    }
+    ENSURE( 0, !synk_topo.applied || synk_topo.all2all ||
+               (src_pe != SimPID::ANY_FED_ID && synk_topo.src[src_pe]),
+            "Link from federate " << src_pe << " must be declared before start");
+}
+/*---------------------------------------------------------------------------*/
+/* Completes the sender side from every federate's declared destinations,    */
+/* and registers the result with TM.  TM subtracts its minimum external      */
+/* lookahead from this federate's contributions (they already include one)   */
+/* and adds each receiver's lookahead back on the way out.  So receivers get */
+/* their own declared lookahead only if none is below the largest per-process*/
+/* lookahead folded into eets; otherwise all get the least remote lookahead. */
+/*---------------------------------------------------------------------------*/
+static void Synk_TopoApply( void )
+{
+    int n = Synk_numnodes, me = Synk_nodeid;
+    bool explicit_dests = !synk_topo.any_dest && !synk_topo.dest.empty();
+
+    synk_topo.dest.resize( n, 0 );
+    synk_topo.src.resize( n, 0 );
+    if( synk_topo.any_dest || !explicit_dests )
+        { synk_topo.dest.assign( n, 1 ); }
+    if( synk_topo.any_src ) { synk_topo.src.assign( n, 1 ); }
+
+    #if MPI_AVAILABLE
+    {
+        vector<char> senders( n, 0 );
+        int retcode = MPI_Alltoall( &synk_topo.dest[0], 1, MPI_CHAR,
+                                    &senders[0], 1, MPI_CHAR, MPI_COMM_WORLD );
+        ENSURE( 0, retcode == MPI_SUCCESS, retcode );
+        for( int i = 0; i < n; i++ )
+            { if( senders[i] ) synk_topo.src[i] = 1; }
+    }
+    #else /*MPI_AVAILABLE*/
+        if( synk_topo.src.empty() || !explicit_dests )
+            { synk_topo.src.assign( n, 1 ); } //Can't infer senders
+    #endif /*MPI_AVAILABLE*/
+    synk_topo.dest[me] = synk_topo.src[me] = 0;
+
+    int ndests = 0, nsrcs = 0;
+    for( int i = 0; i < n; i++ )
+        { ndests += synk_topo.dest[i]; nsrcs += synk_topo.src[i]; }
+    synk_topo.all2all = (ndests == n-1 && nsrcs == n-1);
+
+    TM_Time tm_la = TM_ZERO;
+    if( synk_topo.min_la < SimTime::MAX_TIME )
+        { ts_musik2synk( tm_la, synk_topo.min_la ); }
+    synk_topo.la.resize( n, SimTime::MAX_TIME );
+    for( int i = 0; i < n; i++ )
+    {
+        synk_topo.la[i].reduce_to( synk_topo.any_la );
+        if( synk_topo.la[i] >= SimTime::MAX_TIME )
+            { synk_topo.la[i] = synk_topo.min_la; }
+    }
+    synk_topo.perpair = synk_topo.min_la < SimTime::MAX_TIME &&
+                        synk_topo.max_proc_la <= synk_topo.min_la;
+    bool larger_la = false; //Does any receiver gain from its own lookahead?
+    for( int i = 0; i < n; i++ )
+    {
+        if( synk_topo.dest[i] && synk_topo.max_proc_la < synk_topo.la[i] )
+            { larger_la = true; }
+    }
+    synk_topo.perpair = synk_topo.perpair && larger_la;
+    if( !synk_topo.all2all || synk_topo.perpair ) //TM all-to-all has one LA
+    {
+        for( int i = 0; i < n; i++ )
+        {
+            TM_Time tm_la_i = tm_la;
+            if( synk_topo.perpair ) ts_musik2synk( tm_la_i, synk_topo.la[i] );
+            if( synk_topo.dest[i] ) TM_TopoAddReceiver( i, tm_la_i );
+            if( synk_topo.src[i] ) TM_TopoAddSender( i );
+        }
+        synk_topo.dest[me] = 1; //Local sends are always fine
+    }
+    if( synk_topo.perpair ) ts_musik2synk( tm_la, synk_topo.max_proc_la );
+    TM_TopoSetMinExternalLA( tm_la );
+    synk_topo.applied = true;
+
+    const char *estr = getenv("MK_TOPOLEARN");
+    synk_topo.learn = estr && !strcmp(estr, "true");
+    if( synk_topo.learn ) { synk_topo.used.assign( n, 0 ); }
+
+    MUSDBG( 1, me << ": Federate topology " <<
+               (synk_topo.all2all ? "all-to-all" : "sparse") <<
+               (synk_topo.perpair ? " per-pair lookahead" : "") <<
+               " receivers " << ndests << " senders " << nsrcs );
+}
+/*---------------------------------------------------------------------------*/
+static void Synk_TopoSent( int dest_pe )
+{
+    ENSURE( 1, synk_topo.all2all || synk_topo.dest[dest_pe],
+            Synk_nodeid << " sends to undeclared federate " << dest_pe );
+    if( synk_topo.learn ) { synk_topo.used[dest_pe]++; }
+}
+/*---------------------------------------------------------------------------*/
+static void Synk_TopoReport( void )
+{
+    int n = Synk_numnodes, me = Synk_nodeid, ndeclared = 0, nused = 0;
+    ostringstream links;
+    for( int i = 0; i < n; i++ )
+    {
+        if( i == me ) continue;
+        if( synk_topo.dest[i] ) ndeclared++;
+        if( synk_topo.learn && synk_topo.used[i] > 0 )
+        {
+            nused++;
+            links << " " << i << ":" << synk_topo.used[i];
+        }
+    }
+    MUSDBGNNL(0, me << ":      Federate links = " << ndeclared << " declared" );
+    if( synk_topo.learn ) { MUSDBGNNL(0, ", " << nused << " used [" << links.str() << " ]" ); }
+    MUSDBG(0, "");
+}
+/*---------------------------------------------------------------------------*/
 static void Synk_Start( void )
 {
+    Synk_TopoApply();
     TM_InitDone();
 }
 /*---------------------------------------------------------------------------*/
 static void Synk_Stop( void )
 {
-    if(Synk_nodeid==0)MUSDBG( 1, "Stopping" );
+    if(Synk_nodeid==0)MUSDBG( 1, (Synk_Quiescent() ? "Stopping early" : "Stopping") );
+    Synk_ProgressStop();
+    TM_TopoSetNoForwarding(); //No more events are executed from here on
     TM_Time tm_ts; ts_musik2synk( tm_ts, SimTime::MAX_TIME );
     while( TM_LT( synk_lbts.ts, tm_ts ) )
     {
@@ -371,16 +597,285 @@ if(0){//BGL
     FM_finalize();
     if(Synk_nodeid < _printdbgmaxfedid)TM_PrintStats();
 }
+
 /*---------------------------------------------------------------------------*/
-void Synk_TopoAddDest( int dest_pe, const SimTime &la )
+/*---------------------------------------------------------------------------*/
+__thread SlabHeap *SlabHeap::tls_heap = 0;
+SlabHeap *SlabHeap::heaps = 0;
+unsigned long SlabHeap::chunk_bytes = 0;
+unsigned long SlabHeap::warn_bytes = 0;
+long SlabHeap::max_idle = 1;
+int SlabHeap::hugepages = 0;
+bool SlabHeap::per_thread = false;
+
+/*---------------------------------------------------------------------------*/
+SlabHeap::SlabHeap( void ) : remote_free(0), next_heap(0)
 {
-    TM_Time tm_la; ts_musik2synk( tm_la, la );
-    TM_TopoAddReceiver( dest_pe, tm_la );
+    memset( sclass, 0, sizeof(sclass) );
+    memset( &st, 0, sizeof(st) );
 }
+
 /*---------------------------------------------------------------------------*/
-void Synk_TopoAddSrc( int src_pe )
+void SlabHeap::configure( void )
+{
+    char *estr = 0;
+
+    unsigned long kb = 2048;
+    estr = getenv("SLAB_CHUNKKB");
+    if( estr ) kb = atol( estr );
+    unsigned long cb = 256*1024; /*Must hold several MAX_BLOCK blocks*/
+    while( cb < kb*1024 ) cb *= 2;
+
+    estr = getenv("SLAB_MAXIDLE");
+    max_idle = !estr ? 1 : atol( estr );
+    if( max_idle < 0 ) max_idle = 0;
+
+    estr = getenv("SLAB_HUGEPAGES");
+    hugepages = !estr ? 0 : (!strcmp(estr, "hugetlb") ? 2 :
+                             (!strcmp(estr, "thp") ? 1 : 0));
+
+    estr = getenv("SLAB_PERTHREAD");
+    per_thread = estr && !strcmp(estr, "true");
+
+    estr = getenv("SLAB_WARNMB");
+    warn_bytes = (!estr ? 2000UL : (unsigned long)atol(estr))*1000UL*1000UL;
+
+    chunk_bytes = cb;
+}
+
+/*---------------------------------------------------------------------------*/
+void SlabHeap::print_config( void )
+{
+    if( !chunk_bytes ) configure();
+    SIMCFG( "SLAB_CHUNKKB", chunk_bytes/1024,
+            "slab chunk size (power of 2)" );
+    SIMCFG( "SLAB_MAXIDLE", max_idle,
+            "#idle chunks retained per size class" );
+    SIMCFG( "SLAB_HUGEPAGES",
+            (hugepages==2 ? "hugetlb" : (hugepages==1 ? "thp" : "none")),
+            "huge page backing for slab chunks" );
+    SIMCFG( "SLAB_PERTHREAD", (per_thread ? "true" : "false"),
+            "separate slab heap per thread?" );
+    SIMCFG( "SLAB_WARNMB", warn_bytes/1000/1000,
+            "warn when slab memory reaches this" );
+}
+
+/*---------------------------------------------------------------------------*/
+/* Binds the calling thread to a heap: its own if per-thread heaps are on    */
+/* (or one is asked for), or the first (main) heap otherwise.                */
+/*---------------------------------------------------------------------------*/
+SlabHeap *SlabHeap::attach( bool own )
+{
+    static SlabHeap *first_heap = 0;
+
+    if( !chunk_bytes ) configure();
+
+    SlabHeap *h = first_heap;
+    if( !h || per_thread || own )
+    {
+        h = new SlabHeap();
+        do { h->next_heap = heaps; }
+        while( !__sync_bool_compare_and_swap( &heaps, h->next_heap, h ) );
+        if( !first_heap ) first_heap = h;
+    }
+    tls_heap = h;
+    return h;
+}
+
+/*---------------------------------------------------------------------------*/
+void SlabHeap::totals( Stats &tot )
+{
+    memset( &tot, 0, sizeof(tot) );
+    for( SlabHeap *h = heaps; h; h = h->next_heap )
+    {
+        tot.mapped += h->st.mapped;
+        tot.mapped_hwm += h->st.mapped_hwm;
+        tot.inuse += h->st.inuse;
+        tot.inuse_hwm += h->st.inuse_hwm;
+        tot.nchunks += h->st.nchunks;
+        tot.nreleased += h->st.nreleased;
+        tot.nlarge += h->st.nlarge;
+        tot.nremote += h->st.nremote;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+void SlabHeap::unlink_avail( Chunk *c )
+{
+    ENSURE( 1, c->avail, "" );
+    if( c->prev ) c->prev->next = c->next;
+    else sclass[c->sc].avail = c->next;
+    if( c->next ) c->next->prev = c->prev;
+    c->prev = c->next = 0;
+    c->avail = false;
+}
+
+/*---------------------------------------------------------------------------*/
+void *SlabHeap::alloc_slow( int sc )
 {
-    TM_TopoAddSender( src_pe );
+    drain_remote();
+    if( !sclass[sc].avail )
+    {
+        Chunk *c = new_chunk( sc );
+        c->next = 0;
+        c->prev = 0;
+        c->avail = true;
+        sclass[sc].avail = c;
+        sclass[sc].nidle++;
+    }
+    return alloc( sc*GRAIN );
+}
+
+/*---------------------------------------------------------------------------*/
+void SlabHeap::free_slow( Chunk *c )
+{
+    SizeClass &s = sclass[c->sc];
+    if( !c->avail )
+    {
+        c->prev = 0;
+        c->next = s.avail;
+        if( s.avail ) s.avail->prev = c;
+        s.avail = c;
+        c->avail = true;
+    }
+    if( c->nused == 0 && ++s.nidle > max_idle )
+    {
+        release_chunk( c );
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+void *SlabHeap::alloc_large( size_t nbytes )
+{
+    void *p = malloc( nbytes );
+    ENSURE( 0, p, "Can't malloc "<<nbytes<<" bytes" );
+    st.nlarge++;
+    count_inuse( nbytes );
+    return p;
+}
+
+/*---------------------------------------------------------------------------*/
+void SlabHeap::free_large( void *p, size_t nbytes )
+{
+    st.inuse -= nbytes;
+    ::free( p );
+}
+
+/*---------------------------------------------------------------------------*/
+void SlabHeap::free_remote( void *p )
+{
+    FreeBlock *b = (FreeBlock *)p;
+    do { b->next = remote_free; }
+    while( !__sync_bool_compare_and_swap( &remote_free, b->next, b ) );
+}
+
+/*---------------------------------------------------------------------------*/
+void SlabHeap::drain_remote( void )
+{
+    if( !remote_free ) return;
+    FreeBlock *b = __sync_lock_test_and_set( &remote_free, (FreeBlock *)0 );
+    while( b )
+    {
+        FreeBlock *nb = b->next;
+        Chunk *c = chunk_of( b );
+        ENSURE( 1, c->owner == this, "" );
+        st.nremote++;
+        free( b, c->bsz );
+        b = nb;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+SlabHeap::Chunk *SlabHeap::new_chunk( int sc )
+{
+    char *mem = 0;
+    bool huge = false;
+
+#ifdef MAP_HUGETLB
+    if( hugepages == 2 )
+    {
+        void *m = mmap( 0, chunk_bytes, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0 );
+        if( m != MAP_FAILED && (uintptr_t(m) & (chunk_bytes-1)) != 0 )
+            { munmap( m, chunk_bytes ); m = MAP_FAILED; }
+        if( m == MAP_FAILED )
+        {
+            MUSDBG( 1, "Slab hugetlb mapping failed; using regular pages" );
+            hugepages = 1;
+        }
+        else { mem = (char *)m; huge = true; }
+    }
+#endif
+
+    if( !mem ) /*Over-map and trim to get a chunk-aligned region*/
+    {
+        size_t len = 2*chunk_bytes;
+        void *m = mmap( 0, len, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0 );
+        ENSURE( 0, m != MAP_FAILED, "Can't map "<<len<<" bytes" );
+        char *raw = (char *)m;
+        mem = (char *)((uintptr_t(raw) + chunk_bytes-1) &
+                       ~(uintptr_t(chunk_bytes)-1));
+        if( mem > raw ) munmap( raw, mem-raw );
+        if( raw+len > mem+chunk_bytes )
+            munmap( mem+chunk_bytes, (raw+len)-(mem+chunk_bytes) );
+#ifdef MADV_HUGEPAGE
+        if( hugepages == 1 ) madvise( mem, chunk_bytes, MADV_HUGEPAGE );
+#endif
+    }
+
+    Chunk *c = (Chunk *)mem;
+    long hdrsz = ((sizeof(Chunk)-1)/64+1)*64;
+    c->owner = this;
+    c->sc = sc;
+    c->avail = false;
+    c->huge = huge;
+    c->bsz = sc*GRAIN;
+    c->nblocks = (chunk_bytes-hdrsz)/c->bsz;
+    c->ncarved = 0;
+    c->nused = 0;
+    c->base = mem + hdrsz;
+    c->free_list = 0;
+    c->prev = c->next = 0;
+
+    unsigned long prev_mapped = st.mapped;
+    st.mapped += chunk_bytes;
+    if( st.mapped > st.mapped_hwm ) st.mapped_hwm = st.mapped;
+    st.nchunks++;
+    if( prev_mapped < warn_bytes && st.mapped >= warn_bytes )
+      {MUSDBG( 0, st.mapped<<" slab bytes reaching RAM limit "<<warn_bytes);}
+    MUSDBG( 2, "SlabHeap::new_chunk(" << sc*GRAIN << ") " << c->nblocks <<
+               " blocks ptr=" << ((void*)mem) << (huge?" hugetlb":"") );
+
+    return c;
+}
+
+/*---------------------------------------------------------------------------*/
+void SlabHeap::release_chunk( Chunk *c )
+{
+    ENSURE( 1, c->nused == 0, c->nused );
+    unlink_avail( c );
+    sclass[c->sc].nidle--;
+    st.mapped -= chunk_bytes;
+    st.nreleased++;
+    munmap( (void *)c, chunk_bytes );
+}
+
+/*---------------------------------------------------------------------------*/
+/* Returns every idle chunk to the OS, regardless of the per-class reserve   */
+/*---------------------------------------------------------------------------*/
+void SlabHeap::trim( void )
+{
+    drain_remote();
+    for( int sc = 0; sc < NCLASSES; sc++ )
+    {
+        for( Chunk *c = sclass[sc].avail; c; )
+        {
+            Chunk *nc = c->next;
+            if( c->nused == 0 ) release_chunk( c );
+            c = nc;
+        }
+    }
 }
 
 /*---------------------------------------------------------------------------*/
@@ -394,7 +889,6 @@ const string *SimEventBase::name( void ) const
 /*---------------------------------------------------------------------------*/
 /* Returns whether or not this event is a subclass of given event "type"     */
 /*---------------------------------------------------------------------------*/
-unsigned long SimEventBase::bytes_alloced_sofar = 0;
 bool SimEventBase::isa( const string &s ) const
 {
     bool s_is_prefix_of_my_name = name()->find( s ) == 0;
@@ -1183,6 +1677,7 @@ void MicroKernel::init( const char *stdout_fname )
     status = INITIALIZING;
 
     Synk_Init( stdout_fname );
+    SimProcessBase::sync_epsilon = params.sync.epsilon;
 
     if( fed_id() >= _printdbgmaxfedid )
     {
@@ -1216,6 +1711,7 @@ void MicroKernel::init( const char *stdout_fname )
 const SimPID &MicroKernel::add_mp( MicroProcess *p )
 {
     ENSURE( 0, p, "Process should exist!" );
+    ENSURE( 0, !tls_worker, "Can't add processes in a parallel pass" );
     idmap.add( p, fed_id() );
     cts_pq.add( p );
     ets_pq.add( p );
@@ -1274,6 +1770,98 @@ void Simulator::report_status( const SimTime &dt, const SimTime &endt )
     report.end = endt;
 }
 
+/*---------------------------------------------------------------------------*/
+/*! Original behaviour: start an LBTS computation as soon as nothing is
+ *  committable. */
+class EagerLBTSPolicy : public LBTSPolicy
+{
+    public: virtual const char *name( void ) const { return "eager"; }
+    public: virtual bool initiate( const Observation &o ) { return true; }
+};
+
+/*---------------------------------------------------------------------------*/
+/*! Puts off initiation while it is unlikely to pay for itself:
+ *  - never when this federate is idle, beyond the target rate, since waiting
+ *    then only adds to the wall clock;
+ *  - while the local contribution cannot lift the LBTS above its current
+ *    value, i.e. the round would be unproductive anyway;
+ *  - while there is optimistic work to do, until an interval has elapsed
+ *    since the last initiation.  The interval doubles after each round that
+ *    neither advanced the LBTS nor saw any messages sent or received here,
+ *    and halves after each round during which this federate was mostly
+ *    idle, staying within [1/rate, maxdefer].
+ *  Nothing is ever put off for longer than maxdefer seconds. */
+class AdaptiveLBTSPolicy : public LBTSPolicy
+{
+    public: AdaptiveLBTSPolicy( double rate, double maxdefer, double idlehigh ):
+                mininterval( rate > 0 ? 1.0/rate : 0 ), maxdefer( maxdefer ),
+                idlehigh( idlehigh ), interval( mininterval ),
+                last_start( -1 ), last_idle( 0 ),
+                last_nsent( 0 ), last_nrecd( 0 ), last_lbts( 0 ),
+                deferring_since( -1 ), nunproductive( 0 ), nshrink( 0 ),
+                ngrow( 0 ) {}
+    public: virtual const char *name( void ) const { return "adaptive"; }
+    public: virtual bool initiate( const Observation &o )
+            {
+                if( last_start < 0 ) { last_start = o.now; last_idle = o.idle; }
+                if( deferring_since < 0 ) { deferring_since = o.now; }
+
+                double since = o.now - last_start;
+                bool go = false;
+                if( o.now - deferring_since >= maxdefer ) go = true;
+                else if( o.candidate <= o.lbts ) go = false;
+                else if( o.nevents <= 0 ) go = (since >= mininterval);
+                else go = (since >= interval);
+
+                if( go )
+                {
+                    last_start = o.now; last_idle = o.idle;
+                    deferring_since = -1;
+                }
+                return go;
+            }
+    public: virtual void completed( const Observation &o )
+            {
+                double span = o.now - last_start;
+                double idlefrac = span > 0 ? (o.idle-last_idle)/span : 1;
+                long nmsgs = (o.nsent-last_nsent) + (o.nrecd-last_nrecd);
+                if( o.lbts <= last_lbts )
+                {
+                    nunproductive++;
+                    if( nmsgs <= 0 && interval < maxdefer )
+                    {
+                        interval = interval > 0 ? 2*interval : 1e-4;
+                        if( interval > maxdefer ) interval = maxdefer;
+                        ngrow++;
+                    }
+                }
+                else if( idlefrac > idlehigh && interval > mininterval )
+                {
+                    interval /= 2;
+                    if( interval < mininterval ) interval = mininterval;
+                    nshrink++;
+                }
+                MUSDBG( 3, "LBTS policy advance "<<(o.lbts-last_lbts)<<
+                           " idle "<<idlefrac<<" msgs "<<nmsgs<<
+                           " interval "<<interval );
+                last_idle = o.idle;
+                last_nsent = o.nsent; last_nrecd = o.nrecd;
+                last_lbts = o.lbts;
+            }
+    public: virtual void print_stats( ostream &out, const SimFedID &fed )
+            {
+                MUSDBG(0, fed << ":  LBTS policy interval = " << interval << " [ -" << nshrink << " +" << ngrow << " ] unproductive " << nunproductive );
+            }
+
+    private: double mininterval, maxdefer, idlehigh;
+    private: double interval; /*Seconds between initiations while busy*/
+    private: double last_start, last_idle; /*At the latest initiation*/
+    private: long last_nsent, last_nrecd;
+    private: SimTime last_lbts;
+    private: double deferring_since; /*When initiation was first declined*/
+    private: long nunproductive, nshrink, ngrow;
+};
+
 /*---------------------------------------------------------------------------*/
 MicroKernel::Parameters::Parameters( void )
 {
@@ -1299,6 +1887,61 @@ MicroKernel::Parameters::Parameters( void )
     trace.initialized = false;
     estr = getenv("TRACEFILENAME");
     trace.filename_prefix = strdup( !estr ? "trace" : estr );
+
+    estr = getenv("MK_OPTPOSTLBTS");
+    optimism.postlbts = !estr || strcmp(estr, "false");
+    estr = getenv("MK_OPTWINDOW");
+    optimism.window = !estr ? SimTime::MAX_TIME : SimTime(atof(estr));
+    estr = getenv("MK_OPTTHROTTLE");
+    optimism.throttle = !estr || strcmp(estr, "false");
+    estr = getenv("MK_OPTRBHIGH");
+    optimism.rbhigh = !estr ? 0.2 : atof(estr);
+    estr = getenv("MK_OPTRBLOW");
+    optimism.rblow = !estr ? 0.05 : atof(estr);
+    estr = getenv("MK_OPTMINSCALE");
+    optimism.minscale = !estr ? 1.0/64 : atof(estr);
+    ENSURE( 0, 0 < optimism.minscale && optimism.minscale <= 1,
+            "MK_OPTMINSCALE must be in (0,1]" );
+    ENSURE( 0, optimism.rblow <= optimism.rbhigh,
+            "MK_OPTRBLOW must not exceed MK_OPTRBHIGH" );
+
+    estr = getenv("MK_THREADS");
+    threads.nworkers = !estr ? 1 : atoi(estr);
+    if( threads.nworkers < 1 ) threads.nworkers = 1;
+    estr = getenv("MK_THREADPIN");
+    threads.pin = estr && !strcmp(estr, "true");
+    estr = getenv("MK_THREADMINPROCS");
+    threads.minprocs = !estr ? 2 : atoi(estr);
+    threads.npasses = threads.nprocs = 0;
+
+    estr = getenv("MK_PROGRESS");
+    progress.on = estr && !strcmp(estr, "true");
+    estr = getenv("MK_PROGRESSUS");
+    progress.pollus = !estr ? 50 : atol(estr);
+    progress.ncaptured = 0;
+
+    estr = getenv("MK_LBTSPOLICY");
+    lbts.policy = strdup( !estr ? "eager" : estr );
+    estr = getenv("MK_LBTSRATE");
+    lbts.rate = !estr ? 0 : atof(estr);
+    estr = getenv("MK_LBTSMAXDEFERSEC");
+    lbts.maxdefer = !estr ? 0.01 : atof(estr);
+    estr = getenv("MK_LBTSIDLEHIGH");
+    lbts.idlehigh = !estr ? 0.5 : atof(estr);
+    lbts.ndeferred = 0;
+    lbts.idle = 0;
+    ENSURE( 0, lbts.rate >= 0, "MK_LBTSRATE must not be negative" );
+
+    estr = getenv("MK_QUIESCE");
+    quiesce.on = !estr || strcmp(estr, "false");
+    quiesce.at = SimTime::MAX_TIME;
+
+    counters.n = 0;
+    counters.ntotals = 0;
+
+    estr = getenv("MK_SYNCEPSILON");
+    sync.epsilon = !estr ? 0 : atof(estr);
+    ENSURE( 0, sync.epsilon >= 0, "MK_SYNCEPSILON must not be negative" );
 }
 
 /*---------------------------------------------------------------------------*/
@@ -1320,11 +1963,78 @@ void MicroKernel::start( void )
             "plain text for event trace?" );
     SIMCFG( "TRACEFILENAME", params.trace.filename_prefix,
             "tracefile prefix" );
+    SIMCFG( "MK_OPTPOSTLBTS", (params.optimism.postlbts ? "true" : "false"),
+            "optimistic right after each LBTS?" );
+    SIMCFG( "MK_OPTWINDOW", params.optimism.window.ts,
+            "max optimistic span beyond LBTS" );
+    SIMCFG( "MK_OPTTHROTTLE", (params.optimism.throttle ? "true" : "false"),
+            "adapt optimistic span to rollbacks?" );
+    SIMCFG( "MK_OPTRBHIGH", params.optimism.rbhigh,
+            "rollback fraction to shrink span" );
+    SIMCFG( "MK_OPTRBLOW", params.optimism.rblow,
+            "rollback fraction to grow span" );
+    SIMCFG( "MK_OPTMINSCALE", params.optimism.minscale,
+            "smallest fraction of span" );
+    SIMCFG( "MK_THREADS", params.threads.nworkers,
+            "#threads advancing processes" );
+    SIMCFG( "MK_THREADPIN", (params.threads.pin ? "true" : "false"),
+            "bind threads to cores?" );
+    SIMCFG( "MK_THREADMINPROCS", params.threads.minprocs,
+            "fewest processes for parallel pass" );
+    SIMCFG( "MK_PROGRESS", (params.progress.on ? "true" : "false"),
+            "drain network on a separate thread?" );
+    SIMCFG( "MK_PROGRESSUS", params.progress.pollus,
+            "progress thread poll interval (us)" );
+    SIMCFG( "MK_LBTSPOLICY", params.lbts.policy,
+            "when to initiate LBTS (eager|adaptive)" );
+    SIMCFG( "MK_LBTSRATE", params.lbts.rate,
+            "target LBTS initiations/sec (0=any)" );
+    SIMCFG( "MK_LBTSMAXDEFERSEC", params.lbts.maxdefer,
+            "longest LBTS initiation deferral" );
+    SIMCFG( "MK_LBTSIDLEHIGH", params.lbts.idlehigh,
+            "idle fraction to initiate sooner" );
+    SIMCFG( "MK_QUIESCE", (params.quiesce.on ? "true" : "false"),
+            "stop early once app is quiescent?" );
+    SIMCFG( "MK_SYNCEPSILON", params.sync.epsilon.ts,
+            "tolerated timestamp error (0=exact)" );
+    SlabHeap::print_config();
 
     ENSURE( 0, status == INITIALIZED, status );
     status = STARTING;
 
+    start_workers();
+
+    if( !lbts_policy )
+    {
+        if( !strcmp( params.lbts.policy, "eager" ) )
+        {
+            set_lbts_policy( new EagerLBTSPolicy() );
+        }
+        else if( !strcmp( params.lbts.policy, "adaptive" ) )
+        {
+            set_lbts_policy( new AdaptiveLBTSPolicy( params.lbts.rate,
+                             params.lbts.maxdefer, params.lbts.idlehigh ) );
+        }
+        else
+        {
+            FAIL( "Unknown MK_LBTSPOLICY " << params.lbts.policy );
+        }
+    }
+
     Synk_Start();
+    if( params.progress.on && !FM_threads_serialized() )
+    {
+        MUSDBG( 0, "MK_PROGRESS ignored: MPI did not grant "
+                   "MPI_THREAD_SERIALIZED, needed by the progress thread" );
+        params.progress.on = false;
+    }
+    if( params.progress.on ) { Synk_ProgressStart( params.progress.pollus ); }
+    if( params.sync.epsilon > 0 && fed_id() == 0 &&
+        (params.quiesce.on || params.counters.n > 0) )
+    {
+        MUSDBG( 0, "MK_SYNCEPSILON>0: relaxed commits may pass the LBTS cut, "
+                   "so no early stop on quiescence and no counter totals" );
+    }
     if(fed_id()==0)MUSDBG( 0, "Simulator started." );
 
     TIMER_NOW( start_time_with_init );
@@ -1456,6 +2166,9 @@ const SimTime MicroKernel::run( const SimTime &max_t, unsigned long max_nevents)
     ENSURE( 0, status == STARTED || status == RUNNING, status );
     status = RUNNING;
 
+    if( params.quiesce.at < SimTime::MAX_TIME ) return max_t;
+
+    long last_nevents = 0;
     for( unsigned long i = 0; i < max_nevents; )
     {
         long nevents = 0;
@@ -1480,11 +2193,25 @@ if(0)/*XXX*/if( synk_lbts.nactive <= 0 && i%1000==0 ) {Synk_Tick();} //Read in n
             start_timer_started = true;
         }
 
+        //Relaxed sync: run up to epsilon past LBTS before another round,
+        //falling back to the round if that makes no progress
+        bool relaxed = params.sync.epsilon > 0 && cpb && !cpb->is_kernel &&
+                       min_commit_ts > glbts &&
+                       min_commit_ts <= limit_ts + params.sync.epsilon;
+
         if( min_commit_ts <= glbts )
         {
             MUSDBG( 5, "conservative advance from " << min_commit_ts
                         << " to " << limit_ts );
-            nevents += advance_process( cpb, true, limit_ts );
+            nevents += (workers && !cpb->is_kernel) ?
+                       advance_parallel( limit_ts ) :
+                       advance_process( cpb, true, limit_ts );
+        }
+        else if( relaxed &&
+                 (nevents = advance_process( cpb, true, limit_ts )) > 0 )
+        {
+            MUSDBG( 5, "relaxed advance from " << min_commit_ts
+                        << " to " << limit_ts+params.sync.epsilon );
         }
         else
         {
@@ -1492,13 +2219,32 @@ if(0)/*XXX*/if( synk_lbts.nactive <= 0 && i%1000==0 ) {Synk_Tick();} //Read in n
 
             MUSDBG( 5, "ETS_PQ={"<<ets_pq<<"}" );
 
+            TIMER_TYPE pass_start; TIMER_NOW( pass_start );
+            LBTSPolicy::Observation obs;
+            obs.now = TIMER_SECONDS( pass_start );
+            obs.idle = params.lbts.idle;
+            obs.nevents = last_nevents;
+            obs.nsent = synk_lbts.nsent; obs.nrecd = synk_lbts.nrecd;
+            if( synk_lbts.nactive <= 0 )
+            {
+                obs.lbts = glbts;
+                obs.candidate = min_emitable_ts;
+                do_lbts = lbts_policy->initiate( obs );
+                if( !do_lbts ) params.lbts.ndeferred++;
+            }
+
+            long nlbts = synk_lbts.tot_lbts;
             if( do_lbts ) { Synk_InitiateLBTS( min_emitable_ts ); }
 
-            if( synk_lbts.nactive > 0 ) { Synk_Tick(); }
+            //Still service the network when deferring, to join remote rounds
+            if( synk_lbts.nactive > 0 || !do_lbts ) { Synk_Tick(); }
 
-            if( synk_lbts.nactive <= 0 ) //Just got a new advance
+            if( synk_lbts.nactive <= 0 &&
+                synk_lbts.tot_lbts > nlbts ) //Just got a new advance
             {
                 ts_synk2musik( glbts, synk_lbts.ts );
+                obs.lbts = glbts;
+                lbts_policy->completed( obs );
                 if( report.next < SimTime::MAX_TIME &&
                     glbts >= report.next )
                 {
@@ -1549,7 +2295,16 @@ cout<<"Sleep "<<microsec<<" microseconds"<<endl;
                 }
 
                 make_lbts_callbacks();
-                do_optimistic = (num_feds() <= 1);
+                adapt_optimism();
+                do_optimistic = (num_feds() <= 1) || params.optimism.postlbts;
+                report_counters();
+
+                if( params.quiesce.on && Synk_Quiescent() ) //All feds agreed
+                {
+                    params.quiesce.at = glbts;
+                    if(fed_id()==0)MUSDBG( 1, "Quiescent at LBTS "<<glbts );
+                    break;
+                }
             }
 
             if( do_optimistic )
@@ -1560,8 +2315,8 @@ MUSDBG(3,"b="<<b);//XXX
                     MicroProcess *ppb = pts_pq.top();
                     const SimTime &min_processable_ts =
                             ppb ? ppb->epts() : SimTime::MAX_TIME;
-                    const SimTime &pspan =
-                            ppb ? ppb->pspan() : SimTime::MAX_TIME;
+                    const SimTime pspan = optimistic_span(
+                            ppb ? ppb->pspan() : SimTime::MAX_TIME );
 MUSDBG(4,"optimistic mpts="<<min_processable_ts<<" ppb="<<*ppb);//XXX
                     if( min_processable_ts >= max_t ||
                         min_processable_ts >= SimTime::MAX_TIME ||
@@ -1592,11 +2347,20 @@ MUSDBG(3,"Breaking optimistic batch");//XXX
                     }
                 }
             }
+
+            if( nevents <= 0 ) //Nothing to do but wait for the LBTS
+            {
+                TIMER_TYPE pass_end; TIMER_NOW( pass_end );
+                params.lbts.idle += TIMER_DIFF( pass_end, pass_start );
+            }
         }
 
         i += nevents;
+        last_nevents = nevents;
     }
 
+    if( params.quiesce.at < SimTime::MAX_TIME ) return max_t;//Nothing to come
+
     MicroProcess *cpb = cts_pq.top();
     SimTime min_commit_ts = cpb ? cpb->ects() : SimTime::MAX_TIME;
     min_commit_ts.reduce_to( glbts );
@@ -1606,6 +2370,115 @@ MUSDBG(3,"Breaking optimistic batch");//XXX
     return min_commit_ts;
 }
 
+/*---------------------------------------------------------------------------*/
+/*! This federate's vote in the LBTS reduction being started: quiet only if
+ *  all its events before the cut (the previous reduction's result, the same
+ *  on every federate) are committed, none beyond it could be (relaxed sync
+ *  commits up to epsilon past LBTS), and the application finds its committed
+ *  state quiescent as of the cut. */
+bool MicroKernel::local_quiet( const SimTime &cut )
+{
+    if( !params.quiesce.on || status != RUNNING ) return false;
+    if( glbts + params.sync.epsilon > cut ) return false; //May be past the cut
+    MicroProcess *cpb = cts_pq.top();
+    if( cpb && cpb->ects() < cut ) return false; //Not caught up to the cut
+    return quiescent( cut );
+}
+
+/*---------------------------------------------------------------------------*/
+/*! Registers a counter to be reduced with op across all federates along with
+ *  every LBTS computation; returns its index into counter_values() arrays.
+ *  Every federate must add the same counters in the same order, after init()
+ *  and before start(). */
+int MicroKernel::add_counter( CounterOp op )
+{
+    ENSURE( 0, status == INITIALIZED, "Counters must be added before start()" );
+    ENSURE( 0, params.counters.n < TM_MAXCOUNTERS,
+               "At most " << TM_MAXCOUNTERS << " counters" );
+    TM_CounterOp tmop = op == COUNTER_MIN ? TM_COUNTER_MIN :
+                        op == COUNTER_MAX ? TM_COUNTER_MAX : TM_COUNTER_SUM;
+    int i = TM_AddCounter( tmop );
+    ENSURE( 1, i == params.counters.n, "TM counter " << i );
+    return params.counters.n++;
+}
+
+/*---------------------------------------------------------------------------*/
+/*! This federate's counter values for the LBTS reduction being started.  As
+ *  with local_quiet(), they are exact only if all events before the cut are
+ *  committed and none beyond it, so the committed state is that at the cut;
+ *  otherwise this federate's values are still reduced but the totals are not
+ *  reported. */
+bool MicroKernel::local_counters( const SimTime &cut, long *vals )
+{
+    if( status != RUNNING ) return false;
+    if( glbts + params.sync.epsilon > cut ) return false; //May be past the cut
+    MicroProcess *cpb = cts_pq.top();
+    if( cpb && cpb->ects() < cut ) return false; //Not caught up to the cut
+    return counter_values( cut, vals );
+}
+
+/*---------------------------------------------------------------------------*/
+/*! Hands the application any global totals completed since the last call. */
+void MicroKernel::report_counters( void )
+{
+    if( params.counters.n <= 0 ) return;
+    long totals[TM_MAXCOUNTERS];
+    TM_Time tcut;
+    long ntotals = TM_Recent_Counters( totals, &tcut );
+    if( ntotals <= params.counters.ntotals ) return;
+    params.counters.ntotals = ntotals;
+    SimTime cut; ts_synk2musik( cut, tcut );
+    MUSDBG( 2, "Counter totals #"<<ntotals<<" at "<<cut );
+    counter_totals( cut, totals );
+}
+
+/*---------------------------------------------------------------------------*/
+/*! Span beyond LBTS that a process with the given runahead may currently
+ *  execute into: scaled down by the rollback throttle and capped by the
+ *  configured window. */
+SimTime MicroKernel::optimistic_span( const SimTime &pspan ) const
+{
+    SimTime span( pspan * throttle.scale ); //MAX_TIME stays MAX_TIME
+    span.reduce_to( params.optimism.window );
+    return span;
+}
+
+/*---------------------------------------------------------------------------*/
+/*! Called after each new LBTS: halve the optimistic span if too many of the
+ *  events executed since the last adjustment were rolled back, double it
+ *  (up to the full runahead) if very few were. */
+void MicroKernel::adapt_optimism( void )
+{
+    if( !params.optimism.throttle ) return;
+
+    const unsigned long MIN_SAMPLE = 100; //Too few events to judge below this
+    unsigned long exed = get_estats().executed - throttle.last_exed;
+    unsigned long rbed = get_estats().rolledback - throttle.last_rbed;
+    if( exed < MIN_SAMPLE ) return;
+    throttle.last_exed = get_estats().executed;
+    throttle.last_rbed = get_estats().rolledback;
+
+    double rbfrac = rbed*1.0/exed;
+    if( rbfrac > params.optimism.rbhigh &&
+        throttle.scale > params.optimism.minscale )
+    {
+        throttle.scale /= 2;
+        if( throttle.scale < params.optimism.minscale )
+            throttle.scale = params.optimism.minscale;
+        throttle.nshrink++;
+        MUSDBG( 2, fed_id()<<": rollbacks "<<rbfrac<<" shrink scale to "
+                   <<throttle.scale );
+    }
+    else if( rbfrac < params.optimism.rblow && throttle.scale < 1 )
+    {
+        throttle.scale *= 2;
+        if( throttle.scale > 1 ) throttle.scale = 1;
+        throttle.ngrow++;
+        MUSDBG( 2, fed_id()<<": rollbacks "<<rbfrac<<" grow scale to "
+                   <<throttle.scale );
+    }
+}
+
 /*---------------------------------------------------------------------------*/
 void MicroKernel::print_stats( ostream &out )
 {
@@ -1644,6 +2517,8 @@ void MicroKernel::stop( void )
 
     Synk_Stop();
     synk_lbts.tot_lbts -= synk_lbts.tot_stopping_lbts;//Exclude artifact LBTS
+    params.progress.ncaptured = FM_num_captured();
+    stop_workers();
 
     int high_pid = idmap.highest_pid();
 
@@ -1656,6 +2531,7 @@ void MicroKernel::stop( void )
         if( pid < 0 ) del_mp( mp );
         else del( (SimProcess*)mp ); //XXX
     }
+    SlabHeap::local()->trim();
 
     if( fed_id() < _printdbgmaxfedid )
     {
@@ -1674,10 +2550,24 @@ void MicroKernel::stop( void )
     MUSDBG(0, fed_id() << ":      Federate number = " << fed_id() );
     MUSDBG(0, fed_id() << ":      Total federates = " << num_feds() );
     MUSDBG(0, fed_id() << ":           Batch size = " << params.batch_sz );
+    if( params.threads.nworkers > 1 )
+    {
+    MUSDBG(0, fed_id() << ":       Worker threads = " << params.threads.nworkers );
+    MUSDBG(0, fed_id() << ":      Parallel passes = " << params.threads.npasses );
+    MUSDBG(0, fed_id() << ":   Processes per pass = " << (params.threads.npasses<=0?0:params.threads.nprocs*1.0/params.threads.npasses) );
+    }
+    if( params.progress.on )
+    {
+    MUSDBG(0, fed_id() << ":  Msgs taken in early = " << params.progress.ncaptured );
+    }
     MUSDBG(0, fed_id() << ":        Max local PID = " << high_pid );
     MUSDBG(0, fed_id() << ": Num application LBTS = " << synk_lbts.tot_lbts);
     MUSDBG(0, fed_id() << ":    Num stopping LBTS = " << synk_lbts.tot_stopping_lbts );
     MUSDBG(0, fed_id() << ":   Last computed LBTS = " << last_lbts.ts );
+    if( params.quiesce.at < SimTime::MAX_TIME )
+    {
+    MUSDBG(0, fed_id() << ":    Quiescent at LBTS = " << params.quiesce.at.ts );
+    }
     MUSDBG(0, fed_id() << ":         Total events = "<<get_estats().executed);
     MUSDBG(0, fed_id() << ":      Events per LBTS = "<<get_estats().executed*1.0/synk_lbts.tot_lbts);
     MUSDBG(0, fed_id() << ":      Elapsed seconds = " << nsecs );
@@ -1686,6 +2576,13 @@ void MicroKernel::stop( void )
     MUSDBGNNL(0, fed_id() << ":     Peak memory (MB) = " );
             if( report.peak_memmb <= 0 ) MUSDBG(0, "Unknown" );
             else MUSDBG(0, report.peak_memmb );
+    {
+        SlabHeap::Stats ss; SlabHeap::totals( ss );
+        MUSDBG(0, fed_id() << ": Slab inuse peak (MB) = " << ss.inuse_hwm/1e6 );
+        MUSDBG(0, fed_id() << ":   Slab map peak (MB) = " << ss.mapped_hwm/1e6 );
+        MUSDBG(0, fed_id() << ":  Slab chunks alloced = " << ss.nchunks );
+        MUSDBG(0, fed_id() << ": Slab chunks released = " << ss.nreleased );
+    }
     MUSDBG(0, fed_id() << ": -------------------------------------" );
 
     unsigned long exed = get_estats().executed, cmed = get_estats().committed;
@@ -1693,11 +2590,20 @@ void MicroKernel::stop( void )
     MUSDBG(0, fed_id() << ":     Executed events = " << exed);
     MUSDBG(0, fed_id() << ":    Committed events = " << cmed << " [ " << (exed<=0?0:(cmed*100.0/exed)) << " % ]");
     MUSDBG(0, fed_id() << ":   Rolledback events = " << rbed << " [ " << (exed<=0?0:(rbed*100.0/exed)) << " % ]");
+    if( get_estats().coerced > 0 )
+    {
+    unsigned long coed = get_estats().coerced;
+    MUSDBG(0, fed_id() << ":      Coerced events = " << coed << " [ avg late " << get_estats().distortion/coed << " max " << get_estats().max_distortion << " ]");
+    }
+    MUSDBG(0, fed_id() << ":  Optimism span scale = " << throttle.scale << " [ -" << throttle.nshrink << " +" << throttle.ngrow << " ]");
+    Synk_TopoReport();
+    MUSDBG(0, fed_id() << ":          LBTS policy = " << lbts_policy->name() << " [ deferred " << params.lbts.ndeferred << " ]");
+    lbts_policy->print_stats( cout, fed_id() );
     MUSDBG(0, fed_id() << ": -------------------------------------" );
     }
 
     #if MPI_AVAILABLE
-      struct { long min, max, sum; } totex, totcm, totrb;
+      struct { long min, max, sum; } totex, totcm, totrb, totco;
       #define RGET( _1, _2, _3 ) do{ \
           long inx = 0, outx = 0; \
           inx = _1; \
@@ -1739,6 +2645,7 @@ void MicroKernel::stop( void )
           MGET( executed, totex );
           MGET( committed, totcm );
           MGET( rolledback, totrb );
+          if( params.sync.epsilon > 0 ) { MGET( coerced, totco ); }
           if( fed_id() < _printdbgmaxfedid )
           {
           MUSDBG(0,"------------------");
@@ -1830,6 +2737,63 @@ void SimProcess::enable_undo( bool mode, const SimTime &ra, const SimTime &rs )
   if(added_to_sim)after_dirtied();
 }
 
+/*---------------------------------------------------------------------------*/
+/* Undo record holding a verbatim copy of a region of process state          */
+/*---------------------------------------------------------------------------*/
+class BytesUndo : public UndoRecord
+{
+    public: BytesUndo( void *a, int n ) : UndoRecord(), addr(a), nbytes(n)
+                { memcpy( (void *)(this+1), addr, nbytes ); }
+    public: virtual void undo( void )
+                { memcpy( addr, (void *)(this+1), nbytes ); }
+    private: void *addr;
+    private: int nbytes;
+};
+
+/*---------------------------------------------------------------------------*/
+void SimProcess::log_undo( UndoRecord *rec )
+{
+    if( !rec ) return;
+    if( !undo_logging() ) { delete rec; return; }
+    SimEventBase *ev = execute_context.event;
+    rec->prev = (UndoRecord *)ev->aux()->hook2;
+    ev->aux()->hook2 = rec;
+}
+
+/*---------------------------------------------------------------------------*/
+void SimProcess::save_bytes( void *addr, int nbytes )
+{
+    if( !undo_logging() || nbytes <= 0 ) return;
+    log_undo( new(nbytes) BytesUndo( addr, nbytes ) );
+}
+
+/*---------------------------------------------------------------------------*/
+void SimProcessBase::replay_undo_log( SimEventBase *event )
+{
+    UndoRecord *rec = (UndoRecord *)event->aux()->hook2;
+    event->aux()->hook2 = 0;
+    while( rec )
+    {
+        UndoRecord *prev = rec->prev;
+        rec->undo();
+        delete rec;
+        rec = prev;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+void SimProcessBase::discard_undo_log( SimEventBase *event )
+{
+    UndoRecord *rec = (UndoRecord *)event->aux()->hook2;
+    event->aux()->hook2 = 0;
+    while( rec )
+    {
+        UndoRecord *prev = rec->prev;
+        delete rec;
+        rec = prev;
+    }
+}
+
 /*---------------------------------------------------------------------------*/
 class KEvent_AddDest : public KernelEvent
 {
@@ -1855,30 +2819,17 @@ SimEventID SimProcess::add_dest( const SimPID &dest,
     }
     else
     {
-        if(1)/*XXX*/
-        {
-            /*Skipping Synk_Topo schemes*/
-        }
-        else
-        {
         if( dest.fed_id != sim()->fed_id() )
         {
-            if( dest.fed_id != SimPID::ANY_FED_ID )
-            {
-                Synk_TopoAddDest( dest.fed_id, lookahead );
-            }
-            else
-            {
-                for( int i = 0, n = sim()->num_feds(); i < n; i++ )
-                {
-                    if( i != sim()->fed_id() )
-                        Synk_TopoAddDest( i, lookahead );
-                }
-            }
-        }
+            Synk_TopoAddDest( dest.fed_id, lookahead );
         }
         MUSDBG( 2, "Updating LA to min of " << min_la << " and " << lookahead );
         update_min_la( lookahead );
+        if( dest.fed_id != sim()->fed_id() )
+        {
+            update_fed_la( dest.fed_id, lookahead );
+        }
+        Synk_TopoProcessLA( min_la );
     }
     return eid;
 }
@@ -1916,18 +2867,7 @@ SimEventID SimProcess::add_src( const SimPID &src, const SimTime dt )
     {
         if( src.fed_id != sim()->fed_id() )
         {
-            if( src.fed_id != SimPID::ANY_FED_ID )
-            {
-                Synk_TopoAddSrc( src.fed_id );
-            }
-            else
-            {
-                for( int i = 0, n = sim()->num_feds(); i < n; i++ )
-                {
-                    if( i != sim()->fed_id() )
-                        Synk_TopoAddSrc( i );
-                }
-            }
+            Synk_TopoAddSrc( src.fed_id );
         }
     }
     return eid;
@@ -2036,6 +2976,8 @@ SimTimerID SimProcess::set_timer( const SimTime &dt,
 SimEvent *SimProcess::retract( SimEventID eid )
 {
     SimEvent *event = (SimEvent *)eid;
+    ENSURE( 0, !MicroKernel::tls_worker || event->data._dest == PID(),
+            "Can't retract events sent to other processes with MK_THREADS>1" );
     undispatch( event );
     return event;
 }
@@ -2114,6 +3056,421 @@ void PeriodicSimProcess::timedout( SimTimerID t, void *closure )
        pthread_mutex_unlock( &(_mtx) );                                      \
     }while(0)                                                                \
 
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+/* Worker threads of a multithreaded federate.                               */
+/*                                                                           */
+/* Whenever the kernel can advance a user process conservatively, it instead */
+/* gathers every user process whose earliest committable event lies within  */
+/* the same limit (no event sent while advancing them can be timestamped     */
+/* below it), and the workers advance them all in one parallel pass.  Each   */
+/* process is owned by one worker (local ID modulo #workers), so that its    */
+/* state and newly allocated events stay with that worker's core and slab    */
+/* heap; a worker that runs out of its own processes steals from the others. */
+/* The main thread works as worker 0, and remains the only one talking to    */
+/* other federates and to the time management (TM) layer.  Causal links may  */
+/* join events of processes run by different workers; see CausalLinkGuard.   */
+/*---------------------------------------------------------------------------*/
+#include <sched.h>
+
+__thread WorkerContext *MicroKernel::tls_worker = 0;
+
+/*---------------------------------------------------------------------------*/
+/* Recursive: cancelling a child may roll back, and detach, further events.  */
+/*---------------------------------------------------------------------------*/
+static pthread_mutex_t causal_mtx;
+CausalLinkGuard::CausalLinkGuard( void ) : locked( MicroKernel::tls_worker!=0 )
+    { if( locked ) pthread_mutex_lock( &causal_mtx ); }
+CausalLinkGuard::~CausalLinkGuard( void )
+    { if( locked ) pthread_mutex_unlock( &causal_mtx ); }
+
+/*---------------------------------------------------------------------------*/
+ostream *WorkerContext::divert( ostream *target )
+{
+    for( int i = 0, n = dbgout.size(); i < n; i++ )
+    {
+        if( dbgout[i].first == target ) return dbgout[i].second;
+    }
+    ostringstream *buf = new ostringstream();
+    dbgout.push_back( make_pair( target, buf ) );
+    return buf;
+}
+
+/*---------------------------------------------------------------------------*/
+ostream *_simdbgdivert( ostream *strm )
+{
+    WorkerContext *w = MicroKernel::tls_worker;
+    return w ? w->divert( strm ) : strm;
+}
+
+/*---------------------------------------------------------------------------*/
+class FederateWorkers
+{
+    public: FederateWorkers( int n, bool pin );
+    public: ~FederateWorkers( void );
+    public: int size( void ) const { return nworkers; }
+    public: WorkerContext &context( int i ) { return workers[i].ctx; }
+    public: long run_pass( const vector<MicroProcess*> &procs,
+                           const SimTime &limit_ts );
+
+    private: struct Worker
+             {
+                 FederateWorkers *pool;
+                 int index;
+                 pthread_t tid;
+                 WorkerContext ctx;
+                 vector<MicroProcess*> mine; /*Owned processes in this pass*/
+                 volatile long next; /*Next unclaimed entry in mine*/
+                 long nevents;
+             };
+    private: static void *worker_main( void *arg );
+    private: void pin_to_core( int index );
+    private: void work( Worker &w );
+    private: MicroProcess *claim( Worker &w );
+
+    private: int nworkers;
+    private: Worker *workers;
+    private: vector<int> cores; /*CPUs the rank may run on; empty if unpinned*/
+    private: SimTime limit; /*Safe limit of the current pass*/
+    private: long generation; /*Bumped to start a pass; -1 to exit*/
+    private: int nbusy; /*Helper threads yet to finish the current pass*/
+    private: pthread_mutex_t mtx;
+    private: pthread_cond_t start_cond, done_cond;
+};
+
+/*---------------------------------------------------------------------------*/
+FederateWorkers::FederateWorkers( int n, bool pin ) :
+    nworkers(n), workers(new Worker[n]), cores(), limit(0),
+    generation(0), nbusy(0)
+{
+    pthread_mutex_init( &mtx, NULL );
+    pthread_cond_init( &start_cond, NULL );
+    pthread_cond_init( &done_cond, NULL );
+
+    if( pin ) //Spread over the cores that the launcher bound this rank to
+    {
+        cpu_set_t set; CPU_ZERO( &set );
+        if( !sched_getaffinity( 0, sizeof(set), &set ) )
+        {
+            for( int c = 0; c < CPU_SETSIZE; c++ )
+                { if( CPU_ISSET( c, &set ) ) cores.push_back( c ); }
+        }
+        pin_to_core( 0 );
+    }
+
+    for( int i = 0; i < nworkers; i++ )
+    {
+        Worker &w = workers[i];
+        w.pool = this; w.index = i; w.next = 0; w.nevents = 0;
+        if( i == 0 ) { w.tid = pthread_self(); continue; }
+        int flag = pthread_create( &w.tid, NULL, &worker_main, &w );
+        ENSURE( 0, flag == 0, "Worker creation failed.";perror("pthread_create"));
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+FederateWorkers::~FederateWorkers( void )
+{
+    SIGNAL_CONDITION( mtx, start_cond, generation = -1 );
+    for( int i = 1; i < nworkers; i++ )
+    {
+        pthread_join( workers[i].tid, NULL );
+    }
+    for( int i = 0; i < nworkers; i++ )
+    {
+        vector< pair<ostream *, ostringstream *> > &d = workers[i].ctx.dbgout;
+        for( int j = 0, n = d.size(); j < n; j++ ) delete d[j].second;
+    }
+    delete [] workers;
+}
+
+/*---------------------------------------------------------------------------*/
+void FederateWorkers::pin_to_core( int index )
+{
+    if( cores.empty() ) return;
+    cpu_set_t set; CPU_ZERO( &set );
+    CPU_SET( cores[index % cores.size()], &set );
+    if( pthread_setaffinity_np( pthread_self(), sizeof(set), &set ) )
+        { MUSDBG( 0, "Could not pin worker " << index ); }
+}
+
+/*---------------------------------------------------------------------------*/
+void *FederateWorkers::worker_main( void *arg )
+{
+    Worker *w = (Worker *)arg;
+    FederateWorkers *pool = w->pool;
+
+    pool->pin_to_core( w->index );
+    SlabHeap::bind_thread(); //First touch of its chunks from its own core
+    _simdbgdiverted = true;
+
+    for( long seen = 0; ; )
+    {
+        WAIT_FOR_CONDITION( pool->mtx, pool->start_cond,
+                            pool->generation != seen );
+        pthread_mutex_lock( &pool->mtx );
+        seen = pool->generation;
+        pthread_mutex_unlock( &pool->mtx );
+        if( seen < 0 ) break;
+
+        pool->work( *w );
+
+        SIGNAL_CONDITION( pool->mtx, pool->done_cond, --pool->nbusy );
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+MicroProcess *FederateWorkers::claim( Worker &w )
+{
+    long n = w.mine.size();
+    if( w.next < n )
+    {
+        long i = __sync_fetch_and_add( &w.next, 1 );
+        if( i < n ) return w.mine[i];
+    }
+    for( int k = 1; k < nworkers; k++ ) //Steal from the others
+    {
+        Worker &v = workers[(w.index+k) % nworkers];
+        long vn = v.mine.size();
+        if( v.next >= vn ) continue;
+        long i = __sync_fetch_and_add( &v.next, 1 );
+        if( i < vn ) return v.mine[i];
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+void FederateWorkers::work( Worker &w )
+{
+    MicroKernel::tls_worker = &w.ctx;
+    w.nevents = 0;
+    while( MicroProcess *mp = claim( w ) )
+    {
+        w.nevents += mp->advance( limit );
+    }
+    MicroKernel::tls_worker = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+long FederateWorkers::run_pass( const vector<MicroProcess*> &procs,
+                                const SimTime &limit_ts )
+{
+    for( int i = 0; i < nworkers; i++ )
+    {
+        workers[i].mine.clear();
+        workers[i].next = 0;
+    }
+    for( int i = 0, n = procs.size(); i < n; i++ )
+    {
+        workers[procs[i]->PID().loc_id % nworkers].mine.push_back( procs[i] );
+    }
+    limit = limit_ts;
+
+    SIGNAL_CONDITION( mtx, start_cond, nbusy = nworkers-1; generation++ );
+    work( workers[0] );
+    WAIT_FOR_CONDITION( mtx, done_cond, nbusy == 0 );
+
+    long nevents = 0;
+    for( int i = 0; i < nworkers; i++ ) nevents += workers[i].nevents;
+    return nevents;
+}
+
+/*---------------------------------------------------------------------------*/
+void MicroKernel::start_workers( void )
+{
+    if( params.threads.nworkers <= 1 ) return;
+    ENSURE( 0, !params.trace.generate, "Can't trace events with MK_THREADS>1" );
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init( &attr );
+    pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+    pthread_mutex_init( &causal_mtx, &attr );
+    pthread_mutexattr_destroy( &attr );
+    workers = new FederateWorkers( params.threads.nworkers,
+                                   params.threads.pin );
+}
+
+/*---------------------------------------------------------------------------*/
+void MicroKernel::stop_workers( void )
+{
+    if( !workers ) return;
+    delete workers;
+    workers = 0;
+    pthread_mutex_destroy( &causal_mtx );
+}
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+/* Communication progress thread.                                            */
+/*                                                                           */
+/* While the kernel computes, this thread keeps pulling messages off the     */
+/* network (freeing transport buffers and flow-control credits of senders),  */
+/* but only queues them inside FM.  They are handed to their handlers, in    */
+/* arrival order, by the kernel's own next FM_extract(), so no handler, and  */
+/* none of TM or the kernel, ever runs on this thread.  The two threads take */
+/* turns inside FM and MPI through one (recursive) lock.                     */
+/*---------------------------------------------------------------------------*/
+static struct
+{
+    bool on;                /*Running?*/
+    volatile bool stop;     /*Asked to exit?*/
+    long pollus;            /*Sleep between polls; 0=just yield*/
+    pthread_t tid;
+    pthread_mutex_t mtx;    /*Held by whoever is inside FM/TM*/
+} synk_prog;
+
+/*---------------------------------------------------------------------------*/
+static void Synk_FMLock( void )
+    { if( synk_prog.on ) pthread_mutex_lock( &synk_prog.mtx ); }
+static void Synk_FMUnlock( void )
+    { if( synk_prog.on ) pthread_mutex_unlock( &synk_prog.mtx ); }
+
+/*---------------------------------------------------------------------------*/
+static void *Synk_ProgressMain( void * )
+{
+    FM_capture_thread( TRUE );
+    while( !synk_prog.stop )
+    {
+        if( pthread_mutex_trylock( &synk_prog.mtx ) == 0 )
+        {
+            FM_extract(~0);
+            pthread_mutex_unlock( &synk_prog.mtx );
+        }
+        if( synk_prog.pollus > 0 ) usleep( synk_prog.pollus );
+        else sched_yield();
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static void Synk_ProgressStart( long pollus )
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init( &attr );
+    pthread_mutexattr_settype( &attr, PTHREAD_MUTEX_RECURSIVE );
+    pthread_mutex_init( &synk_prog.mtx, &attr );
+    pthread_mutexattr_destroy( &attr );
+
+    synk_prog.pollus = pollus;
+    synk_prog.stop = false;
+    synk_prog.on = true;
+    int retcode = pthread_create( &synk_prog.tid, 0, Synk_ProgressMain, 0 );
+    ENSURE( 0, retcode == 0, "Can't create progress thread " << retcode );
+}
+
+/*---------------------------------------------------------------------------*/
+static void Synk_ProgressStop( void )
+{
+    if( !synk_prog.on ) return;
+    synk_prog.stop = true;
+    pthread_join( synk_prog.tid, 0 );
+    synk_prog.on = false;
+    pthread_mutex_destroy( &synk_prog.mtx );
+}
+
+/*---------------------------------------------------------------------------*/
+/* Advances, in parallel, all user processes that are committable within the */
+/* given limit.  They are taken out of the kernel's queues for the duration, */
+/* just as in make_lbts_callbacks(), so the queues are never touched by the  */
+/* workers; the work deferred by the workers is applied afterwards.          */
+/*---------------------------------------------------------------------------*/
+long MicroKernel::advance_parallel( const SimTime &limit_ts )
+{
+    ENSURE( 1, temp_mpvec.empty(), "" );
+    long nevents = 0;
+    int i = 0, n = 0;
+
+    TIMER_TYPE t1, t2;
+    if( params.timing.track ) { TIMER_NOW(t1); }
+
+    MicroProcess *mp = 0;
+    while( (mp=cts_pq.top()) && mp->ects() <= limit_ts && !mp->is_kernel )
+    {
+        temp_mpvec.push_back( mp );
+        cts_pq.del( mp );
+    }
+
+    if( (int)temp_mpvec.size() < params.threads.minprocs ) //Not worth a pass
+    {
+        for( i = 0, n = temp_mpvec.size(); i < n; i++ )
+        {
+            cts_pq.add( temp_mpvec[i] );
+        }
+        for( i = 0, n = temp_mpvec.size(); i < n; i++ )
+        {
+            nevents += advance_process( temp_mpvec[i], true, limit_ts );
+        }
+        temp_mpvec.clear();
+        return nevents;
+    }
+
+    for( i = 0, n = temp_mpvec.size(); i < n; i++ )
+    {
+        mp = temp_mpvec[i];
+        pts_pq.del( mp );
+        ets_pq.del( mp );
+        rlbts_pq.del( mp );
+    }
+
+    nevents = workers->run_pass( temp_mpvec, limit_ts );
+    params.threads.npasses++;
+    params.threads.nprocs += temp_mpvec.size();
+
+    for( i = 0, n = temp_mpvec.size(); i < n; i++ )
+    {
+        mp = temp_mpvec[i];
+        cts_pq.add( mp );
+        pts_pq.add( mp );
+        ets_pq.add( mp );
+        rlbts_pq.add( mp );
+    }
+    temp_mpvec.clear();
+
+    for( i = 0; i < workers->size(); i++ )
+    {
+        drain_worker( workers->context( i ) );
+    }
+
+    if( params.timing.track )
+    {
+        TIMER_NOW(t2);
+        params.timing.advance_wt += TIMER_DIFF( t2, t1 );
+    }
+
+    return nevents;
+}
+
+/*---------------------------------------------------------------------------*/
+void MicroKernel::drain_worker( WorkerContext &w )
+{
+    for( int i = 0, n = w.deferred.size(); i < n; i++ )
+    {
+        WorkerContext::Deferred &d = w.deferred[i];
+        if( d.canceller ) { d.canceller->cancel_child( d.event ); }
+        else { forward( d.to, d.event ); }
+    }
+    w.deferred.clear();
+
+    estats.executed += w.estats.executed;
+    estats.committed += w.estats.committed;
+    estats.rolledback += w.estats.rolledback;
+    estats.leftover += w.estats.leftover;
+    estats.sent += w.estats.sent;
+    estats.coerced += w.estats.coerced;
+    estats.distortion += w.estats.distortion;
+    if( w.estats.max_distortion > estats.max_distortion )
+        estats.max_distortion = w.estats.max_distortion;
+    w.estats = EventStats();
+
+    for( int i = 0, n = w.dbgout.size(); i < n; i++ )
+    {
+        ostringstream *buf = w.dbgout[i].second;
+        if( buf->tellp() <= 0 ) continue;
+        (*w.dbgout[i].first) << buf->str();
+        buf->str( "" );
+    }
+}
+
 /*---------------------------------------------------------------------------*/
 typedef enum
 {
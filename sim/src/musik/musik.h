@@ -59,7 +59,11 @@ extern int _enslvl;
  *
  *! \sa SIMDBG()
  */
-extern int _simdbg; extern ostream *_simdbgstrm, *_simdbgstrmdefault, *_musdbgstrm;
+extern int _simdbg; extern ostream *_simdbgstrmdefault, *_musdbgstrm;
+extern __thread ostream *_simdbgstrm;
+/*Worker threads of a multithreaded federate divert their debug output into */
+/*private buffers, which the main thread writes out after each pass.        */
+extern __thread bool _simdbgdiverted; ostream *_simdbgdivert( ostream *strm );
 /*---------------------------------------------------------------------------*/
 /*! \brief A useful debugging macro.
  *
@@ -73,7 +77,8 @@ extern int _simdbg; extern ostream *_simdbgstrm, *_simdbgstrmdefault, *_musdbgst
 #define MUSDBG(level, etc) /*Do nothing*/((void)0)
 #define MUSDBGNNL(level, etc) /*Do nothing*/((void)0)
 #else
-#define SIMDBGSTRM(_strm) do{_simdbgstrm = (_strm);}while(0)
+#define SIMDBGSTRM(_strm)                                                    \
+    do{_simdbgstrm = !_simdbgdiverted ? (_strm) : _simdbgdivert(_strm);}while(0)
 #define SSIMDBG(nnl, level, etc)                                             \
     if( _simdbg >= (level) )                                                 \
     {                                                                        \
@@ -243,6 +248,66 @@ class CopyState
 
 #include "musikpriv.h"
 
+/*---------------------------------------------------------------------------*/
+/*! \brief Entry in the undo log of an optimistically executed event.
+ *
+ * Used for incremental state saving.  A subclass captures the prior value of
+ * some piece of process state when constructed, and restores it in undo().
+ * Records are handed to SimProcess::log_undo() before the state is modified;
+ * on rollback they are undone in reverse order, and on commit discarded.
+ */
+class UndoRecord
+{
+    public: UndoRecord( void ) : prev(0) {}
+    public: virtual ~UndoRecord( void ) {}
+    public: virtual void undo( void ) = 0;
+
+    /*Records live in the slab heap; extra bytes may trail the object*/
+    public: void *operator new( size_t sz ) { return operator new( sz, 0 ); }
+    public: void *operator new( size_t sz, int extra )
+                {
+                    size_t nbytes = 8 + sz + (extra>0 ? extra : 0);
+                    char *p = (char *)SlabHeap::local()->alloc( nbytes );
+                    *(size_t *)p = nbytes;
+                    return p + 8;
+                }
+    public: void operator delete( void *d )
+                {
+                    char *p = (char *)d - 8;
+                    SlabHeap::local()->free( p, *(size_t *)p );
+                }
+    public: void operator delete( void *d, int extra ) { operator delete(d); }
+
+    private: UndoRecord *prev; /*Previously logged record of the same event*/
+    private: friend class SimProcessBase;
+    private: friend class SimProcess;
+};
+
+/*---------------------------------------------------------------------------*/
+/*! \brief Undo record for one entry of a map-like container.
+ *
+ * Remembers whether the key was present, and its value if so; undo() restores
+ * the value or removes the key accordingly.
+ */
+template<class M> class MapEntryUndo : public UndoRecord
+{
+    public: MapEntryUndo( M &m, const typename M::key_type &k ) :
+                UndoRecord(), map(m), key(k), existed(false), value()
+                {
+                    typename M::const_iterator it = m.find( k );
+                    if( it != m.end() ) { existed = true; value = it->second; }
+                }
+    public: virtual void undo( void )
+                {
+                    if( existed ) map[key] = value;
+                    else map.erase( key );
+                }
+    private: M &map;
+    private: typename M::key_type key;
+    private: bool existed;
+    private: typename M::mapped_type value;
+};
+
 /*---------------------------------------------------------------------------*/
 /*! \brief Simulation event exchanged by simulation processes.
  *
@@ -295,6 +360,13 @@ class SimProcess : public SimProcessBase
      *
      * Set mode to true to enable optimistic execution, false to disable.
      * The additional/optional arguments can be specified when mode=true.
+     *
+     * An event arriving at most resilience in the process's past is executed
+     * at the current time instead of causing a rollback.  Setting
+     * MK_SYNCEPSILON=eps extends that to every process, optimistic or not:
+     * processes may run up to eps past LBTS, and stragglers up to eps late
+     * are coerced.  The kernel reports how many events were coerced and by
+     * how much; results are then only approximate to within eps.
      */
     public: virtual void enable_undo( bool mode,
                                     const SimTime &runahead = SimTime::MAX_TIME,
@@ -304,6 +376,26 @@ class SimProcess : public SimProcessBase
     public: virtual void set_state( CopyState *cst ) { copy_state = cst; }
     public: virtual const CopyState *get_state(void) const {return copy_state;}
 
+    //-------------------------------------------------------------------------
+    /*! \brief Incremental state saving for optimistic execution
+     *
+     * Inside execute(), call save_field() (or save_bytes()) before modifying
+     * a piece of state, save_entry() before inserting/updating/erasing a map
+     * entry, or log_undo() with a custom UndoRecord.  Rollback replays the
+     * event's records in reverse; commit recycles them.  All of these are
+     * no-ops (log_undo() deletes its record) when the current event is not
+     * executing optimistically.
+     */
+    public: bool undo_logging( void ) const
+                { return execute_context.event && execute_context.logging; }
+    public: virtual void log_undo( UndoRecord *rec );
+    public: virtual void save_bytes( void *addr, int nbytes );
+    public: template<class T> void save_field( T &field )
+                { if( undo_logging() ) save_bytes( &field, sizeof(field) ); }
+    public: template<class M> void save_entry( M &m,
+                                               const typename M::key_type &k )
+                { if( undo_logging() ) log_undo( new MapEntryUndo<M>(m, k) ); }
+
     //-------------------------------------------------------------------------
     public: virtual SimEventID add_dest( const SimPID &dest,
                                          const SimTime lookahead=0,
@@ -347,6 +439,16 @@ class SimProcess : public SimProcessBase
     //-------------------------------------------------------------------------
     public: virtual void execute( SimEvent *e ) = 0;
     public: virtual void timedout( SimTimerID timer_id, void *closure=0 );
+
+    /*! \brief Reverse computation of an optimistically executed event.
+     *
+     * Invoked on rollback, in reverse order of execution, with now() equal to
+     * the event's time.  It must undo the effects of execute(e), except for
+     * events sent (which the kernel retracts) and any records logged with
+     * log_undo() (which are replayed just before this is invoked).  The
+     * default does nothing, for processes relying on state saving instead.
+     */
+    public: virtual void reverse_execute( SimEvent *e ) {}
 };
 
 /*---------------------------------------------------------------------------*/
@@ -474,6 +576,14 @@ class Simulator : public MicroKernel
                                        unsigned long max_nevents=0xefffffff );
     public: virtual void stop( void );
 
+    /*! \brief Adds a global counter, reduced with op across all federates at
+     * no extra communication by piggybacking on LBTS computations.
+     *
+     * Call on every federate in the same order, between init() and start().
+     * Returns the counter's index into counter_values()/counter_totals().
+     */
+    public: virtual int add_counter( CounterOp op );
+
     //-------------------------------------------------------------------------
     public: static void set_debug_levels(void);/*<!Set ENSURE & SIMDBG levels*/
     public: void report_status(const SimTime &dt, const SimTime &endt);/*<!
@@ -493,6 +603,37 @@ class Simulator : public MicroKernel
     public: virtual SimFedID fed_id( void ) const;
 
     public: static Simulator *sim(void);
+
+    //-------------------------------------------------------------------------
+    //The following may be overridden by the application
+    //-------------------------------------------------------------------------
+    /*! \brief Has this federate gone quiet as of the given time?
+     *
+     * Asked at LBTS boundaries, only once every local event before cut is
+     * committed; cut is the same on all federates.  Answer from committed
+     * state alone, counting anything sent before cut that arrives at or after
+     * it.  Once every federate answers true in the same LBTS round, run()
+     * returns max_t right away (set MK_QUIESCE=false to never stop early).
+     * The property must be stable: a federation quiet everywhere must never
+     * become busy again.  Default: never quiet.
+     */
+    protected: virtual bool quiescent( const SimTime &cut );
+
+    /*! \brief This federate's values of the counters added via add_counter().
+     *
+     * Asked like quiescent(): at LBTS boundaries, with the committed state
+     * being exactly that at cut.  Fill vals[i] for each counter; return false
+     * if the values are not exact as of cut.  Default: nothing to fill.
+     */
+    protected: virtual bool counter_values( const SimTime &cut, long *vals );
+
+    /*! \brief Global totals of all counters as of cut.
+     *
+     * Called from run() after an LBTS computation in which every federate
+     * reported exact values; cut is non-decreasing across calls.
+     */
+    protected: virtual void counter_totals( const SimTime &cut,
+                                            const long *totals );
 };
 
 /*---------------------------------------------------------------------------*/
@@ -523,6 +664,14 @@ inline const SimTime Simulator::run( const SimTime &max_t,
                                      unsigned long max_nevents )
     { return MicroKernel::run( max_t, max_nevents ); }
 inline void Simulator::stop( void ) { MicroKernel::stop(); }
+inline bool Simulator::quiescent( const SimTime &cut )
+    { return MicroKernel::quiescent( cut ); }
+inline int Simulator::add_counter( CounterOp op )
+    { return MicroKernel::add_counter( op ); }
+inline bool Simulator::counter_values( const SimTime &cut, long *vals )
+    { return MicroKernel::counter_values( cut, vals ); }
+inline void Simulator::counter_totals( const SimTime &cut, const long *totals )
+    { MicroKernel::counter_totals( cut, totals ); }
 inline int Simulator::num_feds( void ) const { return MicroKernel::num_feds(); }
 inline SimFedID Simulator::fed_id( void ) const { return MicroKernel::fed_id();}
 /*---------------------------------------------------------------------------*/
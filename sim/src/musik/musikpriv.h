@@ -19,6 +19,8 @@
 #include <map>
 #include <vector>
 #include <deque>
+#include <sstream>
+#include <stdint.h>
 using namespace std;
 
 /*---------------------------------------------------------------------------*/
@@ -599,16 +601,93 @@ inline ostream &operator<<( ostream &out, const LIST_CLASSNAME( _elem_type, _uni
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
-struct FreeList
+/*! \brief Size-class slab allocator for events and other kernel buffers.
+ *
+ * Blocks of each size class (8-byte granularity) are carved out of chunks
+ * that are aligned to the (power-of-two) chunk size, so that the chunk of any
+ * block is found by masking its address.  Free blocks are chained through
+ * their own first word.  Each thread may own a heap; blocks freed by a
+ * thread other than the owner are handed back via the owner's remote list.
+ * Chunks that become idle beyond a small per-class reserve are returned to
+ * the OS.  Requests larger than MAX_BLOCK bypass the slabs.
+ *
+ * <B>Not intended as a supported API.  Subject to change.<B>
+ */
+class SlabHeap
 {
-    FreeList( void ) : free_list(), nbuffers_to_alloc(0) {}
-    deque<void *> free_list;
-    unsigned long nbuffers_to_alloc;
+    public: enum { GRAIN = 8, MAX_BLOCK = 8192, NCLASSES = MAX_BLOCK/GRAIN+1 };
+
+    public: struct Stats
+            {
+                unsigned long mapped, mapped_hwm; /*Bytes held in chunks*/
+                unsigned long inuse, inuse_hwm;   /*Bytes handed out*/
+                unsigned long nchunks, nreleased; /*Chunks mapped/unmapped*/
+                unsigned long nlarge, nremote;    /*Non-slab allocs, x-frees*/
+            };
+
+    private: struct FreeBlock { FreeBlock *next; };
+    private: struct Chunk
+             {
+                 SlabHeap *owner;
+                 int sc;                 /*Size class*/
+                 bool avail;             /*On owner's list of non-full chunks?*/
+                 bool huge;              /*Backed by explicit huge pages?*/
+                 long bsz;               /*Block size in bytes*/
+                 long nblocks, ncarved, nused;
+                 char *base;             /*First block*/
+                 FreeBlock *free_list;
+                 Chunk *prev, *next;     /*In owner's avail list for sc*/
+             };
+    private: struct SizeClass { Chunk *avail; long nidle; };
+
+    public: void *alloc( size_t nbytes );
+    public: void free( void *p, size_t nbytes );
+    public: void trim( void );
+    public: const Stats &stats( void ) const { return st; }
+
+    public: static SlabHeap *local( void );
+    public: static void bind_thread( void ) { attach( true ); }
+    public: static void print_config( void );
+    public: static void totals( Stats &tot );
+
+    private: SlabHeap( void );
+    private: static int size_class( size_t n ) { return (int)((n+GRAIN-1)/GRAIN); }
+    private: static Chunk *chunk_of( void *p )
+             { return (Chunk *)(uintptr_t(p) & ~(uintptr_t(chunk_bytes)-1)); }
+    private: void unlink_avail( Chunk *c );
+    private: void *alloc_slow( int sc );
+    private: void *alloc_large( size_t nbytes );
+    private: void free_large( void *p, size_t nbytes );
+    private: void free_slow( Chunk *c );
+    private: void free_remote( void *p );
+    private: void drain_remote( void );
+    private: Chunk *new_chunk( int sc );
+    private: void release_chunk( Chunk *c );
+    private: void count_inuse( long nbytes )
+             {
+                 st.inuse += nbytes;
+                 if( st.inuse > st.inuse_hwm ) st.inuse_hwm = st.inuse;
+             }
+    private: static SlabHeap *attach( bool own = false );
+    private: static void configure( void );
+
+    private: SizeClass sclass[NCLASSES];
+    private: FreeBlock * volatile remote_free; /*Pushed by non-owner threads*/
+    private: Stats st;
+    private: SlabHeap *next_heap;
+
+    private: static __thread SlabHeap *tls_heap;
+    private: static SlabHeap *heaps;
+    private: static unsigned long chunk_bytes;
+    private: static unsigned long warn_bytes;
+    private: static long max_idle;
+    private: static int hugepages; /*0=off, 1=transparent (madvise), 2=hugetlb*/
+    private: static bool per_thread;
 };
-typedef map<int, FreeList> FreeListMap; /*Indexed by roof(blocksize/10)*/
 
 /*---------------------------------------------------------------------------*/
 class KernelEvent;
+class UndoRecord;
 PQ_FORWARD_DECLS(SimEventBase, recv_ts, epqi);
 
 /*---------------------------------------------------------------------------*/
@@ -664,11 +743,11 @@ class SimEventBase
     public: void *operator new( size_t sz, void *ptr );
     public: void operator delete( void *d, size_t sz );
     public: static void *get_buffer( size_t totsz );
-    public: static unsigned long bytes_alloced_sofar;
 
     private: PQTagType epqi; /*For use in receiver's future event list*/
 
     private: bool is_kernel; /*Is this a kernel implementation event?*/
+    private: double coerced_late; /*Lateness if coerced; counted at commit*/
     public: bool is_kernel_event( void ) const { return is_kernel; }
     private: virtual void kernel_execute( SimProcessBase *p ) {}
 
@@ -687,6 +766,10 @@ class SimEventBase
     private: class AuxiliaryData
     {
         public: AuxiliaryData( void ) : dep(), hook1(0), hook2(0) {}
+        public: void *operator new( size_t sz )
+                    { return SlabHeap::local()->alloc( sz ); }
+        public: void operator delete( void *d, size_t sz )
+                    { SlabHeap::local()->free( d, sz ); }
 
         public: Dependencies dep;
         public: void *hook1, *hook2; //Scratch "registers"
@@ -734,8 +817,6 @@ class SimEventBase
     private: void reset_dep( void ) { if( has_aux() ) aux()->dep.reset(); }
     private: void detach_from_clist_of_parent( void );
 
-    private: static FreeListMap free_map;
-
     private: void coerce_ts( const SimTime &ts, const SimTime &rts );
 
     private: friend class SimEvent;
@@ -765,6 +846,7 @@ inline ostream &operator<<( ostream &out, const SimEventBase &ev )
 inline SimEventBase::SimEventBase( void ) :
     epqi(PQ_TAG_INVALID),
     is_kernel(false),
+    coerced_late(0),
     pprev(0), pnext(0),
     _aux(0)
 {
@@ -777,6 +859,7 @@ inline SimEventBase::SimEventBase( void ) :
 inline SimEventBase::SimEventBase( const SimEventBase &other ) :
     epqi(PQ_TAG_INVALID),
     is_kernel(false),
+    coerced_late(0),
     pprev(0), pnext(0),
     _aux(0)
 {
@@ -789,10 +872,23 @@ inline SimEventBase::~SimEventBase( void )
     del_aux();
 }
 
+/*---------------------------------------------------------------------------*/
+/*! \brief Serializes edits of causal links during a parallel pass, in which
+ * a parent and its children may lie in processes of different workers.
+ * A no-op outside the pass; may be nested. */
+struct CausalLinkGuard
+{
+    CausalLinkGuard( void );
+    ~CausalLinkGuard( void );
+    bool locked;
+};
+
 /*---------------------------------------------------------------------------*/
 inline void SimEventBase::detach_from_clist_of_parent( void )
 {
-    if( has_aux() && aux()->dep.cparent ) //Remove from parent's causal list
+    if( !has_aux() ) return;
+    CausalLinkGuard guard; //The parent's worker may be detaching us too
+    if( aux()->dep.cparent ) //Remove from parent's causal list
     {
         ENSURE( 2, aux()->dep.cparent->data._dest == data._src, *this<< " -- "<<
                   *aux()->dep.cparent<<": parent's dest must be child's src");
@@ -807,6 +903,7 @@ inline void SimEventBase::detach_from_clist_of_parent( void )
 inline void SimEventBase::coerce_ts( const SimTime &ts, const SimTime &rts )
 {
     MUSDBG( 1, *this<<": Coercing TS "<<T()<<" to "<<ts );
+    coerced_late += (ts-T()).ts; //Again if rolled back and re-executed later
     set_time( ts, rts );
 }
 
@@ -938,6 +1035,7 @@ class MicroProcess
     private: friend class PIDMap;
     private: friend class Simulator;
     private: friend class MicroKernel;
+    private: friend class FederateWorkers;
     private: friend class KernelProcessBase;
     private: friend class PQ_CLASSNAME(HeapPQ, MicroProcess, ects, ects_pqi);
     private: friend class PQ_CLASSNAME(HeapPQ, MicroProcess, epts, epts_pqi);
@@ -973,8 +1071,11 @@ struct EventStats
     unsigned long rolledback;
     unsigned long leftover;
     unsigned long sent;
+    unsigned long coerced;//Stragglers committed late instead of rolled back
+    double distortion, max_distortion;//Total & max lateness of those
     EventStats( void ) :
-        executed(0), committed(0), rolledback(0), leftover(0), sent(0) {}
+        executed(0), committed(0), rolledback(0), leftover(0), sent(0),
+        coerced(0), distortion(0), max_distortion(0) {}
 };
 
 /*---------------------------------------------------------------------------*/
@@ -993,9 +1094,12 @@ class SimProcessBase : public MicroProcess
                 can_undo(false),
                 min_la(0),
                 explicit_min_la(false),
+                fed_la(),
+                any_fed_la(SimTime::MAX_TIME),
                 runahead(SimTime::MAX_TIME),
                 resilience(0),
-        copy_state(0)
+        copy_state(0),
+                ntie(0)
                 {
                     fel.set_params( 1, 2.0, 10.0); /*CUSTOMIZE*/
                 }
@@ -1021,13 +1125,19 @@ class SimProcessBase : public MicroProcess
                 }
 
     protected: EventStats &acc_estats( void );
+    protected: virtual long advance( const SimTime &lbts )
+            { return advance_optimistically( lbts, lbts+sync_epsilon, 0xfffff ); }
     public: virtual SimTimerID set_timer( const SimTime &dt,
                                       void *closure=0,bool repeating=false)=0;
     public: virtual void timedout( SimTimerID timer_id, void *closure=0 ) = 0;
 
     public: virtual void execute( SimEvent *e ) = 0;
+    public: virtual void reverse_execute( SimEvent *e ) {}
     protected: virtual void undo_event( SimEventBase *event )
             {
+                bool has_log = event->has_aux() && event->aux()->hook2;
+                if( has_log ) replay_undo_log( event );
+                if( !event->is_kernel ) reverse_execute( (SimEvent *)event );
                 if( !copy_state || !event->has_aux() ) return;
                 ENSURE( 1, event->aux()->hook1, "" );
                 void *buf = event->aux()->hook1;
@@ -1036,25 +1146,46 @@ class SimProcessBase : public MicroProcess
 
     protected: virtual void save_state( SimEventBase *event )
             {
-                if( !copy_state || !event->has_aux() ) return;
+                if( !copy_state ) return;
                 ENSURE( 1, !event->aux()->hook1, "" );
-                int max_bytes = copy_state->max_bytes();
-                void *buf = new char[max_bytes]; //XXX To be optimized
+                void *buf = get_state_buffer( copy_state->max_bytes() );
                 event->aux()->hook1 = buf;
                 copy_state->pack_to( buf );
             }
 
     protected: virtual void free_state( SimEventBase *event )
             {
-                if( !copy_state || !event->has_aux() ) return;
+                if( !event->has_aux() ) return;
+                if( event->aux()->hook2 ) discard_undo_log( event );
+                if( !copy_state ) return;
                 if( event->aux()->hook1 )
                 {
                     char *buf = (char *)event->aux()->hook1;
                     copy_state->freeing( buf );
-                    delete [] buf; //XXX To be optimized - avoid runtime alloc/free
+                    put_state_buffer( buf );
                 }
                 event->aux()->hook1 = 0;
             }
+
+    /*Incremental state saving: hook2 of an event heads its undo log (LIFO)*/
+    private: void replay_undo_log( SimEventBase *event );
+    private: void discard_undo_log( SimEventBase *event );
+
+    /*State buffers come from the slab heap; each is prefixed by its size,  */
+    /*so that a change in max_bytes() doesn't confuse the release.          */
+    private: enum { STATEHDRSZ = 8 };
+    private: static void *get_state_buffer( int max_bytes )
+            {
+                size_t nbytes = STATEHDRSZ + (max_bytes>0 ? max_bytes : 0);
+                char *p = (char *)SlabHeap::local()->alloc( nbytes );
+                *(size_t *)p = nbytes;
+                return p + STATEHDRSZ;
+            }
+    private: static void put_state_buffer( void *buf )
+            {
+                char *p = (char *)buf - STATEHDRSZ;
+                SlabHeap::local()->free( p, *(size_t *)p );
+            }
     protected: virtual void free_event( SimEventBase *e ) { delete e; }
     protected: virtual void commit_event( SimEventBase *e, bool is_kernel )
             {
@@ -1082,6 +1213,7 @@ class SimProcessBase : public MicroProcess
             {
                 if( ev->has_aux() )
                 {
+                CausalLinkGuard guard;
                 while(const SimEventBase *const_child =
                       ev->aux()->dep.clist.peek_tail())
                 {
@@ -1090,7 +1222,7 @@ class SimProcessBase : public MicroProcess
                     child->detach_from_clist_of_parent();
                     ENSURE( 1, ev->aux()->dep.clist.num() == nchildren-1,
                             PID()<<" Clist of "<<*ev<<" must delete "<<*child);
-                    if( cancel )
+                    if( cancel && !defer_cancel( child ) )
                     {
                         undispatch( child );
                         free_event( child );
@@ -1136,6 +1268,7 @@ class SimProcessBase : public MicroProcess
                 detach_all_children_from_clist( ev, false );
 
                 acc_estats().committed++;
+                if( ev->coerced_late > 0 ) note_distortion( ev->coerced_late );
 
                 MUSDBG(3, PID() << " do_one_commit commit_event " << *ev);
                 commit_event( ev, ev->is_kernel );
@@ -1246,12 +1379,12 @@ class SimProcessBase : public MicroProcess
 
                 MUSDBG(3, PID() << " advance_optimistically lbts= "<<lbts<<
                            " limit_ts= "<<limit_ts );
-                ENSURE( 2, can_undo || limit_ts <= lbts ||
+                ENSURE( 2, can_undo || limit_ts <= lbts+sync_epsilon ||
                         limit_ts == SimTime::MAX_TIME,
                         can_undo<<" "<<limit_ts<<" "<<lbts );
 
                 limit_ts.reduce_to( lbts+runahead );
-                committable_ts.increase_to( lbts+resilience );
+                committable_ts.increase_to( lbts+tolerance() );
                 committable_ts.reduce_to( fel_top_ts() ); /*XXX 11Jan09*/
 
 //int _x=0;{cout << "ADVOPT: "<<&lbts.ts<<" "<<&orig_limit_ts.ts<<" "<<&limit_ts.ts<<" "<<&SimTime::MAX_TIME.ts<<endl;}
@@ -1266,7 +1399,7 @@ class SimProcessBase : public MicroProcess
                 {
                     const SimEventBase *cev = fel.peek();
                     if( !cev ) break;
-                    SimTime rbts = cev->T()+resilience;
+                    SimTime rbts = cev->T()+tolerance();
                     rollback_to( rbts );
                     ENSURE( 1, lvt <= rbts || lvt <= lbts,
                             lbts << " " << lvt << "<=" << rbts );
@@ -1282,10 +1415,10 @@ class SimProcessBase : public MicroProcess
                     if( ev->T() < mts )
                     {
                         ENSURE( 1,
-                                mts-ev->T() <= resilience.ts,
+                                mts-ev->T() <= tolerance().ts,
                                 *this<<endl<<
                                 "MTS=["<<mts<<"] EVENT=["<<*ev<<"]"<<endl<<
-                                "RES=["<<resilience<<"] TTS=["<<tts<<"]"<<endl<<
+                                "RES=["<<tolerance()<<"] TTS=["<<tts<<"]"<<endl<<
                                 "LCT=["<<lct<<"] LVT=["<<lvt<<"]"<<endl<<
                                 "RBTS=["<<rbts<<"]");
                         ev->coerce_ts( mts, mts-min_la );
@@ -1293,6 +1426,7 @@ class SimProcessBase : public MicroProcess
 
                     lvt = ev->T();
                     execute_context.event = ev;
+                    execute_context.logging = ( ev->T() > lbts );
                     if( ev->T() > lbts ) save_state( ev );
                     {
                         MUSDBG(3, PID()<<" executing event ev="<<ev<<" "<<*ev);
@@ -1315,6 +1449,7 @@ class SimProcessBase : public MicroProcess
                         ENSURE( 0, num_soe()==0, "" );
                     }
                     execute_context.event = 0;
+                    execute_context.logging = false;
 
                     if( ev->T() > committable_ts )
 		    {
@@ -1337,10 +1472,13 @@ class SimProcessBase : public MicroProcess
                                           const SimTime &dt,
                                           const SimTime &rdt )
             {
+                const SimTime &la_to = fed_lookahead( to.fed_id );
                 SimTime recv_ts( lvt+dt );
-                SimTime retract_ts( recv_ts-min_la );
-                retract_ts.tie += tie_counter;
-                recv_ts.tie += tie_counter++; //XXX Force tie breaks
+                //XXX Force tie breaks; they do not pile up along causal hops,
+                //except at the same instant, where the event must follow lvt
+                if( recv_ts.ts > lvt.ts ) recv_ts.tie = dt.tie + next_tie();
+                else recv_ts.tie += next_tie();
+                SimTime retract_ts( recv_ts-la_to );
 
                 if( rdt > SimTime::ZERO_TIME ) //An earlier retract dt is given
                 {
@@ -1356,19 +1494,20 @@ class SimProcessBase : public MicroProcess
                 else
                 {
                     /*The common case (no retract dt/ts specified)*/
-                    ENSURE( 1, PID()==to || retract_ts == recv_ts-min_la, "" );
+                    ENSURE( 1, PID()==to || retract_ts == recv_ts-la_to, "" );
                 }
 
                 ENSURE( 1, new_event->is_kernel ||
                            PID() == to ||
-                           dt >= min_la,
+                           dt >= la_to,
                            *this<<endl<<
                            "from "<<PID()<<" To "<<to<<endl<<
-                           "now "<<lvt<<" "<<dt<<" >= "<<min_la );
+                           "now "<<lvt<<" "<<dt<<" >= "<<la_to );
                 ENSURE( 2, dt >= 0, "Positive dt required " << dt );
                 new_event->set_src_dest( PID(), to );
                 new_event->set_time( recv_ts, retract_ts );
-                ENSURE( 1, can_undo || lvt <= execute_context.lbts, "" );
+                ENSURE( 1, can_undo || lvt <= execute_context.lbts+sync_epsilon,
+                        lvt << " " << execute_context.lbts );
                 if( lvt > execute_context.lbts )
                 {
                     SimEventBase *generating_event = execute_context.event;
@@ -1378,6 +1517,7 @@ class SimProcessBase : public MicroProcess
                     {
                         ENSURE( 2, generating_event->data._dest == PID(),
                                 PID()<<" must match dest "<<generating_event );
+                        CausalLinkGuard guard;
                         generating_event->aux()->dep.clist.add_as_tail(
                                new_event );
 MUSDBG( 5, PID() << " dispatch() aux lvt "<<lvt<<" lbts "<<execute_context.lbts<<" "<<*new_event );
@@ -1414,6 +1554,22 @@ MUSDBG( 3, PID() << " dispatch() adding event to "<<to<<" "<<*new_event );
                         *event<<" > "<<lvt<<" "<<execute_context.lbts );
                 remove_from_dest( event );
             }
+    /*In a parallel pass, cancellations of events sent to other processes */
+    /*are deferred to the main thread, which then calls cancel_child().    */
+    private: bool defer_cancel( SimEventBase *child );
+    private: void cancel_child( SimEventBase *child )
+            {
+                undispatch( child );
+                free_event( child );
+            }
+
+    //Largest lateness of a straggler that is coerced rather than rolled back
+    protected: const SimTime &tolerance( void ) const
+            { return sync_epsilon > resilience ? sync_epsilon : resilience; }
+    private: void note_distortion( double late )
+            { EventStats &es = acc_estats();
+              es.coerced++; es.distortion += late;
+              if( late > es.max_distortion ) es.max_distortion = late; }
 
     //Earliest commitable time
     protected: virtual const SimTime &ects( void ) const
@@ -1481,6 +1637,25 @@ if( false ) //XXXXXXXX Upon deep re-thinking, I think the following isn't reqd
                 }
                 explicit_min_la = true;
             }
+    private: virtual void update_fed_la( const SimFedID &fid,
+                                         const SimTime &lookahead )
+            {
+                if( fid == SimPID::ANY_FED_ID ) { any_fed_la.reduce_to( lookahead ); }
+                else
+                {
+                    if( fed_la.size() <= size_t(fid) )
+                        { fed_la.resize( fid+1, SimTime::MAX_TIME ); }
+                    fed_la[fid].reduce_to( lookahead );
+                }
+            }
+    private: const SimTime &fed_lookahead( const SimFedID &fid ) const
+            {
+                if( fid == PID().fed_id ) return min_la;
+                const SimTime &la = ( size_t(fid) < fed_la.size() &&
+                                      fed_la[fid] < any_fed_la ) ?
+                                    fed_la[fid] : any_fed_la;
+                return la < SimTime::MAX_TIME ? la : min_la;
+            }
 
     protected: SimTime lvt;//Timestamp of last processed(or being proc'd) event
     protected: SimTime lct;//Timestamp of latest committed event
@@ -1489,22 +1664,31 @@ if( false ) //XXXXXXXX Upon deep re-thinking, I think the following isn't reqd
                 SimTime lbts;
                 SimEventBase *event;
                 SimTime ests; //Min ts of non-local events sent by this event
+                bool logging; //Is the event's undo log being recorded?
                 EventExecutionContext() :
-                    lbts(0), event(0), ests(SimTime::MAX_TIME) {}
+                    lbts(0), event(0), ests(SimTime::MAX_TIME), logging(false) {}
             } execute_context;
 
     private: bool can_undo;  /*!<Does the subclass implement the undo method?*/
     private: SimTime min_la;/*!<Min lookahead from this PID to any other PID*/
     private: bool explicit_min_la;/*!<User explicitly specified lookahead?*/
+    private: vector<SimTime> fed_la;/*!<Lookahead to each remote federate*/
+    private: SimTime any_fed_la;/*!<Lookahead declared to any federate*/
     private: SimTime runahead;/*!<How far can optimistic execution exceed lbts*/
     private: SimTime resilience;/*!<Min diff in timestamps to cause rollback*/
+    private: static SimTime sync_epsilon;/*!<Kernel-wide relaxation, if any*/
     private: CopyState *copy_state;/*!<Automatically checkpointed state*/
-    private: static unsigned long tie_counter; /*For entire local federate*/
+    private: unsigned long ntie;/*!<#events dispatched by this process*/
+    /*! \brief Unique within the federate, and independent of which thread
+     * runs this process: the PID in the high bits, ntie in the low 32. */
+    private: double next_tie( void )
+                { return PID().loc_id*4294967296.0 + (double)(ntie++); }
 
     private: friend class KernelProcessBase;
     private: friend class KEvent_Init;
     private: friend class RemoteFederateProcess;
     private: friend class SimProcess;
+    private: friend class MicroKernel;
 
     public: virtual ostream &operator>>( ostream &out ) const;
     public: void introspect( const char *str ) const;
@@ -1564,6 +1748,62 @@ class PIDMap
     protected: ProcessVector kernel_procs, user_procs;
 };
 
+/*---------------------------------------------------------------------------*/
+/*! \brief Per-thread state of a worker in a multithreaded federate.
+ *
+ * While a worker advances its share of processes in a parallel pass, events
+ * it sends to other processes, and cancellations of earlier sends on
+ * rollback, are deferred here.  The main thread applies them after the pass,
+ * so no process is ever touched by two threads at once.
+ *
+ * <B>Not intended as a supported API.  Subject to change.<B>
+ */
+struct WorkerContext
+{
+    struct Deferred
+    {
+        SimEventBase *event;
+        SimProcessBase *canceller; /*Non-zero if cancelling an earlier send*/
+        SimPID to;
+    };
+    WorkerContext( void ) : deferred(), estats(), dbgout() {}
+    ostream *divert( ostream *target );
+    vector<Deferred> deferred;
+    EventStats estats; /*Counts accumulated since the last drain*/
+    vector< pair<ostream *, ostringstream *> > dbgout; /*Diverted debug text*/
+};
+
+/*---------------------------------------------------------------------------*/
+/*! \brief Decides when this federate initiates a new LBTS computation.
+ *
+ * Consulted by the kernel loop whenever no process is committable and no
+ * LBTS computation is in progress.  Declining only delays this federate's
+ * own initiation: computations started by other federates are still joined,
+ * since the kernel keeps servicing the network while it waits.
+ *
+ * <B>Not intended as a supported API.  Subject to change.<B>
+ */
+class LBTSPolicy
+{
+    public: struct Observation
+            {
+                double now;        /*Wall-clock seconds*/
+                SimTime lbts;      /*Latest global LBTS*/
+                SimTime candidate; /*This federate's contribution if started*/
+                double idle;       /*Cumulative seconds with nothing to do*/
+                long nevents;      /*Events executed in the last loop pass*/
+                long nsent, nrecd; /*Cumulative remote messages*/
+            };
+    public: virtual ~LBTSPolicy( void ) {}
+    public: virtual const char *name( void ) const = 0;
+    public: virtual bool initiate( const Observation &o ) = 0;
+    public: virtual void completed( const Observation &o ) {}
+    public: virtual void print_stats( ostream &out, const SimFedID &fed ) {}
+};
+
+/*---------------------------------------------------------------------------*/
+class FederateWorkers;
+
 /*---------------------------------------------------------------------------*/
 /*! \brief Underlying support class for simulator class.
  *
@@ -1572,9 +1812,11 @@ class PIDMap
 class MicroKernel
 {
     public: MicroKernel( void ) :
-                glbts(0), estats(), report(), status(CONSTRUCTED)
+                workers(0), lbts_policy(0), glbts(0), estats(), report(),
+                throttle(), status(CONSTRUCTED)
                 { ENSURE( 0, !instance, "" ); instance = this; }
-    public: virtual ~MicroKernel( void ) { instance = 0; }
+    public: virtual ~MicroKernel( void )
+                { delete lbts_policy; instance = 0; }
 
     public: virtual int num_feds( void ) const;
     public: virtual SimFedID fed_id( void ) const;
@@ -1610,6 +1852,12 @@ class MicroKernel
     public: virtual const SimTime &forward( const SimPID &to,
                                             SimEventBase *event )
             {
+                if( tls_worker ) //Delivered after the parallel pass
+                {
+                    WorkerContext::Deferred d = { event, 0, to };
+                    tls_worker->deferred.push_back( d );
+                    return event->T();
+                }
                 MicroProcess *to_mp = ID2MP( to );
                 ENSURE(2, to_mp, "Destination "<<to<<" should exist");
                 return to_mp->enqueue( event, glbts );
@@ -1625,12 +1873,36 @@ class MicroKernel
             }
 
     public: virtual const SimTime eets( void ) const;
+    public: virtual bool local_quiet( const SimTime &cut );
+    protected: virtual bool quiescent( const SimTime &cut ) { return false; }
+    public: enum CounterOp { COUNTER_SUM, COUNTER_MIN, COUNTER_MAX };
+    public: virtual int add_counter( CounterOp op );
+    public: virtual bool local_counters( const SimTime &cut, long *vals );
+    protected: virtual bool counter_values( const SimTime &cut, long *vals )
+                   { return true; }
+    protected: virtual void counter_totals( const SimTime &cut,
+                                            const long *totals ) {}
+    private: virtual void report_counters( void );
     public: static const SimTime local_min( void )
             {
                 return instance->status<=RUNNING ?
                             instance->eets() : SimTime::MAX_TIME;
             }
 
+    private: virtual long advance_parallel( const SimTime &limit_ts );
+    private: virtual void drain_worker( WorkerContext &w );
+    private: virtual void start_workers( void );
+    private: virtual void stop_workers( void );
+    public: static __thread WorkerContext *tls_worker;//Set during parallel pass
+    private: FederateWorkers *workers; //Null unless multithreaded
+
+    public: virtual void set_lbts_policy( LBTSPolicy *p ) //Kernel owns p
+            {
+                if( lbts_policy != p ) { delete lbts_policy; }
+                lbts_policy = p;
+            }
+    private: LBTSPolicy *lbts_policy; //Created at start() unless set earlier
+
     private: virtual long advance_process(MicroProcess *spb,bool really_advance,
                                const SimTime &limit_ts,
                                bool optimistically=false,
@@ -1680,7 +1952,62 @@ class MicroKernel
                        ofstream tstream;//Trace file stream
                        char *filename_prefix;
                    } trace;
+                   struct
+                   {
+                       bool postlbts;//Stay optimistic right after new LBTS?
+                       SimTime window;//Cap on optimistic span beyond LBTS
+                       bool throttle;//Adapt span to observed rollback rate?
+                       double rbhigh, rblow;//Rollback fractions to shrink/grow
+                       double minscale;//Smallest fraction of span allowed
+                   } optimism;
+                   struct
+                   {
+                       int nworkers;//#threads advancing processes per federate
+                       bool pin;//Bind each thread to a core of the rank's set?
+                       int minprocs;//Fewest runnable processes for a pass
+                       long npasses;//#parallel passes made
+                       long nprocs;//Total processes advanced in those passes
+                   } threads;
+                   struct
+                   {
+                       bool on;//Drain the network on a separate thread?
+                       long pollus;//That thread's poll interval
+                       unsigned long ncaptured;//#msgs it took in early
+                   } progress;
+                   struct
+                   {
+                       char *policy;//Name of the LBTS initiation policy
+                       double rate;//Target LBTS initiations/sec; 0=unlimited
+                       double maxdefer;//Longest an initiation may be put off
+                       double idlehigh;//Idle fraction to shorten interval
+                       long ndeferred;//#times initiation was declined
+                       double idle;//Total wc time spent waiting on LBTS
+                   } lbts;
+                   struct
+                   {
+                       bool on;//Vote on quiescence in LBTS reductions?
+                       SimTime at;//LBTS at which found quiescent, if ever
+                   } quiesce;
+                   struct
+                   {
+                       int n;//#counters added by the application
+                       long ntotals;//#global totals passed to counter_totals
+                   } counters;
+                   struct
+                   {
+                       SimTime epsilon;//Tolerated lateness; 0=exact sync
+                   } sync;
                } params;
+    protected: struct Throttle
+               {
+                   Throttle() : scale(1.0), last_exed(0), last_rbed(0),
+                                nshrink(0), ngrow(0) {}
+                   double scale; /*Fraction of runahead currently allowed*/
+                   unsigned long last_exed, last_rbed; /*Stats at last adapt*/
+                   long nshrink, ngrow; /*Number of adaptations made*/
+               } throttle;
+    private: virtual void adapt_optimism( void );
+    private: virtual SimTime optimistic_span( const SimTime &pspan ) const;
 
     protected: enum Status
                {
@@ -1789,47 +2116,54 @@ inline ostream &operator<<( ostream &o, const TM_Time &ts )
     { SimTime sts( ts.ts, ts.tie ); return o << "*" << sts; }
 
 /*---------------------------------------------------------------------------*/
-inline void *SimEventBase::get_buffer( size_t totsz )
+inline void *SlabHeap::alloc( size_t nbytes )
 {
-#define BLOCK_SIZE(_sz) (((int(((_sz==0)?8:_sz)-1)/8)+1)*8)
+    if( nbytes > MAX_BLOCK ) return alloc_large( nbytes );
+    int sc = size_class( nbytes );
+    Chunk *c = sclass[sc].avail;
+    if( !c ) return alloc_slow( sc );
+
+    FreeBlock *b = c->free_list;
+    if( b ) c->free_list = b->next;
+    else b = (FreeBlock *)(c->base + (c->ncarved++)*c->bsz);
+    if( c->nused++ == 0 ) sclass[sc].nidle--;
+    if( c->nused >= c->nblocks ) unlink_avail( c );
+    count_inuse( c->bsz );
+    return b;
+}
 
-    ENSURE( 2, totsz >= SHDRSZ+sizeof(SimEventBase),
-            totsz<<" "<<SHDRSZ<<" "<<sizeof(SimEventBase) );
+/*---------------------------------------------------------------------------*/
+inline void SlabHeap::free( void *p, size_t nbytes )
+{
+    if( nbytes > MAX_BLOCK ) { free_large( p, nbytes ); return; }
+    Chunk *c = chunk_of( p );
+    ENSURE( 1, c->sc == size_class( nbytes ), c->sc<<" "<<nbytes );
+    if( c->owner != this ) { c->owner->free_remote( p ); return; }
+
+    FreeBlock *b = (FreeBlock *)p;
+    b->next = c->free_list;
+    c->free_list = b;
+    st.inuse -= c->bsz;
+    bool was_full = !c->avail;
+    if( --c->nused == 0 || was_full ) free_slow( c );
+}
 
-    int bsz = BLOCK_SIZE(totsz);
+/*---------------------------------------------------------------------------*/
+inline SlabHeap *SlabHeap::local( void )
+{
+    SlabHeap *h = tls_heap;
+    return h ? h : attach();
+}
 
-    MUSDBG( 10, "SimEventBase::get_buffer(" << totsz << ") bsz=" << bsz );
+/*---------------------------------------------------------------------------*/
+inline void *SimEventBase::get_buffer( size_t totsz )
+{
+    ENSURE( 2, totsz >= SHDRSZ+sizeof(SimEventBase),
+            totsz<<" "<<SHDRSZ<<" "<<sizeof(SimEventBase) );
 
-    FreeList &fl = free_map[bsz];
-    if( fl.free_list.size() == 0 )
-    {
-        unsigned long ram_size = 2UL*1000UL*1000UL*1000UL; /*CUSTOMIZE*/
-        if( fl.nbuffers_to_alloc<=0 ) fl.nbuffers_to_alloc = 1;/*CUSTOMIZE*/
-        unsigned long rounded_bsz = ((bsz-1)/32+1)*32; /*CUSTOMIZE 32/64/128*/
-        unsigned long bigbufsz = rounded_bsz*fl.nbuffers_to_alloc;
-        void *bigbuf = malloc( bigbufsz );
-        bytes_alloced_sofar += bigbufsz;
-        if( bytes_alloced_sofar >= ram_size )
-          {MUSDBG( 0, bytes_alloced_sofar<<" reaching RAM limit "<<ram_size);}
-        ENSURE( 0, bigbuf, "Can't malloc "<<bigbufsz<<" bytes" );
-        MUSDBG( 2, "SimEventBase::get_buffer(" << totsz << ") allocated " <<
-                    fl.nbuffers_to_alloc<<" bufs * "<<rounded_bsz<<
-                    " bytes/buf = "<<bigbufsz<< "bytes ptr="<< ((int*)bigbuf) );
-        for( unsigned long i = 0; i < fl.nbuffers_to_alloc; i++ )
-        {
-            char *ep = ((char*)bigbuf) + i*rounded_bsz;
-            Synk_Hdr *hdr = (Synk_Hdr *)ep;
-            hdr->totsz = rounded_bsz;
-            fl.free_list.push_back( ep );
-        }
-        if( bigbufsz <= 50UL*1000UL*1000UL ) fl.nbuffers_to_alloc *= 2;
-    }
-    ENSURE( 1, fl.free_list.size() > 0, "List must not be empty" );
-    void *p = fl.free_list.front();
-    ENSURE( 1, p, "A buffer must exist" );
-    fl.free_list.pop_front();
+    void *p = SlabHeap::local()->alloc( totsz );
+    ENSURE( 0, p, "Can't allocate "<<totsz<<" bytes" );
     Synk_Hdr *hdr = (Synk_Hdr *)p;
-    ENSURE( 0, hdr->totsz >= totsz, "" );
     hdr->totsz = totsz;
     MUSDBG( 10, "SimEventBase::get_buffer(" << totsz << ") returning " << hdr);
     return hdr;
@@ -1858,21 +2192,22 @@ inline void *SimEventBase::operator new( size_t sz )
 /*---------------------------------------------------------------------------*/
 inline void SimEventBase::operator delete( void *d, size_t sz )
 {
-    sz += SHDRSZ;
-    int bsz = BLOCK_SIZE(sz);
-
-    MUSDBG( 10, "SimEventbase::delete(" << d << ", " << sz << ")" );
+    MUSDBG( 10, "SimEventbase::delete(" << d << ", " << sz+SHDRSZ << ")" );
 
     Synk_Hdr *hdr = ((Synk_Hdr *)d)-1;
-    FreeList &fl = free_map[bsz];
-    fl.free_list.push_front( hdr );
-    ENSURE( 1, fl.free_list.size() > 0, "List must not be empty" );
-#undef BLOCK_SIZE
+    SlabHeap::local()->free( hdr, sz + SHDRSZ );
 }
 
 /*---------------------------------------------------------------------------*/
 inline EventStats &SimProcessBase::acc_estats( void )
-  { return MicroKernel::muk()->acc_estats(); }
+  { WorkerContext *w = MicroKernel::tls_worker;
+    return w ? w->estats : MicroKernel::muk()->acc_estats(); }
+inline bool SimProcessBase::defer_cancel( SimEventBase *child )
+  { WorkerContext *w = MicroKernel::tls_worker;
+    if( !w || child->data._dest == PID() ) return false;
+    WorkerContext::Deferred d = { child, this, child->data._dest };
+    w->deferred.push_back( d );
+    return true; }
 
 /*---------------------------------------------------------------------------*/
 #endif /*__MUSIKPRIV_H*/